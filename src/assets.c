@@ -0,0 +1,161 @@
+/* Asset manifest */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jot.h"
+#include "assets.h"
+#include "blob.h"
+#include "hash.h"
+#include "memory.h"
+
+
+/* Names are stored normalized (non-alphanumerics become '_'),
+ * so lookups from templates need no translation of their own.
+ * Open addressing with linear probing, at most half full; a
+ * site has a handful of bundles, but every page of it may look
+ * them up, from any build worker, which is safe because the
+ * table is only written before the workers start. */
+
+#define HASHDIGITS 8    /* hex digits of content hash in names */
+
+struct asset {
+  const char *name;     /* normalized; null if slot is empty */
+  const char *url;
+};
+
+static struct {
+  MemPool pool;
+  struct asset *slots;
+  size_t nslots;        /* a power of 2 */
+  size_t count;
+} man;
+
+
+static inline bool
+isalnumchar(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9');
+}
+
+
+/** normalize name into buf (of size len+1) */
+static void
+normalize(char *buf, const char *name, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+    buf[i] = isalnumchar(name[i]) ? name[i] : '_';
+  buf[len] = '\0';
+}
+
+
+/** slot of normalized name: its own or the empty one for it */
+static struct asset *
+findslot(const char *name, size_t len)
+{
+  size_t i = hash64(name, len, 0) & (man.nslots-1);
+  while (man.slots[i].name && strcmp(man.slots[i].name, name))
+    i = (i + 1) & (man.nslots-1);
+  return &man.slots[i];
+}
+
+
+static bool
+grow(void)
+{
+  struct asset *old = man.slots;
+  size_t i, n = man.nslots;
+
+  man.nslots = n ? 2 * n : 16;
+  man.slots = calloc(man.nslots, sizeof(*man.slots));
+  if (!man.slots) {
+    man.slots = old;
+    man.nslots = n;
+    return false;
+  }
+  for (i = 0; i < n; i++)
+    if (old[i].name)
+      *findslot(old[i].name, strlen(old[i].name)) = old[i];
+  free(old);
+  return true;
+}
+
+
+const char *
+assets_hashname(Blob *buf, const char *name, const void *data, size_t len)
+{
+  const char *slash = strrchr(name, '/');
+  const char *dot = strrchr(slash ? slash+1 : name, '.');
+  size_t stem = dot && dot > (slash ? slash+1 : name) ?
+    (size_t) (dot - name) : strlen(name);
+  uint64_t h = hash64(data, len, 0);
+
+  assert(buf != NULL && name != NULL);
+  blob_clear(buf);
+  blob_addbuf(buf, name, stem);
+  blob_addfmt(buf, ".%0*llx%s", HASHDIGITS,
+    (unsigned long long) (h >> (64 - 4*HASHDIGITS)), name + stem);
+  return blob_str(buf);
+}
+
+
+int
+assets_put(const char *name, const char *url)
+{
+  struct asset *p;
+  size_t len;
+  char *key;
+
+  assert(name != NULL && url != NULL);
+  if (2 * (man.count+1) > man.nslots && !grow())
+    return FAILSOFT;
+
+  if (!man.pool.alloc) mem_pool_init(&man.pool, 0);
+  len = strlen(name);
+  key = mem_pool_alloc(&man.pool, len+1);
+  url = mem_pool_dup(&man.pool, url, strlen(url));
+  if (!key || !url) return FAILSOFT;
+  normalize(key, name, len);
+
+  p = findslot(key, len);
+  if (!p->name) man.count++;
+  p->name = key;
+  p->url = url;  /* the old one stays in the pool until cleared */
+  return SUCCESS;
+}
+
+
+const char *
+assets_get(const char *name)
+{
+  char buf[256];
+  size_t len;
+
+  if (!name || man.count == 0) return 0;
+  len = strlen(name);
+  if (len >= sizeof(buf)) return 0;  /* not one of ours */
+  normalize(buf, name, len);
+  return findslot(buf, len)->url;
+}
+
+
+size_t
+assets_count(void)
+{
+  return man.count;
+}
+
+
+void
+assets_clear(void)
+{
+  free(man.slots);
+  man.slots = 0;
+  man.nslots = man.count = 0;
+  mem_pool_free(&man.pool);
+}
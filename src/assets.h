@@ -0,0 +1,30 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+
+#include "blob.h"
+
+/* Asset manifest: names of bundles (CSS, JS) to the URLs of
+ * their content-hashed files; process-wide, read-only between
+ * builds */
+
+const char *assets_hashname(Blob *buf, const char *name,
+                            const void *data, size_t len);
+
+int assets_put(const char *name, const char *url);
+const char *assets_get(const char *name);
+size_t assets_count(void);
+void assets_clear(void);
+
+/* Usage: assets_hashname() makes the file name of a bundle from
+   its name and content: css/site.css => css/site.3fa9c2d1.css,
+   the hex digits from the content's hash; the build then records
+   the bundle's URL with assets_put() (SUCCESS, or FAILSOFT if out
+   of memory), and templates look it up with assets_get(), which
+   returns null for unknown names; in names, any character other
+   than a letter or digit is the same as '_', so "site.css" and
+   "site_css" (mustache has no dots in names) are the same asset;
+   assets_clear() forgets all (the build does this first) */
+
+#endif
@@ -0,0 +1,2207 @@
+/* Build a site on a pool of worker threads */
+
+#define _GNU_SOURCE  /* for sched_getaffinity(2) and CPU_COUNT */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "jot.h"
+#include "assets.h"
+#include "blob.h"
+#include "build.h"
+#include "cache.h"
+#include "copy.h"
+#include "deflate.h"
+#include "deps.h"
+#include "feeds.h"
+#include "hash.h"
+#include "index.h"
+#include "links.h"
+#include "log.h"
+#include "markdown.h"
+#include "memory.h"
+#include "minify.h"
+#include "search.h"
+#include "tar.h"
+#include "taxonomy.h"
+#include "trace.h"
+#include "walkdir.h"
+
+
+/* Each worker owns a Lua state, set up once by running the
+ * build module's setup() (config, init scripts, data, partials).
+ * The main thread walks the source directories into a list of
+ * jobs; workers take the next job from the list until it is
+ * exhausted: pages are rendered by the Lua module's page()
+ * function and then written here, other files are copied.
+ *
+ * Builds are incremental: page() also returns the list of files
+ * it read (layout, partials, data), which we record along with
+ * the source in a dependency graph, saved to DEPS_FILE. Pages
+ * whose inputs are all unchanged since the previous build are
+ * skipped, unless a site-wide input (the config file or one of
+ * the init scripts) changed, which means rebuilding everything.
+ * Pages that do get rendered still profit from CACHE_FILE, where
+ * jot.markdown() and friends keep their results across runs.
+ *
+ * With opts.minify, rendered HTML pages go through minify_html()
+ * on the worker, after page() and before they are written.
+ *
+ * With opts.gzip, each text output (HTML, CSS, JS, SVG, XML) also
+ * gets a compressed sibling, output.gz, for web servers that serve
+ * precompressed files; the worker that writes or copies the output
+ * compresses it (see deflate.c), and only if the output is newer
+ * than its .gz, so unchanged files are not compressed again. A copy
+ * keeps the mtime of its source, which may be older than the .gz,
+ * so a file copied in this build is always compressed again.
+ *
+ * Bundles (config.bundles) are made on the main thread before
+ * the workers start: their files from static are concatenated,
+ * minified, and written under a name with their content's hash,
+ * which goes into the asset manifest (see assets.c) for pages to
+ * refer to. A bundle is an entry in the dependency graph, too,
+ * with source "bundle:name" and the files as inputs, so it is
+ * only made again if one of them changed (and the stale copy
+ * with the old hash is removed).
+ *
+ * While a page renders, its links and ids are collected (from
+ * the Markdown renderer and jot.links(), see links.c), and at the
+ * end, with those of the pages that did not need rendering (kept
+ * in LINKS_FILE) and the links in layouts and partials, they are
+ * checked against all outputs; broken ones are reported.
+ *
+ * With opts.dedup, the target tree is searched for identical files
+ * at the end (see copy_dedup()), and duplicates become hard links;
+ * as a copy linked so has the mtime of another file, isfresh()
+ * then compares contents, so the copy is not made again each time.
+ *
+ * With a search index (config.search), the plain text of each
+ * page comes out of the Markdown renderer the same way and goes
+ * into search.c, which writes the index files at the end; pages
+ * not rendered keep their terms from SEARCH_FILE.
+ *
+ * Before the workers start, the front matter of all pages goes
+ * into the site index, INDEX_FILE (see index.c), re-reading only
+ * pages whose size or mtime changed. Pages that list other pages
+ * (site.pages) have INDEX_FILE as an input, so they are rebuilt
+ * whenever the index changes, and only then.
+ *
+ * The sitemap and feeds are written from the index after all pages
+ * are rendered. Each file written (the sitemap may be split into
+ * shards) is an entry with source "feed:file" and no inputs; those
+ * not written again (fewer shards, feeds turned off) are removed
+ * then, not by planjobs() as for other sources gone.
+ */
+
+#define BUILD_REGKEY "jot.build"
+#define DEPS_FILE ".jot-deps"
+#define CACHE_FILE ".jot-cache"
+#define INDEX_FILE ".jot-index"
+#define LINKS_FILE ".jot-links"
+#define SEARCH_FILE ".jot-search"
+
+#define JOB_RENDER  1   /* render page through Lua */
+#define JOB_COPY    2   /* copy file verbatim */
+#define JOB_SKIP    3   /* page is up to date */
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+struct job {
+  const char *src;      /* input path, relative to site root */
+  const char *rel;      /* path relative to its source dir */
+  int kind;             /* JOB_RENDER, JOB_COPY, JOB_SKIP */
+  int64_t size;         /* of source file */
+  int64_t mtime;        /* nanoseconds */
+};
+
+struct worker {
+  Builder *builder;
+  pthread_t thread;
+  lua_State *L;
+  int npages;           /* pages rendered */
+  int ncopied;          /* files copied verbatim */
+  int nfresh;           /* files not copied: up to date */
+  int nerrors;
+};
+
+struct builder {
+  struct buildopts opts;
+  struct worker *workers;
+  int nworkers;
+  Blob jobs;            /* array of struct job */
+  size_t njobs;
+  size_t next;          /* index of next job to hand out */
+  MemPool pool;         /* storage for path strings */
+  DepGraph *olddeps;    /* from previous build */
+  DepGraph *newdeps;    /* recorded in this build */
+  Blob changed;         /* sorted paths changed since last build */
+  size_t nchanged;
+  bool hinted;          /* only files in changed did change */
+  struct outfile **outputs;  /* hash table (opts.inmemory) */
+  size_t noutbuckets;
+  size_t noutputs;
+  const char *searchdir; /* in pool; null if no search index */
+  struct watch *watch;  /* set up by build_watch_start() */
+  pthread_mutex_t lock;
+};
+
+struct outfile {
+  struct outfile *next; /* in hash chain */
+  char *path;           /* relative to target dir */
+  char *data;           /* rendered output, or null */
+  size_t len;
+  char *file;           /* file to serve (verbatim) if no data */
+};
+
+static void freewatch(struct watch *watch);
+
+
+/** number of CPUs we may run on */
+int
+build_nthreads(void)
+{
+  long n;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    n = CPU_COUNT(&set);
+    if (n > 0) return n;
+  }
+#endif
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** create directory and missing parents (like mkdir -p) */
+static int
+makedirs(const char *path)
+{
+  char *p, *s = strdup(path);
+  int r = 0;
+  if (!s) return -1;
+  for (p = s+1; *p && r == 0; p++) {
+    if (*p != '/') continue;
+    *p = '\0';
+    if (mkdir(s, 0775) < 0 && errno != EEXIST) r = -1;
+    *p = '/';
+  }
+  if (r == 0 && mkdir(s, 0775) < 0 && errno != EEXIST) r = -1;
+  free(s);
+  return r;
+}
+
+
+/** create missing parent directories of the given file */
+static int
+makeparents(const char *fn)
+{
+  const char *p = strrchr(fn, '/');
+  char *s;
+  int r;
+  if (!p || p == fn) return 0;
+  s = strdup(fn);
+  if (!s) return -1;
+  s[p-fn] = '\0';
+  r = makedirs(s);
+  free(s);
+  return r;
+}
+
+
+/** write text to the named file unless it has that content already */
+static int
+writeout(const char *fn, const char *text, size_t len)
+{
+  int r;
+  trace_begin("io", "write", fn);
+  r = copy_buffer(text, len, fn);
+  if (r < 0 && errno == ENOENT && makeparents(fn) == 0)
+    r = copy_buffer(text, len, fn);
+  trace_end();
+  if (r < 0) {
+    log_error("write file %s: %s", fn, strerror(errno));
+    return FAILSOFT;
+  }
+  if (r == 0) log_trace("unchanged: %s", fn);
+  return SUCCESS;
+}
+
+
+/** true iff fn is a text output that should get a .gz sibling */
+static bool
+iscompressible(const char *fn)
+{
+  static const char *const exts[] = {
+    ".html", ".htm", ".css", ".js", ".mjs", ".json", ".svg", ".xml", ".txt" };
+  const char *ext = strrchr(fn, '.');
+  size_t i;
+  if (!ext || strchr(ext, '/')) return false;
+  for (i = 0; i < sizeof(exts)/sizeof(exts[0]); i++)
+    if (!strcmp(ext, exts[i])) return true;
+  return false;
+}
+
+
+/** true iff fn is an HTML file (by its extension) */
+static bool
+ishtml(const char *fn)
+{
+  const char *ext = strrchr(fn, '.');
+  if (!ext || strchr(ext, '/')) return false;
+  return !strcmp(ext, ".html") || !strcmp(ext, ".htm");
+}
+
+
+/** name of the compressed sibling of fn: fn.gz */
+static const char *
+gzipname(const char *fn, Blob *buf)
+{
+  blob_clear(buf);
+  blob_addstr(buf, fn);
+  blob_addstr(buf, ".gz");
+  return blob_str(buf);
+}
+
+
+/** append the contents of file fn to buf */
+static int
+readall(const char *fn, Blob *buf)
+{
+  char chunk[8192];
+  ssize_t n;
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0) {
+    log_error("read %s: %s", fn, strerror(errno));
+    return FAILSOFT;
+  }
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0) blob_addbuf(buf, chunk, n);
+  close(fd);
+  return SUCCESS;
+}
+
+
+/** write fn.gz with text (or the contents of fn if null) unless
+    fn was not just rewritten and fn.gz is newer than it already */
+static int
+writegzip(const char *fn, const char *text, size_t len, bool rewritten)
+{
+  struct stat st, gzst;
+  Blob gzfn = BLOB_INIT, data = BLOB_INIT, out = BLOB_INIT;
+  const char *gz = gzipname(fn, &gzfn);
+  int w, r = SUCCESS;
+
+  if (!rewritten && stat(fn, &st) == 0 && stat(gz, &gzst) == 0 &&
+      (gzst.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+       (gzst.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        gzst.st_mtim.tv_nsec >= st.st_mtim.tv_nsec)))
+    goto done;  /* up to date */
+
+  if (!text) {
+    if (readall(fn, &data) != SUCCESS) {
+      r = FAILSOFT;
+      goto done;
+    }
+    text = blob_str(&data);
+    len = blob_len(&data);
+  }
+
+  trace_begin("build", "gzip", fn);
+  if (deflate_gzip(&out, text, len) < 0) {
+    log_error("gzip %s: out of memory", fn);
+    r = FAILSOFT;
+  }
+  else if ((w = copy_buffer(blob_buf(&out), blob_len(&out), gz)) < 0) {
+    log_error("write file %s: %s", gz, strerror(errno));
+    r = FAILSOFT;
+  }
+  else if (w == 0)  /* same as before: mark it as newer than fn */
+    utimensat(AT_FDCWD, gz, 0, 0);
+  trace_end();
+
+done:
+  blob_free(&gzfn);
+  blob_free(&data);
+  blob_free(&out);
+  return r;
+}
+
+
+/** copy file src to dst (replace if exists), see copy.c */
+static int
+copyfile(const char *src, const char *dst)
+{
+  int r;
+  trace_begin("io", "copy", src);
+  r = copy_file(src, dst);
+  if (r < 0 && errno == ENOENT && makeparents(dst) == 0)
+    r = copy_file(src, dst);
+  trace_end();
+  if (r < 0) {
+    log_error("copy %s to %s: %s", src, dst, strerror(errno));
+    return FAILSOFT;
+  }
+  return SUCCESS;
+}
+
+
+/** make path of output file: target/rel */
+static const char *
+targetpath(Builder *builder, const char *rel, Blob *buf)
+{
+  blob_clear(buf);
+  blob_addstr(buf, builder->opts.target);
+  if (*rel) {
+    blob_addchar(buf, '/');
+    blob_addstr(buf, rel);
+  }
+  return blob_str(buf);
+}
+
+
+/* === output tree === */
+
+
+/* With opts.inmemory, outputs go to a hash table instead of
+ * files in the target dir: rendered pages with their content,
+ * verbatim files as the name of the source file. Workers add
+ * to it (under the builder's lock), build_lookup() serves from
+ * it when no build is running. Nothing is written to the site
+ * dir either: the dependency graph and the site index are kept
+ * in memory, and CACHE_FILE is not used.
+ */
+
+
+static struct outfile **
+out_slot(Builder *builder, const char *path)
+{
+  struct outfile **pp;
+  size_t i = hash64(path, strlen(path), 0) & (builder->noutbuckets - 1);
+  for (pp = &builder->outputs[i]; *pp; pp = &(*pp)->next)
+    if (!strcmp((*pp)->path, path)) break;
+  return pp;
+}
+
+
+static void
+out_grow(Builder *builder)
+{
+  struct outfile **old = builder->outputs;
+  size_t i, n = builder->noutbuckets;
+  size_t size = n ? 2 * n : 1024;
+  struct outfile *p, *next;
+
+  builder->outputs = calloc(size, sizeof(*old));
+  if (!builder->outputs) {  /* keep the old table */
+    builder->outputs = old;
+    return;
+  }
+  builder->noutbuckets = size;
+  for (i = 0; i < n; i++) {
+    for (p = old[i]; p; p = next) {
+      struct outfile **pp = out_slot(builder, p->path);
+      next = p->next;
+      p->next = 0;
+      *pp = p;
+    }
+  }
+  free(old);
+}
+
+
+static void
+out_free(struct outfile *p)
+{
+  free(p->path);
+  free(p->data);
+  free(p->file);
+  free(p);
+}
+
+
+/** store output (copy of data, or name of file); call with lock held */
+static int
+out_put(Builder *builder, const char *path,
+        const char *data, size_t len, const char *file)
+{
+  struct outfile **pp, *p;
+
+  if (builder->noutputs >= builder->noutbuckets)
+    out_grow(builder);
+  if (!builder->outputs) return FAILSOFT;
+
+  p = calloc(1, sizeof(*p));
+  if (!p) return FAILSOFT;
+  p->path = strdup(path);
+  p->data = data ? malloc(len + 1) : 0;
+  p->file = file ? strdup(file) : 0;
+  if (!p->path || (data && !p->data) || (file && !p->file)) {
+    out_free(p);
+    return FAILSOFT;
+  }
+  if (data) {
+    memcpy(p->data, data, len);
+    p->data[len] = '\0';
+  }
+  p->len = len;
+
+  pp = out_slot(builder, path);
+  if (*pp) {  /* replace */
+    p->next = (*pp)->next;
+    out_free(*pp);
+  }
+  else builder->noutputs++;
+  *pp = p;
+  return SUCCESS;
+}
+
+
+/** store or write the output at path (relative to target dir) */
+static int
+putoutput(Builder *builder, const char *path, const char *text, size_t len)
+{
+  Blob buf = BLOB_INIT;
+  int r;
+  links_output(path);
+  if (builder->opts.inmemory) {
+    pthread_mutex_lock(&builder->lock);
+    r = out_put(builder, path, text, len, 0);
+    pthread_mutex_unlock(&builder->lock);
+    if (r != SUCCESS) log_error("build: out of memory");
+  }
+  else {
+    const char *fn = targetpath(builder, path, &buf);
+    r = writeout(fn, text, len);
+    if (r == SUCCESS && builder->opts.gzip && iscompressible(fn))
+      r = writegzip(fn, text, len, false);
+  }
+  blob_free(&buf);
+  return r;
+}
+
+
+static struct outfile *
+out_find(Builder *builder, const char *path)
+{
+  return builder->outputs ? *out_slot(builder, path) : 0;
+}
+
+
+static void
+out_remove(Builder *builder, const char *path)
+{
+  struct outfile **pp, *p;
+  if (!builder->outputs) return;
+  pp = out_slot(builder, path);
+  if ((p = *pp)) {
+    *pp = p->next;
+    out_free(p);
+    builder->noutputs--;
+  }
+}
+
+
+/** find in-memory output: set data and len, or file; false if none */
+bool
+build_lookup(Builder *builder, const char *path,
+             const char **data, size_t *len, const char **file)
+{
+  struct outfile *p = out_find(builder, path);
+  if (!p) return false;
+  *data = p->data;
+  *len = p->len;
+  *file = p->file;
+  return true;
+}
+
+
+static int
+outpcmp(const void *a, const void *b)
+{
+  const struct outfile *const *p = a, *const *q = b;
+  return strcmp((*p)->path, (*q)->path);
+}
+
+
+/** add output p (and its .gz with opts.gzip) to the archive */
+static int
+tarout(Builder *builder, struct tar *tar, const struct outfile *p)
+{
+  Blob data = BLOB_INIT, gz = BLOB_INIT, name = BLOB_INIT;
+  int r = p->data ? tar_add(tar, p->path, p->data, p->len) :
+    tar_addfile(tar, p->path, p->file);
+
+  if (r == 0 && builder->opts.gzip && iscompressible(p->path)) {
+    if (!p->data && readall(p->file, &data) != SUCCESS) r = -1;
+    else if (deflate_gzip(&gz, p->data ? p->data : blob_str(&data),
+               p->data ? p->len : blob_len(&data)) < 0) {
+      errno = ENOMEM;
+      r = -1;
+    }
+    else r = tar_add(tar, gzipname(p->path, &name), blob_buf(&gz),
+               blob_len(&gz));
+  }
+  blob_free(&data);
+  blob_free(&gz);
+  blob_free(&name);
+  return r;
+}
+
+
+/** write the outputs of an in-memory build to a tar archive */
+int
+build_tar(Builder *builder, const char *fn)
+{
+  Blob list = BLOB_INIT;
+  struct outfile **pv, *p;
+  struct tar tar;
+  size_t i, n = 0;
+  int fd, r = SUCCESS;
+
+  assert(builder != NULL && fn != NULL);
+  assert(builder->opts.inmemory);
+
+  pv = blob_prepare(&list, builder->noutputs * sizeof(*pv) + 1);
+  if (!pv) {
+    log_error("build: out of memory");
+    return FAILSOFT;
+  }
+  for (i = 0; i < builder->noutbuckets; i++)
+    for (p = builder->outputs[i]; p; p = p->next)
+      pv[n++] = p;
+  qsort(pv, n, sizeof(*pv), outpcmp);  /* same site, same archive */
+
+  fd = strcmp(fn, "-") ? open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666) : 1;
+  if (fd < 0) {
+    log_error("cannot create %s: %s", fn, strerror(errno));
+    blob_free(&list);
+    return FAILSOFT;
+  }
+
+  trace_begin("io", "tar", fn);
+  tar_begin(&tar, fd, (int64_t) time(0));
+  for (i = 0; i < n && r == SUCCESS; i++) {
+    if (tarout(builder, &tar, pv[i]) < 0) {
+      log_error("tar %s: %s: %s", fn, pv[i]->path, strerror(errno));
+      r = FAILSOFT;
+    }
+  }
+  if (r == SUCCESS && tar_end(&tar) < 0) {
+    log_error("tar %s: %s", fn, strerror(errno));
+    r = FAILSOFT;
+  }
+  trace_end();
+  if (r == SUCCESS)
+    log_info("wrote %zu files to %s, %llu bytes", n, fd == 1 ? "stdout" : fn,
+      (unsigned long long) tar.nbytes);
+  if (fd != 1 && close(fd) < 0 && r == SUCCESS) {
+    log_error("tar %s: %s", fn, strerror(errno));
+    r = FAILSOFT;
+  }
+  if (r != SUCCESS && fd != 1) remove(fn);
+  if (r != SUCCESS) blob_free(&tar.buf);
+  blob_free(&list);
+  return r;
+}
+
+
+/* === jobs === */
+
+
+static int
+strpcmp(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+
+static bool
+isrenderable(const char *path)
+{
+  const char *ext = strrchr(path, '.');
+  if (!ext || strchr(ext, '/')) return false;
+  return !strcmp(ext, ".md") || !strcmp(ext, ".html") || !strcmp(ext, ".htm");
+}
+
+
+static void
+addjob(Builder *builder, const struct walk *walk, const char *rel, int kind)
+{
+  const char *src = walkdir_path(walk);
+  struct job *job = blob_prepare(&builder->jobs, sizeof(*job));
+  size_t ofs = rel - src;
+  job->src = mem_pool_dup(&builder->pool, src, strlen(src));
+  assert(job->src != NULL);
+  job->rel = job->src + ofs;
+  job->kind = kind;
+  job->size = walk->statbuf.st_size;
+  job->mtime = (int64_t) walk->statbuf.st_mtim.tv_sec * 1000000000
+             + walk->statbuf.st_mtim.tv_nsec;
+  blob_addlen(&builder->jobs, sizeof(*job));
+  builder->njobs++;
+}
+
+
+static struct job *
+nextjob(Builder *builder)
+{
+  struct job *job = 0;
+  pthread_mutex_lock(&builder->lock);
+  if (builder->next < builder->njobs)
+    job = (struct job *) blob_buf(&builder->jobs) + builder->next++;
+  pthread_mutex_unlock(&builder->lock);
+  return job;
+}
+
+
+/** site-wide inputs: config file and the init scripts, sorted */
+static size_t
+globalinputs(Builder *builder, Blob *list)
+{
+  struct walk walk;
+  const char **pv;
+  size_t n = 1;
+  int type;
+
+  pv = blob_prepare(list, sizeof(*pv));
+  *pv = builder->opts.config;
+  blob_addlen(list, sizeof(*pv));
+
+  if (walkdir(&walk, "init", WALK_FILE) != 0)
+    return n;  /* no init directory */
+  while ((type = walkdir_next(&walk)) > 0) {
+    const char *path = walkdir_path(&walk);
+    const char *ext = strrchr(path, '.');
+    if (type != WALK_F || strchr(path+5, '/')) continue;
+    if (!ext || strcmp(ext, ".lua")) continue;
+    pv = blob_prepare(list, sizeof(*pv));
+    *pv = mem_pool_dup(&builder->pool, path, strlen(path));
+    blob_addlen(list, sizeof(*pv));
+    n++;
+  }
+  walkdir_free(&walk);
+
+  pv = blob_buf(list);
+  qsort(pv+1, n-1, sizeof(*pv), strpcmp);
+  return n;
+}
+
+
+/** remove output (and its .gz) from target; true iff it was there */
+static bool
+removeoutput(Builder *builder, const char *output)
+{
+  Blob buf = BLOB_INIT, gz = BLOB_INIT;
+  const char *fn = targetpath(builder, output, &buf);
+  bool removed = false;
+  if (builder->opts.inmemory) out_remove(builder, output);
+  else if (remove(fn) == 0) {
+    remove(gzipname(fn, &gz));
+    removed = true;
+  }
+  blob_free(&buf);
+  blob_free(&gz);
+  return removed;
+}
+
+
+static bool
+isfeed(const char *source)
+{
+  return !strncmp(source, "feed:", 5);
+}
+
+
+static void
+removestale(const char *source, const char *output, void *ud)
+{
+  if (*source && !isfeed(source) && removeoutput(ud, output))
+    log_debug("removed %s (source %s is gone)", output, source);
+}
+
+
+/** bring INDEX_FILE up to date with the pages to render */
+static void
+updateindex(Builder *builder)
+{
+  const struct job *jobs = blob_buf(&builder->jobs);
+  struct pageinfo *pv;
+  Blob infos = BLOB_INIT;
+  const char *slash;
+  size_t i, n = 0;
+
+  if (index_count() == 0)
+    index_open(INDEX_FILE);  /* first run: reuse what is there */
+
+  for (i = 0; i < builder->njobs; i++) {
+    if (jobs[i].kind != JOB_RENDER) continue;
+    pv = blob_prepare(&infos, sizeof(*pv));
+    if (!pv) break;
+    memset(pv, 0, sizeof(*pv));
+    pv->path = jobs[i].src;
+    slash = strchr(jobs[i].rel, '/');
+    pv->section = slash ? mem_pool_dup(&builder->pool, jobs[i].rel,
+      slash - jobs[i].rel) : "";
+    if (!pv->section) break;
+    pv->size = jobs[i].size;
+    pv->mtime = jobs[i].mtime;
+    blob_addlen(&infos, sizeof(*pv));
+    n++;
+  }
+
+  /* pages listing others depend on the index, not on the pages;
+     in-memory builds keep it in memory only, so tell the graph */
+  trace_begin("io", "index_update", INDEX_FILE);
+  if (blob_failed(&infos) || i < builder->njobs)
+    log_error("index: out of memory");
+  else if (index_update(builder->opts.inmemory ? 0 : INDEX_FILE,
+                        blob_buf(&infos), n) > 0)
+    deps_changed(builder->olddeps, INDEX_FILE);
+  taxonomy_update();
+  trace_end();
+  blob_free(&infos);
+}
+
+
+/** mark pages whose inputs did not change as JOB_SKIP; return their number */
+static int
+planjobs(Builder *builder, const char *const *globals, size_t nglobals)
+{
+  struct job *jobs = blob_buf(&builder->jobs);
+  const char *const *inputs;
+  const char *out;
+  struct stat statbuf;
+  Blob buf = BLOB_INIT, gz = BLOB_INIT;
+  size_t i, n;
+  bool uptodate;
+  int nskipped = 0;
+
+  /* site-wide inputs: same list and all unchanged? */
+  uptodate = deps_check(builder->olddeps, "") != 0;
+  inputs = deps_inputs(builder->olddeps, "", &n);
+  if (n != nglobals) uptodate = false;
+  for (i = 0; uptodate && i < n; i++)
+    if (strcmp(inputs[i], globals[i])) uptodate = false;
+  if (!uptodate)
+    log_debug("deps: site-wide inputs changed, rebuilding all pages");
+
+  for (i = 0; i < builder->njobs; i++) {
+    if (jobs[i].kind == JOB_COPY) {
+      links_output(jobs[i].rel);
+      /* no inputs, just so the copy is removed with its source */
+      deps_check(builder->olddeps, jobs[i].src);
+      deps_add(builder->newdeps, jobs[i].src, jobs[i].rel, 0, 0);
+      continue;
+    }
+    out = deps_check(builder->olddeps, jobs[i].src);
+    if (!uptodate || !out) continue;
+    if (builder->opts.inmemory ? !out_find(builder, out) :
+        !builder->hinted && stat(targetpath(builder, out, &buf), &statbuf) < 0)
+      continue;
+    if (builder->opts.gzip && !builder->hinted && iscompressible(out) &&
+        stat(gzipname(blob_str(&buf), &gz), &statbuf) < 0)
+      continue;
+    deps_copy(builder->newdeps, builder->olddeps, jobs[i].src);
+    links_output(out);
+    links_keep(out);
+    search_keep(out);
+    jobs[i].kind = JOB_SKIP;
+    nskipped++;
+  }
+
+  deps_stale(builder->olddeps, removestale, builder);
+
+  blob_free(&buf);
+  blob_free(&gz);
+  return nskipped;
+}
+
+
+/** walk dir: mirror its directories in target, add its files as jobs */
+static int
+scantree(Builder *builder, const char *dir, bool render)
+{
+  struct walk walk;
+  Blob buf = BLOB_INIT;
+  size_t dirlen = strlen(dir);
+  int type, r = SUCCESS;
+
+  if (walkdir(&walk, dir, WALK_FILE|WALK_PRE) != 0) {
+    log_error("walkdir %s: %s", dir, strerror(errno));
+    return FAILSOFT;
+  }
+
+  trace_begin("io", "scantree", dir);
+  while ((type = walkdir_next(&walk)) > 0) {
+    const char *path = walkdir_path(&walk);
+    const char *rel = path + dirlen;
+    while (*rel == '/') rel++;
+    switch (type) {
+      case WALK_D:
+        if (builder->opts.inmemory) break;
+        if (makedirs(targetpath(builder, rel, &buf)) < 0) {
+          log_error("mkdir %s: %s", blob_str(&buf), strerror(errno));
+          r = FAILSOFT;
+        }
+        break;
+      case WALK_F:
+        if (render && isrenderable(path))
+          addjob(builder, &walk, rel, JOB_RENDER);
+        else addjob(builder, &walk, rel, JOB_COPY);
+        break;
+      case WALK_NS:
+      case WALK_DNR:
+        log_warn("skipping %s: permission denied", path);
+        break;
+    }
+  }
+  if (type < 0) {
+    log_error("walkdir %s: %s", dir, strerror(errno));
+    r = FAILSOFT;
+  }
+
+  walkdir_free(&walk);
+  trace_end();
+  blob_free(&buf);
+  return r;
+}
+
+
+/* === workers === */
+
+
+/** call build[name](args...) with nargs on stack under msghandler */
+static int
+callbuild(struct worker *worker, const char *name, int nargs, int nrets)
+{
+  lua_State *L = worker->L;
+  int base = lua_gettop(L) - nargs;
+  int r;
+
+  lua_pushcfunction(L, worker->builder->opts.msghandler);
+  lua_getfield(L, LUA_REGISTRYINDEX, BUILD_REGKEY);
+  lua_getfield(L, -1, name);
+  lua_remove(L, -2);
+  lua_rotate(L, base+1, 2);  /* args msgh fun => msgh fun args */
+  r = lua_pcall(L, nargs, nrets, base+1);
+  lua_remove(L, base+1);  /* the msghandler */
+  return r;
+}
+
+
+/** create and set up the worker's Lua state */
+static int
+worker_setup(struct worker *worker)
+{
+  const struct buildopts *opts = &worker->builder->opts;
+  lua_State *L = opts->newstate();
+
+  if (!L) {
+    log_error("cannot create Lua state for build worker");
+    return FAILSOFT;
+  }
+  worker->L = L;
+  trace_begin("lua", "build.setup", 0);
+
+  lua_pushcfunction(L, opts->msghandler);
+  lua_getglobal(L, "require");
+  lua_pushliteral(L, "build");
+  if (lua_pcall(L, 1, 1, -3) != LUA_OK) goto fail;
+  lua_setfield(L, LUA_REGISTRYINDEX, BUILD_REGKEY);
+  lua_pop(L, 1);  /* the msghandler */
+
+  lua_createtable(L, 0, 4);
+  lua_pushstring(L, opts->config);
+  lua_setfield(L, -2, "config");
+  lua_pushstring(L, opts->source);
+  lua_setfield(L, -2, "source");
+  lua_pushstring(L, opts->target);
+  lua_setfield(L, -2, "target");
+  lua_pushboolean(L, opts->drafts);
+  lua_setfield(L, -2, "drafts");
+  if (callbuild(worker, "setup", 1, 0) != LUA_OK) goto fail;
+
+  trace_end();
+  return SUCCESS;
+
+fail:
+  trace_end();
+  lua_close(L);
+  worker->L = 0;
+  return FAILSOFT;
+}
+
+
+static void
+worker_render(struct worker *worker, struct job *job)
+{
+  lua_State *L = worker->L;
+  Blob inputs = BLOB_INIT;
+  Blob minified = BLOB_INIT;
+  Blob links = BLOB_INIT;
+  Blob plain = BLOB_INIT;
+  bool search = worker->builder->searchdir != 0;
+  const char *out, *text, **pv;
+  size_t len, i, n;
+  int r;
+
+  log_debug("rendering %s", job->src);
+  trace_begin("build", "page", job->src);
+  lua_pushlightuserdata(L, &links);
+  lua_setfield(L, LUA_REGISTRYINDEX, LINKS_REGKEY);
+  if (search) {
+    lua_pushlightuserdata(L, &plain);
+    lua_setfield(L, LUA_REGISTRYINDEX, SEARCH_REGKEY);
+  }
+  lua_pushstring(L, job->src);
+  lua_pushstring(L, job->rel);
+  r = callbuild(worker, "page", 2, 3);
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, LINKS_REGKEY);
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, SEARCH_REGKEY);
+  trace_end();
+  if (r != LUA_OK) {
+    log_error("cannot render %s", job->src);  /* details by msghandler */
+    worker->nerrors++;
+    goto done;
+  }
+
+  out = lua_tostring(L, 1);
+  text = lua_tolstring(L, 2, &len);
+  if (!out || !text) {
+    log_error("build.page(%s) returned no output", job->src);
+    worker->nerrors++;
+    goto done;
+  }
+
+  if (worker->builder->opts.minify && ishtml(out)) {
+    trace_begin("build", "minify", out);
+    minify_html(&minified, text, len);
+    trace_end();
+    text = blob_str(&minified);
+    len = blob_len(&minified);
+  }
+
+  r = putoutput(worker->builder, out, text, len);
+  if (r != SUCCESS) {
+    worker->nerrors++;
+    goto done;
+  }
+  worker->npages++;
+  links_page(out, blob_str(&links), blob_len(&links));
+  if (search && blob_len(&plain) > 0) {
+    struct pageinfo info;
+    size_t k;
+    bool found = index_find(job->src, &k) && index_get(k, &info);
+    search_page(out, found && *info.title ? info.title : out,
+      blob_str(&plain), blob_len(&plain));
+  }
+
+  /* record dependencies: the source and what page() read */
+  n = lua_istable(L, 3) ? luaL_len(L, 3) : 0;
+  pv = blob_prepare(&inputs, (n+1) * sizeof(*pv));
+  pv[0] = job->src;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 3, i);
+    pv[i] = lua_tostring(L, -1);  /* kept alive by the table */
+    lua_pop(L, 1);
+    if (!pv[i]) pv[i] = job->src;
+  }
+  pthread_mutex_lock(&worker->builder->lock);
+  deps_add(worker->builder->newdeps, job->src, out, pv, n+1);
+  pthread_mutex_unlock(&worker->builder->lock);
+
+done:
+  lua_settop(L, 0);
+  blob_free(&inputs);
+  blob_free(&minified);
+  blob_free(&links);
+  blob_free(&plain);
+}
+
+
+/** true iff dst is a file of the same size and mtime as src */
+static bool
+isfresh(const char *src, const char *dst)
+{
+  struct stat srcstat, dststat;
+  uint64_t srchash, dsthash;
+  if (stat(src, &srcstat) < 0 || stat(dst, &dststat) < 0) return false;
+  if (!S_ISREG(dststat.st_mode) || dststat.st_size != srcstat.st_size)
+    return false;
+  if (dststat.st_mtime == srcstat.st_mtime) return true;
+  /* linked to an identical output (opts.dedup), with its mtime */
+  return dststat.st_nlink > 1 && hash_file(src, &srchash) == 0 &&
+         hash_file(dst, &dsthash) == 0 && srchash == dsthash;
+}
+
+
+static void
+worker_copy(struct worker *worker, struct job *job)
+{
+  Blob buf = BLOB_INIT;
+  Builder *builder = worker->builder;
+  const char *dst = targetpath(builder, job->rel, &buf);
+  bool copied = false;
+  if (builder->hinted && !bsearch(&job->src, blob_buf(&builder->changed),
+        builder->nchanged, sizeof(job->src), strpcmp))
+    worker->nfresh++;
+  else if (builder->opts.inmemory) {
+    struct outfile *p;
+    int r = SUCCESS;
+    pthread_mutex_lock(&builder->lock);
+    p = out_find(builder, job->rel);
+    if (p && p->file && !strcmp(p->file, job->src)) worker->nfresh++;
+    else if ((r = out_put(builder, job->rel, 0, 0, job->src)) == SUCCESS)
+      worker->ncopied++;
+    pthread_mutex_unlock(&builder->lock);
+    if (r != SUCCESS) {
+      log_error("build: out of memory");
+      worker->nerrors++;
+    }
+  }
+  else {
+    if (!builder->opts.force && isfresh(job->src, dst))
+      worker->nfresh++;
+    else {
+      log_debug("copying %s", job->src);
+      if (copyfile(job->src, dst) == SUCCESS) {
+        worker->ncopied++;
+        copied = true;
+      }
+      else {
+        worker->nerrors++;
+        goto done;
+      }
+    }
+    if (builder->opts.gzip && iscompressible(dst) &&
+        writegzip(dst, 0, 0, copied) != SUCCESS)
+      worker->nerrors++;
+  }
+done:
+  blob_free(&buf);
+}
+
+
+static void *
+worker_main(void *arg)
+{
+  struct worker *worker = arg;
+  struct job *job;
+
+  while ((job = nextjob(worker->builder))) {
+    if (job->kind == JOB_SKIP) continue;
+    if (job->kind == JOB_COPY) {
+      worker_copy(worker, job);
+      continue;
+    }
+    if (!worker->L && worker_setup(worker) != SUCCESS) {
+      worker->nerrors++;
+      break;  /* leave remaining jobs to other workers */
+    }
+    worker_render(worker, job);
+  }
+
+  return 0;
+}
+
+
+static void *
+worker_thread(void *arg)
+{
+  struct worker *worker = arg;
+  if (trace_active()) {
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d",
+      (int) (worker - worker->builder->workers) + 1);
+    trace_thread(name);
+  }
+  return worker_main(worker);
+}
+
+
+/* === bundles === */
+
+
+/** minify a bundle by its type (from name), in place */
+static void
+minifybundle(const char *name, Blob *data)
+{
+  Blob out = BLOB_INIT;
+  const char *ext = strrchr(name, '.');
+  if (!ext || strchr(ext, '/')) return;
+  if (!strcmp(ext, ".css"))
+    minify_css(&out, blob_str(data), blob_len(data));
+  else if (!strcmp(ext, ".js") || !strcmp(ext, ".mjs"))
+    minify_js(&out, blob_str(data), blob_len(data));
+  else return;
+  blob_free(data);
+  *data = out;
+}
+
+
+/** true iff the bundle made from inputs to out needs no update */
+static bool
+bundlefresh(Builder *builder, const char *key, const char *out,
+            const char *const *files, size_t n)
+{
+  const char *const *inputs;
+  Blob buf = BLOB_INIT, gz = BLOB_INIT;
+  struct stat statbuf;
+  size_t i, m;
+  bool fresh = true;
+
+  if (!out) return false;
+  inputs = deps_inputs(builder->olddeps, key, &m);
+  if (m != n) return false;
+  for (i = 0; i < n; i++)
+    if (strcmp(inputs[i], files[i])) return false;
+  if (builder->opts.inmemory)
+    fresh = out_find(builder, out) != 0;
+  else if (stat(targetpath(builder, out, &buf), &statbuf) < 0)
+    fresh = false;
+  else if (builder->opts.gzip && stat(gzipname(blob_str(&buf), &gz), &statbuf) < 0)
+    fresh = false;
+  blob_free(&buf);
+  blob_free(&gz);
+  return fresh;
+}
+
+
+/** make the bundles that build.bundles() lists, fill the manifest */
+static int
+writebundles(Builder *builder)
+{
+  struct worker *worker = &builder->workers[0];
+  lua_State *L = worker->L;
+  Blob key = BLOB_INIT, files = BLOB_INIT, data = BLOB_INIT;
+  Blob hashed = BLOB_INIT, url = BLOB_INIT;
+  const char *name, *out, *old, **pv;
+  size_t i, j, n, nfiles;
+  int r = SUCCESS;
+
+  assets_clear();
+  if (callbuild(worker, "bundles", 0, 1) != LUA_OK) {
+    log_error("cannot set up bundles");  /* details by msghandler */
+    lua_settop(L, 0);
+    return FAILSOFT;
+  }
+  n = lua_istable(L, 1) ? luaL_len(L, 1) : 0;
+  if (n > 0) trace_begin("build", "bundles", 0);
+
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    lua_getfield(L, -1, "name");
+    name = lua_tostring(L, -1);
+    lua_getfield(L, -2, "files");
+    nfiles = lua_istable(L, -1) ? luaL_len(L, -1) : 0;
+    if (!name) {
+      lua_pop(L, 3);
+      continue;
+    }
+
+    blob_clear(&files);
+    pv = blob_prepare(&files, (nfiles+1) * sizeof(*pv));
+    for (j = 0; j < nfiles; j++) {
+      lua_rawgeti(L, -1, j+1);
+      pv[j] = lua_tostring(L, -1);  /* kept alive by the table */
+      lua_pop(L, 1);
+      if (!pv[j]) pv[j] = "";
+    }
+
+    blob_clear(&key);
+    blob_addfmt(&key, "bundle:%s", name);
+    out = deps_check(builder->olddeps, blob_str(&key));
+    old = deps_output(builder->olddeps, blob_str(&key));
+    if (!bundlefresh(builder, blob_str(&key), out, pv, nfiles)) {
+      log_debug("bundling %s from %zu files", name, nfiles);
+      blob_clear(&data);
+      for (j = 0; j < nfiles; j++) {
+        if (readall(pv[j], &data) != SUCCESS) r = FAILSOFT;
+        blob_addchar(&data, '\n');
+      }
+      minifybundle(name, &data);
+      assets_hashname(&hashed, name, blob_str(&data), blob_len(&data));
+      if (old && strcmp(old, blob_str(&hashed)) && removeoutput(builder, old))
+        log_debug("removed %s (old version of %s)", old, name);
+      out = blob_str(&hashed);
+      if (putoutput(builder, out, blob_str(&data), blob_len(&data)) != SUCCESS)
+        r = FAILSOFT;
+    }
+    else links_output(out);
+    deps_add(builder->newdeps, blob_str(&key), out, pv, nfiles);
+
+    blob_clear(&url);
+    blob_addfmt(&url, "/%s", out);
+    if (assets_put(name, blob_str(&url)) != SUCCESS) {
+      log_error("build: out of memory");
+      r = FAILSOFT;
+    }
+    lua_pop(L, 3);
+  }
+
+  if (n > 0) trace_end();
+  lua_settop(L, 0);
+  blob_free(&key);
+  blob_free(&files);
+  blob_free(&data);
+  blob_free(&hashed);
+  blob_free(&url);
+  return r;
+}
+
+
+/* === feeds === */
+
+
+/** write a sitemap or feed file and record it as "feed:name" */
+static int
+putfeedfile(const char *name, const char *data, size_t len, void *ud)
+{
+  Builder *builder = ud;
+  Blob key = BLOB_INIT;
+  blob_addfmt(&key, "feed:%s", name);
+  deps_check(builder->olddeps, blob_str(&key));
+  deps_add(builder->newdeps, blob_str(&key), name, 0, 0);
+  blob_free(&key);
+  return putoutput(builder, name, data, len);
+}
+
+
+/** remove a file of the previous feeds not written this time */
+static void
+removefeed(const char *source, const char *output, void *ud)
+{
+  if (isfeed(source) && removeoutput(ud, output))
+    log_debug("removed %s (no longer written)", output);
+}
+
+
+/** keep a file of the previous feeds (they could not be written) */
+static void
+keepfeed(const char *source, const char *output, void *ud)
+{
+  Builder *builder = ud;
+  if (isfeed(source)) deps_add(builder->newdeps, source, output, 0, 0);
+}
+
+
+/** path of the page relative to its source dir (or drafts) */
+static const char *
+pagerel(Builder *builder, const char *src)
+{
+  size_t len = strlen(builder->opts.source);
+  if (!strncmp(src, builder->opts.source, len) && src[len] == '/')
+    src += len + 1;
+  else if (!strncmp(src, "drafts/", 7))
+    src += 7;
+  return src;
+}
+
+
+/** URL path of the page from source path: same as build.page() */
+static const char *
+pageurl(Builder *builder, const char *src, Blob *buf)
+{
+  const char *ext;
+  src = pagerel(builder, src);
+  blob_clear(buf);
+  ext = strrchr(src, '.');
+  if (ext && !strchr(ext, '/') && !strcmp(ext, ".md")) {
+    blob_addbuf(buf, src, ext - src);
+    blob_addstr(buf, ".html");
+  }
+  else blob_addstr(buf, src);
+  return blob_str(buf);
+}
+
+
+/** the page's body as build.entry() renders it, for its feed entry */
+static void
+pagehtml(Builder *builder, const struct pageinfo *info, Blob *html)
+{
+  struct worker *worker = &builder->workers[0];
+  lua_State *L = worker->L;
+  const char *text;
+  size_t len;
+  int top = lua_gettop(L);
+
+  blob_clear(html);
+  lua_pushstring(L, info->path);
+  lua_pushstring(L, pagerel(builder, info->path));
+  if (callbuild(worker, "entry", 2, 1) != LUA_OK)
+    log_warn("feeds: cannot render %s", info->path);  /* details by msghandler */
+  else if ((text = lua_tolstring(L, -1, &len)))
+    blob_addbuf(html, text, len);
+  lua_settop(L, top);
+}
+
+
+/** write sitemap and feeds from the index, as build.feeds() says */
+static int
+writefeeds(Builder *builder)
+{
+  struct worker *worker = &builder->workers[0];
+  lua_State *L = worker->L;
+  const struct term *terms;
+  const uint32_t *order;
+  struct pageinfo info;
+  struct feed feed;
+  struct sitemap sm;
+  Blob out = BLOB_INIT, url = BLOB_INIT, html = BLOB_INIT;
+  const char *sitemap, *section, *newest = 0;
+  static const char *const names[] = { "rss", "atom" };
+  size_t i, n, count;
+  lua_Integer maxentries;
+  int f, r = SUCCESS;
+
+  if (callbuild(worker, "feeds", 0, 1) != LUA_OK) {
+    log_error("cannot set up feeds");  /* details by msghandler */
+    deps_stale(builder->olddeps, keepfeed, builder);
+    lua_settop(L, 0);
+    return FAILSOFT;
+  }
+  if (!lua_istable(L, -1)) {  /* no feeds */
+    deps_stale(builder->olddeps, removefeed, builder);
+    lua_settop(L, 0);
+    return SUCCESS;
+  }
+  trace_begin("build", "feeds", 0);
+
+  lua_getfield(L, 1, "baseurl");
+  feed.baseurl = lua_tostring(L, -1);
+  lua_getfield(L, 1, "title");
+  feed.title = lua_tostring(L, -1);
+  lua_getfield(L, 1, "description");
+  feed.description = lua_tostring(L, -1);
+  lua_getfield(L, 1, "author");
+  feed.author = lua_tostring(L, -1);
+  lua_getfield(L, 1, "sitemap");
+  sitemap = lua_tostring(L, -1);
+  lua_getfield(L, 1, "section");
+  section = lua_tostring(L, -1);
+  lua_getfield(L, 1, "entries");
+  maxentries = lua_tointeger(L, -1);
+  lua_pop(L, 1);  /* strings are kept alive by the table */
+  if (!feed.baseurl) goto done;
+
+  /* pages, newest first */
+  terms = taxonomy_terms(TAXO_DATE, &n);
+  order = taxonomy_pages(TAXO_DATE);
+  count = n > 0 ? terms[0].count : 0;
+
+  if (sitemap) {
+    sitemap_begin(&sm, feed.baseurl, sitemap, putfeedfile, builder);
+    for (i = 0; i < count && index_get(order[i], &info); i++)
+      sitemap_add(&sm, pageurl(builder, info.path, &url),
+        *info.date ? info.date : 0);
+    if (sitemap_end(&sm) != SUCCESS) r = FAILSOFT;
+  }
+
+  for (f = 0; f < 2; f++) {
+    lua_getfield(L, 1, names[f]);
+    feed.path = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    if (!feed.path) continue;
+    feed.format = f == 0 ? FEED_RSS : FEED_ATOM;
+    feed.out = &out;
+    blob_clear(&out);
+    newest = 0;
+    for (i = 0; !newest && i < count && index_get(order[i], &info); i++)
+      if (*info.date && (!section || !strcmp(info.section, section)))
+        newest = info.date;
+    feed_begin(&feed, newest);
+    for (i = n = 0; i < count && (lua_Integer) n < maxentries; i++) {
+      if (!index_get(order[i], &info) || !*info.date) continue;
+      if (section && strcmp(info.section, section)) continue;
+      pagehtml(builder, &info, &html);
+      feed_entry(&feed, pageurl(builder, info.path, &url), info.title,
+        info.date, blob_str(&html), blob_len(&html));
+      n++;
+    }
+    feed_end(&feed);
+    if (putfeedfile(feed.path, blob_str(&out), blob_len(&out), builder) != SUCCESS)
+      r = FAILSOFT;
+  }
+
+done:
+  deps_stale(builder->olddeps, removefeed, builder);
+  lua_settop(L, 0);
+  blob_free(&out);
+  blob_free(&url);
+  blob_free(&html);
+  trace_end();
+  return r;
+}
+
+
+/* === search === */
+
+
+/** the search index directory from build.search(), or null */
+static const char *
+getsearch(Builder *builder)
+{
+  struct worker *worker = &builder->workers[0];
+  lua_State *L = worker->L;
+  const char *dir = 0;
+
+  if (callbuild(worker, "search", 0, 1) != LUA_OK)
+    log_error("cannot set up search index");  /* details by msghandler */
+  else if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "dir");
+    dir = lua_tostring(L, -1);
+    dir = mem_pool_dup(&builder->pool, dir ? dir : "search",
+      strlen(dir ? dir : "search"));
+  }
+  lua_settop(L, 0);
+  return dir;
+}
+
+
+static int
+flushsearch(const char *name, const char *data, size_t len, void *ud)
+{
+  if (!data) {  /* no such file (any more) */
+    removeoutput(ud, name);
+    return SUCCESS;
+  }
+  return putoutput(ud, name, data, len);
+}
+
+
+/** write the search index of all pages */
+static int
+writesearch(Builder *builder)
+{
+  int r;
+  if (!builder->searchdir) return SUCCESS;
+  trace_begin("build", "search", 0);
+  r = search_write(builder->searchdir, flushsearch, builder);
+  if (!builder->opts.inmemory)
+    search_save(SEARCH_FILE);
+  trace_end();
+  return r;
+}
+
+
+/* === dedup === */
+
+
+/** replace identical files in the target by hard links */
+static int
+dedupoutputs(Builder *builder, struct dedupstats *stats)
+{
+  Blob errmsg = BLOB_INIT;
+  int r = SUCCESS;
+  trace_begin("build", "dedup", builder->opts.target);
+  if (copy_dedup(builder->opts.target, stats, &errmsg) < 0) {
+    log_error("dedup: %s", blob_str(&errmsg));
+    r = FAILSOFT;
+  }
+  trace_end();
+  blob_free(&errmsg);
+  return r;
+}
+
+
+/* === links === */
+
+
+/** check links of all pages and templates; return number broken */
+static int
+checklinks(Builder *builder)
+{
+  static const char *const dirs[] = { "layouts", "partials" };
+  struct walk walk;
+  Blob data = BLOB_INIT, links = BLOB_INIT;
+  size_t i;
+  int type, nbroken;
+
+  trace_begin("build", "checklinks", 0);
+  for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++) {
+    if (walkdir(&walk, dirs[i], WALK_FILE) != 0) continue;
+    while ((type = walkdir_next(&walk)) > 0) {
+      const char *path = walkdir_path(&walk);
+      if (type != WALK_F) continue;
+      blob_clear(&data);
+      blob_clear(&links);
+      if (readall(path, &data) != SUCCESS) continue;
+      links_scan(&links, blob_str(&data), blob_len(&data));
+      links_template(path, blob_str(&links), blob_len(&links));
+    }
+    walkdir_free(&walk);
+  }
+
+  nbroken = links_check();
+  if (nbroken > 0)
+    log_warn("%d broken internal link%s", nbroken, nbroken == 1 ? "" : "s");
+  if (!builder->opts.inmemory)
+    links_save(LINKS_FILE);
+  trace_end();
+
+  blob_free(&data);
+  blob_free(&links);
+  return nbroken;
+}
+
+
+/* === builder === */
+
+
+Builder *
+build_new(const struct buildopts *opts)
+{
+  Builder *builder;
+  int i, n;
+
+  assert(opts != NULL);
+  assert(opts->newstate != NULL);
+  assert(opts->msghandler != NULL);
+
+  if (opts->root && chdir(opts->root) < 0) {
+    log_error("cannot change to site directory %s: %s",
+      opts->root, strerror(errno));
+    return 0;
+  }
+
+  n = opts->nthreads > 0 ? opts->nthreads : build_nthreads();
+
+  builder = calloc(1, sizeof(*builder));
+  if (!builder) goto nomem;
+  builder->workers = calloc(n, sizeof(struct worker));
+  if (!builder->workers) goto nomem;
+  builder->nworkers = n;
+  for (i = 0; i < n; i++)
+    builder->workers[i].builder = builder;
+
+  builder->opts = *opts;
+  if (!builder->opts.config) builder->opts.config = "config.jot";
+  if (!builder->opts.source) builder->opts.source = "content";
+  if (!builder->opts.target) builder->opts.target = "public";
+  builder->jobs = (Blob) BLOB_INIT;
+  builder->changed = (Blob) BLOB_INIT;
+  mem_pool_init(&builder->pool, 0);
+  pthread_mutex_init(&builder->lock, 0);
+
+  log_debug("build: config=%s, source=%s, target=%s, workers=%d",
+    builder->opts.config, builder->opts.source, builder->opts.target, n);
+  return builder;
+
+nomem:
+  log_error("build: out of memory");
+  if (builder) free(builder->workers);
+  free(builder);
+  return 0;
+}
+
+
+int
+build_run(Builder *builder)
+{
+  struct stat statbuf;
+  double start = now();
+  int npages = 0, nskipped = 0, ncopied = 0, nerrors = 0;
+  int i, nthreads;
+  Blob signature = BLOB_INIT;
+  Blob globals = BLOB_INIT;
+  struct dedupstats dedup;
+  size_t nglobals;
+
+  assert(builder != NULL);
+  trace_begin("build", "build_run", 0);
+  memset(&dedup, 0, sizeof(dedup));
+
+  blob_clear(&builder->jobs);
+  builder->njobs = builder->next = 0;
+  mem_pool_free(&builder->pool);
+  mem_pool_init(&builder->pool, 0);
+
+  if (!builder->opts.inmemory && makedirs(builder->opts.target) < 0) {
+    log_error("mkdir %s: %s", builder->opts.target, strerror(errno));
+    nerrors = 1;
+    goto done;
+  }
+
+  if (scantree(builder, builder->opts.source, true) != SUCCESS ||
+      (builder->opts.drafts && stat("drafts", &statbuf) == 0 &&
+       scantree(builder, "drafts", true) != SUCCESS) ||
+      (stat("static", &statbuf) == 0 &&
+       scantree(builder, "static", false) != SUCCESS)) {
+    nerrors = 1;
+    goto done;
+  }
+
+  /* the previous graph is only valid for the same options; it is
+     kept in memory between runs (watch mode) and only loaded from
+     DEPS_FILE on the first; in-memory builds start from scratch */
+  blob_addfmt(&signature, "%s config=%s source=%s target=%s drafts=%d gzip=%d minify=%d",
+    VERSION, builder->opts.config, builder->opts.source,
+    builder->opts.target, builder->opts.drafts, builder->opts.gzip,
+    builder->opts.minify);
+  links_begin();
+  search_begin();
+  if (!builder->olddeps) {
+    if (builder->opts.force || builder->opts.inmemory)
+      builder->olddeps = deps_new();
+    else {
+      trace_begin("io", "deps_load", DEPS_FILE);
+      builder->olddeps = deps_load(DEPS_FILE, blob_str(&signature));
+      links_load(LINKS_FILE);
+      search_load(SEARCH_FILE);
+      trace_end();
+    }
+  }
+  /* inputs modified from now on may have changed after they were
+     read and are not fingerprinted, except INDEX_FILE, which we write */
+  builder->newdeps = deps_new();
+  if (!builder->olddeps || !builder->newdeps) {
+    log_error("build: out of memory");
+    nerrors = 1;
+    goto done;
+  }
+  if (builder->hinted)
+    deps_assume(builder->olddeps, blob_buf(&builder->changed), builder->nchanged);
+  if (!builder->opts.inmemory)
+    cache_open(CACHE_FILE);  /* no cache is no error */
+  updateindex(builder);
+  deps_written(builder->newdeps, INDEX_FILE);
+
+  /* set up first worker here, so config errors show only once */
+  if (!builder->workers[0].L && worker_setup(&builder->workers[0]) != SUCCESS) {
+    nerrors = 1;
+    goto done;
+  }
+
+  builder->searchdir = getsearch(builder);
+
+  /* bundles before planjobs, which removes outputs not seen */
+  if (writebundles(builder) != SUCCESS) nerrors++;
+  nglobals = globalinputs(builder, &globals);
+  trace_begin("build", "planjobs", 0);
+  nskipped = planjobs(builder, blob_buf(&globals), nglobals);
+  trace_end();
+
+  nthreads = MIN(builder->nworkers, (int) builder->njobs);
+  if (nthreads < 1) nthreads = 1;
+  log_debug("build: %zu jobs on %d threads", builder->njobs, nthreads);
+
+  for (i = 0; i < nthreads; i++) {
+    struct worker *worker = &builder->workers[i];
+    if (pthread_create(&worker->thread, 0, worker_thread, worker) != 0) {
+      log_error("cannot create worker thread: %s", strerror(errno));
+      nthreads = i;
+      break;
+    }
+  }
+  if (nthreads < 1)  /* no threads at all: work on main thread */
+    worker_main(&builder->workers[0]);
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join(builder->workers[i].thread, 0);
+
+  if (writefeeds(builder) != SUCCESS) nerrors++;
+  if (writesearch(builder) != SUCCESS) nerrors++;
+  checklinks(builder);
+  if (builder->opts.dedup && !builder->opts.inmemory &&
+      dedupoutputs(builder, &dedup) != SUCCESS)
+    nerrors++;
+
+  for (i = 0; i < builder->nworkers; i++) {
+    struct worker *worker = &builder->workers[i];
+    npages += worker->npages;
+    ncopied += worker->ncopied;
+    nskipped += worker->nfresh;
+    nerrors += worker->nerrors;
+    worker->npages = worker->ncopied = worker->nfresh = worker->nerrors = 0;
+  }
+
+  deps_add(builder->newdeps, "", "", blob_buf(&globals), nglobals);
+  trace_begin("io", "deps_save", DEPS_FILE);
+  deps_fingerprint(builder->newdeps, builder->olddeps);
+  if (!builder->opts.inmemory)
+    deps_save(builder->newdeps, DEPS_FILE, blob_str(&signature));
+  trace_end();
+  deps_free(builder->olddeps);
+  builder->olddeps = builder->newdeps;  /* for the next run */
+  builder->newdeps = 0;
+
+  log_info("built %d pages, copied %d files, %d up to date, %d errors, "
+    "%d threads, %.3fs", npages, ncopied, nskipped, nerrors, nthreads,
+    now() - start);
+  if (builder->opts.dedup && !builder->opts.inmemory)
+    log_info("linked %zu duplicates (%zu linked before), %llu bytes saved",
+      dedup.nlinked, dedup.nshared, (unsigned long long) dedup.nsaved);
+
+done:
+  builder->hinted = false;  /* hints are for one run only */
+  trace_begin("io", "cache_close", CACHE_FILE);
+  cache_close();
+  trace_end();
+  if (builder->newdeps) {  /* failed: start over next time */
+    deps_free(builder->olddeps);
+    deps_free(builder->newdeps);
+    builder->olddeps = builder->newdeps = 0;
+  }
+  blob_free(&signature);
+  blob_free(&globals);
+  trace_end();
+  trace_flush();  /* watch and serve run until killed */
+  return nerrors;
+}
+
+
+void
+build_free(Builder *builder)
+{
+  size_t n;
+  int i;
+  if (!builder) return;
+  for (i = 0; i < builder->nworkers; i++) {
+    if (builder->workers[i].L)
+      lua_close(builder->workers[i].L);
+  }
+  free(builder->workers);
+  for (n = 0; n < builder->noutbuckets; n++) {
+    struct outfile *p, *next;
+    for (p = builder->outputs[n]; p; p = next) {
+      next = p->next;
+      out_free(p);
+    }
+  }
+  free(builder->outputs);
+  freewatch(builder->watch);
+  deps_free(builder->olddeps);
+  taxonomy_free();
+  assets_clear();
+  links_free();
+  search_free();
+  index_close();
+  blob_free(&builder->jobs);
+  blob_free(&builder->changed);
+  mem_pool_free(&builder->pool);
+  pthread_mutex_destroy(&builder->lock);
+  free(builder);
+}
+
+
+/* === watch mode === */
+
+
+/* Watch the site's directories with inotify (Linux only) and
+ * rebuild when something changed. A burst of events (an editor
+ * saving, a git checkout) is collected until BUILD_DEBOUNCE_MS pass
+ * without further events, then the build runs once. As builds
+ * are incremental, only affected pages are rendered. Workers
+ * keep their Lua states, except that changes to the config,
+ * init scripts, or data mean a fresh state (setup again), and
+ * changes to layouts or partials make them reload templates.
+ * The paths reported by inotify are passed on to the build as
+ * hints, so it need not stat all inputs to find what changed;
+ * when in doubt (new directories, queue overflow), it does.
+ */
+
+#define CHANGED_CONTENT    1
+#define CHANGED_TEMPLATES  2
+#define CHANGED_SETUP      4
+
+#if defined(__linux__)
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+
+struct watchdir {
+  const char *path;     /* null if wd not in use */
+  int what;             /* CHANGED_* for events in this dir */
+  bool isroot;          /* the directory containing the config */
+};
+
+struct watch {
+  int fd;               /* from inotify_init() */
+  Blob dirs;            /* array of struct watchdir, indexed by wd */
+  MemPool pool;         /* storage for path strings */
+  const char *config;   /* config file name (in root dir) */
+  Blob changed;         /* array of paths (in pool) */
+  size_t nchanged;
+  bool nohints;         /* changed is incomplete */
+  int changes;          /* CHANGED_* flags pending */
+  struct { const char *name; int what; } tops[8];
+  int ntops;            /* top level dirs that may appear */
+};
+
+
+static int
+watchone(struct watch *watch, const char *path, int what, bool isroot)
+{
+  struct watchdir *dir;
+  size_t n, have;
+  int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS);
+  if (wd < 0) {
+    log_warn("cannot watch %s: %s", path, strerror(errno));
+    return FAILSOFT;
+  }
+  have = blob_len(&watch->dirs) / sizeof(*dir);
+  if ((size_t) wd >= have) {
+    n = (wd + 1 - have) * sizeof(*dir);
+    memset(blob_prepare(&watch->dirs, n), 0, n);
+    blob_addlen(&watch->dirs, n);
+  }
+  dir = (struct watchdir *) blob_buf(&watch->dirs) + wd;
+  dir->path = mem_pool_dup(&watch->pool, path, strlen(path));
+  dir->what = what;
+  dir->isroot = isroot;
+  return SUCCESS;
+}
+
+
+/** watch directory path and all its subdirectories */
+static void
+watchtree(struct watch *watch, const char *path, int what)
+{
+  struct walk walk;
+  int type;
+
+  if (walkdir(&walk, path, WALK_PRE) != 0) return;  /* no such dir */
+  while ((type = walkdir_next(&walk)) > 0)
+    if (type == WALK_D) watchone(watch, walkdir_path(&walk), what, false);
+  walkdir_free(&walk);
+}
+
+
+static void
+watchtop(struct watch *watch, const char *name, int what)
+{
+  if (watch->ntops < (int) (sizeof(watch->tops)/sizeof(watch->tops[0]))) {
+    watch->tops[watch->ntops].name = name;
+    watch->tops[watch->ntops].what = what;
+    watch->ntops++;
+  }
+  watchtree(watch, name, what);
+}
+
+
+static bool
+isscratch(const char *name)
+{
+  /* hidden files and editor backups, e.g. .foo.swp and foo~ */
+  size_t len = strlen(name);
+  return name[0] == '.' || (len > 0 && name[len-1] == '~');
+}
+
+
+static void
+addchanged(struct watch *watch, Blob *path)
+{
+  const char **pp = blob_prepare(&watch->changed, sizeof(*pp));
+  *pp = mem_pool_dup(&watch->pool, blob_str(path), blob_len(path));
+  blob_addlen(&watch->changed, sizeof(*pp));
+  watch->nchanged++;
+}
+
+
+/** read pending events, watch new dirs; return new CHANGED_* flags */
+static int
+readevents(struct watch *watch)
+{
+  union {
+    struct inotify_event event;  /* for alignment */
+    char buf[8192];
+  } u;
+  const struct inotify_event *ev;
+  const struct watchdir *dir;
+  Blob path = BLOB_INIT;
+  size_t ndirs;
+  ssize_t n;
+  char *p;
+  int i, what = 0;
+
+  n = read(watch->fd, u.buf, sizeof(u.buf));
+  if (n <= 0) return 0;
+
+  for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+    ev = (const struct inotify_event *) p;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      log_warn("watch: event queue overflow");
+      what |= CHANGED_CONTENT|CHANGED_SETUP;
+      watch->nohints = true;
+      continue;
+    }
+    ndirs = blob_len(&watch->dirs) / sizeof(*dir);
+    if (ev->wd < 0 || (size_t) ev->wd >= ndirs || !ev->len) continue;
+    dir = (const struct watchdir *) blob_buf(&watch->dirs) + ev->wd;
+    if (!dir->path || isscratch(ev->name)) continue;
+
+    blob_clear(&path);
+    if (strcmp(dir->path, ".")) {
+      blob_addstr(&path, dir->path);
+      blob_addchar(&path, '/');
+    }
+    blob_addstr(&path, ev->name);
+
+    if (dir->isroot) {
+      if (!strcmp(blob_str(&path), watch->config)) {
+        addchanged(watch, &path);
+        what |= CHANGED_SETUP;
+      }
+      else if (ev->mask & IN_ISDIR && ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+        for (i = 0; i < watch->ntops; i++) {
+          if (strcmp(watch->tops[i].name, blob_str(&path))) continue;
+          watchtree(watch, blob_str(&path), watch->tops[i].what);
+          what |= watch->tops[i].what;
+          watch->nohints = true;
+        }
+      }
+      continue;
+    }
+
+    log_debug("watch: %s changed", blob_str(&path));
+    if (ev->mask & IN_ISDIR && ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+      watchtree(watch, blob_str(&path), dir->what);
+      watch->nohints = true;  /* files in there are not reported */
+    }
+    else addchanged(watch, &path);
+    what |= dir->what;
+  }
+
+  blob_free(&path);
+  watch->changes |= what;
+  return what;
+}
+
+
+/** pass the collected paths on to the builder, then forget them */
+static void
+passhints(struct watch *watch, Builder *builder)
+{
+  const char **pv = blob_buf(&watch->changed);
+  size_t i;
+
+  blob_clear(&builder->changed);
+  builder->nchanged = 0;
+  builder->hinted = !watch->nohints;
+  if (builder->hinted) {
+    qsort(pv, watch->nchanged, sizeof(*pv), strpcmp);
+    for (i = 0; i < watch->nchanged; i++) {
+      if (i > 0 && !strcmp(pv[i-1], pv[i])) continue;
+      blob_addbuf(&builder->changed, (char *) &pv[i], sizeof(*pv));
+      builder->nchanged++;
+    }
+  }
+  blob_clear(&watch->changed);
+  watch->nchanged = 0;
+  watch->nohints = false;
+}
+
+
+/** make workers reload templates, or start afresh if that fails */
+static void
+refreshworkers(Builder *builder)
+{
+  int i;
+  for (i = 0; i < builder->nworkers; i++) {
+    struct worker *worker = &builder->workers[i];
+    if (!worker->L) continue;
+    if (callbuild(worker, "refresh", 0, 0) != LUA_OK) {
+      lua_close(worker->L);
+      worker->L = 0;
+    }
+  }
+}
+
+
+/** close workers' Lua states: next build sets them up again */
+static void
+resetworkers(Builder *builder)
+{
+  int i;
+  for (i = 0; i < builder->nworkers; i++) {
+    if (builder->workers[i].L)
+      lua_close(builder->workers[i].L);
+    builder->workers[i].L = 0;
+  }
+}
+
+
+static void
+freewatch(struct watch *watch)
+{
+  if (!watch) return;
+  if (watch->fd >= 0) close(watch->fd);
+  blob_free(&watch->dirs);
+  blob_free(&watch->changed);
+  mem_pool_free(&watch->pool);
+  free(watch);
+}
+
+
+/** set up watches on the site's dirs; return fd to poll or -1 */
+int
+build_watch_start(Builder *builder)
+{
+  struct watch *watch;
+  const char *slash;
+  Blob configdir = BLOB_INIT;
+
+  assert(builder != NULL);
+  if (builder->watch) return builder->watch->fd;
+
+  watch = calloc(1, sizeof(*watch));
+  if (!watch) {
+    log_error("watch: out of memory");
+    return -1;
+  }
+  watch->fd = inotify_init1(IN_CLOEXEC);
+  if (watch->fd < 0) {
+    log_error("inotify: %s", strerror(errno));
+    free(watch);
+    return -1;
+  }
+  watch->dirs = (Blob) BLOB_INIT;
+  watch->changed = (Blob) BLOB_INIT;
+  mem_pool_init(&watch->pool, 0);
+
+  /* the config file's dir (usually the site root) non-recursively */
+  watch->config = builder->opts.config;
+  slash = strrchr(watch->config, '/');
+  if (slash) blob_addbuf(&configdir, watch->config, slash - watch->config);
+  else blob_addchar(&configdir, '.');
+  watchone(watch, blob_str(&configdir), CHANGED_SETUP, true);
+  blob_free(&configdir);
+
+  watchtop(watch, builder->opts.source, CHANGED_CONTENT);
+  if (builder->opts.drafts)
+    watchtop(watch, "drafts", CHANGED_CONTENT);
+  watchtop(watch, "static", CHANGED_CONTENT);
+  watchtop(watch, "layouts", CHANGED_TEMPLATES);
+  watchtop(watch, "partials", CHANGED_TEMPLATES);
+  watchtop(watch, "data", CHANGED_SETUP);
+  watchtop(watch, "init", CHANGED_SETUP);
+
+  builder->watch = watch;
+  return watch->fd;
+}
+
+
+/** read events from the watch fd; true iff changes are pending */
+bool
+build_watch_read(Builder *builder)
+{
+  assert(builder != NULL && builder->watch != NULL);
+  readevents(builder->watch);
+  return builder->watch->changes != 0;
+}
+
+
+/** rebuild for the pending changes; return number of errors */
+int
+build_watch_rebuild(Builder *builder)
+{
+  struct watch *watch;
+  assert(builder != NULL && builder->watch != NULL);
+  watch = builder->watch;
+  if (watch->changes & CHANGED_SETUP) resetworkers(builder);
+  else if (watch->changes & CHANGED_TEMPLATES) refreshworkers(builder);
+  watch->changes = 0;
+  passhints(watch, builder);
+  return build_run(builder);
+}
+
+
+int
+build_watch(Builder *builder)
+{
+  struct pollfd pfd;
+  int timeout, r;
+
+  pfd.fd = build_watch_start(builder);
+  if (pfd.fd < 0) return 1;
+  pfd.events = POLLIN;
+
+  build_run(builder);
+  log_info("watching for changes, press Ctrl-C to stop");
+
+  for (;;) {
+    timeout = -1;  /* wait for first event, then until quiet */
+    while ((r = poll(&pfd, 1, timeout)) > 0) {
+      build_watch_read(builder);
+      timeout = BUILD_DEBOUNCE_MS;
+    }
+    if (r < 0 && errno != EINTR) {
+      log_error("watch: poll: %s", strerror(errno));
+      return 1;
+    }
+    if (builder->watch->changes)
+      build_watch_rebuild(builder);
+  }
+}
+
+#else
+
+static void
+freewatch(struct watch *watch)
+{
+  UNUSED(watch);
+}
+
+
+int
+build_watch_start(Builder *builder)
+{
+  UNUSED(builder);
+  log_error("watch mode is not supported on this platform");
+  return -1;
+}
+
+
+bool
+build_watch_read(Builder *builder)
+{
+  UNUSED(builder);
+  return false;
+}
+
+
+int
+build_watch_rebuild(Builder *builder)
+{
+  return build_run(builder);
+}
+
+
+int
+build_watch(Builder *builder)
+{
+  return build_watch_start(builder) < 0 ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef BUILD_H
+#define BUILD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lua.h"
+
+/* Site building: walk content/ and static/, render pages
+ * on a pool of worker threads, each owning its own Lua state;
+ * paths in the options are relative to the site root */
+
+struct buildopts {
+  const char *root;     /* site root directory (chdir there) */
+  const char *config;   /* config file, default config.jot */
+  const char *source;   /* content dir, default content/ */
+  const char *target;   /* output dir, default public/ */
+  bool drafts;          /* also build drafts/ */
+  bool force;           /* rebuild all, ignore dependencies */
+  bool inmemory;        /* output to memory, see build_lookup() */
+  bool gzip;            /* also write .gz of text outputs */
+  bool minify;          /* minify rendered HTML */
+  bool dedup;           /* hard-link identical outputs */
+  int nthreads;         /* number of workers, 0 for default */
+  lua_State *(*newstate)(void);  /* create a set up Lua state */
+  lua_CFunction msghandler;      /* message handler for pcall */
+};
+
+typedef struct builder Builder;
+
+Builder *build_new(const struct buildopts *opts);
+int build_run(Builder *builder);
+int build_watch(Builder *builder);
+void build_free(Builder *builder);
+
+int build_watch_start(Builder *builder);
+bool build_watch_read(Builder *builder);
+int build_watch_rebuild(Builder *builder);
+
+bool build_lookup(Builder *builder, const char *path,
+                  const char **data, size_t *len, const char **file);
+int build_tar(Builder *builder, const char *fn);
+
+int build_nthreads(void);
+
+/* Usage: build_new() with options, then build_run() as often
+   as desired (the workers' Lua states are kept warm between
+   runs), finally build_free(); build_run() returns the number
+   of errors, that is, zero if all went well; build_watch() runs
+   a build and then another one whenever the sources change, and
+   only returns on failure (to set up the watch); to run your own
+   event loop instead, poll the fd from build_watch_start(), call
+   build_watch_read() when it is readable, and build_watch_rebuild()
+   once no more events came for BUILD_DEBOUNCE_MS; build_lookup()
+   gets an output of an in-memory build (between runs only), and
+   build_tar() writes all of them as a tar archive to a file, or
+   to stdout if fn is "-" */
+
+#define BUILD_DEBOUNCE_MS 30
+
+#endif
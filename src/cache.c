@@ -0,0 +1,627 @@
+/* Persistent build cache */
+
+#define _POSIX_C_SOURCE 200809L  /* for pread(2) and friends */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "cache.h"
+#include "hash.h"
+#include "log.h"
+
+
+/* The cache is two files: the log (e.g. .jot-cache) is a header
+ * followed by records (header, data, padding to 8 bytes), which
+ * are only ever appended; the index (.jot-cache.idx) is an array
+ * of entries (key, record offset, length, generation) sorted by
+ * key, written when the cache is closed. Both are mapped read-only
+ * when the cache is opened, so lookups are a binary search and a
+ * memcpy. Records appended since go into an in-memory hash table
+ * (and are found by scanning the log tail if the index was not
+ * written, e.g. after a crash).
+ *
+ * Each close starts a new generation; entries not used for
+ * MAXAGE generations are evicted, as are the oldest entries when
+ * live data exceeds MAXSIZE. When more than half of the log is
+ * dead records, it is compacted (rewritten with live records).
+ *
+ * Both files are in host byte order and not meant to be shared
+ * between machines; the log header carries the jot version, as
+ * any other version may render differently.
+ */
+
+#define LOGMAGIC "JOTCACHE"
+#define IDXMAGIC "JOTCIDX1"
+#define RECMAGIC 0x4345524AU  /* "JREC" on little endian */
+#define FORMAT   1
+
+#define MAXAGE   20                   /* generations (builds) */
+#define MAXSIZE  (512UL * 1024 * 1024)  /* bytes of live records */
+#define MAXLEN   (256UL * 1024 * 1024)  /* bytes per record */
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+#define RECSIZE(len) ALIGN8(sizeof(struct rechead) + (len))
+
+struct loghead {
+  char magic[8];
+  uint32_t format;
+  uint32_t unused;
+  char version[16];
+};
+
+struct rechead {
+  uint32_t magic;
+  uint32_t len;
+  uint64_t key;
+};
+
+struct idxhead {
+  char magic[8];
+  uint64_t logsize;     /* log bytes covered by this index */
+  uint64_t count;       /* number of entries */
+  uint64_t gen;         /* generation at time of writing */
+};
+
+struct entry {
+  uint64_t key;         /* zero means empty slot in table */
+  uint64_t offset;      /* of record in log */
+  uint32_t len;         /* of record data */
+  uint32_t gen;         /* generation when last used */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  int fd;               /* log file, -1 while cache closed */
+  char *fn;             /* log file name */
+  const char *logmap;   /* log file, mapped at open */
+  size_t logmaplen;     /* length of mapping */
+  size_t logmapsize;    /* valid bytes in mapping */
+  uint64_t logsize;     /* current end of log */
+  void *idxmap;         /* index file, mapped at open */
+  size_t idxmapsize;
+  const struct entry *entries;  /* from index, sorted by key */
+  size_t nentries;
+  unsigned char *used;  /* flags, parallel to entries */
+  struct entry *table;  /* records added since index was written */
+  size_t tabsize;       /* slots, a power of two */
+  size_t tabcount;      /* slots used */
+  uint32_t gen;         /* current generation */
+  size_t hits, misses;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+
+static int
+entrycmp(const void *a, const void *b)
+{
+  const struct entry *p = a;
+  const struct entry *q = b;
+  return p->key < q->key ? -1 : p->key > q->key ? 1 : 0;
+}
+
+
+static int
+gencmp(const void *a, const void *b)
+{
+  const struct entry *p = a;
+  const struct entry *q = b;
+  return p->gen > q->gen ? -1 : p->gen < q->gen ? 1 : 0;  /* newest first */
+}
+
+
+static struct entry *
+tab_find(uint64_t key)
+{
+  size_t i, mask = cache.tabsize - 1;
+  if (!cache.table) return 0;
+  for (i = key & mask; cache.table[i].key; i = (i+1) & mask)
+    if (cache.table[i].key == key) return &cache.table[i];
+  return 0;
+}
+
+
+static int
+tab_insert(const struct entry *entry)
+{
+  size_t i, mask;
+  if (2 * (cache.tabcount + 1) > cache.tabsize) {
+    struct entry *old = cache.table;
+    size_t oldsize = cache.tabsize;
+    size_t newsize = oldsize ? 2 * oldsize : 256;
+    struct entry *new = calloc(newsize, sizeof(*new));
+    if (!new) return -1;
+    cache.table = new;
+    cache.tabsize = newsize;
+    cache.tabcount = 0;
+    for (i = 0; i < oldsize; i++)
+      if (old[i].key) tab_insert(&old[i]);
+    free(old);
+  }
+  mask = cache.tabsize - 1;
+  for (i = entry->key & mask; cache.table[i].key; i = (i+1) & mask)
+    ;
+  cache.table[i] = *entry;
+  cache.tabcount++;
+  return 0;
+}
+
+
+static int
+writeall(int fd, const void *buf, size_t len, uint64_t ofs)
+{
+  const char *p = buf;
+  ssize_t n;
+  while (len > 0) {
+    n = pwrite(fd, p, len, ofs);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    p += n;
+    len -= n;
+    ofs += n;
+  }
+  return 0;
+}
+
+
+static int
+readall(int fd, void *buf, size_t len, uint64_t ofs)
+{
+  char *p = buf;
+  ssize_t n;
+  while (len > 0) {
+    n = pread(fd, p, len, ofs);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+    ofs += n;
+  }
+  return 0;
+}
+
+
+/** the data of the record for entry, from map or file; null on error */
+static const char *
+getdata(int fd, const struct entry *entry, Blob *buf)
+{
+  struct rechead head;
+  char *p;
+
+  if (entry->offset + RECSIZE(entry->len) <= cache.logmapsize) {
+    const char *rec = cache.logmap + entry->offset;
+    memcpy(&head, rec, sizeof(head));
+    if (head.magic != RECMAGIC || head.key != entry->key) return 0;
+    return rec + sizeof(head);
+  }
+
+  p = blob_prepare(buf, sizeof(head) + entry->len);
+  if (readall(fd, p, sizeof(head) + entry->len, entry->offset) < 0)
+    return 0;
+  memcpy(&head, p, sizeof(head));
+  if (head.magic != RECMAGIC || head.key != entry->key) return 0;
+  return p + sizeof(head);
+}
+
+
+static void
+makeheader(struct loghead *head)
+{
+  memset(head, 0, sizeof(*head));
+  memcpy(head->magic, LOGMAGIC, sizeof(head->magic));
+  head->format = FORMAT;
+  strncpy(head->version, VERSION, sizeof(head->version)-1);
+}
+
+
+/** add records from the log tail (not in the index) to the table */
+static void
+scantail(uint64_t ofs, uint64_t end)
+{
+  struct rechead head;
+  struct entry entry;
+
+  while (ofs + sizeof(head) <= end) {
+    memcpy(&head, cache.logmap + ofs, sizeof(head));
+    if (head.magic != RECMAGIC || ofs + RECSIZE(head.len) > end)
+      break;
+    entry.key = head.key;
+    entry.offset = ofs;
+    entry.len = head.len;
+    entry.gen = cache.gen;
+    if (head.key && !tab_find(head.key) && tab_insert(&entry) < 0)
+      break;
+    ofs += RECSIZE(head.len);
+  }
+
+  if (ofs < end) {  /* torn write: drop the broken tail */
+    log_debug("cache: truncating %s at %llu", cache.fn,
+      (unsigned long long) ofs);
+    if (ftruncate(cache.fd, ofs) < 0)
+      log_warn("cache: truncate %s: %s", cache.fn, strerror(errno));
+    cache.logmapsize = ofs;  /* no access to the map beyond EOF */
+  }
+  cache.logsize = ofs;
+}
+
+
+/** map the index file if it is valid for the log; return log offset covered */
+static uint64_t
+loadindex(uint64_t logsize)
+{
+  struct stat statbuf;
+  const struct idxhead *head;
+  Blob fn = BLOB_INIT;
+  void *map;
+  int fd;
+
+  blob_addfmt(&fn, "%s.idx", cache.fn);
+  fd = open(blob_str(&fn), O_RDONLY);
+  blob_free(&fn);
+  if (fd < 0) return sizeof(struct loghead);
+
+  if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t) sizeof(*head)) {
+    close(fd);
+    return sizeof(struct loghead);
+  }
+  map = mmap(0, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return sizeof(struct loghead);
+
+  head = map;
+  if (memcmp(head->magic, IDXMAGIC, sizeof(head->magic)) ||
+      head->logsize > logsize || head->logsize < sizeof(struct loghead) ||
+      (uint64_t) statbuf.st_size !=
+        sizeof(*head) + head->count * sizeof(struct entry)) {
+    log_debug("cache: ignoring invalid index for %s", cache.fn);
+    munmap(map, statbuf.st_size);
+    return sizeof(struct loghead);
+  }
+
+  cache.idxmap = map;
+  cache.idxmapsize = statbuf.st_size;
+  cache.entries = (const struct entry *) (head + 1);
+  cache.nentries = head->count;
+  cache.gen = head->gen + 1;
+  return head->logsize;
+}
+
+
+/** open the cache with the given log file; return SUCCESS or FAILSOFT */
+int
+cache_open(const char *fn)
+{
+  struct loghead head, want;
+  struct stat statbuf;
+  struct flock lock;
+  uint64_t covered;
+  bool fresh = false;
+  int fd;
+
+  assert(fn != NULL);
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.fd >= 0) {
+    pthread_mutex_unlock(&cache.lock);
+    return SUCCESS;
+  }
+
+  fd = open(fn, O_RDWR|O_CREAT, 0666);
+  if (fd < 0) {
+    log_warn("cannot open cache %s: %s", fn, strerror(errno));
+    goto fail;
+  }
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLK, &lock) < 0) {
+    log_warn("cache %s is in use, not caching", fn);
+    goto fail;
+  }
+
+  makeheader(&want);
+  if (fstat(fd, &statbuf) < 0) goto failio;
+  if (statbuf.st_size < (off_t) sizeof(head) ||
+      readall(fd, &head, sizeof(head), 0) < 0 ||
+      memcmp(&head, &want, sizeof(head))) {
+    log_debug("cache: starting new %s", fn);
+    if (ftruncate(fd, 0) < 0) goto failio;
+    if (writeall(fd, &want, sizeof(want), 0) < 0) goto failio;
+    statbuf.st_size = sizeof(want);
+    fresh = true;  /* old index (if any) is void */
+  }
+
+  cache.fd = fd;
+  cache.fn = strdup(fn);
+  cache.logsize = statbuf.st_size;
+  cache.logmaplen = cache.logmapsize = statbuf.st_size;
+  cache.logmap = mmap(0, cache.logmaplen, PROT_READ, MAP_SHARED, fd, 0);
+  if (cache.logmap == MAP_FAILED || !cache.fn) {
+    if (cache.logmap != MAP_FAILED) munmap((void *) cache.logmap, cache.logmaplen);
+    free(cache.fn);
+    cache.fd = -1;
+    cache.fn = 0;
+    cache.logmap = 0;
+    goto failio;
+  }
+
+  cache.gen = 1;
+  covered = fresh ? sizeof(want) : loadindex(cache.logsize);
+  cache.used = calloc(cache.nentries ? cache.nentries : 1, 1);
+  scantail(covered, cache.logsize);
+  cache.hits = cache.misses = 0;
+
+  log_debug("cache: opened %s, %zu indexed, %zu recovered, generation %u",
+    fn, cache.nentries, cache.tabcount, (unsigned) cache.gen);
+  pthread_mutex_unlock(&cache.lock);
+  return SUCCESS;
+
+failio:
+  log_warn("cache %s: %s", fn, strerror(errno));
+fail:
+  if (fd >= 0) close(fd);
+  pthread_mutex_unlock(&cache.lock);
+  return FAILSOFT;
+}
+
+
+/** compute the key for data processed by the given kind and parameter */
+uint64_t
+cache_key(const char *kind, int param, const void *data, size_t len)
+{
+  uint64_t seed = hash64(kind, strlen(kind), (uint64_t) param);
+  uint64_t key = hash64(data, len, seed);
+  return key ? key : 1;  /* zero marks empty slots */
+}
+
+
+/** append cached artefact for key to out; false if not cached */
+bool
+cache_get(uint64_t key, Blob *out)
+{
+  Blob buf = BLOB_INIT;
+  const struct entry *found;
+  struct entry probe;
+  const char *data = 0;
+  size_t i;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.fd < 0) {
+    pthread_mutex_unlock(&cache.lock);
+    return false;
+  }
+
+  probe.key = key;
+  found = bsearch(&probe, cache.entries, cache.nentries,
+                  sizeof(probe), entrycmp);
+  if (found) {
+    i = found - cache.entries;
+    data = getdata(cache.fd, found, &buf);
+    if (data) cache.used[i] = 1;
+  }
+  else if ((found = tab_find(key))) {
+    data = getdata(cache.fd, found, &buf);
+  }
+
+  if (data) {
+    blob_addbuf(out, data, found->len);
+    cache.hits++;
+  }
+  else cache.misses++;
+
+  pthread_mutex_unlock(&cache.lock);
+  blob_free(&buf);
+  return data != 0;
+}
+
+
+/** store artefact for key (unless already cached) */
+void
+cache_put(uint64_t key, const char *data, size_t len)
+{
+  static const char zeros[8];
+  struct rechead head;
+  struct entry entry, probe;
+  uint64_t size;
+
+  if (len > MAXLEN) return;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.fd < 0) goto done;
+
+  probe.key = key;
+  if (bsearch(&probe, cache.entries, cache.nentries, sizeof(probe), entrycmp))
+    goto done;
+  if (tab_find(key)) goto done;
+
+  head.magic = RECMAGIC;
+  head.len = len;
+  head.key = key;
+  size = RECSIZE(len);
+  if (writeall(cache.fd, &head, sizeof(head), cache.logsize) < 0 ||
+      writeall(cache.fd, data, len, cache.logsize + sizeof(head)) < 0 ||
+      writeall(cache.fd, zeros, size - sizeof(head) - len,
+               cache.logsize + sizeof(head) + len) < 0) {
+    log_warn("cache: write %s: %s", cache.fn, strerror(errno));
+    goto done;
+  }
+
+  entry.key = key;
+  entry.offset = cache.logsize;
+  entry.len = len;
+  entry.gen = cache.gen;
+  if (tab_insert(&entry) == 0)
+    cache.logsize += size;
+
+done:
+  pthread_mutex_unlock(&cache.lock);
+}
+
+
+/** write live records to a new log, updating their offsets */
+static int
+compact(struct entry *live, size_t nlive)
+{
+  struct loghead head;
+  Blob tmp = BLOB_INIT;
+  Blob buf = BLOB_INIT;
+  uint64_t ofs = sizeof(head);
+  size_t i, j;
+  int fd;
+
+  blob_addfmt(&tmp, "%s.tmp", cache.fn);
+  fd = open(blob_str(&tmp), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) goto fail;
+
+  makeheader(&head);
+  if (writeall(fd, &head, sizeof(head), 0) < 0) goto fail;
+
+  for (i = j = 0; i < nlive; i++) {
+    const char *data;
+    blob_clear(&buf);
+    data = getdata(cache.fd, &live[i], &buf);
+    if (!data) continue;  /* broken record: drop */
+    data -= sizeof(struct rechead);
+    if (writeall(fd, data, RECSIZE(live[i].len), ofs) < 0) goto fail;
+    live[j] = live[i];
+    live[j++].offset = ofs;
+    ofs += RECSIZE(live[i].len);
+  }
+
+  if (close(fd) < 0) { fd = -1; goto fail; }
+  if (rename(blob_str(&tmp), cache.fn) < 0) { fd = -1; goto fail; }
+
+  log_debug("cache: compacted %s from %llu to %llu bytes", cache.fn,
+    (unsigned long long) cache.logsize, (unsigned long long) ofs);
+  cache.logsize = ofs;
+  blob_free(&tmp);
+  blob_free(&buf);
+  return (int) j;
+
+fail:
+  log_warn("cache: compact %s: %s", cache.fn, strerror(errno));
+  if (fd >= 0) close(fd);
+  remove(blob_str(&tmp));
+  blob_free(&tmp);
+  blob_free(&buf);
+  return -1;
+}
+
+
+static int
+writeindex(const struct entry *entries, size_t count)
+{
+  struct idxhead head;
+  Blob tmp = BLOB_INIT;
+  Blob fn = BLOB_INIT;
+  int fd, r = FAILSOFT;
+
+  blob_addfmt(&fn, "%s.idx", cache.fn);
+  blob_addfmt(&tmp, "%s.idx.tmp", cache.fn);
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, IDXMAGIC, sizeof(head.magic));
+  head.logsize = cache.logsize;
+  head.count = count;
+  head.gen = cache.gen;
+
+  fd = open(blob_str(&tmp), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd >= 0 &&
+      writeall(fd, &head, sizeof(head), 0) == 0 &&
+      writeall(fd, entries, count * sizeof(*entries), sizeof(head)) == 0 &&
+      close(fd) == 0 && rename(blob_str(&tmp), blob_str(&fn)) == 0)
+    r = SUCCESS;
+  else {
+    log_warn("cache: write %s: %s", blob_str(&fn), strerror(errno));
+    remove(blob_str(&tmp));
+  }
+
+  blob_free(&tmp);
+  blob_free(&fn);
+  return r;
+}
+
+
+/** evict old entries, compact if worthwhile, write index, close */
+void
+cache_close(void)
+{
+  struct entry *live;
+  uint64_t livebytes = 0, total;
+  size_t i, n = 0;
+  int r;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.fd < 0) goto done;
+
+  live = malloc((cache.nentries + cache.tabcount + 1) * sizeof(*live));
+  if (!live) {
+    log_error("cache: out of memory");
+    goto unmap;
+  }
+  for (i = 0; i < cache.nentries; i++) {
+    live[n] = cache.entries[i];
+    if (cache.used[i]) live[n].gen = cache.gen;
+    if (live[n].gen + MAXAGE >= cache.gen) n++;
+  }
+  for (i = 0; i < cache.tabsize; i++)
+    if (cache.table[i].key) live[n++] = cache.table[i];
+
+  /* keep the most recently used entries up to MAXSIZE */
+  qsort(live, n, sizeof(*live), gencmp);
+  for (i = 0; i < n; i++) {
+    if (livebytes + RECSIZE(live[i].len) > MAXSIZE) break;
+    livebytes += RECSIZE(live[i].len);
+  }
+  n = i;
+
+  total = cache.logsize - sizeof(struct loghead);
+  if (total - livebytes > livebytes && total - livebytes > 1024*1024) {
+    qsort(live, n, sizeof(*live), entrycmp);  /* sequential copy by key */
+    r = compact(live, n);
+    if (r < 0) goto freelive;  /* leave old log and index */
+    n = r;
+  }
+
+  qsort(live, n, sizeof(*live), entrycmp);
+  writeindex(live, n);
+
+  log_debug("cache: %zu hits, %zu misses, %zu entries, %llu bytes",
+    cache.hits, cache.misses, n, (unsigned long long) livebytes);
+
+freelive:
+  free(live);
+unmap:
+  munmap((void *) cache.logmap, cache.logmaplen);
+  if (cache.idxmap) munmap(cache.idxmap, cache.idxmapsize);
+  close(cache.fd);
+  free(cache.fn);
+  free(cache.used);
+  free(cache.table);
+  cache.fd = -1;
+  cache.fn = 0;
+  cache.logmap = 0;
+  cache.logmaplen = cache.logmapsize = 0;
+  cache.idxmap = 0;
+  cache.idxmapsize = 0;
+  cache.entries = 0;
+  cache.nentries = 0;
+  cache.used = 0;
+  cache.table = 0;
+  cache.tabsize = cache.tabcount = 0;
+
+done:
+  pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,27 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blob.h"
+
+/* Persistent build cache: maps a hash of some input (and the
+ * kind of processing applied to it) to the resulting artefact;
+ * process-wide, thread-safe, and a no-op while not open */
+
+int cache_open(const char *fn);
+void cache_close(void);
+
+uint64_t cache_key(const char *kind, int param, const void *data, size_t len);
+bool cache_get(uint64_t key, Blob *out);
+void cache_put(uint64_t key, const char *data, size_t len);
+
+/* Usage: cache_open() once (a build does so in the site root),
+   then for each input: key = cache_key("markdown", flags, text,
+   len), and if cache_get(key, &out) fails, render and store the
+   result with cache_put(key, ...); finally cache_close(), which
+   writes the index and evicts/compacts as needed */
+
+#endif
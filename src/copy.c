@@ -0,0 +1,571 @@
+/* Fast file copies, atomic writes, and mirroring of directory trees */
+
+#define _GNU_SOURCE  /* for copy_file_range(2) */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "jot.h"
+#include "blob.h"
+#include "copy.h"
+#include "hash.h"
+#include "walkdir.h"
+
+
+/* Files are never rewritten in place: new contents go to a
+ * temporary file next to the target, which is then renamed
+ * over it; so readers see the old file or the new one, never
+ * a partial one, and hard links to the old file keep the old
+ * contents. The temporary name is unique within the process
+ * (by a counter) and across processes (by the pid). */
+
+static void
+tempname(const char *fn, Blob *buf)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned counter = 0;
+  unsigned n;
+
+  pthread_mutex_lock(&lock);
+  n = ++counter;
+  pthread_mutex_unlock(&lock);
+
+  blob_clear(buf);
+  blob_addfmt(buf, "%s.%ld-%u.tmp", fn, (long) getpid(), n);
+}
+
+
+/** rename temp to fn after closing fd; on error remove temp */
+static int
+commit(int fd, const char *temp, const char *fn)
+{
+  int saved;
+  if (close(fd) == 0 && rename(temp, fn) == 0)
+    return 0;
+  saved = errno;
+  unlink(temp);
+  errno = saved;
+  return -1;
+}
+
+
+static void
+discard(int fd, const char *temp)
+{
+  int saved = errno;
+  close(fd);
+  unlink(temp);
+  errno = saved;
+}
+
+
+/* Copy up to size bytes of in to out in the kernel, at their
+ * current file offsets: copy_file_range(2) (between regular files,
+ * server-side on some network file systems), then sendfile(2) (to
+ * any file, pipes included); each step falls back to the next
+ * where the files involved do not support it; add the number of
+ * bytes copied to *pdone, which may be less than size */
+static int
+kernelcopy(int in, int out, off_t size, off_t *pdone)
+{
+#if defined(__linux__)
+  ssize_t n;
+  while (*pdone < size) {
+    n = copy_file_range(in, 0, out, 0, size - *pdone, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                  errno == EINVAL || errno == EOPNOTSUPP)) break;
+    if (n < 0) return -1;
+    if (n == 0) return 0;  /* file shrank? read(2) will tell */
+    *pdone += n;
+  }
+  while (*pdone < size) {
+    n = sendfile(out, in, 0, size - *pdone);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == ENOSYS || errno == EINVAL)) break;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    *pdone += n;
+  }
+#else
+  UNUSED(in);
+  UNUSED(out);
+  UNUSED(size);
+  UNUSED(pdone);
+#endif
+  return 0;
+}
+
+
+/** read(2) and write(2) up to limit bytes (-1 for all) */
+static int
+plaincopy(int in, int out, off_t limit, off_t *pdone)
+{
+  char buf[32*1024];
+  ssize_t n, m, k;
+
+  while (limit < 0 || *pdone < limit) {
+    size_t want = limit < 0 || limit - *pdone > (off_t) sizeof(buf) ?
+      sizeof(buf) : (size_t) (limit - *pdone);
+    n = read(in, buf, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    for (m = 0; m < n; m += k) {
+      k = write(out, buf+m, n-m);
+      if (k < 0 && errno == EINTR) k = 0;
+      else if (k < 0) return -1;
+    }
+    *pdone += n;
+  }
+  return 0;
+}
+
+
+/* Copy the data of in to out (an empty regular file), trying
+ * the fastest way first: a reflink (FICLONE shares the blocks
+ * on btrfs, XFS, and the like), then the kernel (see above),
+ * and finally read(2) and write(2) for whatever is left */
+static int
+copydata(int in, int out, off_t size, size_t *pbytes)
+{
+  off_t done = 0;
+
+#if defined(__linux__) && defined(FICLONE)
+  if (ioctl(out, FICLONE, in) == 0) {
+    *pbytes += size;
+    return 0;
+  }
+#endif
+  if (kernelcopy(in, out, size, &done) < 0) return -1;
+  if (plaincopy(in, out, -1, &done) < 0) return -1;
+  *pbytes += done;
+  return 0;
+}
+
+
+int
+copy_stream(int in, int out, size_t size)
+{
+  off_t done = 0;
+  if (kernelcopy(in, out, (off_t) size, &done) < 0) return -1;
+  if (plaincopy(in, out, (off_t) size, &done) < 0) return -1;
+  return (size_t) done == size ? 0 : 1;
+}
+
+
+static int
+copyfile(const char *src, const char *dst, size_t *pbytes)
+{
+  struct stat st;
+  struct timespec times[2];
+  Blob temp = BLOB_INIT;
+  int in, out = -1, saved;
+
+  in = open(src, O_RDONLY);
+  if (in < 0) return -1;
+  if (fstat(in, &st) < 0) goto fail;
+
+  tempname(dst, &temp);
+  out = open(blob_str(&temp), O_WRONLY|O_CREAT|O_EXCL, st.st_mode & 0777);
+  if (out < 0) goto fail;
+
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  if (copydata(in, out, st.st_size, pbytes) < 0 || futimens(out, times) < 0) {
+    discard(out, blob_str(&temp));
+    goto fail;
+  }
+  if (commit(out, blob_str(&temp), dst) < 0) goto fail;
+  close(in);
+  blob_free(&temp);
+  return 0;
+
+fail:
+  saved = errno;
+  close(in);
+  blob_free(&temp);
+  errno = saved;
+  return -1;
+}
+
+
+/** replace dst by a copy of src, keeping its mtime; -1 and errno on error */
+int
+copy_file(const char *src, const char *dst)
+{
+  size_t nbytes = 0;
+  assert(src != NULL && dst != NULL);
+  return copyfile(src, dst, &nbytes);
+}
+
+
+/** write data to file fn unless it has that content already;
+    1 if written, 0 if unchanged, -1 and errno on error */
+int
+copy_buffer(const void *data, size_t len, const char *fn)
+{
+  struct stat st;
+  Blob temp = BLOB_INIT;
+  const char *p = data;
+  uint64_t h;
+  ssize_t n;
+  bool exists;
+  int fd;
+
+  assert(data != NULL || len == 0);
+  assert(fn != NULL);
+
+  /* same size and same hash: same content, leave it alone */
+  exists = stat(fn, &st) == 0 && S_ISREG(st.st_mode);
+  if (exists && (size_t) st.st_size == len &&
+      hash_file(fn, &h) == 0 && h == hash64(data, len, 0))
+    return 0;
+
+  tempname(fn, &temp);
+  fd = open(blob_str(&temp), O_WRONLY|O_CREAT|O_EXCL, 0666);
+  if (fd < 0) {
+    blob_free(&temp);
+    return -1;
+  }
+  /* keep the mode of the file replaced, not the umask's */
+  if (exists && fchmod(fd, st.st_mode & 0777) < 0) {
+    discard(fd, blob_str(&temp));
+    blob_free(&temp);
+    return -1;
+  }
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      discard(fd, blob_str(&temp));
+      blob_free(&temp);
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  n = commit(fd, blob_str(&temp), fn);
+  blob_free(&temp);
+  return n < 0 ? -1 : 1;
+}
+
+
+static size_t
+trimlen(const char *path)  /* length without trailing slashes */
+{
+  size_t len = strlen(path);
+  while (len > 1 && path[len-1] == '/') len--;
+  return len;
+}
+
+
+static int
+failed(Blob *errmsg, const char *what, const char *path)
+{
+  blob_addfmt(errmsg, "%s %s: %s", what, path, strerror(errno));
+  return -1;
+}
+
+
+/** remove what is in dst but not in src (or is of another type) */
+static int
+prune(const char *src, const char *dst, struct copystats *stats, Blob *errmsg)
+{
+  struct walk walk;
+  struct stat st;
+  Blob buf = BLOB_INIT;
+  size_t srclen = trimlen(src);
+  size_t dstlen = trimlen(dst);
+  int type, r = 0;
+
+  if (walkdir(&walk, dst, WALK_FILE|WALK_POST|WALK_LINK) != 0)
+    return errno == ENOENT ? 0 : failed(errmsg, "walkdir", dst);
+
+  while ((type = walkdir_next(&walk)) > 0) {
+    const char *path = walkdir_path(&walk);
+    bool isdir = type == WALK_DP;
+    if (type != WALK_F && type != WALK_DP && type != WALK_SL) continue;
+    if (!path[dstlen]) continue;  /* dst itself */
+
+    blob_clear(&buf);
+    blob_addbuf(&buf, src, srclen);
+    blob_addstr(&buf, path + dstlen);
+    if (lstat(blob_str(&buf), &st) == 0 && type != WALK_SL &&
+        !S_ISLNK(st.st_mode) && !!S_ISDIR(st.st_mode) == isdir)
+      continue;  /* still there and of the same kind */
+
+    if ((isdir ? rmdir(path) : unlink(path)) < 0) {
+      r = failed(errmsg, "remove", path);
+      break;
+    }
+    stats->nremoved++;
+  }
+  if (type < 0 && r == 0)
+    r = failed(errmsg, "walkdir", dst);
+
+  walkdir_free(&walk);
+  blob_free(&buf);
+  return r;
+}
+
+
+/** make dst a mirror of src; -1 and message in errmsg on error */
+int
+copy_tree(const char *src, const char *dst,
+          struct copystats *stats, Blob *errmsg)
+{
+  struct walk walk;
+  struct stat st;
+  Blob buf = BLOB_INIT;
+  size_t srclen, dstlen;
+  int type, r = 0;
+
+  assert(src != NULL && dst != NULL);
+  assert(stats != NULL && errmsg != NULL);
+  srclen = trimlen(src);
+  dstlen = trimlen(dst);
+
+  if (stat(src, &st) < 0)
+    return failed(errmsg, "sync", src);
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return failed(errmsg, "sync", src);
+  }
+
+  if (prune(src, dst, stats, errmsg) < 0)
+    return -1;
+
+  if (walkdir(&walk, src, WALK_FILE|WALK_PRE) != 0)
+    return failed(errmsg, "walkdir", src);
+
+  while ((type = walkdir_next(&walk)) > 0) {
+    const char *path = walkdir_path(&walk);
+    blob_clear(&buf);
+    blob_addbuf(&buf, dst, dstlen);
+    blob_addstr(&buf, path + srclen);
+
+    if (type == WALK_D) {
+      if (mkdir(blob_str(&buf), 0777) < 0 && errno != EEXIST) {
+        r = failed(errmsg, "mkdir", blob_str(&buf));
+        break;
+      }
+    }
+    else if (type == WALK_F) {
+      const struct stat *sp = &walk.statbuf;
+      if (stat(blob_str(&buf), &st) == 0 && S_ISREG(st.st_mode) &&
+          st.st_size == sp->st_size && st.st_mtime == sp->st_mtime) {
+        stats->nfresh++;
+        continue;
+      }
+      if (copyfile(path, blob_str(&buf), &stats->nbytes) < 0) {
+        r = failed(errmsg, "copy", path);
+        break;
+      }
+      stats->ncopied++;
+    }
+  }
+  if (type < 0 && r == 0)
+    r = failed(errmsg, "walkdir", src);
+
+  walkdir_free(&walk);
+  blob_free(&buf);
+  return r;
+}
+
+
+/* Deduplication: files of the same size are candidates; only they
+ * are hashed (on a few threads, see hash_files()), and files with
+ * the same size and hash are compared byte for byte before one is
+ * replaced by a hard link to the other (the first by path, which
+ * keeps the choice stable from one run to the next). The link is
+ * made under a temporary name and renamed over the duplicate, so
+ * the path never goes missing. Files that are already links to
+ * the same inode count as saved, too. */
+
+struct dupfile {
+  size_t off;           /* of path in paths */
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  uint64_t hash;
+  int err;              /* from hashing */
+};
+
+
+static int
+dupsizecmp(const void *a, const void *b)
+{
+  const struct dupfile *p = a, *q = b;
+  if (p->size != q->size) return p->size < q->size ? -1 : 1;
+  return p->off < q->off ? -1 : p->off > q->off;  /* walk order */
+}
+
+
+static int
+duphashcmp(const void *a, const void *b)
+{
+  const struct dupfile *p = a, *q = b;
+  if (p->size != q->size) return p->size < q->size ? -1 : 1;
+  if (p->hash != q->hash) return p->hash < q->hash ? -1 : 1;
+  return p->off < q->off ? -1 : p->off > q->off;
+}
+
+
+/** true iff files a and b have the same contents */
+static bool
+samecontents(const char *a, const char *b)
+{
+  char buf1[16*1024], buf2[sizeof(buf1)];
+  FILE *fp = fopen(a, "rb"), *fq = fopen(b, "rb");
+  size_t n, m;
+  bool same = fp && fq;
+
+  while (same) {
+    n = fread(buf1, 1, sizeof(buf1), fp);
+    m = fread(buf2, 1, sizeof(buf2), fq);
+    if (n != m || memcmp(buf1, buf2, n)) same = false;
+    if (n < sizeof(buf1)) break;
+  }
+  if (same && (ferror(fp) || ferror(fq))) same = false;
+  if (fp) fclose(fp);
+  if (fq) fclose(fq);
+  return same;
+}
+
+
+/** replace dup by a hard link to orig */
+static int
+linkfile(const char *orig, const char *dup)
+{
+  Blob temp = BLOB_INIT;
+  int r = -1, saved;
+
+  tempname(dup, &temp);
+  if (link(orig, blob_str(&temp)) == 0) {
+    if (rename(blob_str(&temp), dup) == 0) r = 0;
+    else {
+      saved = errno;
+      unlink(blob_str(&temp));
+      errno = saved;
+    }
+  }
+  blob_free(&temp);
+  return r;
+}
+
+
+int
+copy_dedup(const char *dir, struct dedupstats *stats, Blob *errmsg)
+{
+  Blob files = BLOB_INIT, paths = BLOB_INIT, cands = BLOB_INIT;
+  struct dupfile *fv, *f;
+  struct walk walk;
+  const char **pv;
+  uint64_t *hv;
+  int *ev;
+  size_t i, j, k, n, m;
+  int type, r = 0;
+
+  assert(dir != NULL && stats != NULL && errmsg != NULL);
+
+  if (walkdir(&walk, dir, WALK_FILE) != 0)
+    return failed(errmsg, "walkdir", dir);
+  while ((type = walkdir_next(&walk)) > 0) {
+    const struct stat *sp = &walk.statbuf;
+    if (type != WALK_F || !S_ISREG(sp->st_mode) || sp->st_size == 0)
+      continue;
+    f = blob_prepare(&files, sizeof(*f));
+    if (!f) break;
+    f->off = blob_len(&paths);
+    f->size = sp->st_size;
+    f->dev = sp->st_dev;
+    f->ino = sp->st_ino;
+    f->hash = 0;
+    f->err = 0;
+    blob_addlen(&files, sizeof(*f));
+    blob_addbuf(&paths, walkdir_path(&walk), strlen(walkdir_path(&walk)) + 1);
+  }
+  if (type < 0) r = failed(errmsg, "walkdir", dir);
+  walkdir_free(&walk);
+  if (r == 0 && (blob_failed(&files) || blob_failed(&paths))) {
+    errno = ENOMEM;
+    r = failed(errmsg, "dedup", dir);
+  }
+  if (r < 0) goto done;
+
+  /* keep only files that share their size with another */
+  fv = blob_buf(&files);
+  n = blob_len(&files) / sizeof(*fv);
+  stats->nfiles += n;
+  qsort(fv, n, sizeof(*fv), dupsizecmp);
+  for (i = m = 0; i < n; i = j) {
+    for (j = i+1; j < n && fv[j].size == fv[i].size; j++);
+    if (j - i > 1)
+      while (i < j) fv[m++] = fv[i++];
+  }
+
+  /* hash them all in one batch */
+  pv = blob_prepare(&cands, m * (sizeof(*pv) + sizeof(*hv) + sizeof(*ev)) + 1);
+  if (!pv) {
+    errno = ENOMEM;
+    r = failed(errmsg, "dedup", dir);
+    goto done;
+  }
+  hv = (uint64_t *) (pv + m);
+  ev = (int *) (hv + m);
+  for (i = 0; i < m; i++)
+    pv[i] = blob_str(&paths) + fv[i].off;
+  hash_files((const char *const *) pv, m, hv, ev, 0);
+  for (i = 0; i < m; i++) {
+    fv[i].hash = hv[i];
+    fv[i].err = ev[i];
+  }
+  qsort(fv, m, sizeof(*fv), duphashcmp);
+
+  /* in each run of same size and hash, link to the first */
+  for (i = 0; i < m; i = j) {
+    const char *orig = blob_str(&paths) + fv[i].off;
+    for (j = i+1; j < m && fv[j].size == fv[i].size &&
+         fv[j].hash == fv[i].hash; j++);
+    if (fv[i].err) continue;
+    for (k = i+1; k < j; k++) {
+      const char *dup = blob_str(&paths) + fv[k].off;
+      if (fv[k].err || fv[k].dev != fv[i].dev) continue;
+      if (fv[k].ino == fv[i].ino) {
+        stats->nshared++;
+        stats->nsaved += fv[k].size;
+        continue;
+      }
+      if (!samecontents(orig, dup)) continue;
+      if (linkfile(orig, dup) < 0) {
+        r = failed(errmsg, "link", dup);
+        goto done;
+      }
+      stats->nlinked++;
+      stats->nsaved += fv[k].size;
+    }
+  }
+
+done:
+  blob_free(&files);
+  blob_free(&paths);
+  blob_free(&cands);
+  return r;
+}
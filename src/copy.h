@@ -0,0 +1,50 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blob.h"
+
+/* Fast file copies (reflink, copy_file_range, sendfile, where
+ * available), atomic writes, and mirroring of directory trees */
+
+struct copystats {
+  size_t ncopied;       /* files copied */
+  size_t nfresh;        /* files already up to date */
+  size_t nremoved;      /* stale files and directories removed */
+  size_t nbytes;        /* bytes copied */
+};
+
+struct dedupstats {
+  size_t nfiles;        /* files looked at */
+  size_t nlinked;       /* duplicates replaced by a hard link */
+  size_t nshared;       /* duplicates that were links already */
+  uint64_t nsaved;      /* bytes saved by all those links */
+};
+
+int copy_file(const char *src, const char *dst);
+int copy_buffer(const void *data, size_t len, const char *fn);
+int copy_stream(int in, int out, size_t size);
+int copy_tree(const char *src, const char *dst,
+              struct copystats *stats, Blob *errmsg);
+int copy_dedup(const char *dir, struct dedupstats *stats, Blob *errmsg);
+
+/* Usage: copy_file() replaces dst with a copy of src (contents,
+   permissions, modification time) or returns -1 and sets errno;
+   copy_buffer() writes data to fn, but only if the file does not
+   already have this content (so its mtime stays), returning 1 if
+   written and 0 if not; both write a temporary file and rename
+   it, so readers never see a partial file; copy_stream() copies
+   size bytes from file descriptor in to out (a file or a pipe),
+   at their current offsets and in the kernel where it can, and
+   returns 0, or 1 if in ended early, or -1 on error (errno);
+   copy_tree() makes dst a mirror of src: copies files that differ
+   in size or modification time, creates missing directories, and
+   removes what is not in src; on error it returns -1 and appends
+   a message to errmsg; symbolic links are neither followed nor
+   copied; copy_dedup() replaces files in the tree at dir that are
+   identical to another one by a hard link to it, adds to stats,
+   and on error returns -1 with a message in errmsg */
+
+#endif
@@ -0,0 +1,515 @@
+/* Deflate compression, gzip framing */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob.h"
+#include "deflate.h"
+
+
+/* The input is all in memory, so LZ77 needs no sliding buffer:
+ * positions are offsets into the input, a hash of the next three
+ * bytes leads to the most recent position with the same hash
+ * (head), and from there to earlier ones (prev, indexed by the
+ * low bits of the position: a window of 32K). The match finder
+ * follows at most MAXCHAIN links and stops at NICELEN; with lazy
+ * matching, a match is emitted only if the next position does
+ * not have a longer one, otherwise a literal.
+ *
+ * Literals and matches collect in a symbol buffer; when full, it
+ * is emitted as one block with its own Huffman codes, built from
+ * the symbol frequencies (two-queue construction; if a code would
+ * be longer than deflate allows, the frequencies are halved and
+ * the code built again, which is rarely needed and costs little).
+ */
+
+#define WSIZE     32768
+#define WMASK     (WSIZE-1)
+#define HBITS     15
+#define MINMATCH  3
+#define MAXMATCH  258
+#define MAXCHAIN  64
+#define NICELEN   128
+#define LAZYLEN   32      /* no lazy search past a match this long */
+#define MAXSYMS   32768   /* per block */
+
+#define NLIT      286     /* literal/length alphabet */
+#define NDIST     30
+#define NCLEN     19      /* code length alphabet */
+#define MAXBITS   15
+#define MAXCLBITS 7
+
+struct symbol {
+  uint16_t litlen;        /* literal (< 256) or match length */
+  uint16_t dist;          /* 0 for literal */
+};
+
+struct deflate {
+  Blob *out;
+  uint64_t bits;          /* bits not yet written */
+  int nbits;
+  const unsigned char *data;
+  size_t len;
+  int32_t *head;          /* [1<<HBITS] */
+  int32_t *prev;          /* [WSIZE] */
+  struct symbol *syms;    /* [MAXSYMS] */
+  size_t nsyms;
+};
+
+static const uint16_t lbase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lextra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dbase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577 };
+static const uint8_t dextra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t clorder[NCLEN] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+
+/* === bits and codes === */
+
+
+static void
+putbits(struct deflate *z, uint32_t value, int n)
+{
+  z->bits |= (uint64_t) value << z->nbits;
+  z->nbits += n;
+  while (z->nbits >= 8) {
+    blob_addchar(z->out, z->bits & 0xFF);
+    z->bits >>= 8;
+    z->nbits -= 8;
+  }
+}
+
+
+static void
+flushbits(struct deflate *z)
+{
+  if (z->nbits > 0) blob_addchar(z->out, z->bits & 0xFF);
+  z->bits = 0;
+  z->nbits = 0;
+}
+
+
+static int
+ilog2(unsigned v)
+{
+  int n = 0;
+  while (v >>= 1) n++;
+  return n;
+}
+
+
+/** index into lbase of match length len */
+static int
+lencode(unsigned len)
+{
+  unsigned l = len - 3;
+  int nb;
+  if (len == MAXMATCH) return 28;
+  if (l < 8) return l;
+  nb = ilog2(l) - 2;
+  return 4 * (nb + 1) + ((l >> nb) & 3);
+}
+
+
+/** index into dbase of distance dist */
+static int
+distcode(unsigned dist)
+{
+  unsigned d = dist - 1;
+  int nb;
+  if (d < 4) return d;
+  nb = ilog2(d);
+  return 2 * nb + ((d >> (nb - 1)) & 1);
+}
+
+
+struct leaf {
+  uint32_t freq;
+  int sym;
+};
+
+
+static int
+leafcmp(const void *a, const void *b)
+{
+  const struct leaf *p = a;
+  const struct leaf *q = b;
+  if (p->freq != q->freq) return p->freq < q->freq ? -1 : 1;
+  return p->sym - q->sym;
+}
+
+
+/** code lengths for the n symbols with the given frequencies,
+    none longer than limit; at least two symbols get a code */
+static void
+buildlengths(const uint32_t *freq0, int n, int limit, uint8_t *lens)
+{
+  struct leaf leaves[NLIT];
+  uint32_t freq[NLIT];
+  uint32_t weight[2*NLIT];
+  int parent[2*NLIT], depth[2*NLIT];
+  int i, j, k, m, maxdepth;
+
+  assert(n <= NLIT);
+  memcpy(freq, freq0, n * sizeof(*freq));
+  for (i = m = 0; i < n; i++) if (freq[i]) m++;
+  for (i = 0; m < 2 && i < n; i++)
+    if (!freq[i]) freq[i] = 1, m++;
+
+  for (;;) {
+    for (i = m = 0; i < n; i++) {
+      lens[i] = 0;
+      if (freq[i]) {
+        leaves[m].freq = freq[i];
+        leaves[m].sym = i;
+        m++;
+      }
+    }
+    qsort(leaves, m, sizeof(*leaves), leafcmp);
+
+    /* leaves are nodes 0..m-1, internal nodes m..2m-2 in order */
+    for (i = 0; i < m; i++) weight[i] = leaves[i].freq;
+    for (i = 0, j = m, k = m; k < 2*m-1; k++) {
+      int a, b;
+      a = (i < m && (j >= k || weight[i] <= weight[j])) ? i++ : j++;
+      b = (i < m && (j >= k || weight[i] <= weight[j])) ? i++ : j++;
+      weight[k] = weight[a] + weight[b];
+      parent[a] = parent[b] = k;
+    }
+    depth[2*m-2] = 0;
+    maxdepth = 0;
+    for (k = 2*m-3; k >= 0; k--) {
+      depth[k] = depth[parent[k]] + 1;
+      if (k < m && depth[k] > maxdepth) maxdepth = depth[k];
+    }
+    if (maxdepth <= limit) break;
+    for (i = 0; i < n; i++)
+      if (freq[i]) freq[i] = (freq[i] + 1) / 2;
+  }
+
+  for (i = 0; i < m; i++) lens[leaves[i].sym] = depth[i];
+}
+
+
+/** canonical codes for the given lengths, bit-reversed for output */
+static void
+buildcodes(const uint8_t *lens, int n, uint16_t *codes)
+{
+  int count[MAXBITS+1] = { 0 };
+  int next[MAXBITS+1];
+  int i, b, code = 0;
+
+  for (i = 0; i < n; i++) count[lens[i]]++;
+  count[0] = 0;
+  for (b = 1; b <= MAXBITS; b++) {
+    code = (code + count[b-1]) << 1;
+    next[b] = code;
+  }
+  for (i = 0; i < n; i++) {
+    int len = lens[i], c, r = 0;
+    if (!len) continue;
+    c = next[len]++;
+    for (b = 0; b < len; b++) r = (r << 1) | ((c >> b) & 1);
+    codes[i] = r;
+  }
+}
+
+
+/* === blocks === */
+
+
+/** run-length encode the code lengths into clsyms (symbol | extra << 8) */
+static int
+rlelengths(const uint8_t *lens, int n, uint16_t *clsyms, uint32_t *clfreq)
+{
+  int i = 0, ns = 0;
+  while (i < n) {
+    int v = lens[i], run = 1;
+    while (i + run < n && lens[i+run] == v) run++;
+    i += run;
+    if (v == 0) {
+      while (run >= 11) {
+        int r = run > 138 ? 138 : run;
+        clsyms[ns++] = 18 | (r - 11) << 8;
+        clfreq[18]++;
+        run -= r;
+      }
+      if (run >= 3) {
+        clsyms[ns++] = 17 | (run - 3) << 8;
+        clfreq[17]++;
+        run = 0;
+      }
+    }
+    else {
+      clsyms[ns++] = v;
+      clfreq[v]++;
+      run--;
+      while (run >= 3) {
+        int r = run > 6 ? 6 : run;
+        clsyms[ns++] = 16 | (r - 3) << 8;
+        clfreq[16]++;
+        run -= r;
+      }
+    }
+    while (run-- > 0) {
+      clsyms[ns++] = v;
+      clfreq[v]++;
+    }
+  }
+  return ns;
+}
+
+
+/** emit the collected symbols as one block with dynamic codes */
+static void
+writeblock(struct deflate *z, bool last)
+{
+  uint32_t lfreq[NLIT] = { 0 }, dfreq[NDIST] = { 0 }, clfreq[NCLEN] = { 0 };
+  uint8_t lens[NLIT + NDIST], cllens[NCLEN];
+  uint16_t lcodes[NLIT], dcodes[NDIST], clcodes[NCLEN];
+  uint16_t clsyms[NLIT + NDIST];
+  int nlit, ndist, ncl, ns, i;
+  size_t k;
+
+  for (k = 0; k < z->nsyms; k++) {
+    const struct symbol *s = &z->syms[k];
+    if (s->dist == 0) lfreq[s->litlen]++;
+    else {
+      lfreq[257 + lencode(s->litlen)]++;
+      dfreq[distcode(s->dist)]++;
+    }
+  }
+  lfreq[256] = 1;  /* end of block */
+
+  buildlengths(lfreq, NLIT, MAXBITS, lens);
+  buildlengths(dfreq, NDIST, MAXBITS, lens + NLIT);
+  buildcodes(lens, NLIT, lcodes);
+  buildcodes(lens + NLIT, NDIST, dcodes);
+
+  for (nlit = NLIT; nlit > 257 && !lens[nlit-1]; nlit--);
+  for (ndist = NDIST; ndist > 1 && !lens[NLIT + ndist-1]; ndist--);
+  memmove(lens + nlit, lens + NLIT, ndist);  /* one sequence */
+
+  ns = rlelengths(lens, nlit + ndist, clsyms, clfreq);
+  buildlengths(clfreq, NCLEN, MAXCLBITS, cllens);
+  buildcodes(cllens, NCLEN, clcodes);
+  for (ncl = NCLEN; ncl > 4 && !cllens[clorder[ncl-1]]; ncl--);
+
+  /* header: BFINAL, BTYPE=2, HLIT, HDIST, HCLEN, code lengths */
+  putbits(z, last, 1);
+  putbits(z, 2, 2);
+  putbits(z, nlit - 257, 5);
+  putbits(z, ndist - 1, 5);
+  putbits(z, ncl - 4, 4);
+  for (i = 0; i < ncl; i++)
+    putbits(z, cllens[clorder[i]], 3);
+  for (i = 0; i < ns; i++) {
+    int sym = clsyms[i] & 0xFF, extra = clsyms[i] >> 8;
+    putbits(z, clcodes[sym], cllens[sym]);
+    if (sym == 16) putbits(z, extra, 2);
+    else if (sym == 17) putbits(z, extra, 3);
+    else if (sym == 18) putbits(z, extra, 7);
+  }
+
+  /* the data, then end of block */
+  memmove(lens + NLIT, lens + nlit, ndist);  /* distance lengths back */
+  for (k = 0; k < z->nsyms; k++) {
+    const struct symbol *s = &z->syms[k];
+    if (s->dist == 0)
+      putbits(z, lcodes[s->litlen], lens[s->litlen]);
+    else {
+      int lc = lencode(s->litlen), dc = distcode(s->dist);
+      putbits(z, lcodes[257 + lc], lens[257 + lc]);
+      if (lextra[lc]) putbits(z, s->litlen - lbase[lc], lextra[lc]);
+      putbits(z, dcodes[dc], lens[NLIT + dc]);
+      if (dextra[dc]) putbits(z, s->dist - dbase[dc], dextra[dc]);
+    }
+  }
+  putbits(z, lcodes[256], lens[256]);
+  z->nsyms = 0;
+}
+
+
+static void
+addsymbol(struct deflate *z, unsigned litlen, unsigned dist)
+{
+  z->syms[z->nsyms].litlen = litlen;
+  z->syms[z->nsyms].dist = dist;
+  if (++z->nsyms == MAXSYMS) writeblock(z, false);
+}
+
+
+/* === matching === */
+
+
+static unsigned
+hash3(const unsigned char *p)
+{
+  uint32_t v = (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+  return (v * 2654435761U) >> (32 - HBITS);
+}
+
+
+static void
+insert(struct deflate *z, size_t pos)
+{
+  unsigned h = hash3(z->data + pos);
+  z->prev[pos & WMASK] = z->head[h];
+  z->head[h] = (int32_t) pos;
+}
+
+
+/** longest match for pos among earlier positions; length < 3 if none */
+static unsigned
+findmatch(struct deflate *z, size_t pos, unsigned *pdist)
+{
+  const unsigned char *p = z->data + pos;
+  size_t avail = z->len - pos;
+  unsigned maxlen = avail < MAXMATCH ? avail : MAXMATCH;
+  unsigned best = MINMATCH - 1;
+  int32_t cand = z->head[hash3(p)];
+  int chain = MAXCHAIN;
+
+  while (cand >= 0 && pos - cand < WSIZE && chain-- > 0) {
+    const unsigned char *q = z->data + cand;
+    if (q[best] == p[best] && q[0] == p[0] && q[1] == p[1]) {
+      unsigned n = 2;
+      while (n < maxlen && q[n] == p[n]) n++;
+      if (n > best) {
+        best = n;
+        *pdist = pos - cand;
+        if (n >= NICELEN || n == maxlen) break;
+      }
+    }
+    {
+      int32_t next = z->prev[cand & WMASK];
+      if (next >= cand) break;
+      cand = next;
+    }
+  }
+  return best;
+}
+
+
+static void
+compress(struct deflate *z)
+{
+  size_t pos = 0, end = z->len;
+  unsigned len, dist = 0, nextlen = 0, nextdist = 0;
+  bool havenext = false;
+
+  while (pos < end) {
+    if (pos + MINMATCH > end) {
+      addsymbol(z, z->data[pos++], 0);
+      continue;
+    }
+    if (havenext) {
+      len = nextlen;
+      dist = nextdist;
+      havenext = false;
+    }
+    else len = findmatch(z, pos, &dist);
+    insert(z, pos);
+
+    if (len >= MINMATCH && len < LAZYLEN && pos + 1 + MINMATCH <= end) {
+      nextlen = findmatch(z, pos + 1, &nextdist);
+      havenext = true;
+      if (nextlen > len) {
+        addsymbol(z, z->data[pos++], 0);
+        continue;
+      }
+      havenext = false;
+    }
+
+    if (len >= MINMATCH) {
+      size_t stop = pos + len;
+      addsymbol(z, len, dist);
+      for (pos++; pos < stop; pos++)
+        if (pos + MINMATCH <= end) insert(z, pos);
+    }
+    else addsymbol(z, z->data[pos++], 0);
+  }
+  writeblock(z, true);
+  flushbits(z);
+}
+
+
+/* === gzip === */
+
+
+uint32_t
+deflate_crc32(uint32_t crc, const void *data, size_t len)
+{
+  static const uint32_t table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+  const unsigned char *p = data;
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ table[crc & 15];
+    crc = (crc >> 4) ^ table[crc & 15];
+  }
+  return ~crc;
+}
+
+
+static void
+addle32(Blob *out, uint32_t v)
+{
+  blob_addchar(out, v & 0xFF);
+  blob_addchar(out, (v >> 8) & 0xFF);
+  blob_addchar(out, (v >> 16) & 0xFF);
+  blob_addchar(out, (v >> 24) & 0xFF);
+}
+
+
+int
+deflate_gzip(Blob *out, const void *data, size_t len)
+{
+  static const char header[10] = {
+    0x1f, (char) 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  struct deflate z;
+  size_t i;
+
+  assert(out != NULL && (data != NULL || len == 0));
+  if (len > INT32_MAX) return -1;  /* positions are int32_t */
+  memset(&z, 0, sizeof(z));
+  z.out = out;
+  z.data = data;
+  z.len = len;
+  z.head = malloc((1 << HBITS) * sizeof(*z.head));
+  z.prev = malloc(WSIZE * sizeof(*z.prev));
+  z.syms = malloc(MAXSYMS * sizeof(*z.syms));
+  if (!z.head || !z.prev || !z.syms) {
+    free(z.head);
+    free(z.prev);
+    free(z.syms);
+    return -1;
+  }
+  for (i = 0; i < (1 << HBITS); i++) z.head[i] = -1;
+
+  blob_addbuf(out, header, sizeof(header));
+  compress(&z);
+  addle32(out, deflate_crc32(0, data, len));
+  addle32(out, (uint32_t) len);
+
+  free(z.head);
+  free(z.prev);
+  free(z.syms);
+  return blob_failed(out) ? -1 : 0;
+}
@@ -0,0 +1,22 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blob.h"
+
+/* Small Deflate (RFC 1951) compressor with gzip (RFC 1952)
+ * framing, for precompressed outputs; no decompression */
+
+int deflate_gzip(Blob *out, const void *data, size_t len);
+uint32_t deflate_crc32(uint32_t crc, const void *data, size_t len);
+
+/* Usage: deflate_gzip() appends the gzip file for data to out
+   (no file name, zero mtime, so the same data always gives the
+   same bytes) and returns 0, or -1 if out of memory; compression
+   is LZ77 with hash chains and lazy matching, and a dynamic
+   Huffman code per block, similar to gzip -6; deflate_crc32()
+   updates crc (start with 0) with the given data */
+
+#endif
@@ -0,0 +1,578 @@
+/* Dependency graph for incremental builds */
+
+#define _POSIX_C_SOURCE 200809L  /* for st_mtim and clock_gettime(2) */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "deps.h"
+#include "hash.h"
+#include "log.h"
+#include "memory.h"
+
+
+/* The graph file is line oriented text, paths go last on
+ * a line (they may contain blanks but no newlines):
+ *
+ *   jot-deps SIGNATURE
+ *   F HASH SIZE MTIME PATH     fingerprint of an input file
+ *   S SOURCE                   a source file...
+ *   O OUTPUT                   ...the output it rendered to
+ *   I INPUT                    ...and the inputs it read
+ *
+ * Inputs are considered unchanged if size and mtime agree
+ * with their fingerprint, or if the size agrees and the
+ * content hash is the same (file touched but not changed).
+ * For directories only the mtime counts, it changes when
+ * entries are added or removed. An input that did not exist
+ * (a layout looked for but not found) has size ABSENT, so
+ * that creating it counts as a change.
+ *
+ * Inputs are fingerprinted after the build, but read during it:
+ * one modified since the graph was created (the build started)
+ * may have been read before the change, so it gets no fingerprint
+ * and counts as changed next time. The kernel stamps files with
+ * a clock that may lag the real time by one tick of its coarse
+ * clock, so the graph is taken to be created a tick early: no
+ * change is missed, but a file saved just before the build is
+ * rendered once more in the next.
+ * An input the build itself writes before reading it (the site
+ * index) is fingerprinted right after the write instead.
+ */
+
+#define MAGIC "jot-deps"
+
+#define ABSENT    (-2)  /* size of an input that does not exist */
+
+#define UNKNOWN    0
+#define UNCHANGED  1
+#define CHANGED    2
+
+struct fprint {
+  const char *path;
+  uint64_t hash;
+  int64_t size;
+  int64_t mtime;        /* nanoseconds since the epoch */
+  int state;            /* UNKNOWN, UNCHANGED, CHANGED */
+};
+
+struct entry {
+  const char *source;
+  const char *output;
+  size_t first;         /* index into inputs */
+  size_t count;         /* number of inputs */
+  bool seen;            /* looked up by deps_check() */
+};
+
+struct depgraph {
+  MemPool pool;         /* storage for strings */
+  Blob fprints;         /* array of struct fprint, sorted by path */
+  Blob entries;         /* array of struct entry */
+  Blob inputs;          /* array of const char *, sliced by entries */
+  Blob written;         /* array of struct fprint, by deps_written() */
+  size_t nfprints;
+  size_t nentries;
+  size_t ninputs;
+  size_t nwritten;
+  int64_t created;      /* nanoseconds since the epoch */
+  bool sorted;          /* entries sorted by source */
+};
+
+#define FPRINTS(g) ((struct fprint *) blob_buf(&(g)->fprints))
+#define ENTRIES(g) ((struct entry *) blob_buf(&(g)->entries))
+#define INPUTS(g) ((const char **) blob_buf(&(g)->inputs))
+
+
+static int
+fprintcmp(const void *a, const void *b)
+{
+  const struct fprint *p = a;
+  const struct fprint *q = b;
+  return strcmp(p->path, q->path);
+}
+
+
+static int
+entrycmp(const void *a, const void *b)
+{
+  const struct entry *p = a;
+  const struct entry *q = b;
+  return strcmp(p->source, q->source);
+}
+
+
+static int
+strpcmp(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+
+static struct fprint *
+findprint(DepGraph *graph, const char *path)
+{
+  struct fprint key;
+  key.path = path;
+  return bsearch(&key, FPRINTS(graph), graph->nfprints,
+                 sizeof(key), fprintcmp);
+}
+
+
+static struct entry *
+findentry(DepGraph *graph, const char *source)
+{
+  struct entry key;
+  if (!graph->sorted) {
+    if (graph->nentries > 0)
+      qsort(ENTRIES(graph), graph->nentries, sizeof(key), entrycmp);
+    graph->sorted = true;
+  }
+  key.source = source;
+  return bsearch(&key, ENTRIES(graph), graph->nentries,
+                 sizeof(key), entrycmp);
+}
+
+
+/** take a fingerprint of the given file; return 0 or -1 (errno) */
+static int
+fingerprint(const char *path, struct fprint *fp, bool dohash)
+{
+  struct stat statbuf;
+  fp->path = path;
+  if (stat(path, &statbuf) < 0) {
+    if (errno != ENOENT) return -1;
+    fp->mtime = 0;
+    fp->hash = 0;
+    fp->size = ABSENT;
+    return 0;
+  }
+  fp->mtime = (int64_t) statbuf.st_mtim.tv_sec * 1000000000
+            + statbuf.st_mtim.tv_nsec;
+  fp->hash = 0;
+  if (S_ISDIR(statbuf.st_mode)) {
+    fp->size = -1;
+    return 0;
+  }
+  fp->size = statbuf.st_size;
+  return dohash ? hash_file(path, &fp->hash) : 0;
+}
+
+
+/** true iff the input is unchanged since the old graph was saved */
+static bool
+unchanged(DepGraph *old, const char *path)
+{
+  struct fprint cur, *fp = findprint(old, path);
+  if (!fp) return false;
+  if (fp->state == UNKNOWN) {
+    fp->state = CHANGED;
+    if (fingerprint(path, &cur, false) < 0 || cur.size != fp->size) ;
+    else if (cur.mtime == fp->mtime) fp->state = UNCHANGED;
+    else if (cur.size >= 0 && hash_file(path, &cur.hash) == 0 &&
+             cur.hash == fp->hash) {
+      fp->state = UNCHANGED;
+      fp->mtime = cur.mtime;  /* touched only: save new mtime */
+    }
+    if (fp->state == CHANGED) log_debug("deps: %s changed", path);
+  }
+  return fp->state == UNCHANGED;
+}
+
+
+/** now, less a tick of the clock for file times, in nanoseconds */
+static int64_t
+clocknow(void)
+{
+  struct timespec ts, res;
+  int64_t t;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  t = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#ifdef CLOCK_REALTIME_COARSE
+  if (clock_getres(CLOCK_REALTIME_COARSE, &res) == 0)
+    t -= (int64_t) res.tv_sec * 1000000000 + res.tv_nsec;
+#endif
+  return t;
+}
+
+
+DepGraph *
+deps_new(void)
+{
+  DepGraph *graph = calloc(1, sizeof(*graph));
+  if (!graph) return 0;
+  graph->created = clocknow();
+  mem_pool_init(&graph->pool, 0);
+  graph->fprints = (Blob) BLOB_INIT;
+  graph->entries = (Blob) BLOB_INIT;
+  graph->inputs = (Blob) BLOB_INIT;
+  graph->written = (Blob) BLOB_INIT;
+  graph->sorted = true;
+  return graph;
+}
+
+
+void
+deps_free(DepGraph *graph)
+{
+  if (!graph) return;
+  mem_pool_free(&graph->pool);
+  blob_free(&graph->fprints);
+  blob_free(&graph->entries);
+  blob_free(&graph->inputs);
+  blob_free(&graph->written);
+  free(graph);
+}
+
+
+/** record that source rendered to output from the given inputs */
+void
+deps_add(DepGraph *graph, const char *source, const char *output,
+         const char *const *inputs, size_t ninputs)
+{
+  struct entry *entry;
+  const char **p;
+  size_t i;
+
+  assert(graph != NULL);
+  assert(source != NULL && output != NULL);
+
+  entry = blob_prepare(&graph->entries, sizeof(*entry));
+  entry->source = mem_pool_dup(&graph->pool, source, strlen(source));
+  entry->output = mem_pool_dup(&graph->pool, output, strlen(output));
+  entry->first = graph->ninputs;
+  entry->count = ninputs;
+  entry->seen = false;
+  blob_addlen(&graph->entries, sizeof(*entry));
+  graph->nentries++;
+  graph->sorted = false;
+
+  p = blob_prepare(&graph->inputs, ninputs * sizeof(*p));
+  for (i = 0; i < ninputs; i++)
+    p[i] = mem_pool_dup(&graph->pool, inputs[i], strlen(inputs[i]));
+  blob_addlen(&graph->inputs, ninputs * sizeof(*p));
+  graph->ninputs += ninputs;
+}
+
+
+/** take the fingerprint of an input the build just wrote, before
+    it is read, for deps_fingerprint() to use */
+void
+deps_written(DepGraph *graph, const char *path)
+{
+  struct fprint cur;
+  assert(graph != NULL && path != NULL);
+  if (fingerprint(path, &cur, true) < 0) return;  /* changed next time */
+  cur.path = mem_pool_dup(&graph->pool, path, strlen(path));
+  cur.state = UNKNOWN;
+  if (cur.path) {
+    blob_addbuf(&graph->written, (const char *) &cur, sizeof(cur));
+    graph->nwritten++;
+  }
+}
+
+
+/** carry the entry for source over from the old graph */
+bool
+deps_copy(DepGraph *graph, DepGraph *old, const char *source)
+{
+  struct entry *entry = findentry(old, source);
+  if (!entry || !entry->output) return false;
+  deps_add(graph, entry->source, entry->output,
+           INPUTS(old) + entry->first, entry->count);
+  return true;
+}
+
+
+/** assume only the given inputs (sorted) changed, all others not */
+void
+deps_assume(DepGraph *old, const char *const *changed, size_t n)
+{
+  struct fprint *fprints = FPRINTS(old);
+  size_t i;
+  for (i = 0; i < old->nfprints; i++) {
+    bool found = n > 0 && bsearch(&fprints[i].path, changed, n,
+                                  sizeof(*changed), strpcmp);
+    fprints[i].state = found ? CHANGED : UNCHANGED;
+  }
+}
+
+
+/** assume the given input changed, whatever its fingerprint says */
+void
+deps_changed(DepGraph *old, const char *path)
+{
+  struct fprint *fp = findprint(old, path);
+  if (fp) fp->state = CHANGED;  /* no fingerprint: changed anyway */
+}
+
+
+/** return output of source if none of its inputs changed, else null */
+const char *
+deps_check(DepGraph *old, const char *source)
+{
+  struct entry *entry = findentry(old, source);
+  const char **inputs;
+  size_t i;
+
+  if (!entry) return 0;
+  entry->seen = true;
+  if (!entry->output) return 0;
+  inputs = INPUTS(old) + entry->first;
+  for (i = 0; i < entry->count; i++)
+    if (!unchanged(old, inputs[i])) return 0;
+  return entry->output;
+}
+
+
+/** return the recorded output of source, changed or not */
+const char *
+deps_output(DepGraph *old, const char *source)
+{
+  struct entry *entry = findentry(old, source);
+  return entry ? entry->output : 0;
+}
+
+
+/** return the recorded inputs of source (and their number in *pn) */
+const char *const *
+deps_inputs(DepGraph *old, const char *source, size_t *pn)
+{
+  struct entry *entry = findentry(old, source);
+  *pn = entry ? entry->count : 0;
+  return entry ? INPUTS(old) + entry->first : 0;
+}
+
+
+/** call func for all entries not looked up by deps_check() */
+void
+deps_stale(DepGraph *old,
+  void (*func)(const char *source, const char *output, void *ud), void *ud)
+{
+  struct entry *entries = ENTRIES(old);
+  size_t i;
+  for (i = 0; i < old->nentries; i++)
+    if (!entries[i].seen && entries[i].output)
+      func(entries[i].source, entries[i].output, ud);
+}
+
+
+/** load graph from file; empty graph if no file or other signature */
+DepGraph *
+deps_load(const char *fn, const char *signature)
+{
+  DepGraph *graph;
+  struct entry *entry;
+  Blob buf = BLOB_INIT;
+  char *text, *line, *next;
+  char chunk[8192];
+  size_t n, lineno = 1;
+  FILE *fp;
+
+  graph = deps_new();
+  if (!graph) return 0;
+
+  fp = fopen(fn, "rb");
+  if (!fp) {
+    if (errno != ENOENT) log_warn("read file %s: %s", fn, strerror(errno));
+    return graph;
+  }
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    blob_addbuf(&buf, chunk, n);
+  fclose(fp);
+
+  text = mem_pool_dup(&graph->pool, blob_str(&buf), blob_len(&buf));
+  blob_free(&buf);
+  if (!text) goto nomem;
+
+  blob_addfmt(&buf, "%s %s", MAGIC, signature);
+  line = text;
+  next = strchr(line, '\n');
+  if (next) *next = '\0';
+  if (!next || strcmp(line, blob_str(&buf))) {
+    log_debug("deps: %s is outdated, ignoring it", fn);
+    blob_free(&buf);
+    return graph;
+  }
+  blob_free(&buf);
+
+  for (line = next+1; *line; line = next+1, lineno++) {
+    struct fprint *fprint;
+    const char **input;
+    int ofs = 0;
+    next = strchr(line, '\n');
+    if (!next) break;  /* truncated: ignore last line */
+    *next = '\0';
+    if (line[0] && line[1] != ' ') goto bad;
+    switch (line[0]) {
+      case 'F':
+        fprint = blob_prepare(&graph->fprints, sizeof(*fprint));
+        if (sscanf(line+2, "%" SCNx64 " %" SCNd64 " %" SCNd64 " %n",
+              &fprint->hash, &fprint->size, &fprint->mtime, &ofs) < 3 || !ofs)
+          goto bad;
+        fprint->path = line + 2 + ofs;
+        fprint->state = UNKNOWN;
+        blob_addlen(&graph->fprints, sizeof(*fprint));
+        graph->nfprints++;
+        break;
+      case 'S':
+        entry = blob_prepare(&graph->entries, sizeof(*entry));
+        entry->source = line+2;
+        entry->output = 0;
+        entry->first = graph->ninputs;
+        entry->count = 0;
+        entry->seen = false;
+        blob_addlen(&graph->entries, sizeof(*entry));
+        graph->nentries++;
+        break;
+      case 'O':
+        if (!graph->nentries) goto bad;
+        ENTRIES(graph)[graph->nentries-1].output = line+2;
+        break;
+      case 'I':
+        if (!graph->nentries) goto bad;
+        input = blob_prepare(&graph->inputs, sizeof(*input));
+        *input = line+2;
+        blob_addlen(&graph->inputs, sizeof(*input));
+        graph->ninputs++;
+        ENTRIES(graph)[graph->nentries-1].count++;
+        break;
+      default:
+        goto bad;
+    }
+  }
+
+  if (graph->nfprints > 0)
+    qsort(FPRINTS(graph), graph->nfprints, sizeof(struct fprint), fprintcmp);
+  graph->sorted = false;
+
+  log_debug("deps: loaded %zu entries, %zu inputs from %s",
+    graph->nentries, graph->nfprints, fn);
+  return graph;
+
+bad:
+  log_warn("%s:%zu: invalid line, ignoring dependencies", fn, lineno);
+  deps_free(graph);
+  return deps_new();
+
+nomem:
+  log_error("deps: out of memory");
+  deps_free(graph);
+  return 0;
+}
+
+
+/** fingerprint inputs (reuse old ones if unchanged) but not those
+    modified since graph was created; graph can then serve as the
+    old graph for the next build, or be saved */
+void
+deps_fingerprint(DepGraph *graph, DepGraph *old)
+{
+  Blob paths = BLOB_INIT;
+  const char **pv, *last = 0;
+  struct fprint *fp, *written, cur;
+  size_t i, j, n;
+
+  assert(graph != NULL);
+  written = blob_buf(&graph->written);
+
+  blob_clear(&graph->fprints);
+  graph->nfprints = 0;
+
+  /* fingerprint each distinct input once */
+  n = graph->ninputs;
+  blob_addbuf(&paths, blob_buf(&graph->inputs), n * sizeof(*pv));
+  pv = blob_buf(&paths);
+  if (n > 0) qsort(pv, n, sizeof(*pv), strpcmp);
+  for (i = 0; i < n; i++) {
+    if (last && !strcmp(last, pv[i])) continue;
+    last = pv[i];
+    for (j = 0; j < graph->nwritten; j++)
+      if (!strcmp(written[j].path, pv[i])) break;
+    if (j < graph->nwritten)
+      cur = written[j];
+    else if (old && unchanged(old, pv[i]))
+      cur = *findprint(old, pv[i]);
+    else if (fingerprint(pv[i], &cur, true) < 0) {
+      log_debug("deps: cannot fingerprint %s: %s", pv[i], strerror(errno));
+      continue;  /* no fingerprint: counts as changed next time */
+    }
+    else if (cur.mtime >= graph->created) {
+      log_debug("deps: %s modified during build", pv[i]);
+      continue;  /* may have been read before: changed next time */
+    }
+    fp = blob_prepare(&graph->fprints, sizeof(*fp));
+    *fp = cur;
+    fp->path = pv[i];  /* our copy */
+    fp->state = UNKNOWN;
+    blob_addlen(&graph->fprints, sizeof(*fp));
+    graph->nfprints++;
+  }
+
+  for (i = 0; i < graph->nentries; i++)
+    ENTRIES(graph)[i].seen = false;
+
+  blob_free(&paths);
+}
+
+
+/** write graph with the fingerprints of its inputs to file */
+int
+deps_save(DepGraph *graph, const char *fn, const char *signature)
+{
+  Blob tmp = BLOB_INIT;
+  const struct fprint *fprints;
+  struct entry *entries;
+  size_t i, j;
+  FILE *fp;
+
+  assert(graph != NULL);
+
+  blob_addfmt(&tmp, "%s.tmp", fn);
+  fp = fopen(blob_str(&tmp), "wb");
+  if (!fp) goto fail;
+
+  fprintf(fp, "%s %s\n", MAGIC, signature);
+
+  fprints = FPRINTS(graph);
+  for (i = 0; i < graph->nfprints; i++)
+    fprintf(fp, "F %016" PRIx64 " %" PRId64 " %" PRId64 " %s\n",
+      fprints[i].hash, fprints[i].size, fprints[i].mtime, fprints[i].path);
+
+  if (!graph->sorted && graph->nentries > 0)
+    qsort(ENTRIES(graph), graph->nentries, sizeof(struct entry), entrycmp);
+  graph->sorted = true;
+  entries = ENTRIES(graph);
+  for (i = 0; i < graph->nentries; i++) {
+    const char **inputs = INPUTS(graph) + entries[i].first;
+    fprintf(fp, "S %s\nO %s\n", entries[i].source, entries[i].output);
+    for (j = 0; j < entries[i].count; j++)
+      fprintf(fp, "I %s\n", inputs[j]);
+  }
+
+  if (ferror(fp)) {
+    fclose(fp);
+    goto fail;
+  }
+  if (fclose(fp) != 0 || rename(blob_str(&tmp), fn) < 0) goto fail;
+
+  log_debug("deps: saved %zu entries to %s", graph->nentries, fn);
+  blob_free(&tmp);
+  return SUCCESS;
+
+fail:
+  log_warn("cannot save dependencies to %s: %s", fn, strerror(errno));
+  remove(blob_str(&tmp));
+  blob_free(&tmp);
+  return FAILSOFT;
+}
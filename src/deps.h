@@ -0,0 +1,48 @@
+#ifndef DEPS_H
+#define DEPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Dependency graph for incremental builds: for each source
+ * the output it rendered to and the input files it read;
+ * persisted with fingerprints (mtime, size, hash) of all
+ * inputs, so the next build can tell what changed */
+
+typedef struct depgraph DepGraph;
+
+DepGraph *deps_new(void);
+DepGraph *deps_load(const char *fn, const char *signature);
+void deps_written(DepGraph *graph, const char *path);
+void deps_fingerprint(DepGraph *graph, DepGraph *old);
+int deps_save(DepGraph *graph, const char *fn, const char *signature);
+void deps_free(DepGraph *graph);
+
+void deps_add(DepGraph *graph, const char *source, const char *output,
+              const char *const *inputs, size_t ninputs);
+bool deps_copy(DepGraph *graph, DepGraph *old, const char *source);
+
+void deps_assume(DepGraph *old, const char *const *changed, size_t n);
+void deps_changed(DepGraph *old, const char *path);
+const char *deps_check(DepGraph *old, const char *source);
+const char *deps_output(DepGraph *old, const char *source);
+const char *const *deps_inputs(DepGraph *old, const char *source, size_t *pn);
+void deps_stale(DepGraph *old,
+  void (*func)(const char *source, const char *output, void *ud), void *ud);
+
+/* Usage: load the previous graph with deps_load() (an empty
+   graph if none or if its signature differs), then for each
+   source: if deps_check() says its inputs are unchanged, carry
+   it over to the new graph with deps_copy(), otherwise render
+   and record its inputs with deps_add(); deps_output() and
+   deps_inputs() tell what was recorded for a source, changed
+   or not; deps_stale() reports the old sources that were not
+   checked (gone); deps_written() notes an input the build wrote
+   itself (fingerprinted then, not at the end); finally take
+   fingerprints of the new graph's inputs with deps_fingerprint()
+   and write it with deps_save(), or keep it for the next build;
+   if the caller knows which files changed (e.g. from inotify),
+   deps_assume() saves looking at all the inputs; deps_changed()
+   marks an input as changed that the caller knows to be */
+
+#endif
@@ -0,0 +1,424 @@
+/* Sitemaps and feeds */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "feeds.h"
+#include "markdown.h"
+#include "utils.h"
+
+
+/* Both formats want absolute URLs and their own date format,
+ * RFC 822 for RSS and RFC 3339 for Atom; front matter dates are
+ * YYYY-MM-DD with an optional time, so we parse and reformat
+ * them (entries without a valid date get none). Text is escaped
+ * for XML as it is appended; entry content is HTML, escaped, not
+ * in CDATA (which would break on "]]>" in the content), and its
+ * relative href and src values are made absolute against the
+ * entry's URL, as feed readers show it out of the site. */
+
+#define MAXURLS   50000
+#define MAXBYTES  (50UL * 1000 * 1000)
+
+#define SITEMAP_HEAD "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+  "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n"
+#define SITEMAP_TAIL "</urlset>\n"
+
+struct moment {
+  int year, month, day;
+  int hour, min, sec;
+};
+
+
+/** parse YYYY-MM-DD[(T| )HH:MM[:SS]]; false if not a date */
+static bool
+parsedate(const char *s, struct moment *t)
+{
+  int n = 0;
+  memset(t, 0, sizeof(*t));
+  if (!s || sscanf(s, "%4d-%2d-%2d%n", &t->year, &t->month, &t->day, &n) != 3)
+    return false;
+  if (t->month < 1 || t->month > 12 || t->day < 1 || t->day > 31)
+    return false;
+  s += n;
+  if ((*s == 'T' || *s == ' ') &&
+      sscanf(s+1, "%2d:%2d:%2d", &t->hour, &t->min, &t->sec) < 2)
+    t->hour = t->min = t->sec = 0;
+  return true;
+}
+
+
+/** day of week, 0 is Sunday (Sakamoto's method) */
+static int
+weekday(int y, int m, int d)
+{
+  static const int k[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+  if (m < 3) y--;
+  return (y + y/4 - y/100 + y/400 + k[m-1] + d) % 7;
+}
+
+
+static void
+addrfc822(Blob *out, const struct moment *t)
+{
+  static const char *const days[] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char *const months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  blob_addfmt(out, "%s, %02d %s %04d %02d:%02d:%02d +0000",
+    days[weekday(t->year, t->month, t->day)], t->day, months[t->month-1],
+    t->year, t->hour, t->min, t->sec);
+}
+
+
+static void
+addrfc3339(Blob *out, const struct moment *t)
+{
+  blob_addfmt(out, "%04d-%02d-%02dT%02d:%02d:%02dZ",
+    t->year, t->month, t->day, t->hour, t->min, t->sec);
+}
+
+
+/** append text, escaped for XML content and attributes */
+static void
+addescaped(Blob *out, const char *s, size_t len)
+{
+  const char *end = s + len;
+  while (s < end) {
+    const char *p = s;
+    while (p < end && *p != '&' && *p != '<' && *p != '>' && *p != '"') p++;
+    blob_addbuf(out, s, p - s);
+    if (p == end) break;
+    switch (*p) {
+      case '&': blob_addstr(out, "&amp;"); break;
+      case '<': blob_addstr(out, "&lt;"); break;
+      case '>': blob_addstr(out, "&gt;"); break;
+      default:  blob_addstr(out, "&quot;"); break;
+    }
+    s = p + 1;
+  }
+}
+
+
+static void
+addelem(Blob *out, const char *indent, const char *tag, const char *text)
+{
+  blob_addfmt(out, "%s<%s>", indent, tag);
+  addescaped(out, text, strlen(text));
+  blob_addfmt(out, "</%s>\n", tag);
+}
+
+
+/** append baseurl/path, escaped */
+static void
+addurl(Blob *out, const char *baseurl, const char *path)
+{
+  addescaped(out, baseurl, strlen(baseurl));
+  blob_addchar(out, '/');
+  while (*path == '/') path++;
+  addescaped(out, path, strlen(path));
+}
+
+
+#define ISWS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f')
+
+
+/** first character of URL v (an attribute value), or 0 if it is
+    not relative: empty, protocol-relative, or with a scheme */
+static char
+relative(const char *v, size_t len)
+{
+  Blob url = BLOB_INIT;
+  const char *s;
+  char c;
+
+  mkdnhtml_unescape(&url, v, len);  /* mustache writes / as &#x2F; */
+  s = blob_str(&url);
+  c = strncmp(s, "//", 2) ? *s : 0;
+  if (isalpha((unsigned char) *s)) {
+    while (isalnum((unsigned char) *s) || *s == '+' || *s == '-' || *s == '.') s++;
+    if (*s == ':') c = 0;
+  }
+  blob_free(&url);
+  return c;
+}
+
+
+/** append what a relative URL starting with c needs in front of
+    it to be absolute (page path is where it is from), escaped */
+static void
+addbase(Blob *out, const char *baseurl, const char *path, char c)
+{
+  const char *slash;
+  addescaped(out, baseurl, strlen(baseurl));
+  if (c == '/') return;
+  while (*path == '/') path++;
+  blob_addchar(out, '/');
+  if (c == '#' || c == '?') addescaped(out, path, strlen(path));
+  else if ((slash = strrchr(path, '/')))
+    addescaped(out, path, slash + 1 - path);
+}
+
+
+/** append HTML, escaped, with relative links made absolute */
+static void
+addcontent(Blob *out, const char *baseurl, const char *path,
+           const char *html, size_t len)
+{
+  const char *s = html, *p = html, *end = html + len, *name, *v;
+  size_t n, vlen;
+  char c;
+
+  while ((p = memchr(p, '<', end - p))) {
+    p++;
+    if (p >= end || !isalpha((unsigned char) *p)) continue;
+    while (p < end && *p != '>' && *p != '<') {  /* attributes */
+      while (p < end && (ISWS(*p) || *p == '/')) p++;
+      name = p;
+      while (p < end && !ISWS(*p) && *p != '=' && *p != '>' && *p != '<') p++;
+      n = p - name;
+      while (p < end && ISWS(*p)) p++;
+      if (p >= end || *p != '=') continue;
+      for (p++; p < end && ISWS(*p); p++);
+      if (p < end && (*p == '"' || *p == '\'')) {
+        const char *q = memchr(p+1, *p, end - (p+1));
+        v = p + 1;
+        vlen = (q ? q : end) - v;
+        p = q ? q + 1 : end;
+      }
+      else {
+        v = p;
+        while (p < end && !ISWS(*p) && *p != '>') p++;
+        vlen = p - v;
+      }
+      if (((n == 4 && !strnicmp(name, "href", 4)) ||
+           (n == 3 && !strnicmp(name, "src", 3))) && (c = relative(v, vlen))) {
+        addescaped(out, s, v - s);
+        addbase(out, baseurl, path, c);
+        s = v;
+      }
+    }
+  }
+  addescaped(out, s, end - s);
+}
+
+
+void
+feed_begin(struct feed *feed, const char *updated)
+{
+  Blob *out = feed->out;
+  struct moment t;
+
+  assert(feed != NULL && out != NULL && feed->baseurl != NULL);
+  blob_addstr(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+
+  if (feed->format == FEED_ATOM) {
+    blob_addstr(out, "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n");
+    addelem(out, "  ", "title", feed->title ? feed->title : "");
+    if (feed->description) addelem(out, "  ", "subtitle", feed->description);
+    blob_addstr(out, "  <id>");
+    addurl(out, feed->baseurl, "");
+    blob_addstr(out, "</id>\n  <link href=\"");
+    addurl(out, feed->baseurl, "");
+    blob_addstr(out, "\"/>\n  <link rel=\"self\" href=\"");
+    addurl(out, feed->baseurl, feed->path);
+    blob_addstr(out, "\"/>\n  <updated>");
+    if (!parsedate(updated, &t)) parsedate("1970-01-01", &t);
+    addrfc3339(out, &t);
+    blob_addstr(out, "</updated>\n  <author>\n");
+    addelem(out, "    ", "name", feed->author ? feed->author :
+      feed->title ? feed->title : feed->baseurl);
+    blob_addstr(out, "  </author>\n");
+  }
+  else {
+    blob_addstr(out, "<rss version=\"2.0\" "
+      "xmlns:atom=\"http://www.w3.org/2005/Atom\">\n<channel>\n");
+    addelem(out, "  ", "title", feed->title ? feed->title : "");
+    blob_addstr(out, "  <link>");
+    addurl(out, feed->baseurl, "");
+    blob_addstr(out, "</link>\n  <atom:link rel=\"self\" "
+      "type=\"application/rss+xml\" href=\"");
+    addurl(out, feed->baseurl, feed->path);
+    blob_addstr(out, "\"/>\n");
+    addelem(out, "  ", "description", feed->description ? feed->description :
+      feed->title ? feed->title : "");
+    if (parsedate(updated, &t)) {
+      blob_addstr(out, "  <lastBuildDate>");
+      addrfc822(out, &t);
+      blob_addstr(out, "</lastBuildDate>\n");
+    }
+  }
+}
+
+
+void
+feed_entry(struct feed *feed, const char *path, const char *title,
+           const char *date, const char *html, size_t len)
+{
+  Blob *out = feed->out;
+  struct moment t;
+  bool dated = parsedate(date, &t);
+
+  if (feed->format == FEED_ATOM) {
+    blob_addstr(out, "  <entry>\n");
+    addelem(out, "    ", "title", title ? title : "");
+    blob_addstr(out, "    <id>");
+    addurl(out, feed->baseurl, path);
+    blob_addstr(out, "</id>\n    <link href=\"");
+    addurl(out, feed->baseurl, path);
+    blob_addstr(out, "\"/>\n    <updated>");
+    if (!dated) parsedate("1970-01-01", &t);
+    addrfc3339(out, &t);
+    blob_addstr(out, "</updated>\n");
+    if (html) {
+      blob_addstr(out, "    <content type=\"html\">");
+      addcontent(out, feed->baseurl, path, html, len);
+      blob_addstr(out, "</content>\n");
+    }
+    blob_addstr(out, "  </entry>\n");
+  }
+  else {
+    blob_addstr(out, "  <item>\n");
+    addelem(out, "    ", "title", title ? title : "");
+    blob_addstr(out, "    <link>");
+    addurl(out, feed->baseurl, path);
+    blob_addstr(out, "</link>\n    <guid>");
+    addurl(out, feed->baseurl, path);
+    blob_addstr(out, "</guid>\n");
+    if (dated) {
+      blob_addstr(out, "    <pubDate>");
+      addrfc822(out, &t);
+      blob_addstr(out, "</pubDate>\n");
+    }
+    if (html) {
+      blob_addstr(out, "    <description>");
+      addcontent(out, feed->baseurl, path, html, len);
+      blob_addstr(out, "</description>\n");
+    }
+    blob_addstr(out, "  </item>\n");
+  }
+}
+
+
+void
+feed_end(struct feed *feed)
+{
+  if (feed->format == FEED_ATOM)
+    blob_addstr(feed->out, "</feed>\n");
+  else blob_addstr(feed->out, "</channel>\n</rss>\n");
+}
+
+
+/* === sitemaps === */
+
+
+/** name of shard i: sitemap.xml => sitemap-i.xml */
+static void
+shardname(Blob *buf, const char *name, int i)
+{
+  const char *dot = strrchr(name, '.');
+  size_t len = dot && !strchr(dot, '/') ? (size_t) (dot - name) : strlen(name);
+  blob_clear(buf);
+  blob_addbuf(buf, name, len);
+  blob_addfmt(buf, "-%d%s", i, name + len);
+}
+
+
+static void
+flushshard(struct sitemap *sm, const char *name)
+{
+  int r;
+  blob_addstr(&sm->buf, SITEMAP_TAIL);
+  r = sm->flush(name, blob_str(&sm->buf), blob_len(&sm->buf), sm->ud);
+  if (sm->status == SUCCESS) sm->status = r;
+  blob_clear(&sm->buf);
+  blob_addstr(&sm->buf, SITEMAP_HEAD);
+  sm->nurls = 0;
+}
+
+
+void
+sitemap_begin(struct sitemap *sm, const char *baseurl, const char *name,
+  int (*flush)(const char *name, const char *data, size_t len, void *ud),
+  void *ud)
+{
+  assert(sm != NULL && baseurl != NULL && name != NULL && flush != NULL);
+  sm->baseurl = baseurl;
+  sm->name = name;
+  sm->flush = flush;
+  sm->ud = ud;
+  sm->buf = (Blob) BLOB_INIT;
+  sm->nurls = 0;
+  sm->nshards = 0;
+  sm->status = SUCCESS;
+  blob_addstr(&sm->buf, SITEMAP_HEAD);
+}
+
+
+void
+sitemap_add(struct sitemap *sm, const char *path, const char *lastmod)
+{
+  size_t mark = blob_len(&sm->buf);
+  struct moment t;
+
+  blob_addstr(&sm->buf, "<url><loc>");
+  addurl(&sm->buf, sm->baseurl, path);
+  blob_addstr(&sm->buf, "</loc>");
+  if (parsedate(lastmod, &t))
+    blob_addfmt(&sm->buf, "<lastmod>%04d-%02d-%02d</lastmod>",
+      t.year, t.month, t.day);
+  blob_addstr(&sm->buf, "</url>\n");
+
+  /* shard full? then this URL starts the next one */
+  if (sm->nurls >= MAXURLS ||
+      blob_len(&sm->buf) + sizeof(SITEMAP_TAIL) > MAXBYTES) {
+    Blob url = BLOB_INIT, name = BLOB_INIT;
+    blob_addbuf(&url, blob_str(&sm->buf) + mark, blob_len(&sm->buf) - mark);
+    blob_trunc(&sm->buf, mark);
+    shardname(&name, sm->name, ++sm->nshards);
+    flushshard(sm, blob_str(&name));
+    blob_addbuf(&sm->buf, blob_str(&url), blob_len(&url));
+    blob_free(&url);
+    blob_free(&name);
+  }
+  sm->nurls++;
+}
+
+
+int
+sitemap_end(struct sitemap *sm)
+{
+  Blob name = BLOB_INIT;
+  int i;
+
+  if (sm->nshards == 0)
+    flushshard(sm, sm->name);
+  else {
+    shardname(&name, sm->name, ++sm->nshards);
+    flushshard(sm, blob_str(&name));
+
+    /* the sitemap index, in place of the sitemap */
+    blob_clear(&sm->buf);
+    blob_addstr(&sm->buf, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<sitemapindex xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+    for (i = 1; i <= sm->nshards; i++) {
+      shardname(&name, sm->name, i);
+      blob_addstr(&sm->buf, "<sitemap><loc>");
+      addurl(&sm->buf, sm->baseurl, blob_str(&name));
+      blob_addstr(&sm->buf, "</loc></sitemap>\n");
+    }
+    blob_addstr(&sm->buf, "</sitemapindex>\n");
+    i = sm->flush(sm->name, blob_str(&sm->buf), blob_len(&sm->buf), sm->ud);
+    if (sm->status == SUCCESS) sm->status = i;
+  }
+
+  blob_free(&name);
+  blob_free(&sm->buf);
+  return sm->status;
+}
@@ -0,0 +1,56 @@
+#ifndef FEEDS_H
+#define FEEDS_H
+
+#include <stddef.h>
+
+#include "blob.h"
+
+/* Sitemaps and news feeds (RSS 2.0 and Atom), written item by
+ * item into a Blob, so memory is one file's worth at most */
+
+#define FEED_RSS    1
+#define FEED_ATOM   2
+
+struct feed {
+  int format;           /* FEED_RSS or FEED_ATOM */
+  const char *baseurl;  /* absolute, no trailing slash */
+  const char *path;     /* of the feed itself, e.g. "atom.xml" */
+  const char *title;
+  const char *description;
+  const char *author;
+  Blob *out;
+};
+
+void feed_begin(struct feed *feed, const char *updated);
+void feed_entry(struct feed *feed, const char *path, const char *title,
+                const char *date, const char *html, size_t len);
+void feed_end(struct feed *feed);
+
+struct sitemap {
+  const char *baseurl;  /* absolute, no trailing slash */
+  const char *name;     /* e.g. "sitemap.xml" */
+  int (*flush)(const char *name, const char *data, size_t len, void *ud);
+  void *ud;
+  Blob buf;             /* current shard */
+  size_t nurls;         /* in current shard */
+  int nshards;          /* shards flushed */
+  int status;
+};
+
+void sitemap_begin(struct sitemap *sm, const char *baseurl, const char *name,
+  int (*flush)(const char *name, const char *data, size_t len, void *ud),
+  void *ud);
+void sitemap_add(struct sitemap *sm, const char *path, const char *lastmod);
+int sitemap_end(struct sitemap *sm);
+
+/* Usage: for a feed, fill in struct feed, call feed_begin() with
+   the date of the newest entry, feed_entry() for each entry (path
+   relative to baseurl, date as in front matter: YYYY-MM-DD, maybe
+   with a time, taken as UTC), then feed_end(); the feed is in
+   *out. For a sitemap, call sitemap_begin(), sitemap_add() for
+   each page, and sitemap_end(), which returns the first status
+   other than SUCCESS from flush; flush is called with each file:
+   the sitemap itself, or for more than 50,000 URLs (or 50MB),
+   shards named like name-1.xml, then the sitemap index as name */
+
+#endif
@@ -0,0 +1,143 @@
+/* Front matter extraction */
+
+#define _POSIX_C_SOURCE 200809L  /* for pread(2) */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "frontmatter.h"
+
+
+#define DELIM "---"      /* a line of its own, LF or CRLF, opens and closes */
+#define CHUNKSIZE 1024
+
+
+/** length of the delimiter line at s (n bytes, eof if that is all
+    there is); 0 if there is none, or if more input may tell (*more) */
+static size_t
+delimiter(const char *s, size_t n, bool eof, bool *more)
+{
+  const size_t dlen = sizeof(DELIM)-1;
+  size_t k = dlen;
+
+  *more = false;
+  if (n < dlen) {
+    *more = !eof && memcmp(s, DELIM, n) == 0;
+    return 0;
+  }
+  if (memcmp(s, DELIM, dlen) != 0) return 0;
+  if (n > dlen && s[dlen] == '\r') k++;
+  if (n > k) return s[k] == '\n' ? k+1 : 0;
+  if (eof) return k;  /* last line, no newline */
+  *more = true;
+  return 0;
+}
+
+
+/* Most headers are a few hundred bytes, so the first read is
+ * small; as long as the closing delimiter is not in what was
+ * read so far, read again, twice as much each time, searching
+ * only the new bytes (and the few before that could be part of
+ * a delimiter). The rest of the file is never read here. */
+
+int
+frontmatter_read(const char *fn, Blob *header, size_t *poffset)
+{
+  Blob buf = BLOB_INIT;
+  size_t len = 0, chunk = CHUNKSIZE, i = 0, oplen, cllen;
+  const char *s;
+  bool more;
+  ssize_t n;
+  int fd, r = 0;
+
+  assert(fn != NULL && header != NULL && poffset != NULL);
+  *poffset = 0;
+
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) return -1;
+
+  for (;;) {
+    char *p = blob_prepare(&buf, chunk);
+    if (!p) {
+      errno = ENOMEM;
+      r = -1;
+      break;
+    }
+    n = pread(fd, p, chunk, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      r = -1;
+      break;
+    }
+    blob_addlen(&buf, n);
+    len += n;
+    s = blob_str(&buf);
+
+    oplen = delimiter(s, len, n == 0, &more);
+    if (more) continue;
+    if (!oplen) break;  /* no front matter */
+    if (i < oplen-1) i = oplen-1;  /* its newline may precede closing */
+    for (; i < len; i++) {
+      if (s[i] != '\n') continue;
+      cllen = delimiter(s+i+1, len-i-1, n == 0, &more);
+      if (more) break;  /* read on, search again from here */
+      if (cllen) {
+        blob_addbuf(header, s+oplen, i+1 - oplen);
+        *poffset = i+1 + cllen;
+        r = 1;
+        break;
+      }
+    }
+    if (r || n == 0) break;  /* found or no closing delimiter */
+    chunk *= 2;
+  }
+
+  blob_free(&buf);
+  if (r < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+  }
+  else close(fd);
+  return r;
+}
+
+
+void
+frontmatter_parse(const char *text, size_t len,
+  void (*func)(const char *key, size_t klen,
+               const char *value, size_t vlen, void *ud), void *ud)
+{
+  const char *end = text + len;
+  const char *p = text;
+
+  assert(text != NULL && func != NULL);
+
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *key, *val, *q;
+    size_t klen;
+    if (!eol) eol = end;
+
+    /* key: value, same as "^%s*([%w_-]+)%s*:%s*(.-)%s*$" */
+    for (q = p; q < eol && isspace((unsigned char) *q); q++);
+    for (key = q; q < eol && (isalnum((unsigned char) *q) || *q == '_' || *q == '-'); q++);
+    klen = q - key;
+    for (; q < eol && isspace((unsigned char) *q); q++);
+    if (klen > 0 && q < eol && *q == ':') {
+      for (q++; q < eol && isspace((unsigned char) *q); q++);
+      for (val = q, q = eol; q > val && isspace((unsigned char) q[-1]); q--);
+      func(key, klen, val, q - val, ud);
+    }
+
+    p = eol < end ? eol + 1 : end;
+  }
+}
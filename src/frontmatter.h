@@ -0,0 +1,27 @@
+#ifndef FRONTMATTER_H
+#define FRONTMATTER_H
+
+#include <stddef.h>
+
+#include "blob.h"
+
+/* Front matter: an optional header at the start of a content
+ * file, between a line "---" and the next such line; either
+ * key: value lines or a Lua table constructor { ... } */
+
+int frontmatter_read(const char *fn, Blob *header, size_t *poffset);
+
+void frontmatter_parse(const char *text, size_t len,
+  void (*func)(const char *key, size_t klen,
+               const char *value, size_t vlen, void *ud), void *ud);
+
+/* Usage: frontmatter_read() reads only the leading bytes of the
+   file, until the closing delimiter, and puts the header text
+   (without delimiters) into the blob and the offset of the body
+   into *poffset; it returns 1 if there is front matter, 0 if not
+   (the body is the whole file), -1 and sets errno on error;
+   frontmatter_parse() calls func for each key: value line of a
+   header (value trimmed); a header that begins with { is Lua
+   and left to the caller */
+
+#endif
@@ -0,0 +1,217 @@
+/* Fast non-cryptographic hashing */
+
+#define _POSIX_C_SOURCE 200112L  /* for mmap(2) */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+
+/* This is the XXH64 algorithm by Yann Collet, see
+ * https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ * (the spec), which is fast (several GB/s) and good enough for
+ * detecting changed content (but not for cryptographic uses).
+ *
+ * Files are hashed from a read-only mapping, so there is no copy
+ * and no buffer to size. With many files, the time goes to page
+ * faults and system calls more than to the hash itself, so
+ * hash_files() spreads them over threads that take batches of
+ * HASHBATCH files from a shared counter.
+ */
+
+#define HASHBATCH 8     /* files per turn in hash_files() */
+
+#define P1 UINT64_C(0x9E3779B185EBCA87)
+#define P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define P3 UINT64_C(0x165667B19E3779F9)
+#define P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define P5 UINT64_C(0x27D4EB2F165667C5)
+
+#define ROTL(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static uint64_t
+read64(const unsigned char *p)
+{
+  /* little endian, regardless of host byte order */
+  return (uint64_t) p[0]       | (uint64_t) p[1] <<  8 |
+         (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+         (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+         (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+
+static uint64_t
+read32(const unsigned char *p)
+{
+  return (uint64_t) p[0]       | (uint64_t) p[1] <<  8 |
+         (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24;
+}
+
+
+static uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+  acc += input * P2;
+  acc = ROTL(acc, 31);
+  return acc * P1;
+}
+
+
+static uint64_t
+merge64(uint64_t acc, uint64_t val)
+{
+  acc ^= round64(0, val);
+  return acc * P1 + P4;
+}
+
+
+uint64_t
+hash64(const void *data, size_t size, uint64_t seed)
+{
+  const unsigned char *p = data;
+  const unsigned char *end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    const unsigned char *limit = end - 32;
+    uint64_t v1 = seed + P1 + P2;
+    uint64_t v2 = seed + P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - P1;
+    do {
+      v1 = round64(v1, read64(p));    p += 8;
+      v2 = round64(v2, read64(p));    p += 8;
+      v3 = round64(v3, read64(p));    p += 8;
+      v4 = round64(v4, read64(p));    p += 8;
+    } while (p <= limit);
+    h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+    h = merge64(h, v1);
+    h = merge64(h, v2);
+    h = merge64(h, v3);
+    h = merge64(h, v4);
+  }
+  else h = seed + P5;
+
+  h += (uint64_t) size;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= round64(0, read64(p));
+    h = ROTL(h, 27) * P1 + P4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * P1;
+    h = ROTL(h, 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * P5;
+    h = ROTL(h, 11) * P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+
+/** hash contents of the given file; return 0 or -1 (errno) */
+int
+hash_file(const char *path, uint64_t *phash)
+{
+  struct stat statbuf;
+  void *p;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &statbuf) < 0) goto fail;
+  if (statbuf.st_size == 0) {
+    *phash = hash64("", 0, 0);
+    close(fd);
+    return 0;
+  }
+  p = mmap(0, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) goto fail;
+  *phash = hash64(p, statbuf.st_size, 0);
+  munmap(p, statbuf.st_size);
+  close(fd);
+  return 0;
+
+fail:
+  { int saved = errno; close(fd); errno = saved; }
+  return -1;
+}
+
+
+struct hashjob {
+  pthread_mutex_t lock;
+  const char *const *paths;
+  uint64_t *hashes;
+  int *errs;
+  size_t n;
+  size_t next;          /* next file to hash */
+};
+
+
+static void *
+hash_thread(void *arg)
+{
+  struct hashjob *job = arg;
+  size_t i, end;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    i = job->next;
+    end = job->n - i < HASHBATCH ? job->n : i + HASHBATCH;
+    job->next = end;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= end) break;
+    for (; i < end; i++) {
+      job->hashes[i] = 0;
+      job->errs[i] = hash_file(job->paths[i], &job->hashes[i]) < 0 ? errno : 0;
+    }
+  }
+  return 0;
+}
+
+
+/** hash n files on up to nthreads threads (0: one per CPU) */
+void
+hash_files(const char *const *paths, size_t n, uint64_t *hashes, int *errs,
+           int nthreads)
+{
+  struct hashjob job;
+  pthread_t threads[64];
+  int i, started = 0;
+
+  if (nthreads <= 0) nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > 64) nthreads = 64;
+  if ((size_t) nthreads > (n + HASHBATCH - 1) / HASHBATCH)
+    nthreads = (int) ((n + HASHBATCH - 1) / HASHBATCH);
+
+  pthread_mutex_init(&job.lock, 0);
+  job.paths = paths;
+  job.hashes = hashes;
+  job.errs = errs;
+  job.n = n;
+  job.next = 0;
+
+  /* the calling thread is one of them */
+  for (i = 1; i < nthreads; i++)
+    if (pthread_create(&threads[started], 0, hash_thread, &job) == 0)
+      started++;
+  hash_thread(&job);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], 0);
+  pthread_mutex_destroy(&job.lock);
+}
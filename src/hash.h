@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fast non-cryptographic hashing (XXH64 algorithm) */
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
+
+int hash_file(const char *path, uint64_t *phash);
+void hash_files(const char *const *paths, size_t n, uint64_t *hashes,
+                int *errs, int nthreads);
+
+/* Usage: hash64() hashes a buffer; hash_file() the contents of a
+   file (mapped, not read), returning 0 or -1 and errno; hash_files()
+   hashes n files on a few threads, with hashes[i] and errs[i] (0 or
+   the errno) for paths[i] */
+
+#endif
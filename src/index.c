@@ -0,0 +1,449 @@
+/* Site index: page metadata, persisted and mapped */
+
+#define _POSIX_C_SOURCE 200809L  /* for fstat(2) and mmap(2) */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "jot.h"
+#include "blob.h"
+#include "copy.h"
+#include "frontmatter.h"
+#include "index.h"
+#include "log.h"
+#include "memory.h"
+
+
+/* The index file is a header, an array of fixed-size records
+ * sorted by path, and a string table: all distinct strings,
+ * sorted, each terminated by \0, the empty string first. Records
+ * refer to strings by their offset in the table. So a lookup is
+ * a binary search in the mapped file, and reading a record is
+ * pointer arithmetic. Integers are in host byte order; the file
+ * is a cache, not meant to be shared between machines. */
+
+#define MAGIC  "JOTINDX1"
+#define FORMAT 1
+
+struct header {
+  char magic[8];
+  uint32_t format;
+  uint32_t count;       /* number of records */
+  uint64_t strsize;     /* bytes in string table */
+};
+
+struct record {
+  uint32_t path;        /* offsets into string table */
+  uint32_t section;
+  uint32_t title;
+  uint32_t date;
+  uint32_t tags;
+  uint32_t unused;
+  uint64_t offset;
+  int64_t size;
+  int64_t mtime;
+};
+
+static struct {
+  void *map;            /* file mapped by index_open() */
+  size_t mapsize;
+  Blob image;           /* or image built by index_update() */
+  const struct record *records;
+  size_t count;
+  const char *strings;
+  size_t strsize;
+  unsigned serial;      /* incremented when records change */
+} idx = { 0, 0, BLOB_INIT, 0, 0, 0, 0, 0 };
+
+
+/** point idx at the index in data; false if data is not an index */
+static bool
+setup(const char *data, size_t size)
+{
+  struct header head;
+  size_t recsize;
+
+  if (size < sizeof(head)) return false;
+  memcpy(&head, data, sizeof(head));
+  if (memcmp(head.magic, MAGIC, sizeof(head.magic)) || head.format != FORMAT)
+    return false;
+  recsize = (size_t) head.count * sizeof(struct record);
+  if (head.strsize < 1 || size - sizeof(head) < recsize ||
+      size - sizeof(head) - recsize != head.strsize)
+    return false;
+
+  idx.records = (const struct record *) (data + sizeof(head));
+  idx.count = head.count;
+  idx.strings = data + sizeof(head) + recsize;
+  idx.strsize = head.strsize;
+  if (idx.strings[idx.strsize-1] != '\0') {
+    idx.records = 0;
+    idx.count = 0;
+    return false;
+  }
+  return true;
+}
+
+
+/** true iff the index in memory is the given image */
+static bool
+current(const Blob *image)
+{
+  const char *data = idx.map ? idx.map : blob_buf(&idx.image);
+  size_t size = idx.map ? idx.mapsize : blob_len(&idx.image);
+  return idx.records && size == blob_len(image) &&
+         !memcmp(data, blob_buf(image), size);
+}
+
+
+/** map the index file; -1 if there is none or it is not valid */
+int
+index_open(const char *fn)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  index_close();
+
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return -1;
+
+  if (!setup(p, st.st_size)) {
+    log_debug("index: ignoring %s: not a valid index", fn);
+    munmap(p, st.st_size);
+    return -1;
+  }
+  idx.map = p;
+  idx.mapsize = st.st_size;
+  log_debug("index: mapped %s, %zu records", fn, idx.count);
+  return 0;
+}
+
+
+void
+index_close(void)
+{
+  if (idx.map) munmap(idx.map, idx.mapsize);
+  blob_free(&idx.image);
+  idx.map = 0;
+  idx.mapsize = 0;
+  idx.records = 0;
+  idx.count = 0;
+  idx.strings = 0;
+  idx.strsize = 0;
+  idx.serial++;
+}
+
+
+size_t
+index_count(void)
+{
+  return idx.count;
+}
+
+
+unsigned
+index_serial(void)
+{
+  return idx.serial;
+}
+
+
+static const char *
+string(uint32_t ofs)
+{
+  return ofs < idx.strsize ? idx.strings + ofs : "";
+}
+
+
+bool
+index_get(size_t i, struct pageinfo *info)
+{
+  const struct record *rec;
+  if (i >= idx.count) return false;
+  rec = &idx.records[i];
+  info->path = string(rec->path);
+  info->section = string(rec->section);
+  info->title = string(rec->title);
+  info->date = string(rec->date);
+  info->tags = string(rec->tags);
+  info->offset = rec->offset;
+  info->size = rec->size;
+  info->mtime = rec->mtime;
+  return true;
+}
+
+
+bool
+index_find(const char *path, size_t *pi)
+{
+  size_t lo = 0, hi = idx.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = strcmp(path, string(idx.records[mid].path));
+    if (c == 0) {
+      *pi = mid;
+      return true;
+    }
+    if (c < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return false;
+}
+
+
+/* === updating === */
+
+
+struct scan {
+  MemPool *pool;
+  struct pageinfo *info;
+};
+
+
+static const char *
+dupstr(MemPool *pool, const char *s, size_t len)
+{
+  const char *p = mem_pool_dup(pool, s, len);
+  return p ? p : "";
+}
+
+
+static void
+setfield(const char *key, size_t klen, const char *value, size_t vlen, void *ud)
+{
+  struct scan *scan = ud;
+  const char **field = 0;
+  if (klen == 5 && !memcmp(key, "title", 5)) field = &scan->info->title;
+  else if (klen == 4 && !memcmp(key, "date", 4)) field = &scan->info->date;
+  else if (klen == 4 && !memcmp(key, "tags", 4)) field = &scan->info->tags;
+  if (field) *field = dupstr(scan->pool, value, vlen);
+}
+
+
+/** evaluate a Lua table constructor and pick out our fields */
+static void
+luaheader(struct scan *scan, const char *text, size_t len)
+{
+  static const char *const keys[] = { "title", "date", "tags" };
+  lua_State *L = luaL_newstate();
+  Blob code = BLOB_INIT;
+  size_t i;
+
+  if (!L) return;
+  blob_addstr(&code, "return ");
+  blob_addbuf(&code, text, len);
+  if (luaL_loadbufferx(L, blob_str(&code), blob_len(&code), scan->info->path, "t") == LUA_OK) {
+    lua_newtable(L);
+    lua_setupvalue(L, -2, 1);  /* empty _ENV */
+    if (lua_pcall(L, 0, 1, 0) == LUA_OK && lua_istable(L, -1)) {
+      for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+        Blob buf = BLOB_INIT;
+        lua_getfield(L, -1, keys[i]);
+        if (lua_istable(L, -1)) {  /* list of tags: join */
+          lua_Integer j, n = luaL_len(L, -1);
+          for (j = 1; j <= n; j++) {
+            lua_geti(L, -1, j);
+            if (lua_isstring(L, -1)) {
+              if (blob_len(&buf)) blob_addstr(&buf, ", ");
+              blob_addstr(&buf, lua_tostring(L, -1));
+            }
+            lua_pop(L, 1);
+          }
+        }
+        else if (lua_isstring(L, -1))
+          blob_addstr(&buf, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        setfield(keys[i], strlen(keys[i]), blob_str(&buf), blob_len(&buf), scan);
+        blob_free(&buf);
+      }
+    }
+  }
+  blob_free(&code);
+  lua_close(L);
+}
+
+
+/** fill info from the front matter of info->path */
+static void
+scanfile(MemPool *pool, struct pageinfo *info)
+{
+  Blob header = BLOB_INIT;
+  struct scan scan;
+  const char *s;
+  size_t len, offset;
+
+  scan.pool = pool;
+  scan.info = info;
+  info->title = info->date = info->tags = "";
+  info->offset = 0;
+
+  if (frontmatter_read(info->path, &header, &offset) < 0) {
+    log_warn("index: cannot read %s: %s", info->path, strerror(errno));
+    return;
+  }
+  info->offset = offset;
+  s = blob_str(&header);
+  len = blob_len(&header);
+  while (len > 0 && (*s == ' ' || *s == '\t' || *s == '\n')) s++, len--;
+  if (len > 0 && *s == '{') luaheader(&scan, s, len);
+  else frontmatter_parse(s, len, setfield, &scan);
+  blob_free(&header);
+}
+
+
+static int
+infocmp(const void *a, const void *b)
+{
+  const struct pageinfo *p = a;
+  const struct pageinfo *q = b;
+  return strcmp(p->path, q->path);
+}
+
+
+struct strent {
+  const char *s;
+  uint32_t ofs;
+};
+
+
+static int
+strentcmp(const void *a, const void *b)
+{
+  const struct strent *p = a;
+  const struct strent *q = b;
+  return strcmp(p->s, q->s);
+}
+
+
+static uint32_t
+lookup(const struct strent *strs, size_t n, const char *s)
+{
+  struct strent key, *p;
+  key.s = s;
+  p = bsearch(&key, strs, n, sizeof(key), strentcmp);
+  assert(p != NULL);
+  return p->ofs;
+}
+
+
+/** make an index of the given sources, reusing what we have;
+    1 if the index changed, 0 if not, -1 on error */
+int
+index_update(const char *fn, const struct pageinfo *sources, size_t n)
+{
+  MemPool pool;
+  Blob infos = BLOB_INIT;
+  Blob strs = BLOB_INIT;
+  Blob image = BLOB_INIT;
+  struct pageinfo *pv;
+  struct strent *sv;
+  struct header head;
+  size_t i, j, k, nstrs, nscanned = 0;
+  int r;
+
+  mem_pool_init(&pool, 0);
+
+  /* records: from the current index if fingerprints agree */
+  pv = blob_prepare(&infos, n * sizeof(*pv));
+  if (!pv && n > 0) goto nomem;
+  for (i = 0; i < n; i++) {
+    if (index_find(sources[i].path, &j) && index_get(j, &pv[i]) &&
+        pv[i].size == sources[i].size && pv[i].mtime == sources[i].mtime &&
+        !strcmp(pv[i].section, sources[i].section))
+      continue;
+    pv[i] = sources[i];
+    scanfile(&pool, &pv[i]);
+    nscanned++;
+  }
+  blob_addlen(&infos, n * sizeof(*pv));
+  if (n > 0) qsort(pv, n, sizeof(*pv), infocmp);
+
+  /* string table: distinct strings, sorted, "" first */
+  sv = blob_prepare(&strs, (5*n+1) * sizeof(*sv));
+  if (!sv) goto nomem;
+  k = 0;
+  sv[k++].s = "";
+  for (i = 0; i < n; i++) {
+    sv[k++].s = pv[i].path;
+    sv[k++].s = pv[i].section;
+    sv[k++].s = pv[i].title;
+    sv[k++].s = pv[i].date;
+    sv[k++].s = pv[i].tags;
+  }
+  qsort(sv, k, sizeof(*sv), strentcmp);
+  for (i = j = 0; i < k; i++)
+    if (j == 0 || strcmp(sv[j-1].s, sv[i].s)) sv[j++] = sv[i];
+  nstrs = j;
+
+  /* the image: header, records, strings */
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, MAGIC, sizeof(head.magic));
+  head.format = FORMAT;
+  head.count = n;
+  blob_addbuf(&image, (const char *) &head, sizeof(head));
+  for (i = 0; i < nstrs; i++) {
+    sv[i].ofs = head.strsize;
+    head.strsize += strlen(sv[i].s) + 1;
+  }
+  for (i = 0; i < n; i++) {
+    struct record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.path = lookup(sv, nstrs, pv[i].path);
+    rec.section = lookup(sv, nstrs, pv[i].section);
+    rec.title = lookup(sv, nstrs, pv[i].title);
+    rec.date = lookup(sv, nstrs, pv[i].date);
+    rec.tags = lookup(sv, nstrs, pv[i].tags);
+    rec.offset = pv[i].offset;
+    rec.size = pv[i].size;
+    rec.mtime = pv[i].mtime;
+    blob_addbuf(&image, (const char *) &rec, sizeof(rec));
+  }
+  for (i = 0; i < nstrs; i++)
+    blob_addbuf(&image, sv[i].s, strlen(sv[i].s) + 1);
+  memcpy(blob_buf(&image), &head, sizeof(head));  /* with strsize */
+  if (blob_failed(&image)) goto nomem;
+
+  /* write if changed (no file: compare with the index in memory);
+     keep the image (not the file) in memory */
+  if (!fn) r = current(&image) ? 0 : 1;
+  else if ((r = copy_buffer(blob_buf(&image), blob_len(&image), fn)) < 0)
+    log_warn("index: cannot write %s: %s", fn, strerror(errno));
+  index_close();
+  idx.image = image;
+  setup(blob_buf(&idx.image), blob_len(&idx.image));
+  log_debug("index: %zu records, %zu front matters read", n, nscanned);
+
+  mem_pool_free(&pool);
+  blob_free(&infos);
+  blob_free(&strs);
+  return r;
+
+nomem:
+  log_error("index: out of memory");
+  mem_pool_free(&pool);
+  blob_free(&infos);
+  blob_free(&strs);
+  blob_free(&image);
+  return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Site index: metadata of all content pages (from their front
+ * matter) in a compact binary file that is mapped, not parsed;
+ * updated by the build, reading front matter only of pages that
+ * changed; process-wide, read-only between updates */
+
+struct pageinfo {
+  const char *path;     /* source file, relative to site root */
+  const char *section;  /* first directory below the source dir */
+  const char *title;    /* from front matter, "" if none */
+  const char *date;
+  const char *tags;     /* as in front matter, comma separated */
+  uint64_t offset;      /* of body in source file */
+  int64_t size;         /* fingerprint of source file */
+  int64_t mtime;        /* nanoseconds since the epoch */
+};
+
+int index_open(const char *fn);
+void index_close(void);
+int index_update(const char *fn, const struct pageinfo *sources, size_t n);
+
+size_t index_count(void);
+unsigned index_serial(void);
+bool index_get(size_t i, struct pageinfo *info);
+bool index_find(const char *path, size_t *pi);
+
+/* Usage: index_open() maps the index file (if any); the build
+   then calls index_update() with path, section, size and mtime
+   of all sources (the other fields are ignored), which reuses
+   records whose fingerprint agrees, reads the front matter of
+   the others, writes the file if anything changed (returns 1,
+   else 0, or -1 on error; with a null file name it only tells),
+   and keeps the result in memory;
+   index_count(), index_get(), index_find() access the records,
+   sorted by path; strings point into the mapping (or image) and
+   are valid until the next update or index_close(); the number
+   from index_serial() changes whenever the records may have */
+
+#endif
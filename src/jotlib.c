@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -7,6 +8,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <dirent.h>
 #include <fcntl.h>
@@ -20,10 +22,23 @@
 
 #include "jot.h"
 #include "jotlib.h"
+#include "assets.h"
 #include "log.h"
 #include "blob.h"
+#include "cache.h"
+#include "copy.h"
+#include "deflate.h"
+#include "frontmatter.h"
+#include "hash.h"
+#include "index.h"
+#include "links.h"
+#include "taxonomy.h"
 #include "markdown.h"
+#include "minify.h"
 #include "pikchr.h"
+#include "search.h"
+#include "tar.h"
+#include "trace.h"
 #include "utils.h"
 #include "walkdir.h"
 #include "wildmatch.h"
@@ -108,22 +123,76 @@ failed(lua_State *L, const char *fmt, ...)
 }
 
 
-/* fs.readfile(fn): string | nil errmsg errno */
+/* fs.tar(fn, entries): true | nil errmsg errno; each entry is
+   {name, data} or {name, file = path}; mtime of data is now */
+static int
+fs_tar(lua_State *L)
+{
+  const char *fn = luaL_checkstring(L, 1);
+  const char *name, *data, *file;
+  struct tar tar;
+  size_t len;
+  lua_Integer i, n;
+  int fd, r = 0, saverr;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = luaL_len(L, 2);
+  for (i = 1; i <= n; i++) {  /* check all before writing */
+    luaL_argcheck(L, lua_rawgeti(L, 2, i) == LUA_TTABLE &&
+      lua_rawgeti(L, -1, 1) == LUA_TSTRING, 2, "entry without name");
+    lua_pop(L, 2);
+  }
+
+  fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) return luaL_fileresult(L, 0, fn);
+  tar_begin(&tar, fd, (int64_t) time(0));
+  for (i = 1; r == 0 && i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_getfield(L, -3, "file");
+    name = lua_tostring(L, -3);
+    data = lua_tolstring(L, -2, &len);
+    file = lua_tostring(L, -1);
+    if (file) r = tar_addfile(&tar, name, file);
+    else r = tar_add(&tar, name, data ? data : "", data ? len : 0);
+    lua_pop(L, 4);
+  }
+  if (r == 0) r = tar_end(&tar);
+  else blob_free(&tar.buf);
+  saverr = errno;
+  close(fd);
+  errno = saverr;
+  if (r < 0) return luaL_fileresult(L, 0, fn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/* fs.readfile(fn, offset?): string | nil errmsg errno */
 static int
 fs_readfile(lua_State *L)
 {
   size_t r;
   luaL_Buffer buf;
   const char *fn = luaL_checkstring(L, 1);
+  long offset = (long) luaL_optinteger(L, 2, 0);
   FILE *fp = fopen(fn, "rb");
   if (!fp)
     return luaL_fileresult(L, 0, fn);
+  if (offset > 0 && fseek(fp, offset, SEEK_SET) != 0) {
+    int n = luaL_fileresult(L, 0, fn);
+    fclose(fp);
+    return n;
+  }
+  trace_begin("io", "readfile", fn);
   luaL_buffinit(L, &buf);
   do {  /* read entire file in chunks */
     char *p = luaL_prepbuffsize(&buf, LUAL_BUFFERSIZE);
     r = fread(p, sizeof(char), LUAL_BUFFERSIZE, fp);
     luaL_addsize(&buf, r);
   } while (r == LUAL_BUFFERSIZE);
+  trace_end();
   if (ferror(fp)) {
     int n = luaL_fileresult(L, 0, fn);
     fclose(fp);
@@ -135,31 +204,113 @@ fs_readfile(lua_State *L)
 }
 
 
-/* fs.writefile(fn, s...): true | nil errmsg errno */
+/** push hash as 16 hex digits */
+static void
+pushhash(lua_State *L, uint64_t h)
+{
+  char buf[20];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) h);
+  lua_pushstring(L, buf);
+}
+
+
+/** fs.hash(fn): hex string | nil errmsg errno */
 static int
-fs_writefile(lua_State *L)
+fs_hash(lua_State *L)
 {
-  int ok = 1, arg, nargs = lua_gettop(L);
   const char *fn = luaL_checkstring(L, 1);
-  FILE *fp = fopen(fn, "wb");
-  if (!fp)
+  uint64_t h;
+  int r;
+  trace_begin("io", "hash", fn);
+  r = hash_file(fn, &h);
+  trace_end();
+  if (r < 0)
     return luaL_fileresult(L, 0, fn);
-  for (arg = 2; arg <= nargs; arg++) {
-    size_t len;
-    const char *s = lua_tolstring(L, arg, &len);
-    ok = ok && fwrite(s, sizeof(char), len, fp) == len;
+  pushhash(L, h);
+  return 1;
+}
+
+
+/** fs.hashmany(fns): table of hex strings (false if unreadable) */
+static int
+fs_hashmany(lua_State *L)
+{
+  Blob buf = BLOB_INIT;
+  const char **paths;
+  uint64_t *hashes;
+  int *errs;
+  size_t i, n;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = luaL_len(L, 1);
+  paths = blob_prepare(&buf, n * (sizeof(*paths) + sizeof(*hashes) +
+    sizeof(*errs)) + 1);
+  if (!paths) return jot_error(L, "out of memory");
+  hashes = (uint64_t *) (paths + n);
+  errs = (int *) (hashes + n);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i+1);
+    paths[i] = lua_tostring(L, -1);  /* kept alive by the table */
+    lua_pop(L, 1);
+    if (!paths[i]) {
+      blob_free(&buf);
+      return luaL_error(L, "hashmany: item %d is not a string", (int) i+1);
+    }
   }
-  if (ferror(fp)) {
-    int n = luaL_fileresult(L, 0, fn);
-    fclose(fp);
-    return n;
+
+  trace_begin("io", "hashmany", 0);
+  hash_files((const char *const *) paths, n, hashes, errs, 0);
+  trace_end();
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    if (errs[i]) {
+      log_debug("hashmany: %s: %s", paths[i], strerror(errs[i]));
+      lua_pushboolean(L, 0);
+    }
+    else pushhash(L, hashes[i]);
+    lua_rawseti(L, -2, i+1);
   }
-  fclose(fp);
-  lua_pushboolean(L, 1);
+  blob_free(&buf);
   return 1;
 }
 
 
+/* fs.writefile(fn, s...): true written | nil errmsg errno */
+static int
+fs_writefile(lua_State *L)
+{
+  int r, nargs = lua_gettop(L);
+  const char *fn = luaL_checkstring(L, 1);
+  const char *s;
+  size_t len;
+
+  /* one string as is, several concatenated */
+  if (nargs == 2) s = luaL_checklstring(L, 2, &len);
+  else {
+    luaL_Buffer buf;
+    int arg;
+    luaL_buffinit(L, &buf);
+    for (arg = 2; arg <= nargs; arg++) {
+      luaL_checkstring(L, arg);
+      lua_pushvalue(L, arg);
+      luaL_addvalue(&buf);
+    }
+    luaL_pushresult(&buf);
+    s = lua_tolstring(L, -1, &len);
+  }
+
+  trace_begin("io", "writefile", fn);
+  r = copy_buffer(s, len, fn);
+  trace_end();
+  if (r < 0)
+    return luaL_fileresult(L, 0, fn);
+  lua_pushboolean(L, 1);
+  lua_pushboolean(L, r > 0);
+  return 2;
+}
+
+
 /** fs.getcwd(): path */
 static int
 fs_getcwd(lua_State *L)
@@ -235,12 +386,14 @@ fs_listdir(lua_State *L)
     return failed(L, "opendir %s: %s", path, strerror(errno));
 
   lua_newtable(L);
+  trace_begin("io", "listdir", path);
   errno = 0;
   for (i = 1; (e = readdir(dp)); i++) {
     lua_pushinteger(L, i);
     lua_pushstring(L, e->d_name);
     lua_settable(L, -3);
   }
+  trace_end();
 
   if (errno) {
     lua_pop(L, 1);  /* the table */
@@ -522,6 +675,7 @@ fs_glob(lua_State *L)
     if (walkdir(&walk, dir, wflags) != 0)
       return jot_error(L, "walkdir: %s", strerror(errno));
 
+    trace_begin("io", "glob", dir);
     int type;
     while ((type = walkdir_next(&walk)) > 0) {
       const char *path = walkdir_path(&walk);
@@ -534,6 +688,7 @@ fs_glob(lua_State *L)
       }
     }
     walkdir_free(&walk);
+    trace_end();
     if (type < 0)
       return jot_error(L, "walkdir: %s", strerror(errno));
   }
@@ -541,6 +696,34 @@ fs_glob(lua_State *L)
 }
 
 
+/** fs.sync(src, dst): ncopied nremoved | nil errmsg */
+static int
+fs_sync(lua_State *L)
+{
+  struct copystats stats;
+  Blob errmsg = BLOB_INIT;
+  const char *src = luaL_checkstring(L, 1);
+  const char *dst = luaL_checkstring(L, 2);
+  int r;
+
+  memset(&stats, 0, sizeof(stats));
+  trace_begin("io", "sync", src);
+  r = copy_tree(src, dst, &stats, &errmsg);
+  trace_end();
+  if (r < 0) {
+    luaL_pushfail(L);
+    lua_pushstring(L, blob_str(&errmsg));
+    blob_free(&errmsg);
+    return 2;
+  }
+  log_debug("sync %s to %s: %zu copied (%zu bytes), %zu fresh, %zu removed",
+    src, dst, stats.ncopied, stats.nbytes, stats.nfresh, stats.nremoved);
+  lua_pushinteger(L, stats.ncopied);
+  lua_pushinteger(L, stats.nremoved);
+  return 2;
+}
+
+
 static int
 jot_split_iter(lua_State *L)
 {
@@ -660,19 +843,40 @@ jot_getenv(lua_State *L)
 static int
 jot_pikchr(lua_State *L)
 {
+  Blob blob = BLOB_INIT;
   const char *s, *t;
   const char *class = "pikchr";
   int w, h, darkmode, r;
   unsigned int flags;
+  uint64_t key;
+  size_t len;
 
-  s = luaL_checkstring(L, 1);
+  s = luaL_checklstring(L, 1, &len);
   darkmode = lua_toboolean(L, 2);
 
   flags = PIKCHR_PLAINTEXT_ERRORS;
   if (darkmode) flags |= PIKCHR_DARK_MODE;
 
+  /* cached as "width height\nsvg"; errors are not cached */
+  key = cache_key("pikchr", flags, s, len);
+  if (cache_get(key, &blob)) {
+    char *end;
+    w = strtol(blob_str(&blob), &end, 10);
+    h = strtol(end, &end, 10);
+    if (*end == '\n') {
+      lua_pushstring(L, end+1);
+      lua_pushinteger(L, w);
+      lua_pushinteger(L, h);
+      blob_free(&blob);
+      return 3;
+    }
+    blob_clear(&blob);
+  }
+
   log_trace("calling pikchr()");
+  trace_begin("pikchr", "pikchr", 0);
   t = pikchr(s, class, flags, &w, &h);
+  trace_end();
 
   if (!t) {
     return failed(L, "pikchr() returns null; out of memory?");
@@ -686,28 +890,105 @@ jot_pikchr(lua_State *L)
     lua_pushinteger(L, w);
     lua_pushinteger(L, h);
     r = 3;
+    blob_addfmt(&blob, "%d %d\n%s", w, h, t);
+    cache_put(key, blob_str(&blob), blob_len(&blob));
   }
 
   free((void *) t);
+  blob_free(&blob);
 
   return r;
 }
 
 
-/** jot.markdown(str): string */
+/** a collector (regkey) of the page being built, or null */
+static Blob *
+getcollector(lua_State *L, const char *regkey)
+{
+  Blob *buf;
+  lua_getfield(L, LUA_REGISTRYINDEX, regkey);
+  buf = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return buf;
+}
+
+
+/** render s through the syntax tree, or streaming in chunks of n bytes */
+static void
+markdown_other(Blob *out, const char *s, size_t len, int pretty, lua_Integer n)
+{
+  if (n <= 0) {
+    struct mkdnnode *doc = markdown_parse(s, len, 0);
+    mkdnhtml_tree(out, doc, 0, pretty, 0, 0);
+    markdown_freetree(doc);
+  }
+  else {
+    struct mkdnstream *sp = mkdnhtml_begin(0, pretty);
+    size_t i;
+    for (i = 0; i < len; i += (size_t) n)
+      markdown_feed(sp, out, s+i, len-i < (size_t) n ? len-i : (size_t) n);
+    mkdnhtml_end(sp, out);
+  }
+}
+
+
+/** jot.markdown(str, [opts, [how]]): string */
 static int
 jot_markdown(lua_State *L)
 {
   Blob blob = BLOB_INIT;
   Blob *pout = &blob;
+  Blob *links, *text;
   const char *s;
   size_t len;
   int pretty;
 
+  uint64_t key;
+
   s = luaL_checklstring(L, 1, &len);
   pretty = luaL_optinteger(L, 2, 0);
-  log_trace("calling mkdnhtml()");
-  mkdnhtml(pout, s, len, 0, pretty);
+  if (!lua_isnoneornil(L, 3)) {  /* "tree" or chunk size; not cached */
+    static const char *const hows[] = { "tree", 0 };
+    lua_Integer n = 0;
+    if (lua_type(L, 3) != LUA_TNUMBER) luaL_checkoption(L, 3, 0, hows);
+    else {
+      n = luaL_checkinteger(L, 3);
+      luaL_argcheck(L, n > 0, 3, "chunk size must be positive");
+    }
+    markdown_other(pout, s, len, pretty, n);
+    lua_pushlstring(L, blob_str(pout), blob_len(pout));
+    blob_free(pout);
+    return 1;
+  }
+  key = cache_key("markdown", pretty, s, len);
+  links = getcollector(L, LINKS_REGKEY);
+  text = getcollector(L, SEARCH_REGKEY);
+  if (links || text) {  /* in a build: links and text, cached alongside */
+    uint64_t lkey = cache_key("mkdnlinks", pretty, s, len);
+    uint64_t tkey = cache_key("mkdntext", pretty, s, len);
+    Blob found = BLOB_INIT, plain = BLOB_INIT;
+    if (!cache_get(key, pout) || (links && !cache_get(lkey, &found)) ||
+        (text && !cache_get(tkey, &plain))) {
+      log_trace("calling mkdnhtml_collect()");
+      blob_clear(pout);
+      blob_clear(&found);
+      blob_clear(&plain);
+      mkdnhtml_collect(pout, s, len, 0, pretty, links ? &found : 0,
+                       text ? &plain : 0);
+      cache_put(key, blob_str(pout), blob_len(pout));
+      if (links) cache_put(lkey, blob_str(&found), blob_len(&found));
+      if (text) cache_put(tkey, blob_str(&plain), blob_len(&plain));
+    }
+    if (links) blob_add(links, &found);
+    if (text) blob_add(text, &plain);
+    blob_free(&found);
+    blob_free(&plain);
+  }
+  else if (!cache_get(key, pout)) {
+    log_trace("calling mkdnhtml()");
+    mkdnhtml(pout, s, len, 0, pretty);
+    cache_put(key, blob_str(pout), blob_len(pout));
+  }
 
   s = blob_str(pout);
   len = blob_len(pout);
@@ -717,6 +998,339 @@ jot_markdown(lua_State *L)
 }
 
 
+/** jot.links(html): collect links and ids for the link checker;
+    outside of builds, return the links found (for testing) */
+static int
+jot_links(lua_State *L)
+{
+  size_t len, i, n = 0;
+  const char *s = luaL_checklstring(L, 1, &len);
+  Blob *links = getcollector(L, LINKS_REGKEY), found = BLOB_INIT;
+  if (links) {
+    links_scan(links, s, len);
+    return 0;
+  }
+  links_scan(&found, s, len);
+  lua_newtable(L);
+  for (i = 0; i < blob_len(&found); i += strlen(blob_str(&found) + i) + 1)
+    if (blob_str(&found)[i] == 'L') {
+      lua_pushstring(L, blob_str(&found) + i + 1);
+      lua_rawseti(L, -2, ++n);
+    }
+  blob_free(&found);
+  return 1;
+}
+
+
+/** jot.asset(name): URL of the named bundle, or nil */
+static int
+jot_asset(lua_State *L)
+{
+  const char *url = assets_get(luaL_checkstring(L, 1));
+  if (url) lua_pushstring(L, url);
+  else lua_pushnil(L);
+  return 1;
+}
+
+
+/** jot.gzip(data): string, data in a gzip file (as build -z writes) */
+static int
+jot_gzip(lua_State *L)
+{
+  Blob blob = BLOB_INIT;
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  if (deflate_gzip(&blob, s, len) < 0) {
+    blob_free(&blob);
+    return luaL_error(L, "out of memory");
+  }
+  lua_pushlstring(L, blob_str(&blob), blob_len(&blob));
+  blob_free(&blob);
+  return 1;
+}
+
+
+/** jot.minify(text [, kind]): string; kind html (default), css, js */
+static int
+jot_minify(lua_State *L)
+{
+  static const char *const kinds[] = { "html", "css", "js", 0 };
+  static void (*const funcs[])(Blob *, const char *, size_t) = {
+    minify_html, minify_css, minify_js };
+  Blob blob = BLOB_INIT;
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  int kind = luaL_checkoption(L, 2, "html", kinds);
+  funcs[kind](&blob, s, len);
+  lua_pushlstring(L, blob_str(&blob), blob_len(&blob));
+  blob_free(&blob);
+  return 1;
+}
+
+
+static void
+setfield(const char *key, size_t klen, const char *value, size_t vlen, void *ud)
+{
+  lua_State *L = ud;
+  lua_pushlstring(L, key, klen);
+  lua_pushlstring(L, value, vlen);
+  lua_rawset(L, -3);
+}
+
+
+/** jot.frontmatter(fn): table offset | nil errmsg */
+static int
+jot_frontmatter(lua_State *L)
+{
+  Blob header = BLOB_INIT;
+  const char *fn = luaL_checkstring(L, 1);
+  const char *s;
+  size_t offset, len;
+  int r;
+
+  trace_begin("io", "frontmatter", fn);
+  r = frontmatter_read(fn, &header, &offset);
+  trace_end();
+  if (r < 0) {
+    blob_free(&header);
+    return failed(L, "%s: %s", fn, strerror(errno));
+  }
+
+  s = blob_str(&header);
+  len = blob_len(&header);
+  while (len > 0 && isspace((unsigned char) *s)) s++, len--;
+
+  if (len > 0 && *s == '{') {
+    /* a Lua table: evaluate in an empty environment */
+    Blob code = BLOB_INIT;
+    blob_addstr(&code, "return ");
+    blob_addbuf(&code, s, len);
+    r = luaL_loadbufferx(L, blob_str(&code), blob_len(&code), fn, "t");
+    blob_free(&code);
+    if (r == LUA_OK) {
+      lua_newtable(L);
+      lua_setupvalue(L, -2, 1);  /* _ENV */
+      r = lua_pcall(L, 0, 1, 0);
+    }
+    if (r != LUA_OK || !lua_istable(L, -1)) {
+      blob_free(&header);
+      return failed(L, "%s: front matter: %s", fn,
+        r != LUA_OK ? lua_tostring(L, -1) : "not a table");
+    }
+  }
+  else {
+    lua_newtable(L);
+    frontmatter_parse(s, len, setfield, L);
+  }
+
+  blob_free(&header);
+  lua_pushinteger(L, offset);
+  return 2;
+}
+
+
+/** jot.cache.get(kind, input): string | nil */
+static int
+cache_getitem(lua_State *L)
+{
+  Blob blob = BLOB_INIT;
+  size_t len;
+  const char *kind = luaL_checkstring(L, 1);
+  const char *input = luaL_checklstring(L, 2, &len);
+  if (!cache_get(cache_key(kind, 0, input, len), &blob))
+    return 0;
+  lua_pushlstring(L, blob_str(&blob), blob_len(&blob));
+  blob_free(&blob);
+  return 1;
+}
+
+
+/** jot.cache.put(kind, input, value): true */
+static int
+cache_putitem(lua_State *L)
+{
+  size_t len, vlen;
+  const char *kind = luaL_checkstring(L, 1);
+  const char *input = luaL_checklstring(L, 2, &len);
+  const char *value = luaL_checklstring(L, 3, &vlen);
+  cache_put(cache_key(kind, 0, input, len), value, vlen);
+  return ok(L);
+}
+
+
+/** jot.trace.begin(cat, name, detail?): true */
+static int
+trace_beginspan(lua_State *L)
+{
+  const char *cat = luaL_checkstring(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  const char *detail = luaL_optstring(L, 3, 0);
+  trace_begin(cat, name, detail);
+  return ok(L);
+}
+
+
+/** jot.trace.finish(): true */
+static int
+trace_endspan(lua_State *L)
+{
+  trace_end();
+  return ok(L);
+}
+
+
+/** jot.trace.active(): boolean */
+static int
+trace_isactive(lua_State *L)
+{
+  lua_pushboolean(L, trace_active());
+  return 1;
+}
+
+
+/** push the index record as a table, tags split into a list */
+static void
+pushpageinfo(lua_State *L, const struct pageinfo *info)
+{
+  const char *p, *q, *e;
+  lua_Integer n = 0;
+
+  lua_createtable(L, 0, 8);
+  lua_pushstring(L, info->path);
+  lua_setfield(L, -2, "source");
+  lua_pushstring(L, info->section);
+  lua_setfield(L, -2, "section");
+  lua_pushstring(L, info->title);
+  lua_setfield(L, -2, "title");
+  lua_pushstring(L, info->date);
+  lua_setfield(L, -2, "date");
+  lua_pushinteger(L, (lua_Integer) info->offset);
+  lua_setfield(L, -2, "offset");
+  lua_pushinteger(L, info->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, info->mtime / 1000000000);
+  lua_setfield(L, -2, "mtime");
+
+  lua_newtable(L);
+  for (p = info->tags; *p; p = *e ? e+1 : e) {
+    e = strchr(p, ',');
+    if (!e) e = p + strlen(p);
+    for (q = e; q > p && isspace((unsigned char) q[-1]); q--);
+    while (p < q && isspace((unsigned char) *p)) p++;
+    if (p == q) continue;
+    lua_pushlstring(L, p, q - p);
+    lua_rawseti(L, -2, ++n);
+  }
+  lua_setfield(L, -2, "tags");
+}
+
+
+/** jot.index.open(fn): true | nil errmsg */
+static int
+index_openfile(lua_State *L)
+{
+  const char *fn = luaL_checkstring(L, 1);
+  if (index_open(fn) < 0)
+    return failed(L, "%s: no valid index", fn);
+  taxonomy_update();
+  return ok(L);
+}
+
+
+/** jot.index.count(): number of pages */
+static int
+index_getcount(lua_State *L)
+{
+  lua_pushinteger(L, (lua_Integer) index_count());
+  return 1;
+}
+
+
+/** jot.index.serial(): number that changes with the index */
+static int
+index_getserial(lua_State *L)
+{
+  lua_pushinteger(L, index_serial());
+  return 1;
+}
+
+
+/** jot.index.get(i): table | nil */
+static int
+index_getpage(lua_State *L)
+{
+  struct pageinfo info;
+  lua_Integer i = luaL_checkinteger(L, 1);
+  if (i < 1 || !index_get(i-1, &info)) return 0;
+  pushpageinfo(L, &info);
+  return 1;
+}
+
+
+/** jot.index.find(source): i | nil */
+static int
+index_findpage(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  size_t i;
+  if (!index_find(path, &i)) return 0;
+  lua_pushinteger(L, (lua_Integer) i + 1);
+  return 1;
+}
+
+
+/** jot.index.group(kind): terms, pages | nil errmsg */
+static int
+index_group(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const struct term *terms;
+  const uint32_t *pages;
+  size_t i, n;
+  int kind = taxonomy_kind(name);
+
+  if (kind < 0)
+    return failed(L, "no such taxonomy: %s", name);
+  terms = taxonomy_terms(kind, &n);
+  pages = taxonomy_pages(kind);
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, terms[i].name);
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, (lua_Integer) terms[i].first + 1);
+    lua_setfield(L, -2, "first");
+    lua_pushinteger(L, (lua_Integer) terms[i].count);
+    lua_setfield(L, -2, "count");
+    lua_rawseti(L, -2, (lua_Integer) i + 1);
+  }
+
+  n = n > 0 ? terms[n-1].first + terms[n-1].count : 0;
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, (lua_Integer) pages[i] + 1);
+    lua_rawseti(L, -2, (lua_Integer) i + 1);
+  }
+  return 2;
+}
+
+
+/** jot.index.pages(): list of tables, by source path */
+static int
+index_getpages(lua_State *L)
+{
+  struct pageinfo info;
+  size_t i, n = index_count();
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n && index_get(i, &info); i++) {
+    pushpageinfo(L, &info);
+    lua_rawseti(L, -2, (lua_Integer) i + 1);
+  }
+  return 1;
+}
+
+
 /** jot.checkblob(boolean): true | nil errmsg */
 static int
 jot_checkblob(lua_State *L)
@@ -759,8 +1373,39 @@ static const struct luaL_Reg fslib[] = {
   {"listdir",   fs_listdir   },
   {"walkdir",   fs_walkdir   },
   {"glob",      fs_glob      },
+  {"sync",      fs_sync      },
+  {"hash",      fs_hash      },
+  {"hashmany",  fs_hashmany  },
   {"readfile",  fs_readfile  },
   {"writefile", fs_writefile },
+  {"tar",       fs_tar       },
+  {0, 0}
+};
+
+
+static const struct luaL_Reg cachelib[] = {
+  {"get",       cache_getitem },
+  {"put",       cache_putitem },
+  {0, 0}
+};
+
+
+static const struct luaL_Reg tracelib[] = {
+  {"begin",     trace_beginspan },
+  {"finish",    trace_endspan   },
+  {"active",    trace_isactive  },
+  {0, 0}
+};
+
+
+static const struct luaL_Reg indexlib[] = {
+  {"open",      index_openfile  },
+  {"count",     index_getcount  },
+  {"serial",    index_getserial },
+  {"get",       index_getpage   },
+  {"find",      index_findpage  },
+  {"pages",     index_getpages  },
+  {"group",     index_group     },
   {0, 0}
 };
 
@@ -770,6 +1415,11 @@ static const struct luaL_Reg jotlib[] = {
   {"getenv",    jot_getenv    },
   {"pikchr",    jot_pikchr    },
   {"markdown",  jot_markdown  },
+  {"gzip",      jot_gzip      },
+  {"minify",    jot_minify    },
+  {"asset",     jot_asset     },
+  {"links",     jot_links     },
+  {"frontmatter", jot_frontmatter },
   {"checkblob", jot_checkblob },
   {0, 0}
 };
@@ -799,6 +1449,15 @@ luaopen_jotlib(lua_State *L)
   luaL_newlib(L, fslib);
   lua_setfield(L, -2, "fs");
 
+  luaL_newlib(L, cachelib);
+  lua_setfield(L, -2, "cache");
+
+  luaL_newlib(L, tracelib);
+  lua_setfield(L, -2, "trace");
+
+  luaL_newlib(L, indexlib);
+  lua_setfield(L, -2, "index");
+
   lua_pushstring(L, VERSION);
   lua_setfield(L, -2, "VERSION");
 
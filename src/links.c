@@ -0,0 +1,654 @@
+/* Internal link checker */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "hash.h"
+#include "links.h"
+#include "log.h"
+#include "markdown.h"
+#include "memory.h"
+#include "utils.h"
+
+
+/* Rather than parse the generated HTML again, links are taken
+ * where they are made: the Markdown renderer reports its links
+ * and images, and only HTML written by hand (raw HTML in Markdown,
+ * HTML pages, templates) is scanned for attributes. Each page's
+ * links and ids are kept as one buffer of records, "L" or "A",
+ * then the text, then a NUL; the buffers of pages that were not
+ * rendered carry over from the previous build (LINKS_FILE, see
+ * build.c), so every build checks the whole site.
+ *
+ * The check resolves each link against the page's own path (a
+ * trailing slash means index.html, as does a directory) and looks
+ * it up in a hash set of all outputs; links with a fragment must
+ * also find the id on the target page, if that is a page. Links
+ * with a scheme (http:, mailto:, ...) and protocol-relative ones
+ * are external and not checked, nor are links that still have a
+ * {{tag}} in them (templates, or Markdown before its template is
+ * rendered). */
+
+#define MAGIC "JOTLINKS 1"
+
+struct page {
+  char *path;           /* output path, or template file */
+  char *data;           /* records: L or A, text, NUL */
+  size_t len;
+  bool seen;            /* rendered or kept in this build */
+  bool template;
+};
+
+struct slot {
+  const char *key;      /* null if empty */
+  size_t len;
+  size_t value;
+};
+
+struct map {            /* string => size_t, open addressing */
+  MemPool pool;
+  struct slot *slots;
+  size_t nslots;        /* a power of 2 */
+  size_t count;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  Blob pages;           /* array of struct page */
+  size_t npages;
+  struct map bypath;    /* page path => index in pages */
+  struct map outputs;   /* output path => 0 */
+} links = { PTHREAD_MUTEX_INITIALIZER, BLOB_INIT, 0, { POOL_INIT, 0, 0, 0 },
+            { POOL_INIT, 0, 0, 0 } };
+
+
+/* === string map === */
+
+
+static struct slot *
+map_slot(struct map *map, const char *key, size_t len)
+{
+  size_t i = hash64(key, len, 0) & (map->nslots-1);
+  while (map->slots[i].key && (map->slots[i].len != len ||
+         memcmp(map->slots[i].key, key, len)))
+    i = (i + 1) & (map->nslots-1);
+  return &map->slots[i];
+}
+
+
+static const struct slot *
+map_find(struct map *map, const char *key, size_t len)
+{
+  struct slot *p;
+  if (map->count == 0) return 0;
+  p = map_slot(map, key, len);
+  return p->key ? p : 0;
+}
+
+
+/** add key (copied) with value, or update its value */
+static bool
+map_put(struct map *map, const char *key, size_t len, size_t value)
+{
+  struct slot *p;
+
+  if (2 * (map->count+1) > map->nslots) {
+    struct slot *old = map->slots;
+    size_t i, n = map->nslots;
+    map->nslots = n ? 2 * n : 256;
+    map->slots = calloc(map->nslots, sizeof(*map->slots));
+    if (!map->slots) {
+      map->slots = old;
+      map->nslots = n;
+      return false;
+    }
+    for (i = 0; i < n; i++)
+      if (old[i].key)
+        *map_slot(map, old[i].key, old[i].len) = old[i];
+    free(old);
+  }
+
+  p = map_slot(map, key, len);
+  if (!p->key) {
+    if (!map->pool.alloc) mem_pool_init(&map->pool, 0);
+    p->key = mem_pool_dup(&map->pool, key, len);
+    if (!p->key) return false;
+    p->len = len;
+    map->count++;
+  }
+  p->value = value;
+  return true;
+}
+
+
+static void
+map_free(struct map *map)
+{
+  free(map->slots);
+  map->slots = 0;
+  map->nslots = map->count = 0;
+  mem_pool_free(&map->pool);
+}
+
+
+/* === collecting === */
+
+
+static void
+addrecord(Blob *buf, char type, const char *s, size_t len)
+{
+  size_t i, start;
+  if (!buf || len == 0) return;
+  blob_addchar(buf, type);
+  start = blob_len(buf);
+  blob_addbuf(buf, s, len);
+  for (i = start; i < blob_len(buf); i++)  /* one record per line */
+    if (blob_str(buf)[i] == '\n' || blob_str(buf)[i] == '\0')
+      ((char *) blob_buf(buf))[i] = ' ';
+  blob_addchar(buf, '\0');
+}
+
+
+void
+links_addhref(Blob *buf, const char *href, size_t len)
+{
+  addrecord(buf, 'L', href, len);
+}
+
+
+void
+links_addid(Blob *buf, const char *id, size_t len)
+{
+  addrecord(buf, 'A', id, len);
+}
+
+
+#define ISWS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f')
+
+
+/** add attribute value, with character references decoded */
+static void
+addvalue(Blob *buf, char type, const char *s, size_t len)
+{
+  Blob tmp = BLOB_INIT;
+  if (!memchr(s, '&', len)) {
+    addrecord(buf, type, s, len);
+    return;
+  }
+  mkdnhtml_unescape(&tmp, s, len);
+  addrecord(buf, type, blob_str(&tmp), blob_len(&tmp));
+  blob_free(&tmp);
+}
+
+
+void
+links_scan(Blob *buf, const char *html, size_t len)
+{
+  const char *p = html, *end = html + len, *name, *v;
+  size_t n, vlen;
+  char type;
+
+  if (!buf) return;
+  while ((p = memchr(p, '<', end - p))) {
+    p++;
+    if (p < end && *p == '!') continue;  /* comment, doctype */
+    /* tag name and attributes up to the end of the tag */
+    while (p < end && *p != '>' && *p != '<') {
+      while (p < end && (ISWS(*p) || *p == '/')) p++;
+      name = p;
+      while (p < end && !ISWS(*p) && *p != '=' && *p != '>' && *p != '<') p++;
+      n = p - name;
+      while (p < end && ISWS(*p)) p++;
+      if (p >= end || *p != '=') continue;
+      for (p++; p < end && ISWS(*p); p++);
+      if (p < end && (*p == '"' || *p == '\'')) {
+        const char *q = memchr(p+1, *p, end - (p+1));
+        v = p + 1;
+        vlen = (q ? q : end) - v;
+        p = q ? q + 1 : end;
+      }
+      else {
+        v = p;
+        while (p < end && !ISWS(*p) && *p != '>') p++;
+        vlen = p - v;
+      }
+      if ((n == 4 && !strnicmp(name, "href", 4)) || (n == 3 && !strnicmp(name, "src", 3)))
+        type = 'L';
+      else if ((n == 2 && !strnicmp(name, "id", 2)) || (n == 4 && !strnicmp(name, "name", 4)))
+        type = 'A';
+      else continue;
+      addvalue(buf, type, v, vlen);
+    }
+  }
+}
+
+
+/* === pages === */
+
+
+#define PAGES ((struct page *) blob_buf(&links.pages))
+
+
+/** the page for path, added if new; null if out of memory */
+static struct page *
+getpage(const char *path, bool template)
+{
+  const struct slot *slot = map_find(&links.bypath, path, strlen(path));
+  struct page *page;
+
+  if (slot) return &PAGES[slot->value];
+  page = blob_prepare(&links.pages, sizeof(*page));
+  if (!page) return 0;
+  memset(page, 0, sizeof(*page));
+  page->path = strcopy(path);
+  if (!page->path || !map_put(&links.bypath, path, strlen(path), links.npages)) {
+    free(page->path);
+    return 0;
+  }
+  page->template = template;
+  blob_addlen(&links.pages, sizeof(*page));
+  return &PAGES[links.npages++];
+}
+
+
+static void
+setpage(const char *path, const char *data, size_t len, bool template)
+{
+  struct page *page;
+  char *copy = malloc(len ? len : 1);
+
+  pthread_mutex_lock(&links.lock);
+  page = copy ? getpage(path, template) : 0;
+  if (!page) {
+    log_warn("links: out of memory");
+    free(copy);
+  }
+  else {
+    free(page->data);
+    memcpy(copy, data, len);
+    page->data = copy;
+    page->len = len;
+    page->seen = true;
+  }
+  pthread_mutex_unlock(&links.lock);
+}
+
+
+void
+links_page(const char *path, const char *data, size_t len)
+{
+  assert(path != NULL && (data != NULL || len == 0));
+  setpage(path, data, len, false);
+}
+
+
+void
+links_template(const char *path, const char *data, size_t len)
+{
+  assert(path != NULL && (data != NULL || len == 0));
+  setpage(path, data, len, true);
+}
+
+
+void
+links_keep(const char *path)
+{
+  const struct slot *slot;
+  pthread_mutex_lock(&links.lock);
+  slot = map_find(&links.bypath, path, strlen(path));
+  if (slot) PAGES[slot->value].seen = true;
+  pthread_mutex_unlock(&links.lock);
+}
+
+
+void
+links_output(const char *path)
+{
+  pthread_mutex_lock(&links.lock);
+  if (!map_put(&links.outputs, path, strlen(path), 0))
+    log_warn("links: out of memory");
+  pthread_mutex_unlock(&links.lock);
+}
+
+
+void
+links_begin(void)
+{
+  size_t i;
+  pthread_mutex_lock(&links.lock);
+  map_free(&links.outputs);
+  for (i = 0; i < links.npages; i++)
+    PAGES[i].seen = false;
+  pthread_mutex_unlock(&links.lock);
+}
+
+
+/** drop pages not seen in this build (gone), rebuild the index */
+static void
+compact(void)
+{
+  struct page *pages = PAGES;
+  size_t i, n = 0;
+
+  map_free(&links.bypath);
+  for (i = 0; i < links.npages; i++) {
+    if (!pages[i].seen) {
+      free(pages[i].path);
+      free(pages[i].data);
+      continue;
+    }
+    pages[n] = pages[i];
+    map_put(&links.bypath, pages[n].path, strlen(pages[n].path), n);
+    n++;
+  }
+  links.npages = n;
+  blob_trunc(&links.pages, n * sizeof(*pages));
+}
+
+
+void
+links_free(void)
+{
+  size_t i;
+  for (i = 0; i < links.npages; i++) {
+    free(PAGES[i].path);
+    free(PAGES[i].data);
+  }
+  blob_free(&links.pages);
+  links.npages = 0;
+  map_free(&links.bypath);
+  map_free(&links.outputs);
+}
+
+
+/* === checking === */
+
+
+static int
+hexval(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+/** true iff href has a scheme (like http:) or starts with // */
+static bool
+isexternal(const char *href, size_t len)
+{
+  size_t i;
+  if (len >= 2 && href[0] == '/' && href[1] == '/') return true;
+  for (i = 0; i < len && isAlpha(href[i]); i++);
+  if (i == 0) return false;
+  for (; i < len && (isAlnum(href[i]) || href[i] == '+' ||
+         href[i] == '-' || href[i] == '.'); i++);
+  return i < len && href[i] == ':';
+}
+
+
+/** append path segment s (percent-decoded) to the path in buf,
+    resolving "." and ".."; false if ".." goes above the root */
+static bool
+addsegment(Blob *buf, const char *s, size_t len)
+{
+  size_t i;
+
+  if (len == 0 || (len == 1 && s[0] == '.')) return true;
+  if (len == 2 && s[0] == '.' && s[1] == '.') {
+    if (blob_len(buf) == 0) return false;
+    for (i = blob_len(buf); i > 0 && blob_str(buf)[i-1] != '/'; i--);
+    blob_trunc(buf, i > 0 ? i-1 : 0);
+    return true;
+  }
+  if (blob_len(buf) > 0) blob_addchar(buf, '/');
+  for (i = 0; i < len; i++) {
+    if (s[i] == '%' && i + 2 < len && hexval(s[i+1]) >= 0 &&
+        hexval(s[i+2]) >= 0) {
+      blob_addchar(buf, (char) (hexval(s[i+1]) * 16 + hexval(s[i+2])));
+      i += 2;
+    }
+    else blob_addchar(buf, s[i]);
+  }
+  return true;
+}
+
+
+/** resolve href on the page at base to an output path in target
+    and a fragment; 1 if done, 0 if not ours to check (external,
+    or a template's own "#id"), -1 if it leaves the site */
+static int
+resolve(const struct page *page, const char *href, size_t len,
+        Blob *target, const char **pfrag, size_t *pfraglen)
+{
+  const char *hash, *query, *p, *end, *seg;
+  size_t n;
+
+  blob_clear(target);
+  if (isexternal(href, len)) return 0;
+  if (memchr(href, '{', len)) return 0;  /* {{tag}}, made later or never */
+
+  hash = memchr(href, '#', len);
+  *pfrag = hash ? hash + 1 : href + len;
+  *pfraglen = hash ? (size_t) (href + len - hash - 1) : 0;
+  n = hash ? (size_t) (hash - href) : len;
+  query = memchr(href, '?', n);
+  if (query) n = query - href;
+
+  if (n == 0) {  /* this page */
+    if (page->template) return 0;
+    blob_addstr(target, page->path);
+    return 1;
+  }
+
+  p = href;
+  end = href + n;
+  if (*p == '/') p++;
+  else if (!page->template) {  /* relative to the page's directory */
+    const char *slash = strrchr(page->path, '/');
+    if (slash) blob_addbuf(target, page->path, slash - page->path);
+  }
+  while (p < end) {
+    seg = p;
+    while (p < end && *p != '/') p++;
+    if (!addsegment(target, seg, p - seg)) return -1;
+    if (p < end) p++;
+  }
+  if (end[-1] == '/' || blob_len(target) == 0)
+    addsegment(target, "index.html", 10);
+  return 1;
+}
+
+
+/** true iff target is an output, or a directory with index.html
+    (then target is changed to that) */
+static bool
+isoutput(Blob *target)
+{
+  if (map_find(&links.outputs, blob_str(target), blob_len(target)))
+    return true;
+  blob_addstr(target, "/index.html");
+  return map_find(&links.outputs, blob_str(target), blob_len(target)) != 0;
+}
+
+
+static int
+pagecmp(const void *a, const void *b)
+{
+  const struct page *const *p = a, *const *q = b;
+  return strcmp((*p)->path, (*q)->path);
+}
+
+
+int
+links_check(void)
+{
+  struct map anchors = { POOL_INIT, 0, 0, 0 };
+  Blob key = BLOB_INIT, target = BLOB_INIT, sorted = BLOB_INIT;
+  const struct page **pv;
+  const char *rec, *end, *frag;
+  size_t i, len, fraglen;
+  int r, nlinks = 0, nbroken = 0;
+
+  pthread_mutex_lock(&links.lock);
+  compact();
+
+  /* ids: "path#id" for pages, "#id" for templates (all pages) */
+  for (i = 0; i < links.npages; i++) {
+    const struct page *page = &PAGES[i];
+    for (rec = page->data, end = rec + page->len; rec < end; rec += len + 2) {
+      len = strlen(rec+1);
+      if (*rec != 'A') continue;
+      blob_clear(&key);
+      if (!page->template) blob_addstr(&key, page->path);
+      blob_addchar(&key, '#');
+      blob_addbuf(&key, rec+1, len);
+      map_put(&anchors, blob_str(&key), blob_len(&key), 0);
+    }
+  }
+
+  pv = blob_prepare(&sorted, links.npages * sizeof(*pv));
+  for (i = 0; pv && i < links.npages; i++)
+    pv[i] = &PAGES[i];
+  if (pv) qsort(pv, links.npages, sizeof(*pv), pagecmp);
+
+  for (i = 0; pv && i < links.npages; i++) {
+    const struct page *page = pv[i];
+    for (rec = page->data, end = rec + page->len; rec < end; rec += len + 2) {
+      len = strlen(rec+1);
+      if (*rec != 'L') continue;
+      r = resolve(page, rec+1, len, &target, &frag, &fraglen);
+      if (r == 0) continue;
+      nlinks++;
+      if (r < 0 || !isoutput(&target)) {
+        log_warn("%s: broken link %s", page->path, rec+1);
+        nbroken++;
+        continue;
+      }
+      if (fraglen == 0 || !map_find(&links.bypath, blob_str(&target), blob_len(&target)))
+        continue;  /* no anchor, or not a page */
+      blob_clear(&key);
+      blob_addchar(&key, '#');
+      blob_addbuf(&key, frag, fraglen);
+      if (map_find(&anchors, blob_str(&key), blob_len(&key))) continue;
+      blob_clear(&key);
+      blob_add(&key, &target);
+      blob_addchar(&key, '#');
+      blob_addbuf(&key, frag, fraglen);
+      if (map_find(&anchors, blob_str(&key), blob_len(&key))) continue;
+      log_warn("%s: no anchor for link %s", page->path, rec+1);
+      nbroken++;
+    }
+  }
+  pthread_mutex_unlock(&links.lock);
+
+  log_debug("links: checked %d internal links of %zu pages, %d broken",
+    nlinks, links.npages, nbroken);
+  map_free(&anchors);
+  blob_free(&key);
+  blob_free(&target);
+  blob_free(&sorted);
+  return nbroken;
+}
+
+
+/* === persistence === */
+
+
+int
+links_save(const char *fn)
+{
+  Blob tmp = BLOB_INIT;
+  const char *rec, *end;
+  size_t i, len;
+  FILE *fp;
+
+  assert(fn != NULL);
+  blob_addfmt(&tmp, "%s.tmp", fn);
+  fp = fopen(blob_str(&tmp), "wb");
+  if (!fp) goto fail;
+
+  fprintf(fp, "%s\n", MAGIC);
+  pthread_mutex_lock(&links.lock);
+  for (i = 0; i < links.npages; i++) {
+    const struct page *page = &PAGES[i];
+    if (page->template || !page->seen) continue;
+    fprintf(fp, "P %s\n", page->path);
+    for (rec = page->data, end = rec + page->len; rec < end; rec += len + 2) {
+      len = strlen(rec+1);
+      fprintf(fp, "%c %s\n", *rec, rec+1);
+    }
+  }
+  pthread_mutex_unlock(&links.lock);
+
+  if (ferror(fp)) {
+    fclose(fp);
+    goto fail;
+  }
+  if (fclose(fp) != 0 || rename(blob_str(&tmp), fn) < 0) goto fail;
+  blob_free(&tmp);
+  return SUCCESS;
+
+fail:
+  log_warn("links: cannot write %s: %s", fn, strerror(errno));
+  remove(blob_str(&tmp));
+  blob_free(&tmp);
+  return FAILSOFT;
+}
+
+
+int
+links_load(const char *fn)
+{
+  Blob line = BLOB_INIT, data = BLOB_INIT, path = BLOB_INIT;
+  FILE *fp;
+  int c;
+  bool ok = false;
+
+  assert(fn != NULL);
+  if (links.npages > 0) return SUCCESS;  /* have them in memory */
+  fp = fopen(fn, "rb");
+  if (!fp) {
+    if (errno != ENOENT) log_warn("links: cannot read %s: %s", fn, strerror(errno));
+    return FAILSOFT;
+  }
+
+  for (;;) {
+    blob_clear(&line);
+    while ((c = getc(fp)) != EOF && c != '\n')
+      blob_addchar(&line, (char) c);
+    if (c == EOF && blob_len(&line) == 0) break;
+    if (!ok) {  /* first line */
+      ok = !strcmp(blob_str(&line), MAGIC);
+      if (!ok) break;
+      continue;
+    }
+    if (blob_len(&line) < 2 || blob_str(&line)[1] != ' ') continue;
+    if (blob_str(&line)[0] == 'P') {
+      if (blob_len(&path) > 0)
+        setpage(blob_str(&path), blob_str(&data), blob_len(&data), false);
+      blob_clear(&path);
+      blob_addstr(&path, blob_str(&line) + 2);
+      blob_clear(&data);
+    }
+    else addrecord(&data, blob_str(&line)[0], blob_str(&line) + 2,
+                   blob_len(&line) - 2);
+  }
+  if (blob_len(&path) > 0)
+    setpage(blob_str(&path), blob_str(&data), blob_len(&data), false);
+  fclose(fp);
+
+  links_begin();  /* nothing seen yet */
+  blob_free(&line);
+  blob_free(&data);
+  blob_free(&path);
+  return ok ? SUCCESS : FAILSOFT;
+}
@@ -0,0 +1,45 @@
+#ifndef LINKS_H
+#define LINKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "blob.h"
+
+/* Internal link checker: links and anchors (ids) of all pages,
+ * collected while rendering, checked against the set of outputs
+ * at the end of a build; process-wide, thread-safe */
+
+#define LINKS_REGKEY "jot.links"  /* Lua registry: Blob for links */
+
+void links_addhref(Blob *buf, const char *href, size_t len);
+void links_addid(Blob *buf, const char *id, size_t len);
+void links_scan(Blob *buf, const char *html, size_t len);
+
+int links_load(const char *fn);
+void links_begin(void);
+void links_output(const char *path);
+void links_page(const char *path, const char *data, size_t len);
+void links_keep(const char *path);
+void links_template(const char *path, const char *data, size_t len);
+int links_check(void);
+int links_save(const char *fn);
+void links_free(void);
+
+/* Usage: while a page renders, links_addhref() and links_addid()
+   collect its links and ids into a buffer (the Markdown renderer
+   does so for links and images, links_scan() for the href, src,
+   id, and name attributes of HTML); a build calls links_begin(),
+   then links_output() for every file it writes or keeps, and for
+   each page links_page() with its output path and the buffer, or
+   links_keep() if the page was up to date (its links are kept from
+   the previous build, as restored by links_load()); templates go
+   in with links_template(), their links are relative to the site
+   root and their ids count for all pages; links_check() logs all
+   broken internal links and anchors and returns their number;
+   links_save() writes the pages' links for the next build; while
+   a build renders a page, LINKS_REGKEY in the Lua registry is a
+   light userdata, the Blob that jot.markdown() and jot.links()
+   collect into */
+
+#endif
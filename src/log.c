@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200112L  /* for localtime_r(3) */
 
 #include <assert.h>
 #include <stdarg.h>
@@ -160,8 +161,9 @@ log_log(int level, const char *file, int line, const char *fmt, ...)
     .level = level, .fmt = fmt, .file = file, .line = line
   };
 
+  struct tm tm;
   time_t t = time(0);
-  evt.time = localtime(&t);
+  evt.time = localtime_r(&t, &tm);  /* reentrant: we log from threads */
   evt.userdata = 0;
 
   if (!Log.quiet && level >= Log.threshold) {
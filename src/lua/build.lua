@@ -0,0 +1,435 @@
+-- site building: setup() once per Lua state (build worker),
+-- then page() for each page to render; the C side walks the
+-- source tree, hands out pages, and writes the results; page()
+-- also returns the files it read, for incremental builds
+
+local jot = require "jotlib"
+local log = jot.log
+local path = jot.path
+local fs = jot.fs
+local lustache = require "lustache"
+
+local M = {}
+
+local site = {}       -- exposed to templates as {{site.*}}
+local partials = {}   -- partial name => template text
+local partialfiles = {}  -- partial name => file name
+local layouts = {}    -- layout name => template text (or false)
+local inputs          -- files read by the current page (list and set)
+local bundles = {}    -- bundle name (as in asset.*) => its files
+
+
+local function record(fn)
+  if inputs and not inputs[fn] then
+    inputs[fn] = true
+    inputs[#inputs+1] = fn
+  end
+end
+
+
+local function readfile(fn, offset)
+  return assert(fs.readfile(fn, offset))
+end
+
+
+local function stripext(fn)
+  return fn:match("^(.+)%.[^./]*$") or fn
+end
+
+
+-- load the config file (Lua code) into its own table
+local function loadconfig(fn)
+  local config = setmetatable({}, { __index = _G })
+  assert(loadfile(fn, "t", config))()
+  return setmetatable(config, nil)
+end
+
+
+-- load data/* into a table: Lua files by their return value,
+-- anything else as a string; keyed by name without extension;
+-- return a proxy that records which files a page accesses
+local function loaddata(dir)
+  local data, files = {}, {}
+  if fs.exists(dir, "directory") then
+    files = fs.glob({}, path.join(dir, "*"))
+    table.sort(files)
+  end
+  for i, fn in ipairs(files) do
+    local name = stripext(path.basename(fn))
+    if path.match("*.lua", path.basename(fn)) then
+      data[name] = assert(loadfile(fn))()
+    else
+      data[name] = readfile(fn)
+    end
+    files[name], files[i] = fn, nil
+  end
+  return setmetatable({}, {
+    __index = function(_, name)
+      if files[name] then record(files[name]) end
+      return data[name]
+    end,
+    __pairs = function()
+      record(dir)  -- also depends on the list of data files
+      for _, fn in pairs(files) do record(fn) end
+      return next, data, nil
+    end
+  })
+end
+
+
+-- load partials/** keyed by relative path, with and without extension;
+-- return the table of texts and the table of file names
+local function loadpartials(dir)
+  local t, files = {}, {}
+  if not fs.exists(dir, "directory") then return t, files end
+  for _, fn in ipairs(fs.glob({}, path.join(dir, "**"))) do
+    if fn:sub(-1) ~= "/" then  -- skip directories
+      local rel = fn:sub(#dir+2)
+      local text = readfile(fn)
+      t[rel] = text
+      t[stripext(rel)] = text
+      files[rel] = fn
+      files[stripext(rel)] = fn
+    end
+  end
+  return t, files
+end
+
+
+-- site.pages: all pages from the site index (front matter only),
+-- made into tables once per index update; a page that looks at
+-- them depends on the index (which changes when any page does)
+local INDEX_FILE = ".jot-index"
+local pages, serial
+local groups = {}     -- taxonomy kind => list of terms
+
+local function getpages()
+  if serial ~= jot.index.serial() then
+    pages, serial = jot.index.pages(), jot.index.serial()
+    groups = {}
+    for _, page in ipairs(pages) do
+      local src = page.source
+      local rel = src:sub(#site.source+2)
+      if src:sub(1, #site.source+1) ~= site.source .. "/" then
+        rel = src:match("^[^/]*/(.*)$") or src  -- drafts
+      end
+      if path.match("**/*.md", src) then rel = stripext(rel) .. ".html" end
+      page.path = rel
+      page.url = "/" .. rel
+    end
+  end
+  record(INDEX_FILE)
+  return pages
+end
+
+
+-- a view is a list of count pages, order[first..first+count-1]
+-- being their indices in site.pages; it copies nothing, so is
+-- cheap to make for every term and pager; view.pagers splits it
+-- into pagers of site.config.paginate (default 10) items each;
+-- numbers as strings work, too, for {{list.pagers.2.items}}
+local makeview
+
+local function makepagers(order, first, count)
+  local size = tonumber(site.config.paginate) or 10
+  local n = math.max(1, (count + size - 1) // size)
+  local pagers = {}
+  for k = 1, n do
+    local ofs = (k-1) * size
+    pagers[k] = {
+      number = k, total = n, first = k == 1, last = k == n,
+      newer = k > 1 and k-1 or nil, older = k < n and k+1 or nil,
+      items = makeview(order, first + ofs, math.min(size, count - ofs)),
+    }
+  end
+  return setmetatable(pagers, {
+    __index = function(t, k) return rawget(t, tonumber(k)) end
+  })
+end
+
+function makeview(order, first, count)
+  local pagers
+  return setmetatable({}, {
+    __index = function(_, k)
+      if k == "pagers" then
+        pagers = pagers or makepagers(order, first, count)
+        return pagers
+      end
+      local i = math.tointeger(tonumber(k))
+      if i and i >= 1 and i <= count then
+        return getpages()[order[first+i-1]]
+      end
+    end,
+    __len = function() return count end,
+    __pairs = function(t)
+      return function(_, i)
+        if i < count then return i+1, t[i+1] end
+      end, t, 0
+    end
+  })
+end
+
+
+-- terms of a taxonomy (section, tag, year, month; see taxonomy.c),
+-- sorted by name, also accessible by name; each with its pages
+local function getgroup(kind)
+  getpages()  -- current index, recorded as input
+  if not groups[kind] then
+    local terms, order = assert(jot.index.group(kind))
+    local byname = {}
+    for _, term in ipairs(terms) do
+      term.pages = makeview(order, term.first, term.count)
+      byname[term.name] = term
+    end
+    groups[kind] = setmetatable(terms, {
+      __index = function(t, k) return byname[k] or rawget(t, tonumber(k)) end
+    })
+  end
+  return groups[kind]
+end
+
+local listings = {
+  pages = getpages,
+  sections = function() return getgroup("section") end,
+  tags = function() return getgroup("tag") end,
+  years = function() return getgroup("year") end,
+  months = function() return getgroup("month") end,
+  recent = function()  -- all pages, newest first
+    local all = getgroup("date")[1]
+    return all and all.pages or makeview({}, 1, 0)
+  end,
+}
+
+setmetatable(site, {
+  __index = function(_, name)
+    local get = listings[name]
+    if get then return get() end
+  end
+})
+
+
+-- config.bundles maps bundle names (like "site.css") to lists
+-- of files in static/; the build concatenates, minifies, and
+-- writes them under a name with their content hash, and the
+-- template says {{asset.site_css}} to get its URL (a page that
+-- does depends on the bundle's files)
+local function loadbundles(config)
+  local t = {}
+  for name, files in pairs(config or {}) do
+    local list = {}
+    for i, fn in ipairs(files) do list[i] = path.join("static", fn) end
+    t[(tostring(name):gsub("[^%w]", "_"))] = list
+    t[#t+1] = { name = tostring(name), files = list }
+  end
+  table.sort(t, function(a, b) return a.name < b.name end)
+  return t
+end
+
+local asset = setmetatable({}, {
+  __index = function(_, name)
+    local files = bundles[(tostring(name):gsub("[^%w]", "_"))]
+    for _, fn in ipairs(files or {}) do record(fn) end
+    return jot.asset(name)
+  end
+})
+
+
+-- lustache caches compiled partials, so record partial
+-- usage where the renderer looks them up, not in the table
+local renderer = lustache.renderer
+local renderpartial = renderer._partial
+function renderer:_partial(name, ...)
+  -- if there is none (yet), the directory it would go into
+  record(partialfiles[name] or path.dirname(path.join("partials", name)))
+  return renderpartial(self, name, ...)
+end
+
+
+-- lustache parses templates into token trees, one table per
+-- character of text; keep these trees in the build cache (as
+-- Lua source) so that unchanged templates skip the parser
+local function serialize(t, buf)
+  buf[#buf+1] = "{"
+  for k, v in pairs(t) do
+    buf[#buf+1] = type(k) == "number" and "[" .. k .. "]=" or "[" .. string.format("%q", k) .. "]="
+    if type(v) == "table" then serialize(v, buf)
+    else buf[#buf+1] = string.format("%q", v) end
+    buf[#buf+1] = ","
+  end
+  buf[#buf+1] = "}"
+  return buf
+end
+
+local parsetemplate = renderer.parse
+function renderer:parse(template, tags)
+  local key = table.concat(tags or self.tags, " ") .. "\n" .. template
+  local code = jot.cache.get("template", key)
+  local chunk = code and load(code, "=template", "t", {})
+  if chunk then return chunk() end
+  local tokens = parsetemplate(self, template, tags)
+  jot.cache.put("template", key, "return " .. table.concat(serialize(tokens, {})))
+  return tokens
+end
+
+
+-- with --trace, show template compile and render as spans;
+-- a span is finished on error, too, so later ones do not nest
+if jot.trace.active() then
+  local trace = jot.trace
+  local compile, render = renderer.compile, renderer.render
+  local function finish(ok, ...)
+    trace.finish()
+    if not ok then error(..., 0) end
+    return ...
+  end
+  function renderer:compile(...)
+    trace.begin("template", "compile")
+    return finish(pcall(compile, self, ...))
+  end
+  function renderer:render(...)
+    trace.begin("template", "render")
+    return finish(pcall(render, self, ...))
+  end
+end
+
+
+-- get layout by name from layouts/, false if there is none
+-- (recorded anyway: creating it makes the page out of date)
+local function getlayout(name)
+  local layout = layouts[name]
+  local fn = path.join("layouts", name .. ".html")
+  if layout == nil then
+    layout = fs.exists(fn, "file") and readfile(fn) or false
+    layouts[name] = layout
+  end
+  record(fn)
+  return layout
+end
+
+
+function M.setup(opts)
+  log.debug("build setup: config=" .. opts.config)
+  site.config = loadconfig(opts.config)
+  site.source = opts.source
+  site.target = opts.target
+  site.drafts = opts.drafts
+
+  -- run init scripts in name order
+  if fs.exists("init", "directory") then
+    local files = fs.glob({}, "init/*.lua")
+    table.sort(files)
+    for _, fn in ipairs(files) do
+      log.debug("running " .. fn)
+      assert(loadfile(fn))()
+    end
+  end
+
+  site.data = loaddata("data")
+  bundles = loadbundles(site.config.bundles)
+  partials, partialfiles = loadpartials("partials")
+  layouts = {}
+end
+
+
+-- settings for the sitemap and feeds, which the build writes
+-- from the site index after the pages (see feeds.c); nil if the
+-- config has no baseurl; config.feeds may set the file names
+-- (false for none), the number of entries, and a section
+function M.feeds()
+  local config = site.config
+  if not config.baseurl then return nil end
+  local feeds = config.feeds or {}
+  local function name(value, default)
+    if value == nil then return default end
+    return value or nil
+  end
+  return {
+    baseurl = (tostring(config.baseurl):gsub("/+$", "")),
+    title = config.title,
+    description = config.description,
+    author = config.author,
+    sitemap = name(feeds.sitemap, "sitemap.xml"),
+    rss = name(feeds.rss, "rss.xml"),
+    atom = name(feeds.atom, "atom.xml"),
+    entries = tonumber(feeds.entries) or 20,
+    section = feeds.section,
+  }
+end
+
+
+-- settings for the search index, which the build writes from
+-- the text of all Markdown pages (see search.c); nil unless the
+-- config has search, which may be a table that sets the dir
+function M.search()
+  local search = site.config.search
+  if not search then return nil end
+  if type(search) ~= "table" then search = {} end
+  return { dir = tostring(search.dir or "search"):gsub("^/+", ""):gsub("/+$", "") }
+end
+
+
+-- the bundles to make, a list of { name = ..., files = { ... } }
+-- sorted by name, with file names relative to the site root
+function M.bundles()
+  return table.move(bundles, 1, #bundles, 1, {})
+end
+
+
+-- reload partials and forget layouts (watch mode: templates changed)
+function M.refresh()
+  log.debug("build refresh: reloading templates")
+  partials, partialfiles = loadpartials("partials")
+  layouts = {}
+  renderer:clear_cache()
+end
+
+
+-- render the body of the page at src (rel is relative to its
+-- source dir): Markdown, then mustache; return page and view too
+local function render(src, rel)
+  local page, offset = assert(jot.frontmatter(src))
+  local body = readfile(src, offset)
+  local out = rel
+
+  if path.match("**/*.md", src) then
+    body = jot.markdown(body)
+    out = stripext(rel) .. ".html"
+  end
+
+  page.source = src
+  page.path = out
+  page.url = "/" .. out
+
+  local view = setmetatable({ page = page, site = site, asset = asset },
+    { __index = _G })
+  return lustache:render(body, view, partials), page, view
+end
+
+
+-- render the page at src (rel is relative to its source dir);
+-- return output path (relative to target dir), page text, and
+-- the list of files read (other than src) for the dependency graph
+function M.page(src, rel)
+  inputs = {}
+  local body, page, view = render(src, rel)
+  if page.path == rel then jot.links(body) end  -- HTML: scan for links
+
+  local layout = page.layout ~= "none" and getlayout(page.layout or "default")
+  if layout then
+    view.content = body
+    body = lustache:render(layout, view, partials)
+  end
+
+  local list = table.move(inputs, 1, #inputs, 1, {})
+  inputs = nil
+  return page.path, body, list
+end
+
+
+-- the page at src rendered as for M.page() but without its layout,
+-- for the content of its feed entry
+function M.entry(src, rel)
+  return (render(src, rel))
+end
+
+return M
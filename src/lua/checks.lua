@@ -189,7 +189,7 @@ log.debug(string.format("type %s, size %s, mtime %s",
 assert(fs.rmdir(name))
 
 
-log.info("Checking file system operations: touch, glob, walkdir, remove")
+log.info("Checking file system operations: touch, glob, sync, walkdir, remove")
 local dir = assert(fs.tempdir())
 assert(fs.touch(path.join(dir, "foo")))
 assert(fs.touch(path.join(dir, "bar")))
@@ -219,13 +219,86 @@ assert(t[7] == nil)
 t = fs.glob({}, path.join(dir, "sub", "spam"))
 assert(t[1] == path.join(dir, "sub", "spam"))
 assert(t[2] == nil)
+--mirror with sync: copy all, then nothing, then remove stale:
+local dir2 = assert(fs.tempdir())
+assert(fs.writefile(path.join(dir, "foo"), "some content"))
+assert(fs.touch(path.join(dir2, "stale")))
+local ncopied, nremoved = fs.sync(dir, dir2)
+assert(ncopied == 7 and nremoved == 1)
+assert(fs.readfile(path.join(dir2, "foo")) == "some content")
+local _, written = fs.writefile(path.join(dir2, "foo"), "some ", "content")
+assert(written == false)  -- same content: not written again
+assert(fs.exists(path.join(dir2, "sub/subsub/nested"), "file"))
+ncopied, nremoved = fs.sync(dir, dir2)
+assert(ncopied == 0 and nremoved == 0)
+assert(fs.remove(path.join(dir, "sub", "spam")))
+ncopied, nremoved = fs.sync(dir, dir2)
+assert(ncopied == 0 and nremoved == 1)
+assert(not fs.exists(path.join(dir2, "sub", "spam")))
+assert(not fs.sync(path.join(dir, "foo"), dir2))
+--replacing a file keeps its mode:
+local function mode(fn)
+  local p = assert(io.popen("stat -c %a '" .. fn .. "'"))
+  local s = p:read("l")
+  p:close()
+  return s
+end
+local fn = path.join(dir2, "mode")
+assert(fs.writefile(fn, "old"))
+assert(io.popen("chmod 600 '" .. fn .. "'")):close()
+assert(fs.writefile(fn, "new") and mode(fn) == "600")
+assert(fs.remove(fn))
+--fingerprints, one at a time and batched:
+local h = assert(fs.hash(path.join(dir, "foo")))
+assert(#h == 16 and h == fs.hash(path.join(dir2, "foo")))
+assert(not fs.hash(path.join(dir, "nosuch")))
+t = fs.hashmany{path.join(dir, "foo"), path.join(dir, "nosuch"), path.join(dir, "bar")}
+assert(t[1] == h and t[2] == false and t[3] == fs.hash(path.join(dir, "bar")))
 --and recursively delete by a post-order walk (DP not D):
-for path, type in fs.walkdir(dir) do
-  if type=="F" or type=="DP" or type=="SL" then
-    assert(fs.remove(path))
+for _, d in ipairs{dir, dir2} do
+  for path, type in fs.walkdir(d) do
+    if type=="F" or type=="DP" or type=="SL" then
+      assert(fs.remove(path))
+    end
   end
+  assert(not fs.exists(d))
 end
-assert(not fs.exists(dir))
+
+
+log.info("Checking front matter extraction")
+dir = assert(fs.tempdir())
+local fn = path.join(dir, "page.md")
+assert(fs.writefile(fn, "---\ntitle: Hello \n  x-y : 1\n---\nBody\n"))
+local meta, offset = assert(jot.frontmatter(fn))
+assert(meta.title == "Hello" and meta["x-y"] == "1" and offset == 32)
+assert(fs.readfile(fn, offset) == "Body\n")
+assert(fs.writefile(fn, "---\n{ tags = {'a', 'b'}, n = 2 }\n---\n", ("x"):rep(5000)))
+meta, offset = assert(jot.frontmatter(fn))
+assert(meta.tags[2] == "b" and meta.n == 2 and offset == 37)
+assert(fs.writefile(fn, "---\n{ os.exit() }\n---\n"))
+assert(not jot.frontmatter(fn))  -- empty environment
+assert(fs.writefile(fn, "---\ntitle: " .. ("x"):rep(3000) .. "\n---\n"))
+meta, offset = assert(jot.frontmatter(fn))
+assert(#meta.title == 3000 and offset == 3016)
+assert(fs.writefile(fn, "---\nno: end\n"))
+meta, offset = assert(jot.frontmatter(fn))
+assert(next(meta) == nil and offset == 0)
+assert(fs.writefile(fn, "---\r\ntitle: Crlf\r\n---\r\nBody\r\n"))
+meta, offset = assert(jot.frontmatter(fn))
+assert(meta.title == "Crlf" and offset == 23)
+assert(fs.writefile(fn, "---\ntitle: Eof\n---"))  -- no final newline
+meta, offset = assert(jot.frontmatter(fn))
+assert(meta.title == "Eof" and offset == 18)
+assert(fs.writefile(fn, "---\ntitle: " .. ("x"):rep(1008) .. "\r\n---\r"))
+meta, offset = assert(jot.frontmatter(fn))  -- delimiter across reads
+assert(#meta.title == 1008 and offset == 1025)
+assert(fs.writefile(fn, "---\ntitle: No\n----\n"))
+meta, offset = assert(jot.frontmatter(fn))
+assert(next(meta) == nil and offset == 0)
+assert(not jot.index.open(fn))  -- not an index
+assert(jot.index.count() == 0 and jot.index.get(1) == nil)
+assert(fs.remove(fn))
+assert(fs.rmdir(dir))
 
 
 log.info("Checking Markdown rendering");
@@ -238,6 +311,19 @@ assert(html == [[<h1>Title</h1>
 a <a href="/url">link</a> to <strong>nowhere</strong>.</p>
 ]])
 
+-- link definitions count only in block context, not in code blocks:
+html = jot.markdown("[foo]\n\n```\n[foo]: /fenced\n```\n\n    [foo]: /indented\n")
+assert(not html:find("<a ", 1, true) and html:find("[foo]: /fenced", 1, true))
+html = jot.markdown("[foo]\n\n> - [foo]: /url\n")
+assert(html:find('<a href="/url">foo</a>', 1, true))
+
+-- streaming holds blocks for an undefined label, but not forever:
+mkdn = "a[i]\n\n" .. ("Some text.\n\n"):rep(30000) .. "[i]: /url\n"
+assert(jot.markdown(mkdn):find('<p>a<a href="/url">i</a></p>', 1, true))
+assert(jot.markdown(mkdn, 0, 4096):sub(1, 12) == "<p>a[i]</p>\n")
+mkdn = "a[i]\n\nSome text.\n\n[i]: /url\n"
+assert(jot.markdown(mkdn, 0, 4096) == jot.markdown(mkdn))
+
 mkdnskip = {
   [204]="leave precedence of duplicate link defs undefined",
   [206]="will not case-fold non-ASCII",
@@ -258,7 +344,6 @@ mkdnskip = {
   [93] = "illogical (low priority)",
   [212] = "known bug (medium priority)",
   [213] = "known bug (medium priority)",
-  [218] = "known bug (medium priority)",
   [237] = "illogical (but also a bug)",
   [238] = "illogical (low priority)",
   [312] = "illogical (low priority)",
@@ -272,11 +357,21 @@ last = nil
 function Test(t)
   if first and t.number < first then return end
   if last and t.number > last then return end
+  local r = jot.markdown(t.input, 256)
+  -- syntax tree and stream parser (odd chunks) must agree with it:
+  local tree, stream = jot.markdown(t.input, 256, "tree"), jot.markdown(t.input, 256, 7)
+  if tree == r and jot.markdown(t.input, 1, "tree") ~= jot.markdown(t.input, 1) then
+    tree = nil  -- pretty output, too
+  end
+  if tree ~= r or stream ~= r then
+    numfail = numfail + 1
+    log.error(string.format("mkdn FAIL test #%d: %s", t.number,
+      tree ~= r and "tree differs" or "stream differs"))
+  end
   if mkdnskip[t.number] then
     log.debug(string.format("mkdn SKIP test #%d (%s)", t.number, mkdnskip[t.number]))
     return
   end
-  local r = jot.markdown(t.input, 256)
   if r ~= t.result then
     numfail = numfail + 1
     log.error(string.format("mkdn FAIL test #%d on %s", t.number, t.section))
@@ -290,6 +385,13 @@ end
 env = { Test = Test }
 loadfile("../test/spec.lua", "t", env)()
 assert(numfail == 0, "Failed CommonMark test(s): " .. numfail)
+-- blank line before a list of another type (no spec example):
+for _, s in ipairs{"- b\n\n+ c\n", "2) o\n\n- x\n", "- a\n- b\n\n+ c\n"} do
+  local r = jot.markdown(s, 256)
+  assert(r:find("<li>b</li>", 1, true) or r:find("<li>o</li>", 1, true))
+  assert(jot.markdown(s, 256, "tree") == r)
+  assert(jot.markdown(s, 256, 7) == r and jot.markdown(s, 256, 4096) == r)
+end
 
 
 log.info("Checking Pikchr rendering")
@@ -299,4 +401,275 @@ assert(svg:sub(1,5) == "<svg ")
 assert(svg:sub(-7) == "</svg>\n")
 
 
+log.info("Checking HTML minifier")
+assert(jot.minify("<p>\n  Hello,   <em>world</em> !\n</p>\n") ==
+  "<p>Hello, <em>world</em> !</p>")
+assert(jot.minify("<div><!-- note --> <a href=\"x.html\"  title=\"a b\">x</a></div>") ==
+  "<div><a href=x.html title=\"a b\">x</a></div>")
+assert(jot.minify("<pre>a\n   b</pre>") == "<pre>a\n   b</pre>")
+assert(jot.minify("<!--[if IE]>x<![endif]-->") == "<!--[if IE]>x<![endif]-->")
+
+
+assert(jot.minify("a , b { color : red ; }\n/* x */", "css") == "a,b{color:red}")
+assert(jot.minify("calc(1px + 2px) url( a b.png )", "css") == "calc(1px + 2px) url( a b.png )")
+assert(jot.minify(".a { & :hover { color : red } }", "css") == ".a{& :hover{color:red}}")
+assert(jot.minify(".a { color : red ; &:hover { x : y } }", "css") == ".a{color:red;&:hover{x:y}}")
+assert(jot.minify("  x = a + +b; // c\n\n  y = /\\//g\n", "js") == "x=a+ +b;\ny=/\\//g\n")
+assert(jot.asset("site.css") == nil)  -- no manifest outside builds
+
+
+log.info("Checking link scanning")
+html = require("lustache"):render('<a href="{{url}}">x</a><img src="a.png?w=1&amp;h=2">',
+  { url = "/blog/post.html" })
+assert(html:find("&#x2F;blog&#x2F;post.html", 1, true))  -- as lustache escapes
+links = jot.links(html .. '<a href="&lt;&#47;&#x2f;&copy;&bogus;">')
+assert(#links == 3 and links[1] == "/blog/post.html" and links[2] == "a.png?w=1&h=2")
+assert(links[3] == "<//\u{A9}&bogus;")
+
+
+log.info("Checking gzip output (decompressed here, not by deflate.c)")
+-- Inflate (RFC 1951) the data of a gzip file as jot.gzip() makes
+-- it (no optional header fields); Huffman decoding as in zlib's
+-- puff.c: codes of each length in order, one bit at a time
+local function gunzip(gz)
+  local pos, bitbuf, bitcnt = 11, 0, 0
+  local out = {}
+  assert(gz:sub(1, 4) == "\31\139\8\0", "not a gzip file jot makes")
+
+  local function bits(n)
+    while bitcnt < n do
+      bitbuf = bitbuf | assert(gz:byte(pos), "truncated") << bitcnt
+      pos, bitcnt = pos + 1, bitcnt + 8
+    end
+    local v = bitbuf & ((1 << n) - 1)
+    bitbuf, bitcnt = bitbuf >> n, bitcnt - n
+    return v
+  end
+
+  local function huffman(lengths, first, n)
+    local count, symbol, offs = {}, {}, { [1] = 0 }
+    for len = 0, 15 do count[len] = 0 end
+    for s = 0, n-1 do
+      local len = lengths[first+s]
+      count[len] = count[len] + 1
+    end
+    for len = 1, 14 do offs[len+1] = offs[len] + count[len] end
+    for s = 0, n-1 do
+      local len = lengths[first+s]
+      if len > 0 then symbol[offs[len]], offs[len] = s, offs[len] + 1 end
+    end
+    return { count = count, symbol = symbol }
+  end
+
+  local function decode(h)
+    local code, first, index = 0, 0, 0
+    for len = 1, 15 do
+      code = code | bits(1)
+      local count = h.count[len]
+      if code - count < first then return h.symbol[index + code - first] end
+      index, first, code = index + count, (first + count) << 1, code << 1
+    end
+    error("invalid Huffman code")
+  end
+
+  local lbase = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 }
+  local lext = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 }
+  local dbase = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577 }
+  local dext = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 }
+  local order = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 }
+
+  local function codes(lencode, distcode)
+    while true do
+      local sym = decode(lencode)
+      if sym < 256 then out[#out+1] = sym
+      elseif sym == 256 then return
+      else
+        sym = sym - 256
+        local len = lbase[sym] + bits(lext[sym])
+        local d = decode(distcode) + 1
+        local dist = dbase[d] + bits(dext[d])
+        assert(dist <= #out, "distance too far back")
+        for _ = 1, len do out[#out+1] = out[#out+1-dist] end
+      end
+    end
+  end
+
+  repeat
+    local last, kind = bits(1), bits(2)
+    if kind == 0 then  -- stored
+      bitbuf, bitcnt = 0, 0
+      local len, nlen = string.unpack("<I2I2", gz, pos)
+      assert(len == ~nlen & 0xffff, "bad stored length")
+      for i = pos + 4, pos + 3 + len do out[#out+1] = gz:byte(i) end
+      pos = pos + 4 + len
+    elseif kind == 1 then  -- fixed codes
+      local lengths = {}
+      for s = 0, 287 do
+        lengths[s] = s < 144 and 8 or s < 256 and 9 or s < 280 and 7 or 8
+      end
+      for s = 288, 317 do lengths[s] = 5 end
+      codes(huffman(lengths, 0, 288), huffman(lengths, 288, 30))
+    elseif kind == 2 then  -- dynamic codes
+      local nlen, ndist, ncode = bits(5) + 257, bits(5) + 1, bits(4) + 4
+      local lengths = {}
+      for i = 1, 19 do lengths[order[i]] = i <= ncode and bits(3) or 0 end
+      local lencode = huffman(lengths, 0, 19)
+      local i = 0
+      lengths = {}
+      while i < nlen + ndist do
+        local sym, val, rep = decode(lencode)
+        if sym < 16 then val, rep = sym, 1
+        elseif sym == 16 then val, rep = assert(lengths[i-1]), 3 + bits(2)
+        elseif sym == 17 then val, rep = 0, 3 + bits(3)
+        else val, rep = 0, 11 + bits(7) end
+        for _ = 1, rep do lengths[i], i = val, i + 1 end
+      end
+      codes(huffman(lengths, 0, nlen), huffman(lengths, nlen, ndist))
+    else error("invalid block type") end
+  until last == 1
+
+  local chunks = {}
+  for i = 1, #out, 4096 do
+    chunks[#chunks+1] = string.char(table.unpack(out, i, math.min(i + 4095, #out)))
+  end
+  local data = table.concat(chunks)
+  local crc, size = string.unpack("<I4I4", gz, pos)
+  assert(pos + 8 == #gz + 1, "garbage after gzip trailer")
+  return data, crc, size
+end
+
+local function crc32(s)
+  local crc = 0xffffffff
+  for i = 1, #s do
+    crc = crc ~ s:byte(i)
+    for _ = 1, 8 do crc = (crc >> 1) ~ (0xedb88320 & -(crc & 1)) end
+  end
+  return ~crc & 0xffffffff
+end
+
+local seed = 1
+local function random(n)
+  local t = {}
+  for i = 1, n do
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff
+    t[i] = string.char(seed >> 16 & 0xff)
+  end
+  return table.concat(t)
+end
+
+local inputs = {
+  "", "a", random(20000), ("\0"):rep(100000),
+  ("Some text, some more text. "):rep(2000) .. random(300) .. ("abc"):rep(5000),
+  assert(fs.readfile(EXEPATH)):sub(1, 150000),
+}
+for _, data in ipairs(inputs) do
+  local gz = jot.gzip(data)
+  local text, crc, size = gunzip(gz)
+  assert(text == data, "gzip round trip failed")
+  assert(crc == crc32(data) and size == #data, "bad gzip trailer")
+  assert(jot.gzip(data) == gz)  -- same data, same bytes
+end
+assert(#jot.gzip(inputs[4]) < 1000)
+
+
+log.info("Checking tar output")
+-- read a tar archive into a list of {name, data}, checking the
+-- header checksums and taking names from pax headers
+local function untar(tar)
+  local files, pos, paxname = {}, 1, nil
+  while true do
+    local head = assert(tar:sub(pos, pos + 511))
+    assert(#head == 512, "truncated archive")
+    if head == ("\0"):rep(512) then
+      assert(tar:sub(pos + 512) == ("\0"):rep(512), "bad end of archive")
+      return files
+    end
+    local sum = 256  -- checksum field taken as blanks
+    for i = 1, 512 do
+      if i <= 148 or i > 156 then sum = sum + head:byte(i) end
+    end
+    assert(sum == tonumber(head:sub(149, 156):match("%d+"), 8), "bad header checksum")
+    assert(head:sub(258, 263) == "ustar\0")
+    local function field(i, n) return head:sub(i, i + n - 1):match("^[^%z]*") end
+    local size = tonumber(field(125, 11), 8)
+    local data = tar:sub(pos + 512, pos + 511 + size)
+    local name = field(1, 100)
+    if field(346, 155) ~= "" then name = field(346, 155) .. "/" .. name end
+    local typeflag = head:sub(157, 157)
+    if typeflag == "x" then
+      paxname = data:match("%d+ path=([^\n]*)\n")
+    else
+      assert(typeflag == "0", "not a regular file")
+      files[#files+1] = { paxname or name, data }
+      paxname = nil
+    end
+    pos = pos + 512 + (size + 511) // 512 * 512
+  end
+end
+
+dir = assert(fs.tempdir())
+fn = path.join(dir, "site.tar")
+local long = ("deeply/"):rep(20) .. ("x"):rep(120) .. ".html"
+local static = path.join(dir, "static.bin")
+assert(fs.writefile(static, inputs[3]))
+assert(fs.tar(fn, {
+  { "index.html", "<p>Hello</p>\n" },
+  { "empty.txt", "" },
+  { ("a/"):rep(60) .. "b.css", inputs[5] },
+  { long, "long name\n" },
+  { "static.bin", file = static },
+}))
+t = untar(assert(fs.readfile(fn)))
+assert(#t == 5)
+assert(t[1][1] == "index.html" and t[1][2] == "<p>Hello</p>\n")
+assert(t[2][1] == "empty.txt" and t[2][2] == "")
+assert(t[3][1] == ("a/"):rep(60) .. "b.css" and t[3][2] == inputs[5])
+assert(t[4][1] == long and t[4][2] == "long name\n")
+assert(t[5][1] == "static.bin" and t[5][2] == inputs[3])
+assert(not fs.tar(path.join(dir, "nosuch", "x.tar"), {}))
+assert(fs.remove(fn) and fs.remove(static) and fs.remove(dir))
+
+
+log.info("Checking incremental builds")
+-- run jot build on dir, return the number of pages it rendered
+local function build(dir)
+  local cmd = string.format("'%s' -v build '%s' 2>&1", EXEPATH, dir)
+  local pipe = assert(io.popen(cmd))
+  local output = pipe:read("a")
+  assert(pipe:close(), output)
+  return tonumber(output:match("built (%d+) pages"))
+end
+
+-- write file as saved age seconds ago: one saved just before a
+-- build (within a clock tick) is rendered once more in the next
+local function save(fn, text, age)
+  assert(fs.writefile(fn, text))
+  assert(fs.touch(fn, os.time() - age))
+end
+
+dir = assert(fs.tempdir())
+assert(fs.mkdir(path.join(dir, "content")))
+save(path.join(dir, "config.jot"), 'title = "Checks"\n', 60)
+save(path.join(dir, "content", "a.md"), "---\ntitle: A\n---\nText\n", 60)
+save(path.join(dir, "content", "list.md"), "{{#site.pages}}{{title}} {{/site.pages}}\n", 60)
+assert(build(dir) == 2)
+assert(build(dir) == 0)
+save(path.join(dir, "content", "a.md"), "---\ntitle: B\n---\nText\n", 30)
+assert(build(dir) == 2)  -- the page and the list (the index changed)
+assert(build(dir) == 0)  -- and nothing again
+for p, type in fs.walkdir(dir) do
+  if type=="F" or type=="DP" then assert(fs.remove(p)) end
+end
+
+
+log.info("Checking jot.cache (not open outside of builds)")
+assert(jot.cache.put("test", "input", "value") == true)
+assert(jot.cache.get("test", "input") == nil)
+
+
 log.info("OK");
@@ -15,7 +15,11 @@
 #include "jotlib.h"
 #include "log.h"
 #include "blob.h"
+#include "build.h"
+#include "serve.h"
+#include "trace.h"
 #include "cmdargs.h"
+#include "copy.h"
 #include "pikchr.h"
 #include "markdown.h"
 
@@ -30,6 +34,17 @@
 
 static const char *me = "jot";
 static int verbosity = 2;  /* WARN and higher */
+static char exepath[1024];
+static const char *tracefile = 0;
+static const char *tarfile = 0;
+
+static const struct longopt {
+  const char *name;
+  const char **value;
+} longopts[] = {
+  { "trace", &tracefile },
+  { "tar", &tarfile },
+};
 
 
 #if 0
@@ -69,6 +84,45 @@ get_exe_path(char *buf, int size)
 }
 
 
+/* take long options --name FILE (or --name=FILE) out of argv,
+   wherever they appear before --, as cmdargs knows only short
+   options; return the new argc, or -1 and the option's name in
+   *missing if it has no argument */
+static int
+striplongopts(int argc, char **argv, const char **missing)
+{
+  size_t k, len;
+  int i, j;
+  for (i = j = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--")) {
+      while (i < argc) argv[j++] = argv[i++];
+      break;
+    }
+    for (k = 0; k < sizeof(longopts)/sizeof(longopts[0]); k++) {
+      len = strlen(longopts[k].name);
+      if (strncmp(argv[i], "--", 2) || strncmp(argv[i]+2, longopts[k].name, len))
+        continue;
+      if (argv[i][2+len] == '=') {
+        *longopts[k].value = argv[i] + 3 + len;
+        break;
+      }
+      if (argv[i][2+len] == '\0') {
+        if (++i >= argc) {
+          *missing = longopts[k].name;
+          return -1;
+        }
+        *longopts[k].value = argv[i];
+        break;
+      }
+    }
+    if (k == sizeof(longopts)/sizeof(longopts[0]))
+      argv[j++] = argv[i];
+  }
+  argv[j] = 0;
+  return j;
+}
+
+
 static int
 identify(void)
 {
@@ -106,6 +160,7 @@ usage(const char *fmt, ...)
     fprintf(fp, "\nCommands:\n"
     "  new <path>      create initial site structure in <path>\n"
     "  build [path]    build or rebuild site in path (or .)\n"
+    "  serve [path]    serve site on localhost, rebuild on changes\n"
     "  render FILE     render FILE to stdout\n"
     "  markdown [file] process Markdown to HTML on stdout\n"
     "  pikchr [file]   process Pikchr to SVG on stdout\n"
@@ -119,11 +174,22 @@ usage(const char *fmt, ...)
     "  -x              allow unsafe functions (io.* etc.)\n"
     "  -h              show this help and quit\n"
     "  -V              show version and quit\n"
+    "  --trace FILE    write trace events (Chrome JSON) to FILE\n"
     "\nBuild options:\n"
     "  -c FILE         override config file location\n"
     "  -s DIR          source: build from DIR (override config)\n"
     "  -t DIR          target: build to DIR (override config)\n"
     "  -d              build draft posts\n"
+    "  -f              force full rebuild (ignore dependencies)\n"
+    "  -w              watch for changes and rebuild\n"
+    "  -m              minify rendered HTML (white space, comments, quotes)\n"
+    "  -z              also write .gz of text outputs (HTML, CSS, JS, ...)\n"
+    "  -l              hard-link identical output files (saves space)\n"
+    "  -j num          number of worker threads (default: #CPUs)\n"
+    "  --tar FILE      write the site as a tar archive to FILE (- for stdout)\n"
+    "\nServe options:\n"
+    "  -c, -s, -d, -j  as for build (output is kept in memory)\n"
+    "  -p port         listen on localhost:port (default: 8000)\n"
     "\nRender options:\n"
     "  -l FILES        load Lua file(s) to init render env\n"
     "  -p GLOBS        load partials and expose through {{>FILE}}\n"
@@ -261,6 +327,24 @@ setup_lua(lua_State *L, const char *exepath)
 }
 
 
+/** create and set up a new Lua state (e.g. for build workers) */
+static lua_State *
+newstate(void)
+{
+  lua_State *L = luaL_newstate();
+  int r;
+  if (!L) return 0;
+  trace_begin("lua", "setup_lua", 0);
+  r = setup_lua(L, exepath);
+  trace_end();
+  if (r != SUCCESS) {
+    lua_close(L);
+    return 0;
+  }
+  return L;
+}
+
+
 static const char *
 strip_where(lua_State *L, const char *msg, int level)
 {
@@ -361,7 +445,9 @@ runfile(lua_State *L, const char *module_name, int nargs, int nrets)
     /* arg1 .. argN path chunk => chunk arg1 .. argN path, then pop path */
     lua_rotate(L, -(nargs+2), 1);
     lua_pop(L, 1);
+    trace_begin("lua", "runfile", module_name);
     lua_call(L, nargs, nrets);
+    trace_end();
   }
   else luaL_error(L, "error loading Lua code from %s (err=%d)", path, rc);
 }
@@ -407,26 +493,22 @@ readfile(const char *fn, Blob *blob)
 }
 
 
-/** write the blob to the named file (overwrite if exists) */
+/** write the text to the named file (replace if exists and differs) */
 static int
 writefile(const char *fn, const char *text)
 {
-  FILE *fp = stdout;
   assert(text != 0);
 
   if (fn && !streq(fn, "-")) {
-    fp = fopen(fn, "w");
-    if (!fp) {
+    if (copy_buffer(text, strlen(text), fn) < 0) {
       log_error("write file %s: %s", fn, strerror(errno));
       return FAILSOFT;
     }
+    return SUCCESS;
   }
-  fputs(text, fp);
-  fflush(fp);
-  if (fp != stdout)
-    fclose(fp);
-  if (ferror(fp)) {
-    log_error("write file %s: %s", fn,
+  fputs(text, stdout);
+  if (fflush(stdout) != 0 || ferror(stdout)) {
+    log_error("write to stdout: %s",
       errno ? strerror(errno) : "unspecified error");
     return FAILSOFT;
   }
@@ -457,14 +539,115 @@ render(lua_State *L)
 }
 
 
+/** jot build [-c config] [-s srcdir] [-t targetdir] [-d] [-f] [-w] [-m] [-z] [-l] [-j num] [--tar file] [path] */
+static int
+dobuild(lua_State *L)
+{
+  struct buildopts opts;
+  Builder *builder;
+  int nerrors;
+  bool watch;
+
+  runcode(L, 1, 12,
+    "local args = ...\n"
+    "if type(args) ~= 'table' then args = {} end\n"
+    "local jobs = args['j'] and math.tointeger(tonumber(args['j']))\n"
+    "if args['j'] and not jobs then error('build: option -j expects a number') end\n"
+    "local extra = #args > 1 and true or false\n"
+    "return args[1], args['c'], args['s'], args['t'], args['d'], args['f'], args['w'], args['m'], args['z'], args['l'], jobs, extra");
+
+  if (lua_toboolean(L, -1))
+    return usage("build: too many arguments");
+
+  memset(&opts, 0, sizeof(opts));
+  opts.root = lua_tostring(L, -12);
+  opts.config = lua_tostring(L, -11);
+  opts.source = lua_tostring(L, -10);
+  opts.target = lua_tostring(L, -9);
+  opts.drafts = lua_toboolean(L, -8);
+  opts.force = lua_toboolean(L, -7);
+  watch = lua_toboolean(L, -6);
+  opts.minify = lua_toboolean(L, -5);
+  opts.gzip = lua_toboolean(L, -4);
+  opts.dedup = lua_toboolean(L, -3);
+  opts.nthreads = lua_tointeger(L, -2);
+  opts.inmemory = tarfile != 0;  /* no target dir, just the archive */
+  opts.newstate = newstate;
+  opts.msghandler = msghandler;
+
+  if (tarfile && watch)
+    return usage("build: option --tar cannot go with -w");
+
+  builder = build_new(&opts);
+  if (!builder)
+    return luaL_error(L, "build: cannot initialize");
+  nerrors = watch ? build_watch(builder) : build_run(builder);
+  if (tarfile && nerrors == 0 && build_tar(builder, tarfile) != SUCCESS)
+    nerrors++;
+  build_free(builder);
+
+  if (nerrors > 0)
+    return luaL_error(L, "build failed with %d error(s)", nerrors);
+  return 0;
+}
+
+
+/** jot serve [-c config] [-s srcdir] [-d] [-j num] [-p port] [path] */
+static int
+doserve(lua_State *L)
+{
+  struct buildopts opts;
+  Builder *builder;
+  int port, s;
+
+  runcode(L, 1, 7,
+    "local args = ...\n"
+    "if type(args) ~= 'table' then args = {} end\n"
+    "local jobs = args['j'] and math.tointeger(tonumber(args['j']))\n"
+    "if args['j'] and not jobs then error('serve: option -j expects a number') end\n"
+    "local port = math.tointeger(tonumber(args['p'] or 8000))\n"
+    "if not port or port < 1 or port > 65535 then error('serve: option -p expects a port number') end\n"
+    "local extra = #args > 1 and true or false\n"
+    "return args[1], args['c'], args['s'], args['d'], jobs, port, extra");
+
+  if (lua_toboolean(L, -1))
+    return usage("serve: too many arguments");
+
+  memset(&opts, 0, sizeof(opts));
+  opts.root = lua_tostring(L, -7);
+  opts.config = lua_tostring(L, -6);
+  opts.source = lua_tostring(L, -5);
+  opts.drafts = lua_toboolean(L, -4);
+  opts.nthreads = lua_tointeger(L, -3);
+  port = lua_tointeger(L, -2);
+  opts.inmemory = true;
+  opts.newstate = newstate;
+  opts.msghandler = msghandler;
+
+  builder = build_new(&opts);
+  if (!builder)
+    return luaL_error(L, "serve: cannot initialize");
+  s = serve(builder, port);
+  build_free(builder);
+
+  if (s)
+    return luaL_error(L, "serve: failed");
+  return 0;
+}
+
+
 /** jot markdown [-o outfile] [-p pretty] file [args] */
 static int
 domarkdown(lua_State *L)
 {
-  Blob input = BLOB_INIT;
   Blob output = BLOB_INIT;
+  struct mkdnstream *sp;
   const char *infn, *outfn;
-  int r, pretty = 0;
+  FILE *fp = stdin;
+  char buf[16384];
+  size_t n;
+  bool tostdout;
+  int r = SUCCESS, pretty = 0;
 
   runcode(L, 1, 4,
     "local args = ...\n"
@@ -502,17 +685,36 @@ domarkdown(lua_State *L)
   if (lua_toboolean(L, -1))
     return usage("markdown: too many arguments");
 
-  r = readfile(infn, &input);
-  if (r != SUCCESS) goto done;
-  if (!infn) infn = "(stdin)";
-
-  log_trace("calling mkdnhtml()");
-  mkdnhtml(&output, blob_str(&input), blob_len(&input), 0, pretty);
+  if (infn && !streq(infn, "-")) {
+    fp = fopen(infn, "r");
+    if (!fp) {
+      log_error("read file %s: %s", infn, strerror(errno));
+      return FAILSOFT;
+    }
+  }
+  else infn = "(stdin)";
+
+  /* parse as we read; to stdout, write completed blocks as we go */
+  log_trace("calling mkdnhtml_begin()");
+  sp = mkdnhtml_begin(0, pretty);
+  tostdout = !outfn || streq(outfn, "-");
+  while (r == SUCCESS && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    markdown_feed(sp, &output, buf, n);
+    if (tostdout && blob_len(&output) > 0) {
+      r = writefile(0, blob_str(&output));
+      blob_clear(&output);
+    }
+  }
+  if (ferror(fp)) {
+    log_error("read file %s: %s", infn, strerror(errno));
+    r = FAILSOFT;
+  }
+  if (fp != stdin) fclose(fp);
+  mkdnhtml_end(sp, &output);
 
-  r = writefile(outfn, blob_str(&output));
+  if (r == SUCCESS)
+    r = writefile(tostdout ? 0 : outfn, blob_str(&output));
 
-done:
-  blob_free(&input);
   blob_free(&output);
   return r;
 }
@@ -623,7 +825,8 @@ docmd(
       case 'x': sandbox = false;  /* FALLTHRU */
       default:
         lua_pushfstring(L, "%c", args->optopt);  /* key */
-        lua_pushstring(L, args->optarg);  /* value (may be null) */
+        if (args->optarg) lua_pushstring(L, args->optarg);
+        else lua_pushboolean(L, 1);  /* flag without argument */
         lua_rawset(L, -3);
     }
   }
@@ -654,8 +857,12 @@ main(int argc, char **argv)
 {
   struct cmdargs args;
   const char *cmd;
+  const char *missing = 0;
   int opt, s = SUCCESS;
-  char exepath[1024];
+
+  argc = striplongopts(argc, argv, &missing);
+  if (argc < 0)
+    return usage("option --%s requires an argument", missing);
 
   cmdargs_init(&args, argc, argv);
   me = cmdargs_getprog(&args);
@@ -698,7 +905,14 @@ main(int argc, char **argv)
     return FAILSOFT;
   }
 
+  if (tracefile && trace_open(tracefile) != SUCCESS) {
+    s = FAILSOFT;
+    goto cleanup;
+  }
+
+  trace_begin("lua", "setup_lua", 0);
   s = setup_lua(L, exepath);
+  trace_end();
   if (s) goto cleanup;
 
   if (streq(cmd, "new")) {
@@ -706,8 +920,10 @@ main(int argc, char **argv)
     s = FAILSOFT;
   }
   else if (streq(cmd, "build")) {
-    log_error("command not yet implemented: %s", cmd);
-    s = FAILSOFT;
+    s = docmd(L, cmd, dobuild, &args, "c:dflms:t:wzj:hqv");
+  }
+  else if (streq(cmd, "serve")) {
+    s = docmd(L, cmd, doserve, &args, "c:ds:j:p:hqv");
   }
   else if (streq(cmd, "render")) {
     s = docmd(L, cmd, render, &args, "l:p:o:hqv");
@@ -734,6 +950,7 @@ main(int argc, char **argv)
 cleanup:
   log_trace("closing Lua state");
   lua_close(L);
+  trace_close();
 
   return s;
 }
@@ -10,12 +10,14 @@
 #include "log.h"
 #include "memory.h"
 #include "markdown.h"
+#include "phash.h"
 
 
 /* Markdown has block elements and inline (span) elements.
  * Reference style links and images can be forward-looking,
  * so we need to collect link definitions before the actual
- * rendering in a second pass over the Markdown.
+ * rendering in a second pass over the Markdown (or, when
+ * streaming, hold back blocks until their labels are defined).
  * The input is parsed into a sequence of blocks, and within
  * each block the inlines are parsed and passed through the
  * render callbacks to the output buffer. Note that list and
@@ -75,6 +77,18 @@ strnicmp(const char *s, const char *t, size_t n)
 }
 
 
+typedef struct slice {
+  const char *s;
+  size_t n;
+} Slice;
+
+
+static Slice slice(const char *s, size_t len) {
+  Slice slice = { s, len };
+  return slice;
+}
+
+
 typedef struct parser Parser;
 
 typedef size_t (*CharProc)(
@@ -84,11 +98,22 @@ struct parser {
   struct markdown render;
   void *udata;
   int nesting_depth;         /* to limit recursion depth */
-  Blob linkdefs;             /* collected link definitions */
+  struct linkdef *linkdefs;  /* hash table of link definitions */
+  size_t nlinkdefs;
+  size_t linkslots;          /* a power of 2, or 0 */
+  MemPool *defpool;          /* labels, links, titles of link defs */
+  bool collecting;           /* dry run: collect link definitions */
+  bool wanting;              /* stream: note labels not (yet) defined */
+  size_t nwanted;            /* stream: number of such labels */
+  int dryrun;                /* DRYRUN_BLOCKS or DRYRUN_LINKS */
+  bool recording;            /* markdown_parse: building a syntax tree */
+  Slice raw;                 /* source of the span (or code info) being
+                                rendered, for the syntax tree */
   Blob *blob_pool[100];
   size_t pool_index;
   CharProc livechars[128];   /* chars like & and \ that trigger an action */
   char emphchars[32];        /* all chars that mark emphasis */
+  unsigned char charclass[256];  /* CC_ flags by byte value */
   const struct tagname *pretag;
   const struct tagname *scripttag;
   const struct tagname *styletag;
@@ -96,125 +121,60 @@ struct parser {
 };
 
 
-typedef struct slice {
-  const char *s;
-  size_t n;
-} Slice;
+/* character classes for inline scanning (Parser.charclass) */
+#define CC_EMPH    1         /* emphasis delimiter (emphchars) */
+#define CC_BRACKET 2         /* [ or ] */
+#define CC_TICK    4         /* backtick */
+#define CC_ANGLE   8         /* < */
+#define CC_ESCAPE  16        /* backslash */
+#define CC_LIVE    32        /* has an action in livechars */
+#define CC_INLINE  (CC_EMPH|CC_BRACKET|CC_TICK|CC_ANGLE|CC_ESCAPE)
 
+#define IS_EMPH(parser, c) ((parser)->charclass[(unsigned char) (c)] & CC_EMPH)
 
-static Slice slice(const char *s, size_t len) {
-  Slice slice = { s, len };
-  return slice;
-}
+
+/* dry runs call no-op block callbacks and no inline ones */
+#define DRYRUN_BLOCKS 1      /* only find the extent of blocks */
+#define DRYRUN_LINKS  2      /* also resolve links, note undefined labels */
 
 
 struct linkdef {
-  const char *label;
-  Slice link;
+  const char *label;         /* as by make_label; null if slot is free */
+  size_t len;
+  unsigned long hash;        /* label_hash() */
+  Slice link;                /* null if label used but not yet defined */
   Slice title;
+  bool wanted;               /* stream: undefined, and held blocks wait */
 };
 
 
-/** html block tags, ordered as by tagname_cmp (first len, then lexic) */
-static const struct tagname {
+/** html block tags (see tagnames.txt) */
+struct tagname {
   const char *name;
   size_t len;
-} tagnames[] = {
-  { "p",           1 },
-  { "dd",          2 },
-  { "dl",          2 },
-  { "dt",          2 },
-  { "h1",          2 },
-  { "h2",          2 },
-  { "h3",          2 },
-  { "h4",          2 },
-  { "h5",          2 },
-  { "h6",          2 },
-  { "hr",          2 },
-  { "li",          2 },
-  { "ol",          2 },
-  { "td",          2 },
-  { "th",          2 },
-  { "tr",          2 },
-  { "ul",          2 },
-  { "col",         3 },
-  { "dir",         3 },
-  { "div",         3 },
-  { "nav",         3 },
-  { "pre",         3 },
-  { "base",        4 },
-  { "body",        4 },
-  { "form",        4 },
-  { "head",        4 },
-  { "html",        4 },
-  { "link",        4 },
-  { "main",        4 },
-  { "menu",        4 },
-  { "aside",       5 },
-  { "frame",       5 },
-  { "param",       5 },
-  { "style",       5 },
-  { "table",       5 },
-  { "tbody",       5 },
-  { "tfoot",       5 },
-  { "thead",       5 },
-  { "title",       5 },
-  { "track",       5 },
-  { "center",      6 },
-  { "dialog",      6 },
-  { "figure",      6 },
-  { "footer",      6 },
-  { "header",      6 },
-  { "iframe",      6 },
-  { "legend",      6 },
-  { "option",      6 },
-  { "script",      6 },
-  { "source",      6 },
-  { "address",     7 },
-  { "article",     7 },
-  { "caption",     7 },
-  { "details",     7 },
-  { "section",     7 },
-  { "summary",     7 },
-  { "basefont",    8 },
-  { "colgroup",    8 },
-  { "fieldset",    8 },
-  { "frameset",    8 },
-  { "menuitem",    8 },
-  { "noframes",    8 },
-  { "optgroup",    8 },
-  { "textarea",    8 },
-  { "blockquote", 10 },
-  { "figcaption", 10 },
 };
 
-
-static int
-tagname_cmp(const void *a, const void *b)
-{
-  const struct tagname *pa = a;
-  const struct tagname *pb = b;
-  if (pa->len < pb->len) return -1;
-  if (pa->len > pb->len) return +1;
-  return strnicmp(pa->name, pb->name, pa->len);
-}
+#include "tagnames.h"
 
 
 static const struct tagname *
 tagname_find(const char *text, size_t size)
 {
-  struct tagname key;
-  size_t nmemb = ARLEN(tagnames);
-  size_t msize = sizeof(tagnames[0]);
   size_t j = 0;
 
   /* TOOD /[A-Za-z][-A-Za-z0-9]star/ would be correcter */
   while (j < size && ISALPHA(text[j])) j++;
   if (j >= size) return 0;
 
-  key.name = text;
-  key.len = j;
-  return bsearch(&key, tagnames, nmemb, msize, tagname_cmp);
+  return tagnames_find(text, j);
+}
+
+
+/** true iff name (of given length) is a block-level HTML tag */
+bool
+markdown_blocktag(const char *name, size_t len)
+{
+  return tagnames_find(name, len) != 0;
 }
 
 
@@ -280,12 +240,143 @@ make_label(const char *text, size_t size, Blob *buf)
 }
 
 
-static int
-linkdef_cmp(const void *a, const void *b)
+/** hash of a link label, folded as by make_label but in place */
+static unsigned long
+label_hash(const char *text, size_t size, size_t *plen)
+{
+  unsigned long h = 2166136261UL;  /* FNV-1a */
+  size_t j, n = 0;
+  bool inrun = false;
+  for (j = 0; j < size && ISSPACE(text[j]); j++);
+  for (; j < size; j++) {
+    if (ISSPACE(text[j])) inrun = true;
+    else {
+      if (inrun) {
+        h = (h ^ ' ') * 16777619UL;
+        n++;
+        inrun = false;
+      }
+      h = (h ^ (unsigned char) TOLOWER(text[j])) * 16777619UL;
+      n++;
+    }
+  }
+  *plen = n;
+  return h & 0xFFFFFFFFUL;
+}
+
+
+/** true iff label (as by make_label) is text folded as by make_label */
+static bool
+label_equal(const char *label, const char *text, size_t size)
 {
-  const struct linkdef *pa = a;
-  const struct linkdef *pb = b;
-  return strcmp(pa->label, pb->label);
+  size_t j;
+  bool inrun = false;
+  for (j = 0; j < size && ISSPACE(text[j]); j++);
+  for (; j < size; j++) {
+    if (ISSPACE(text[j])) inrun = true;
+    else {
+      if (inrun) {
+        if (*label++ != ' ') return false;
+        inrun = false;
+      }
+      if (*label++ != TOLOWER(text[j])) return false;
+    }
+  }
+  return *label == 0;
+}
+
+
+/** the slot for label text: its definition, or a free slot */
+static struct linkdef *
+linkdef_slot(Parser *parser, const char *text, size_t size,
+  unsigned long *phash, size_t *plen)
+{
+  struct linkdef *p;
+  size_t i, mask = parser->linkslots-1;
+
+  *phash = label_hash(text, size, plen);
+  for (i = *phash & mask; (p = &parser->linkdefs[i])->label; i = (i+1) & mask) {
+    if (p->hash == *phash && p->len == *plen &&
+        label_equal(p->label, text, size)) break;
+  }
+  return p;
+}
+
+
+/** grow the hash table of link definitions to n slots */
+static void
+linkdef_rehash(Parser *parser, size_t n)
+{
+  struct linkdef *old = parser->linkdefs;
+  size_t i, j, oldn = parser->linkslots;
+
+  parser->linkdefs = mem_alloc(n * sizeof(*parser->linkdefs));
+  assert(parser->linkdefs != OUT_OF_MEMORY);
+  memset(parser->linkdefs, 0, n * sizeof(*parser->linkdefs));
+  parser->linkslots = n;
+  for (i = 0; i < oldn; i++) {
+    if (!old[i].label) continue;
+    for (j = old[i].hash & (n-1); parser->linkdefs[j].label; j = (j+1) & (n-1));
+    parser->linkdefs[j] = old[i];
+  }
+  mem_free(old);
+}
+
+
+/** the entry for label text, made (undefined) if new */
+static struct linkdef *
+linkdef_entry(Parser *parser, const char *text, size_t size)
+{
+  struct linkdef *p;
+  unsigned long h;
+  size_t len;
+  Blob *buf;
+
+  if (2*(parser->nlinkdefs+1) > parser->linkslots)
+    linkdef_rehash(parser, parser->linkslots ? 2*parser->linkslots : 64);
+  p = linkdef_slot(parser, text, size, &h, &len);
+  if (p->label) return p;
+
+  buf = blob_get(parser);
+  p->label = mem_pool_dup(parser->defpool, make_label(text, size, buf), len);
+  assert(p->label != OUT_OF_MEMORY);
+  blob_put(parser, buf);
+  p->len = len;
+  p->hash = h;
+  p->link = p->title = slice(0, 0);
+  p->wanted = false;
+  parser->nlinkdefs++;
+  return p;
+}
+
+
+/** the link definition for label text, or null; allocates nothing */
+static const struct linkdef *
+linkdef_lookup(Parser *parser, const char *text, size_t size)
+{
+  const struct linkdef *p;
+  unsigned long h;
+  size_t len;
+
+  if (!parser->nlinkdefs) return 0;
+  p = linkdef_slot(parser, text, size, &h, &len);
+  return p->link.s ? p : 0;
+}
+
+
+/** add a link definition (copied); false if label already defined */
+static bool
+linkdef_add(Parser *parser, Slice label, Slice link, Slice title)
+{
+  struct linkdef *p = linkdef_entry(parser, label.s, label.n);
+
+  if (p->link.s) return false;  /* the first one wins */
+  if (p->wanted) parser->nwanted--;  /* see linkdef_find() */
+  p->wanted = false;
+  p->link = slice(mem_pool_dup(parser->defpool, link.s, link.n), link.n);
+  p->title = slice(mem_pool_dup(parser->defpool, title.s, title.n), title.n);
+  assert(p->link.s && p->title.s);
+  return true;
 }
 
 
@@ -295,20 +386,16 @@ linkdef_find(
   const char *text, size_t size, Parser *parser,
   Slice *plink, Slice *ptitle)
 {
-  Blob *buf;
-  struct linkdef key, *ptr;
-  size_t msize = sizeof(struct linkdef);
-  size_t nmemb = blob_len(&parser->linkdefs)/msize;
-  if (!nmemb) return 0;
-  buf = blob_get(parser);
-  key.label = make_label(text, size, buf);
-  key.link = slice(0, 0);
-  key.title = slice(0, 0);
-  ptr = bsearch(&key, blob_buf(&parser->linkdefs), nmemb, msize, linkdef_cmp);
-  blob_put(parser, buf);
-  if (!ptr) return 0;
-  if (plink) *plink = ptr->link;
-  if (ptitle) *ptitle = ptr->title;
+  const struct linkdef *p = linkdef_lookup(parser, text, size);
+  if (!p && parser->wanting) {
+    /* note the label (undefined) for streaming, which must wait for it */
+    struct linkdef *q = linkdef_entry(parser, text, size);
+    if (!q->wanted) parser->nwanted++;
+    q->wanted = true;
+  }
+  if (!p) return 0;
+  if (plink) *plink = p->link;
+  if (ptitle) *ptitle = p->title;
   return 1;
 }
 
@@ -637,6 +724,21 @@ scan_link_tail(
 }
 
 
+/** skip bytes not in any of the classes in mask; return new position */
+static size_t
+skip_plain(const unsigned char *cc, const char *text, size_t j, size_t size,
+           int mask)
+{
+  const unsigned char *s = (const unsigned char *) text;
+  /* most bytes are plain text: test four at a time */
+  while (j+4 <= size &&
+         !((cc[s[j]] | cc[s[j+1]] | cc[s[j+2]] | cc[s[j+3]]) & mask))
+    j += 4;
+  while (j < size && !(cc[s[j]] & mask)) j++;
+  return j;
+}
+
+
 static size_t
 scan_tickrun(const char *text, size_t size)
 {
@@ -801,6 +903,7 @@ emit_linebreak(
   if (pos >= 2 && text[pos-1] == ' ' && text[pos-2] == ' ') {
     blob_trimend(out); blob_addchar(out, ' ');
     assert(parser->render.linebreak != 0);
+    parser->raw = slice(text+pos, 1+extra);
     return parser->render.linebreak(out, parser->udata) ? 1 + extra : 0;
   }
 
@@ -808,6 +911,7 @@ emit_linebreak(
   if (pos >= 1 && text[pos-1] == '\\') {
     blob_trunc(out, blob_len(out)-1); blob_addchar(out, ' ');
     assert(parser->render.linebreak != 0);
+    parser->raw = slice(text+pos, 1+extra);
     return parser->render.linebreak(out, parser->udata) ? 1 + extra : 0;
   }
 
@@ -826,11 +930,8 @@ emit_text(Blob *out, const char *text, size_t size, Parser *parser)
   /* copy chars to output, looking for "active" chars */
   i = j = 0;
   for (;;) {
-    for (; j < size; j++) {
-      unsigned uc = ((unsigned) text[j]) & 0x7F;
-      action = parser->livechars[uc];
-      if (action) break;
-    }
+    j = skip_plain(parser->charclass, text, j, size, CC_LIVE);
+    action = j < size ? parser->livechars[(unsigned char) text[j]] : 0;
     if (j > i) {
       if (parser->render.text)
         parser->render.text(out, text+i, j-i, parser->udata);
@@ -1020,10 +1121,11 @@ emit_plain(Blob *out, const char *text, Span *span, Parser *parser)
       emit_text(out, text+ofs, child->ofs-ofs, parser);
 
     type = child->type;
-    if (strchr(parser->emphchars, type)) {
+    if (IS_EMPH(parser, type)) {
       Blob *temp = blob_get(parser);
       emit_plain(temp, text, child, parser);
-      emit_text(out, blob_str(temp), blob_len(temp), parser);
+      if (parser->recording) blob_add(out, temp);  /* already text nodes */
+      else emit_text(out, blob_str(temp), blob_len(temp), parser);
       blob_put(parser, temp);
     }
     else if (type == '[' || type == '!') {
@@ -1059,11 +1161,12 @@ emit_span(Blob *out, const char *text, Span *span, Parser *parser)
     return;
   }
 
-  if (strchr(parser->emphchars, type) && parser->render.emphasis) {
+  if (IS_EMPH(parser, type) && parser->render.emphasis) {
     Blob *temp = blob_get(parser);
     char c = span->type;
     int n = span->olen;
     emit_spans(temp, text, span, parser);  /* nested spans */
+    parser->raw = slice(text+span->ofs, span->len);
     done = parser->render.emphasis(out, c, n, temp, parser->udata);
     blob_put(parser, temp);
   }
@@ -1080,6 +1183,7 @@ emit_span(Blob *out, const char *text, Span *span, Parser *parser)
       emit_spans(body, text, span, parser);  /* render nested spans */
     emit_url(link, linkslice.s, linkslice.n, parser);
     emit_text(title, titleslice.s, titleslice.n, parser);
+    parser->raw = slice(text+span->ofs, span->len);
     done = type == '!'
       ? parser->render.image(out, link, title, body, parser->udata)
       : parser->render.link(out, link, title, body, parser->udata);
@@ -1092,17 +1196,20 @@ emit_span(Blob *out, const char *text, Span *span, Parser *parser)
     size_t ofs = span->ofs + span->olen;
     size_t len = span->len - span->olen - span->clen;
     emit_codespan(temp, text+ofs, len);
+    parser->raw = slice(text+span->ofs, span->len);
     done = parser->render.codespan(out, temp, parser->udata);
     blob_put(parser, temp);
   }
   else if ((type == '@' || type == ':') && parser->render.autolink) {
     size_t ofs = span->ofs+1;
     size_t len = span->len-2;
+    parser->raw = slice(text+span->ofs, span->len);
     done = parser->render.autolink(out, type, text+ofs, len, parser->udata);
   }
   else if (type == '<' && parser->render.htmltag) {
     size_t ofs = span->ofs;
     size_t len = span->len;
+    parser->raw = slice(text+span->ofs, span->len);
     done = parser->render.htmltag(out, text+ofs, len, parser->udata);
   }
 
@@ -1283,7 +1390,7 @@ process_emphasis(struct delimlist *list, struct delim *start, size_t end, SpanTr
       addspan(tree, opener->type, ofs, len, m, m);
       /* drop emph delims between opener and closer: */
       for (ptr = opener->next; ptr && ptr != closer; ptr = ptr->next)
-        if (strchr(parser->emphchars, ptr->type))
+        if (IS_EMPH(parser, ptr->type))
           delim_drop(list, ptr);
       /* shorten or drop opener&closer items: */
       if (opener->len > m) opener->len -= m;
@@ -1343,7 +1450,7 @@ process_links(struct delimlist *list, const char *text, size_t pos, size_t size,
   /* process body inlines; drop unmatched emph delims: */
   process_emphasis(list, start, pos, tree, parser);
   for (ptr = start; ptr && ptr->ofs < pos; ptr = ptr->next)
-    if (strchr(parser->emphchars, ptr->type))
+    if (IS_EMPH(parser, ptr->type))
       delim_drop(list, ptr);
 
   /* brackets before link still group, but don't create links: */
@@ -1366,13 +1473,16 @@ parse_inlines(Blob *out, const char *text, size_t size, Parser *parser)
   SpanTree tree;
   size_t i, j, len;
 
+  if (parser->dryrun == DRYRUN_BLOCKS) return;
+
   /* create span tree, add root */
   initspans(&tree, 0, size);
 
   /* add all delimiter runs to a doubly linked list */
-  for (j = 0; j < size; ) {
-    const char *p = strchr(parser->emphchars, text[j]);
-    if (p) { char delim = text[j], before, after;
+  for (j = 0; ; ) {
+    j = skip_plain(parser->charclass, text, j, size, CC_INLINE);
+    if (j >= size) break;
+    if (IS_EMPH(parser, text[j])) { char delim = text[j], before, after;
       for (i = j++; j < size && text[j] == delim; j++);
       before = i > 0 ? text[i-1] : blank;
       after = j < size ? text[j] : blank;
@@ -1395,7 +1505,7 @@ parse_inlines(Blob *out, const char *text, size_t size, Parser *parser)
         delim_push(&delims, j, len, '`', flags);
         j += len;
       }
-      else j += scan_tickrun(text, size);  /* lonely backtick(s) */
+      else j += scan_tickrun(text+j, size-j);  /* lonely backtick(s) */
     }
     else if (text[j] == '<') { char type;
       if ((len = scan_autolink(text+j, size-j, &type))) {
@@ -1430,7 +1540,7 @@ parse_inlines(Blob *out, const char *text, size_t size, Parser *parser)
   free_delims(&delims);
 
   /*dump_spans(tree.root, 0);*/
-  emit_spans(out, text, tree.root, parser);
+  if (!parser->dryrun) emit_spans(out, text, tree.root, parser);
 
   freespans(&tree);
 }
@@ -1687,6 +1797,9 @@ typedef struct {
 static void
 parse_blocks(Blob *out, const char *text, size_t size, Parser *parser, BlockInfo *pinfo);
 
+static void
+tree_raw(Blob *out, const char *text, size_t size, Parser *parser);
+
 
 /** parse atx heading; return #chars scanned if found, else 0 */
 static size_t
@@ -1791,8 +1904,10 @@ parse_codeblock(Blob *out, const char *text, size_t size, Parser *parser)
   }
 
   blob_trunc(temp, mark);
-  if (parser->render.codeblock)
+  if (parser->render.codeblock) {
+    parser->raw = slice(0, 0);
     parser->render.codeblock(out, nolang, temp, parser->udata);
+  }
   blob_put(parser, temp);
   return j;
 }
@@ -1860,6 +1975,7 @@ parse_fencedcode(Blob *out, const char *text, size_t size, Parser *parser)
   if (parser->render.codeblock) {
     Blob *info = blob_get(parser);
     emit_text(info, text+infofs, infend-infofs, parser);
+    parser->raw = slice(text+infofs, infend-infofs);
     parser->render.codeblock(out, blob_str(info), temp, parser->udata);
     blob_put(parser, info);
   }
@@ -1928,10 +2044,11 @@ parse_listitem(Blob *out, char type, bool *ploose, const char *text, size_t size
     for (i = 0; j+i < size && text[j+i] == ' '; i++);
     if (i < pre && is_ruleline(text+j, size-j)) break;
     /* next non-sub list item ends current item: */
-    if (i < sub+4 && (len = is_itemline(text+j+i, size-j-i, 0, 0))) {
+    if (i < sub+4 && (len = is_itemline(text+j+i, size-j-i, &itemtype, 0))) {
       sub = len+i;
       if (i < pre) {
-        if (wasblank) *ploose = true;
+        /* blank line between items, but not before another list: */
+        if (wasblank && itemtype == type) *ploose = true;
         break;  /* next (non-sub-) item ends current item */
       }
     }
@@ -2113,7 +2230,8 @@ parse_htmlblock(Blob *out, const char *text, size_t size, size_t startlen, int k
       j += len;
       if (is_blankline(text+j, size-j)) break;
     }
-    blob_addbuf(out, text, j);
+    if (parser->recording) tree_raw(out, text, j, parser);
+    else blob_addbuf(out, text, j);
     return j;
   }
 
@@ -2206,63 +2324,73 @@ parse_paragraph(Blob *out, const char *text, size_t size, Parser *parser, bool *
 }
 
 
-static void
-parse_blocks(Blob *out, const char *text, size_t size, Parser *parser, BlockInfo *pinfo)
+/** parse the one block at text; return its length (0 if none) */
+static size_t
+parse_block(Blob *out, const char *text, size_t size, Parser *parser,
+            bool unwrapped, bool *pisblock)
 {
-  size_t start;
+  size_t len;
   char itemtype;
   int itemstart;
   int htmlkind;
-  bool unwrapped = pinfo && pinfo->unwrapped;
-  bool block1 = 0, blockN = 0;
+  Slice label, link, title;
 
-  parser->nesting_depth++;
-  for (start=0; start<size; ) {
-    const char *ptr = text+start;
-    size_t len, end = size-start;
-    bool isblock = true;
+  if (pisblock) *pisblock = true;
 
-    if ((len = parse_atxheading(out, ptr, end, parser))) {
-      /* nothing else to do */
-    }
-    else if (is_codeline(ptr, end)) {
-      len = parse_codeblock(out, ptr, end, parser);
-    }
-    else if (is_quoteline(ptr, end)) {
-      len = parse_blockquote(out, ptr, end, parser);
-    }
-    else if ((len = is_ruleline(ptr, end))) {
-      do_hrule(out, parser);
-    }
-    else if (is_fenceline(ptr, end)) {
-      len = parse_fencedcode(out, ptr, end, parser);
-    }
-    else if (is_itemline(ptr, end, &itemtype, &itemstart)) {
-      len = parse_list(out, itemtype, itemstart, ptr, end, parser);
-    }
-    else if ((len = is_htmlline(ptr, end, &htmlkind, parser))) {
-      len = parse_htmlblock(out, ptr, end, len, htmlkind, parser);
-    }
-    // TODO table lines
-    else if ((len = is_linkdef(ptr, end, 0, 0, 0))) {
-      /* nothing to do, just skip it */
-    }
-    else if ((len = is_blankline(ptr, end))) {
-      /* nothing to do, blank lines separate blocks */
-    }
-    else {
-      /* Non-blank lines that cannot be interpreted otherwise
-         form a paragraph in Markdown/CommonMark: */
-      bool unwrap = unwrapped;
-      len = parse_paragraph(out, ptr, end, parser, &unwrap);
-      isblock = !unwrap;
-    }
+  if ((len = parse_atxheading(out, text, size, parser))) {
+    /* nothing else to do */
+  }
+  else if (is_codeline(text, size)) {
+    len = parse_codeblock(out, text, size, parser);
+  }
+  else if (is_quoteline(text, size)) {
+    len = parse_blockquote(out, text, size, parser);
+  }
+  else if ((len = is_ruleline(text, size))) {
+    do_hrule(out, parser);
+  }
+  else if (is_fenceline(text, size)) {
+    len = parse_fencedcode(out, text, size, parser);
+  }
+  else if (is_itemline(text, size, &itemtype, &itemstart)) {
+    len = parse_list(out, itemtype, itemstart, text, size, parser);
+  }
+  else if ((len = is_htmlline(text, size, &htmlkind, parser))) {
+    len = parse_htmlblock(out, text, size, len, htmlkind, parser);
+  }
+  // TODO table lines
+  else if ((len = is_linkdef(text, size, &label, &link, &title))) {
+    /* collected in a dry run before, nothing to render */
+    if (parser->collecting) linkdef_add(parser, label, link, title);
+  }
+  else if ((len = is_blankline(text, size))) {
+    /* nothing to do, blank lines separate blocks */
+  }
+  else {
+    /* Non-blank lines that cannot be interpreted otherwise
+       form a paragraph in Markdown/CommonMark: */
+    bool unwrap = unwrapped;
+    len = parse_paragraph(out, text, size, parser, &unwrap);
+    if (pisblock) *pisblock = !unwrap;
+  }
+
+  return len;
+}
 
+
+static void
+parse_blocks(Blob *out, const char *text, size_t size, Parser *parser, BlockInfo *pinfo)
+{
+  size_t start, len;
+  bool unwrapped = pinfo && pinfo->unwrapped;
+  bool block1 = 0, blockN = 0, isblock;
+
+  parser->nesting_depth++;
+  for (start=0; start<size; start += len) {
+    len = parse_block(out, text+start, size-start, parser, unwrapped, &isblock);
     if (start == 0) block1 = isblock;
     blockN = isblock;
-
-    if (len) start += len;
-    else break;
+    if (!len) break;
   }
   parser->nesting_depth--;
 
@@ -2276,13 +2404,24 @@ parse_blocks(Blob *out, const char *text, size_t size, Parser *parser, BlockInfo
 static void
 init(Parser *parser, struct markdown *mkdn)
 {
+  size_t i;
+
   assert(parser != 0);
   assert(mkdn != 0);
 
   parser->render = *mkdn;
   parser->udata = mkdn->udata;
   parser->nesting_depth = 0;
-  parser->linkdefs = (Blob) BLOB_INIT;
+  parser->linkdefs = 0;
+  parser->nlinkdefs = 0;
+  parser->linkslots = 0;
+  parser->defpool = 0;
+  parser->collecting = false;
+  parser->wanting = false;
+  parser->nwanted = 0;
+  parser->dryrun = 0;
+  parser->recording = false;
+  parser->raw = slice(0, 0);
 
   memset(parser->blob_pool, 0, sizeof(parser->blob_pool));
   parser->pool_index = 0;
@@ -2305,6 +2444,18 @@ init(Parser *parser, struct markdown *mkdn)
   if (mkdn->linebreak) parser->livechars['\n'] = emit_linebreak;
   if (mkdn->linebreak) parser->livechars['\r'] = emit_linebreak;
 
+  /* byte classes, for a quick skip over plain text: */
+  memset(parser->charclass, 0, sizeof(parser->charclass));
+  for (i = 0; parser->emphchars[i]; i++)
+    parser->charclass[(unsigned char) parser->emphchars[i]] |= CC_EMPH;
+  parser->charclass['['] |= CC_BRACKET;
+  parser->charclass[']'] |= CC_BRACKET;
+  parser->charclass['`'] |= CC_TICK;
+  parser->charclass['<'] |= CC_ANGLE;
+  parser->charclass['\\'] |= CC_ESCAPE;
+  for (i = 0; i < ARLEN(parser->livechars); i++)
+    if (parser->livechars[i]) parser->charclass[i] |= CC_LIVE;
+
   parser->pretag = tagname_find("pre", -1);
   assert(parser->pretag != 0);
   parser->scripttag = tagname_find("script", -1);
@@ -2316,10 +2467,84 @@ init(Parser *parser, struct markdown *mkdn)
 }
 
 
+/** release the parser's memory */
+static void
+fini(Parser *parser)
+{
+  assert(parser->nesting_depth == 0);
+  mem_free(parser->linkdefs);
+  while (parser->pool_index > 0) {
+    parser->pool_index--;
+    blob_free(parser->blob_pool[parser->pool_index]);
+    mem_free(parser->blob_pool[parser->pool_index]);
+  }
+}
+
+
+static void nop_block(Blob *out, Blob *text, void *udata)
+{ UNUSED(out); UNUSED(text); UNUSED(udata); }
+static void nop_heading(Blob *out, int level, Blob *text, void *udata)
+{ UNUSED(level); nop_block(out, text, udata); }
+static void nop_codeblock(Blob *out, const char *lang, Blob *text, void *udata)
+{ UNUSED(lang); nop_block(out, text, udata); }
+static void nop_list(Blob *out, char type, int start, Blob *text, void *udata)
+{ UNUSED(type); UNUSED(start); nop_block(out, text, udata); }
+static void nop_listitem(Blob *out, int ts, int te, Blob *text, void *udata)
+{ UNUSED(ts); UNUSED(te); nop_block(out, text, udata); }
+static void nop_hrule(Blob *out, void *udata)
+{ UNUSED(out); UNUSED(udata); }
+
+
+/** block callbacks that render nothing, for dry runs */
+static void
+nop_callbacks(struct markdown *dry, const struct markdown *mkdn)
+{
+  *dry = *mkdn;
+  dry->heading = mkdn->heading ? nop_heading : 0;
+  dry->paragraph = mkdn->paragraph ? nop_block : 0;
+  dry->codeblock = mkdn->codeblock ? nop_codeblock : 0;
+  dry->blockquote = mkdn->blockquote ? nop_block : 0;
+  dry->list = mkdn->list ? nop_list : 0;
+  dry->listitem = mkdn->listitem ? nop_listitem : 0;
+  dry->hrule = mkdn->hrule ? nop_hrule : 0;
+  dry->htmlblock = mkdn->htmlblock ? nop_block : 0;
+}
+
+
+/** true iff text may contain a link definition (has "]:") */
+static bool
+has_linkdef(const char *text, size_t size)
+{
+  const char *p = text, *end = text+size;
+  while ((p = memchr(p, ']', end-p)) && ++p < end)
+    if (*p == ':') return true;
+  return false;
+}
+
+
+/** collect the link definitions in text: a dry run over its blocks,
+    so only those in block context count, as CommonMark requires */
+static void
+collect_linkdefs(Parser *parser, const char *text, size_t size)
+{
+  struct markdown render = parser->render;
+  Blob scratch = BLOB_INIT;
+
+  if (!has_linkdef(text, size)) return;
+  nop_callbacks(&parser->render, &render);
+  parser->dryrun = DRYRUN_BLOCKS;
+  parser->collecting = true;
+  parse_blocks(&scratch, text, size, parser, 0);
+  parser->render = render;
+  parser->dryrun = 0;
+  parser->collecting = false;
+  blob_free(&scratch);
+}
+
+
 PUBLIC void
 markdown(Blob *out, const char *text, size_t size, struct markdown *mkdn)
 {
-  size_t start;
   Parser parser;
   MemPool pool;
 
@@ -2330,50 +2555,763 @@ markdown(Blob *out, const char *text, size_t size, struct markdown *mkdn)
   mem_pool_init(&pool, 2000);
 
   /* 1st pass: collect references */
-  // TODO too simplistic for CM: must see linkdefs in block context
-  for (start = 0; start < size; ) {
+  parser.defpool = &pool;
+  collect_linkdefs(&parser, text, size);
+
+  /* 2nd pass: do the rendering */
+  if (mkdn->prolog) mkdn->prolog(out, mkdn->udata);
+  parse_blocks(out, text, size, &parser, false);
+  if (mkdn->epilog) mkdn->epilog(out, mkdn->udata);
+
+  fini(&parser);
+  mem_pool_free(&pool);
+}
+
+
+/* === streaming === */
+
+
+/* The stream parser buffers input until it has complete lines and
+ * then looks for complete top-level blocks: a block is complete if
+ * it ends before the last non-blank line seen so far (the remaining
+ * lines may still belong to it). Finding the extent of a block does
+ * not depend on the render callbacks, so a dry run (DRYRUN_BLOCKS)
+ * measures blocks without side effects; only complete blocks are
+ * rendered. Link definitions are collected as they come, those in
+ * other blocks (like block quotes) by a dry run over complete blocks.
+ * A block that refers to a label not yet defined (as found by a
+ * DRYRUN_LINKS) becomes a patch point: it and all blocks after it
+ * are held (as source) until all missing labels are defined or the
+ * input ends, then rendered in order. Consumed input is released.
+ * So that a stray bracket (like a[i]) cannot hold the rest of the
+ * document, held blocks are rendered anyway (links unresolved, with
+ * a warning naming the labels) once there are more than MAXHELD bytes
+ * of them.
+ */
+
+#define MAXHELD (256*1024)
+
+struct mkdnstream {
+  Parser parser;
+  struct markdown render;    /* the caller's callbacks */
+  struct markdown dryrun;    /* no-op block callbacks */
+  MemPool pool;              /* labels, links, titles of link defs */
+  Blob input;                /* input not yet consumed (after done) */
+  size_t done;               /* input consumed (rendered or held) */
+  size_t wait;               /* unfinished input at last try */
+  Blob scratch;              /* output of dry runs */
+  Blob held;                 /* source of held blocks */
+  Blob heldlens;             /* their lengths (size_t) */
+  bool started;              /* prolog emitted */
+};
+
+
+/** true iff one of the lines in text is blank */
+static bool
+has_blankline(const char *text, size_t size)
+{
+  size_t j, len;
+  for (j = 0; j < size; j += len) {
+    if (is_blankline(text+j, size-j)) return true;
+    len = scan_line(text+j, size-j);
+    if (!len) break;
+  }
+  return false;
+}
+
+
+/** parse one top-level block as a dry run or for real; return its length */
+static size_t
+stream_block(struct mkdnstream *sp, Blob *out,
+  const char *text, size_t size, int dryrun)
+{
+  Parser *parser = &sp->parser;
+  size_t len;
+
+  if (dryrun) {
+    blob_clear(&sp->scratch);
+    out = &sp->scratch;
+    parser->render = sp->dryrun;
+    parser->wanting = dryrun == DRYRUN_LINKS;
+  }
+  parser->dryrun = dryrun;
+  len = parse_block(out, text, size, parser, false, 0);
+  parser->render = sp->render;
+  parser->wanting = false;
+  parser->dryrun = 0;
+  parser->recording = false;
+  parser->raw = slice(0, 0);
+
+  return len;
+}
+
+
+/** render the held blocks and release them */
+static void
+stream_release(struct mkdnstream *sp, Blob *out)
+{
+  const char *text = blob_str(&sp->held);
+  const size_t *lens = blob_buf(&sp->heldlens);
+  size_t i, n = blob_len(&sp->heldlens)/sizeof(*lens);
+
+  for (i = 0; i < n; text += lens[i++]) {
+    stream_block(sp, out, text, lens[i], 0);
+  }
+
+  blob_clear(&sp->held);
+  blob_clear(&sp->heldlens);
+}
+
+
+/** render the held blocks with their labels unresolved; stop waiting */
+static void
+stream_giveup(struct mkdnstream *sp, Blob *out)
+{
+  Parser *parser = &sp->parser;
+  Blob *labels = blob_get(parser);
+  size_t i;
+
+  for (i = 0; i < parser->linkslots; i++) {
+    struct linkdef *p = &parser->linkdefs[i];
+    if (!p->wanted) continue;
+    blob_addfmt(labels, "%s[%.*s]", blob_len(labels) ? ", " : "",
+      (int) p->len, p->label);
+    p->wanted = false;
+  }
+  parser->nwanted = 0;
+  log_warn("mkdn: over %d KiB held, rendering without %s",
+    MAXHELD/1024, blob_str(labels));
+  blob_put(parser, labels);
+  stream_release(sp, out);
+}
+
+
+/** collect the link definitions nested in a complete block */
+static void
+stream_collect(struct mkdnstream *sp, const char *text, size_t size)
+{
+  sp->parser.collecting = true;
+  stream_block(sp, 0, text, size, DRYRUN_BLOCKS);
+  sp->parser.collecting = false;
+}
+
+
+/** consume the complete blocks of the input (all of it if atend) */
+static void
+stream_parse(struct mkdnstream *sp, Blob *out, bool atend)
+{
+  const char *text = blob_str(&sp->input);
+  size_t size = blob_len(&sp->input);
+  size_t avail, limit, pos, len, i;
+  bool holding;
+
+  if (atend) avail = limit = size;
+  else {
+    /* only complete lines, and blocks before the last non-blank line: */
+    for (avail = size; avail > sp->done && text[avail-1] != '\n'; avail--);
+    if (avail - sp->done < 2*sp->wait) return;  /* amortize dry runs */
+    for (limit = avail; limit > sp->done; limit = i) {
+      for (i = limit-1; i > sp->done && text[i-1] != '\n'; i--);
+      if (!is_blankline(text+i, limit-i)) break;
+    }
+    if (limit > sp->done) limit = i;
+  }
+
+  for (pos = sp->done; pos < limit; pos += len) {
+    const char *ptr = text+pos;
+    size_t end = avail-pos;
     Slice label, link, title;
-    size_t len = is_linkdef(text+start, size-start, &label, &link, &title);
-    if (len) {
-      struct linkdef *pdef = blob_prepare(&parser.linkdefs, sizeof(*pdef));
-      Blob *buf = blob_get(&parser);
-      make_label(label.s, label.n, buf);
-      pdef->label = mem_pool_dup(&pool, blob_str(buf), blob_len(buf));
-      assert(pdef->label != OUT_OF_MEMORY);
-      pdef->link = link;
-      pdef->title = title;
-      blob_addlen(&parser.linkdefs, sizeof(*pdef));
-      blob_put(&parser, buf);
-      start += len;
+    len = stream_block(sp, out, ptr, end, DRYRUN_BLOCKS);
+    if (!len || pos+len > limit) break;
+    if (is_linkdef(ptr, end, &label, &link, &title) == len) {
+      /* a title may follow on the next lines, but not after a blank */
+      size_t next = ptr[len-1] == '\n' ? len : len+scan_line(ptr+len, end-len);
+      if (!atend && !title.n && !has_blankline(ptr+next, end-next)) break;
+      linkdef_add(&sp->parser, label, link, title);
+      if (blob_len(&sp->heldlens) && !sp->parser.nwanted) stream_release(sp, out);
+      continue;
     }
-    else {
-      len = scan_line(text+start, size-start);
-      if (len) start += len;
-      else break;
+    if (has_linkdef(ptr, len)) {
+      stream_collect(sp, ptr, len);
+      if (blob_len(&sp->heldlens) && !sp->parser.nwanted) stream_release(sp, out);
+    }
+    holding = blob_len(&sp->heldlens) > 0;
+    if (!holding && memchr(ptr, ']', len)) {
+      stream_block(sp, out, ptr, len, DRYRUN_LINKS);
+      holding = sp->parser.nwanted > 0;
+    }
+    else if (holding && memchr(ptr, ']', len)) {
+      stream_block(sp, out, ptr, len, DRYRUN_LINKS);
     }
+    if (holding) {
+      blob_addbuf(&sp->held, ptr, len);
+      blob_addbuf(&sp->heldlens, (const char *) &len, sizeof(len));
+      if (blob_len(&sp->held) > MAXHELD) stream_giveup(sp, out);
+    }
+    else stream_block(sp, out, ptr, len, 0);
   }
 
-  /* sort link defs to allow binary search later on */
-  if (blob_len(&parser.linkdefs) > 0) {
-    qsort(blob_buf(&parser.linkdefs),
-          blob_len(&parser.linkdefs)/sizeof(struct linkdef),
-          sizeof(struct linkdef), linkdef_cmp);
+  sp->wait = pos < avail ? avail - pos : 0;
+  sp->done = pos;
+
+  /* drop consumed input (amortized, not on every call): */
+  if (sp->done > 0 && sp->done >= size - sp->done) {
+    char *s = blob_buf(&sp->input);
+    memmove(s, s + sp->done, size - sp->done);
+    blob_trunc(&sp->input, size - sp->done);
+    sp->done = 0;
   }
+}
 
-  /* 2nd pass: do the rendering */
-  if (mkdn->prolog) mkdn->prolog(out, mkdn->udata);
-  parse_blocks(out, text, size, &parser, false);
-  if (mkdn->epilog) mkdn->epilog(out, mkdn->udata);
 
-  /* release memory */
-  assert(parser.nesting_depth == 0);
-  blob_free(&parser.linkdefs);
-  while (parser.pool_index > 0) {
-    parser.pool_index--;
-    blob_free(parser.blob_pool[parser.pool_index]);
-    mem_free(parser.blob_pool[parser.pool_index]);
+PUBLIC struct mkdnstream *
+markdown_begin(struct markdown *mkdn)
+{
+  struct mkdnstream *sp;
+
+  assert(mkdn != NULL);
+  sp = mem_alloc(sizeof(*sp));
+  assert(sp != OUT_OF_MEMORY);
+  memset(sp, 0, sizeof(*sp));
+
+  init(&sp->parser, mkdn);
+  mem_pool_init(&sp->pool, 2000);
+  sp->parser.defpool = &sp->pool;
+  sp->render = *mkdn;
+
+  nop_callbacks(&sp->dryrun, mkdn);
+
+  return sp;
+}
+
+
+PUBLIC void
+markdown_feed(struct mkdnstream *sp, Blob *out, const char *text, size_t size)
+{
+  assert(sp != NULL && out != NULL);
+  if (!text || !size) return;
+
+  if (!sp->started) {
+    if (sp->render.prolog) sp->render.prolog(out, sp->render.udata);
+    sp->started = true;
+  }
+
+  blob_addbuf(&sp->input, text, size);
+  stream_parse(sp, out, false);
+}
+
+
+PUBLIC void *
+markdown_end(struct mkdnstream *sp, Blob *out)
+{
+  void *udata;
+
+  if (!sp) return 0;
+  assert(out != NULL);
+
+  if (sp->started) {
+    stream_parse(sp, out, true);
+    stream_release(sp, out);
+    if (sp->render.epilog) sp->render.epilog(out, sp->render.udata);
   }
+
+  fini(&sp->parser);
+  mem_pool_free(&sp->pool);
+  blob_free(&sp->input);
+  blob_free(&sp->scratch);
+  blob_free(&sp->held);
+  blob_free(&sp->heldlens);
+  udata = sp->render.udata;
+  mem_free(sp);
+
+  return udata;
+}
+
+
+/* === syntax tree === */
+
+
+/* markdown_parse() runs the parser with recording callbacks. Their
+ * output is the text they are given, with nodes embedded as a NUL
+ * byte and the node's index in five bytes 0x80..0xBF; a container
+ * callback decodes its content into child nodes. Text stays text,
+ * so the parser can trim and truncate it as usual (line breaks);
+ * each text run starts with NUL, 0x02 (the text callback need not
+ * be linear), and a literal NUL is escaped as NUL, 0x01. Node text points into
+ * the source where it is there (code, HTML blocks), else into the
+ * arena, as does the source of spans and the code info string.
+ * markdown_render() replays the tree through the callbacks, and
+ * where a span callback declines, it emits the span's source as
+ * text, like the parser does.
+ */
+
+struct mkdndoc {
+  struct mkdnnode node;      /* MKDN_DOCUMENT; must be first */
+  MemPool pool;              /* all nodes and copied text */
+};
+
+struct recorder {
+  struct mkdndoc *doc;
+  Parser *parser;
+  Blob nodes;                /* struct mkdnnode * by index */
+};
+
+#define NODEREF_LEN 6        /* NUL and 5 x 6 bits of node index */
+
+
+/** text in the arena, unless it is in the source */
+static const char *
+tree_text(struct recorder *rec, const char *text, size_t size)
+{
+  const char *src = rec->doc->node.text;
+  char *s;
+  if (text >= src && text+size <= src+rec->doc->node.size) return text;
+  s = mem_pool_dup(&rec->doc->pool, text, size);
+  assert(s != OUT_OF_MEMORY);
+  return s;
+}
+
+
+/** new node of the given type, embedded into out */
+static struct mkdnnode *
+tree_add(Blob *out, struct recorder *rec, int type)
+{
+  struct mkdnnode *node = mem_pool_alloc(&rec->doc->pool, sizeof(*node));
+  size_t index = blob_len(&rec->nodes)/sizeof(node);
+  char ref[NODEREF_LEN];
+  int i;
+
+  assert(node != OUT_OF_MEMORY);
+  assert(index < (1UL << 30));
+  memset(node, 0, sizeof(*node));
+  node->type = type;
+  if (type != MKDN_TEXT && rec->parser->raw.n) {
+    node->raw = tree_text(rec, rec->parser->raw.s, rec->parser->raw.n);
+    node->rawsize = rec->parser->raw.n;
+  }
+  rec->parser->raw = slice(0, 0);
+  blob_addbuf(&rec->nodes, (const char *) &node, sizeof(node));
+
+  ref[0] = 0;
+  for (i = 1; i < NODEREF_LEN; i++, index >>= 6)
+    ref[i] = (char) (0x80 | (index & 63));
+  if (out) blob_addbuf(out, ref, sizeof(ref));
+
+  return node;
+}
+
+
+/** decode recorded content into a list of nodes */
+static struct mkdnnode *
+tree_decode(struct recorder *rec, Blob *blob)
+{
+  struct mkdnnode *head = 0, **tail = &head, *node;
+  const char *s = blob_str(blob);
+  size_t i, j, k, index, n = blob_len(blob);
+  Blob *temp = blob_get(rec->parser);
+
+  for (i = 0; ; ) {
+    /* text up to the next node (or end), unescaping NULs: */
+    for (j = i; j < n; j++) {
+      if (s[j] != 0) continue;
+      if (j+1 < n && s[j+1] == 1) {
+        blob_addbuf(temp, s+i, j-i+1);
+        i = ++j + 1;
+        continue;
+      }
+      if (j+1 < n && s[j+1] == 2) break;
+      for (k = 1; k < NODEREF_LEN && j+k < n &&
+                  (s[j+k] & 0xC0) == 0x80; k++);
+      if (k == NODEREF_LEN) break;
+    }
+    blob_addbuf(temp, s+i, j-i);
+    if (blob_len(temp) > 0) {
+      node = tree_add(0, rec, MKDN_TEXT);
+      node->text = tree_text(rec, blob_str(temp), blob_len(temp));
+      node->size = blob_len(temp);
+      blob_clear(temp);
+      *tail = node; tail = &node->next;
+    }
+    if (j >= n) break;
+    if (s[j+1] == 2) { i = j+2; continue; }
+    for (index = 0, k = NODEREF_LEN-1; k > 0; k--)
+      index = (index << 6) | (s[j+k] & 63);
+    assert(index < blob_len(&rec->nodes)/sizeof(node));
+    node = ((struct mkdnnode **) blob_buf(&rec->nodes))[index];
+    *tail = node; tail = &node->next;
+    i = j + NODEREF_LEN;
+  }
+
+  blob_put(rec->parser, temp);
+  return head;
+}
+
+
+static void
+tree_raw(Blob *out, const char *text, size_t size, Parser *parser)
+{
+  struct mkdnnode *node = tree_add(out, parser->udata, MKDN_RAW);
+  node->text = tree_text(parser->udata, text, size);
+  node->size = size;
+}
+
+
+static void
+rec_text(Blob *out, const char *text, size_t size, void *udata)
+{
+  const char *p;
+  UNUSED(udata);
+  blob_addbuf(out, "\0\2", 2);  /* keep text runs apart */
+  while ((p = memchr(text, 0, size))) {
+    blob_addbuf(out, text, p-text+1);
+    blob_addchar(out, 1);
+    size -= p-text+1;
+    text = p+1;
+  }
+  blob_addbuf(out, text, size);
+}
+
+
+static void
+rec_container(Blob *out, int type, char c, int n, Blob *text, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, type);
+  node->c = c;
+  node->n = n;
+  node->down = tree_decode(udata, text);
+}
+
+
+static void
+rec_heading(Blob *out, int level, Blob *text, void *udata)
+{ rec_container(out, MKDN_HEADING, 0, level, text, udata); }
+
+static void
+rec_paragraph(Blob *out, Blob *text, void *udata)
+{ rec_container(out, MKDN_PARAGRAPH, 0, 0, text, udata); }
+
+static void
+rec_blockquote(Blob *out, Blob *text, void *udata)
+{ rec_container(out, MKDN_BLOCKQUOTE, 0, 0, text, udata); }
+
+static void
+rec_list(Blob *out, char type, int start, Blob *text, void *udata)
+{ rec_container(out, MKDN_LIST, type, start, text, udata); }
+
+static void
+rec_listitem(Blob *out, int tightstart, int tightend, Blob *text, void *udata)
+{
+  int n = (tightstart ? 1 : 0) | (tightend ? 2 : 0);
+  rec_container(out, MKDN_LISTITEM, 0, n, text, udata);
+}
+
+
+static void
+rec_codeblock(Blob *out, const char *lang, Blob *text, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_CODEBLOCK);
+  UNUSED(lang);  /* rendered again from the info string in raw */
+  node->text = tree_text(udata, blob_str(text), blob_len(text));
+  node->size = blob_len(text);
+}
+
+
+static void
+rec_hrule(Blob *out, void *udata)
+{
+  tree_add(out, udata, MKDN_HRULE);
+}
+
+
+static void
+rec_htmlblock(Blob *out, Blob *text, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_HTMLBLOCK);
+  node->text = tree_text(udata, blob_str(text), blob_len(text));
+  node->size = blob_len(text);
+}
+
+
+static bool
+rec_emphasis(Blob *out, char c, int n, Blob *text, void *udata)
+{
+  rec_container(out, MKDN_EMPHASIS, c, n, text, udata);
+  return true;
+}
+
+
+static bool
+rec_codespan(Blob *out, Blob *code, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_CODESPAN);
+  node->text = tree_text(udata, blob_str(code), blob_len(code));
+  node->size = blob_len(code);
+  return true;
+}
+
+
+static bool
+rec_link(Blob *out, Blob *link, Blob *title, Blob *body, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_LINK);
+  node->down = tree_decode(udata, body);
+  node->link = tree_decode(udata, link);
+  node->title = tree_decode(udata, title);
+  return true;
+}
+
+
+static bool
+rec_image(Blob *out, Blob *src, Blob *title, Blob *alt, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_IMAGE);
+  node->down = tree_decode(udata, alt);
+  node->link = tree_decode(udata, src);
+  node->title = tree_decode(udata, title);
+  return true;
+}
+
+
+static bool
+rec_autolink(Blob *out, char type, const char *text, size_t size, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_AUTOLINK);
+  node->c = type;
+  node->text = tree_text(udata, text, size);
+  node->size = size;
+  return true;
+}
+
+
+static bool
+rec_htmltag(Blob *out, const char *text, size_t size, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_HTMLTAG);
+  node->text = tree_text(udata, text, size);
+  node->size = size;
+  return true;
+}
+
+
+static bool
+rec_linebreak(Blob *out, void *udata)
+{
+  tree_add(out, udata, MKDN_LINEBREAK);
+  return true;
+}
+
+
+static bool
+rec_entity(Blob *out, const char *text, size_t size, void *udata)
+{
+  struct mkdnnode *node = tree_add(out, udata, MKDN_ENTITY);
+  node->text = node->raw = tree_text(udata, text, size);
+  node->size = node->rawsize = size;
+  return true;
+}
+
+
+PUBLIC struct mkdnnode *
+markdown_parse(const char *text, size_t size, const char *emphchars)
+{
+  struct markdown rec;
+  struct recorder recorder;
+  struct mkdndoc *doc;
+  Parser parser;
+  MemPool pool;
+  Blob out = BLOB_INIT;
+
+  doc = mem_alloc(sizeof(*doc));
+  assert(doc != OUT_OF_MEMORY);
+  memset(doc, 0, sizeof(*doc));
+  mem_pool_init(&doc->pool, 8000);
+  doc->node.type = MKDN_DOCUMENT;
+  doc->node.text = text;
+  doc->node.size = size;
+  if (!text || !size) return &doc->node;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.emphchars = emphchars;
+  rec.udata = &recorder;
+  rec.heading = rec_heading;
+  rec.paragraph = rec_paragraph;
+  rec.codeblock = rec_codeblock;
+  rec.blockquote = rec_blockquote;
+  rec.list = rec_list;
+  rec.listitem = rec_listitem;
+  rec.hrule = rec_hrule;
+  rec.htmlblock = rec_htmlblock;
+  rec.emphasis = rec_emphasis;
+  rec.codespan = rec_codespan;
+  rec.link = rec_link;
+  rec.image = rec_image;
+  rec.autolink = rec_autolink;
+  rec.htmltag = rec_htmltag;
+  rec.linebreak = rec_linebreak;
+  rec.entity = rec_entity;
+  rec.text = rec_text;
+
+  init(&parser, &rec);
+  recorder.doc = doc;
+  recorder.parser = &parser;
+  recorder.nodes = (Blob) BLOB_INIT;
+  mem_pool_init(&pool, 2000);
+
+  parser.defpool = &pool;
+  collect_linkdefs(&parser, text, size);
+  parser.recording = true;
+  parse_blocks(&out, text, size, &parser, 0);
+  doc->node.down = tree_decode(&recorder, &out);
+
+  blob_free(&out);
+  blob_free(&recorder.nodes);
+  fini(&parser);
   mem_pool_free(&pool);
+
+  return &doc->node;
+}
+
+
+/** render a list of nodes through the callbacks in parser */
+static void
+tree_render(Blob *out, const struct mkdnnode *node, Parser *parser, bool rawtext)
+{
+  const struct markdown *r = &parser->render;
+  void *udata = parser->udata;
+  Blob *temp, *link, *title;
+  bool done;
+
+  for (; node; node = node->next) {
+    Blob text = { (char *) node->text, node->size, 0 };  /* static blob */
+    done = true;
+    switch (node->type) {
+    case MKDN_TEXT:
+      if (r->text && !rawtext) r->text(out, node->text, node->size, udata);
+      else blob_addbuf(out, node->text, node->size);
+      break;
+    case MKDN_RAW:
+      blob_addbuf(out, node->text, node->size);
+      break;
+    case MKDN_HEADING:
+    case MKDN_PARAGRAPH:
+    case MKDN_BLOCKQUOTE:
+    case MKDN_LIST:
+    case MKDN_LISTITEM:
+      if (r->blockopen && r->blockclose) {  /* no copy of the content */
+        r->blockopen(out, node->type, node->c, node->n, udata);
+        tree_render(out, node->down, parser, false);
+        r->blockclose(out, node->type, node->c, node->n, udata);
+        break;
+      }
+      temp = blob_get(parser);
+      tree_render(temp, node->down, parser, false);
+      if (node->type == MKDN_HEADING && r->heading)
+        r->heading(out, node->n, temp, udata);
+      else if (node->type == MKDN_PARAGRAPH && r->paragraph)
+        r->paragraph(out, temp, udata);
+      else if (node->type == MKDN_BLOCKQUOTE && r->blockquote)
+        r->blockquote(out, temp, udata);
+      else if (node->type == MKDN_LIST && r->list)
+        r->list(out, node->c, node->n, temp, udata);
+      else if (node->type == MKDN_LISTITEM && r->listitem)
+        r->listitem(out, node->n & 1, node->n >> 1, temp, udata);
+      else if (node->type == MKDN_PARAGRAPH || node->type == MKDN_LISTITEM)
+        blob_add(out, temp);
+      blob_put(parser, temp);
+      break;
+    case MKDN_CODEBLOCK:
+      if (!r->codeblock) break;
+      temp = blob_get(parser);
+      emit_text(temp, node->raw, node->rawsize, parser);
+      r->codeblock(out, blob_str(temp), &text, udata);
+      blob_put(parser, temp);
+      break;
+    case MKDN_HRULE:
+      if (r->hrule) r->hrule(out, udata);
+      break;
+    case MKDN_HTMLBLOCK:
+      if (r->htmlblock) r->htmlblock(out, &text, udata);
+      break;
+    case MKDN_EMPHASIS:
+      done = false;
+      if (r->emphasis && IS_EMPH(parser, node->c)) {
+        temp = blob_get(parser);
+        tree_render(temp, node->down, parser, false);
+        done = r->emphasis(out, node->c, node->n, temp, udata);
+        blob_put(parser, temp);
+      }
+      break;
+    case MKDN_LINK:
+    case MKDN_IMAGE:
+      done = false;
+      if (node->type == MKDN_LINK ? !r->link : !r->image) break;
+      temp = blob_get(parser);
+      link = blob_get(parser);
+      title = blob_get(parser);
+      tree_render(temp, node->down, parser, false);
+      tree_render(link, node->link, parser, true);
+      tree_render(title, node->title, parser, false);
+      done = node->type == MKDN_LINK
+        ? r->link(out, link, title, temp, udata)
+        : r->image(out, link, title, temp, udata);
+      blob_put(parser, temp);
+      blob_put(parser, link);
+      blob_put(parser, title);
+      break;
+    case MKDN_CODESPAN:
+      done = r->codespan && r->codespan(out, &text, udata);
+      break;
+    case MKDN_AUTOLINK:
+      done = r->autolink &&
+             r->autolink(out, node->c, node->text, node->size, udata);
+      break;
+    case MKDN_HTMLTAG:
+      done = r->htmltag && r->htmltag(out, node->text, node->size, udata);
+      break;
+    case MKDN_LINEBREAK:
+      done = r->linebreak && r->linebreak(out, udata);
+      break;
+    case MKDN_ENTITY:
+      done = r->entity && r->entity(out, node->text, node->size, udata);
+      if (!done && rawtext) {  /* in a link destination */
+        blob_addbuf(out, node->text, node->size);
+        done = true;
+      }
+      break;
+    default:
+      assert(NOT_REACHED);
+    }
+    /* if a span was not processed, emit its source as plain text */
+    if (!done) emit_text(out, node->raw, node->rawsize, parser);
+  }
+}
+
+
+PUBLIC void
+markdown_render(Blob *out, const struct mkdnnode *doc, struct markdown *mkdn)
+{
+  Parser parser;
+
+  if (!doc || !doc->size || !mkdn) return;
+  assert(out != NULL);
+  assert(doc->type == MKDN_DOCUMENT);
+
+  init(&parser, mkdn);
+  if (mkdn->prolog) mkdn->prolog(out, mkdn->udata);
+  tree_render(out, doc->down, &parser, false);
+  if (mkdn->epilog) mkdn->epilog(out, mkdn->udata);
+  fini(&parser);
+}
+
+
+PUBLIC void
+markdown_freetree(struct mkdnnode *doc)
+{
+  struct mkdndoc *p = (struct mkdndoc *) doc;
+  if (!doc) return;
+  assert(doc->type == MKDN_DOCUMENT);
+  mem_pool_free(&p->pool);
+  mem_free(p);
 }
 
 
@@ -2389,6 +3327,12 @@ main(int argc, char **argv)
   Blob output = BLOB_INIT;
   char buf[2048];
   size_t n;
+  bool usetree = false;
+
+  if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+    usetree = true;  /* go through the syntax tree */
+    argc--; argv++;
+  }
 
   if (argc > 1) {
     FILE *fp = fopen(argv[1], "r");
@@ -2404,7 +3348,12 @@ main(int argc, char **argv)
     }
   }
 
-  mkdnhtml(&output, blob_str(&input), blob_len(&input), 0, 256);
+  if (usetree) {
+    struct mkdnnode *doc = markdown_parse(blob_str(&input), blob_len(&input), 0);
+    mkdnhtml_tree(&output, doc, 0, 256, 0, 0);
+    markdown_freetree(doc);
+  }
+  else mkdnhtml(&output, blob_str(&input), blob_len(&input), 0, 256);
 
   fputs(blob_str(&output), stdout);
   fflush(stdout);
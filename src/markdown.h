@@ -2,6 +2,7 @@
 #ifndef MARKDOWN_H
 #define MARKDOWN_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "blob.h"
@@ -25,6 +26,14 @@ struct markdown {
   void (*htmlblock)(Blob *out, Blob *text, void *udata);
   /* TOOD table/row/cell */
 
+  /* container callbacks, markdown_render() only: if both are set,
+     headings, paragraphs, block quotes, lists and list items are
+     written straight to out, open before and close after their
+     content, not passed to the callbacks above in a Blob; type is
+     an enum mkdntype, c and n as in struct mkdnnode */
+  void (*blockopen)(Blob *out, int type, char c, int n, void *udata);
+  void (*blockclose)(Blob *out, int type, char c, int n, void *udata);
+
   /* span callbacks */
   bool (*emphasis)(Blob *out, char c, int n, Blob *text, void *udata);
   bool (*codespan)(Blob *out, Blob *code, void *udata);
@@ -42,6 +51,56 @@ struct markdown {
 
 void markdown(Blob *out, const char *txt, size_t len, struct markdown *mkdn);
 
+struct mkdnstream;  /* incremental parsing, see below */
+
+struct mkdnstream *markdown_begin(struct markdown *mkdn);
+void markdown_feed(struct mkdnstream *sp, Blob *out, const char *txt, size_t len);
+void *markdown_end(struct mkdnstream *sp, Blob *out);
+  /* feed appends the output of completed blocks, end the rest;
+     end releases the stream and returns mkdn's udata */
+
+enum mkdntype {
+  MKDN_DOCUMENT, MKDN_HEADING, MKDN_PARAGRAPH, MKDN_CODEBLOCK,
+  MKDN_BLOCKQUOTE, MKDN_LIST, MKDN_LISTITEM, MKDN_HRULE, MKDN_HTMLBLOCK,
+  MKDN_RAW, MKDN_EMPHASIS, MKDN_CODESPAN, MKDN_LINK, MKDN_IMAGE,
+  MKDN_AUTOLINK, MKDN_HTMLTAG, MKDN_LINEBREAK, MKDN_ENTITY, MKDN_TEXT
+};
+
+struct mkdnnode {
+  struct mkdnnode *next;     /* next sibling */
+  struct mkdnnode *down;     /* content: blocks, inlines, body, alt */
+  struct mkdnnode *link;     /* link, image: destination */
+  struct mkdnnode *title;    /* link, image: title */
+  const char *text;          /* text, code, html, entity, source */
+  size_t size;
+  const char *raw;           /* spans: source; codeblock: info */
+  size_t rawsize;
+  unsigned char type;        /* enum mkdntype */
+  char c;                    /* list type, emphasis char, autolink type */
+  int n;                     /* heading level, list start, emphasis count,
+                                list item: 1 if tight start, 2 if tight end */
+};
+
+struct mkdnnode *markdown_parse(const char *txt, size_t len, const char *emphchars);
+void markdown_render(Blob *out, const struct mkdnnode *doc, struct markdown *mkdn);
+void markdown_freetree(struct mkdnnode *doc);
+  /* parse once into an arena-allocated tree (nodes are what the
+     callbacks would get), then render it any number of times */
+
 void mkdnhtml(Blob *out, const char *txt, size_t len, const char *wrap, int pretty);
+void mkdnhtml_collect(Blob *out, const char *txt, size_t len, const char *wrap,
+                      int pretty, Blob *links, Blob *text);
+  /* also collect links (see links.h) and plain text, if not null */
+struct mkdnstream *mkdnhtml_begin(const char *wrap, int pretty);
+void mkdnhtml_end(struct mkdnstream *sp, Blob *out);
+  /* feed with markdown_feed() between mkdnhtml_begin and _end */
+void mkdnhtml_tree(Blob *out, const struct mkdnnode *doc, const char *wrap,
+                   int pretty, Blob *links, Blob *text);
+  /* like mkdnhtml_collect() but from a tree by markdown_parse() */
+void mkdnhtml_unescape(Blob *out, const char *text, size_t size);
+  /* append text with character references (&name; &#n; &#xh;)
+     decoded, as in HTML attribute values */
+
+bool markdown_blocktag(const char *name, size_t len);
 
 #endif
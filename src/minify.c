@@ -0,0 +1,467 @@
+/* HTML, CSS, and JavaScript minifiers */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blob.h"
+#include "markdown.h"
+#include "minify.h"
+#include "utils.h"
+
+
+/* A single pass over the text, which is either white space, a
+ * comment, a tag, or other text. White space is held back until
+ * we know what follows: next to a block-level tag (as known from
+ * markdown.c) it is dropped, otherwise it shrinks to one byte.
+ * Tags are copied attribute by attribute, so the white space in
+ * between can be normalized and quotes dropped where the value
+ * cannot be misread without them. Raw text elements are copied
+ * up to their end tag as they are. Nothing here can make invalid
+ * HTML valid, but valid HTML stays valid and means the same. */
+
+#define ISWS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f')
+
+
+static size_t
+namelen(const char *s, const char *end)
+{
+  const char *p = s;
+  while (p < end && (isAlnum(*p) || *p == '-')) p++;
+  return p - s;
+}
+
+
+/** true iff the element's text is copied verbatim */
+static bool
+israw(const char *name, size_t n)
+{
+  static const char *const raw[] = { "pre", "textarea", "script", "style" };
+  size_t i;
+  for (i = 0; i < sizeof(raw)/sizeof(raw[0]); i++)
+    if (strlen(raw[i]) == n && !strnicmp(name, raw[i], n)) return true;
+  return false;
+}
+
+
+/** true iff the attribute value needs no quotes */
+static bool
+canunquote(const char *s, size_t n)
+{
+  size_t i;
+  if (n == 0 || s[n-1] == '/') return false;
+  for (i = 0; i < n; i++) {
+    char c = s[i];
+    if (ISWS(c) || c == '"' || c == '\'' || c == '=' ||
+        c == '<' || c == '>' || c == '`')
+      return false;
+  }
+  return true;
+}
+
+
+/** copy the tag at p (p[0] is '<'), minified; return end of tag */
+static const char *
+copytag(Blob *out, const char *p, const char *end)
+{
+  const char *q = p + 1;
+  bool unquoted = false;  /* last thing copied was an unquoted value */
+
+  blob_addchar(out, '<');
+  if (q < end && *q == '/') blob_addchar(out, *q++);
+  while (q < end && !ISWS(*q) && *q != '>' && !(*q == '/' && q+1 < end && q[1] == '>'))
+    blob_addchar(out, *q++);
+
+  while (q < end) {
+    const char *name;
+    while (q < end && ISWS(*q)) q++;
+    if (q >= end) break;
+    if (*q == '>') {
+      blob_addchar(out, *q++);
+      break;
+    }
+    if (*q == '/' && q+1 < end && q[1] == '>') {
+      if (unquoted) blob_addchar(out, ' ');
+      blob_addstr(out, "/>");
+      q += 2;
+      break;
+    }
+
+    /* attribute name, then maybe = and value */
+    blob_addchar(out, ' ');
+    name = q;
+    while (q < end && !ISWS(*q) && *q != '=' && *q != '>' &&
+           !(*q == '/' && q+1 < end && q[1] == '>'))
+      q++;
+    if (q == name) q++;  /* stray '=': copy it */
+    blob_addbuf(out, name, q - name);
+    unquoted = false;
+
+    while (q < end && ISWS(*q)) q++;
+    if (q < end && *q == '=') {
+      blob_addchar(out, *q++);
+      while (q < end && ISWS(*q)) q++;
+      if (q < end && (*q == '"' || *q == '\'')) {
+        const char *v = q + 1;
+        const char *e = memchr(v, *q, end - v);
+        if (!e) e = end;
+        if (canunquote(v, e - v)) {
+          blob_addbuf(out, v, e - v);
+          unquoted = true;
+        }
+        else blob_addbuf(out, q, e < end ? e+1 - q : e - q);
+        q = e < end ? e + 1 : end;
+      }
+      else {
+        const char *v = q;
+        while (q < end && !ISWS(*q) && *q != '>') q++;
+        blob_addbuf(out, v, q - v);
+        unquoted = true;
+      }
+    }
+  }
+  return q;
+}
+
+
+/** end of raw text of element name: at its end tag or at end */
+static const char *
+rawend(const char *p, const char *end, const char *name, size_t n)
+{
+  for (; p + 2 + n <= end; p++) {
+    if (p[0] == '<' && p[1] == '/' && !strnicmp(p+2, name, n) &&
+        (p + 2 + n == end || !(isAlnum(p[2+n]) || p[2+n] == '-')))
+      return p;
+  }
+  return end;
+}
+
+
+void
+minify_html(Blob *out, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *q;
+  int pending = 0;      /* held back white space: ' ' or '\n' */
+  bool trim = true;     /* drop white space here (after a block tag) */
+
+  assert(out != NULL && (text != NULL || len == 0));
+
+  while (p < end) {
+    if (ISWS(*p)) {
+      if (!pending) pending = ' ';
+      for (; p < end && ISWS(*p); p++)
+        if (*p == '\n') pending = '\n';
+      continue;
+    }
+
+    if (*p == '<' && end - p >= 4 && !memcmp(p, "<!--", 4)) {
+      for (q = p + 4; q + 3 <= end; q++)
+        if (q[0] == '-' && q[1] == '-' && q[2] == '>') break;
+      q = q + 3 <= end ? q + 3 : end;
+      if (p + 5 <= end && (p[4] == '[' || p[4] == '<')) {  /* conditional */
+        if (pending && !trim) blob_addchar(out, pending);
+        blob_addbuf(out, p, q - p);
+        pending = 0;
+        trim = false;
+      }
+      p = q;
+      continue;
+    }
+
+    if (*p == '<' && p + 1 < end &&
+        (isAlpha(p[1]) || p[1] == '!' || p[1] == '?' ||
+         (p[1] == '/' && p + 2 < end && isAlpha(p[2])))) {
+      const char *name = p + 1 + (p[1] == '/');
+      size_t n = namelen(name, end);
+      bool block = p[1] == '!' || p[1] == '?' || markdown_blocktag(name, n);
+      bool opening = p[1] != '/';
+      if (pending && !trim && !block) blob_addchar(out, pending);
+      pending = 0;
+      p = copytag(out, p, end);
+      trim = block;
+      if (opening && n && israw(name, n) && (p == end || p[-1] != '>' ||
+          p[-2] != '/')) {
+        q = rawend(p, end, name, n);
+        blob_addbuf(out, p, q - p);
+        p = q;
+        trim = false;
+      }
+      continue;
+    }
+
+    /* text, up to white space or a tag */
+    if (pending && !trim) blob_addchar(out, pending);
+    pending = 0;
+    trim = false;
+    for (q = p + 1; q < end && !ISWS(*q) && *q != '<'; q++);
+    blob_addbuf(out, p, q - p);
+    p = q;
+  }
+}
+
+
+/* === CSS and JavaScript === */
+
+
+/* Both are careful rather than clever: comments go, and white
+ * space goes where it cannot separate tokens. In CSS, that is
+ * around braces, semicolons, commas, and combinators (but not
+ * around + and -, which calc() needs), and the last semicolon
+ * in a block. In JavaScript, line breaks are kept, because the
+ * language inserts semicolons at some of them; only indentation,
+ * trailing white space, and empty lines go, and runs of blanks
+ * shrink to one or go away between punctuation. Strings, regular
+ * expression literals, template literals, and url() in CSS are
+ * copied as they are. */
+
+#define ISIDENT(c) (isAlnum(c) || (c) == '_' || (c) == '$' || ((c) & 0x80))
+
+
+/** end of quoted string at p (p[0] is the quote) */
+static const char *
+strend(const char *p, const char *end)
+{
+  char quote = *p++;
+  while (p < end && *p != quote) {
+    if (*p == '\\' && p+1 < end) p++;
+    else if (*p == '\n' && quote != '`') return p;  /* unterminated */
+    p++;
+  }
+  return p < end ? p+1 : end;
+}
+
+
+/** end of comment at p (p[0..1] is slash star) */
+static const char *
+commentend(const char *p, const char *end)
+{
+  for (p += 2; p + 1 < end; p++)
+    if (p[0] == '*' && p[1] == '/') return p + 2;
+  return end;
+}
+
+
+/** true iff white space after c is never needed */
+static bool
+cssnoafter(char c)
+{
+  return c == '{' || c == '}' || c == ';' || c == ',' || c == '>' ||
+         c == '~' || c == ':' || c == '(';
+}
+
+
+/** true iff white space before c is never needed (not ':' or '(',
+    as in "a :hover" and "and (...)") */
+static bool
+cssnobefore(char c)
+{
+  return c == '{' || c == '}' || c == ';' || c == ',' || c == '>' ||
+         c == '~' || c == ')';
+}
+
+
+/** true iff the block after this prelude holds rules, not
+    declarations: @media and the like */
+static bool
+cssgroup(const char *s, size_t n)
+{
+  static const char *const rules[] = {
+    "@media", "@supports", "@document", "@layer", "@container", "@scope"
+  };
+  size_t i, k;
+  for (i = 0; i < sizeof(rules)/sizeof(rules[0]); i++) {
+    k = strlen(rules[i]);
+    if (n >= k && !strnicmp(s, rules[i], k) && (n == k || !isAlnum(s[k])))
+      return true;
+  }
+  return false;
+}
+
+
+/** true iff what follows p, up to ';' or a brace, is a selector
+    (ends with '{'): a rule nested in declarations, as in "& :hover" */
+static bool
+cssnested(const char *p, const char *end)
+{
+  while (p < end) {
+    if (*p == '{') return true;
+    if (*p == ';' || *p == '}') return false;
+    if (*p == '"' || *p == '\'') p = strend(p, end);
+    else if (*p == '/' && p+1 < end && p[1] == '*') p = commentend(p, end);
+    else p++;
+  }
+  return false;
+}
+
+
+/** skip white space, comments, and empty declarations at p */
+static const char *
+cssskip(const char *p, const char *end)
+{
+  while (p < end) {
+    if (ISWS(*p) || *p == ';') p++;
+    else if (*p == '/' && p+1 < end && p[1] == '*') p = commentend(p, end);
+    else break;
+  }
+  return p;
+}
+
+
+void
+minify_css(Blob *out, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *q;
+  bool space = false;   /* white space held back */
+  uint64_t groups = 1;  /* bit d: block at depth d holds rules */
+  int depth = 0;        /* of nested blocks, 63 at most */
+  size_t prelude = blob_len(out);  /* where the current one began */
+
+  assert(out != NULL && (text != NULL || len == 0));
+
+  while (p < end) {
+    char c = *p;
+    if (ISWS(c)) {
+      space = true;
+      p++;
+      continue;
+    }
+    if (c == '/' && p+1 < end && p[1] == '*') {
+      p = commentend(p, end);
+      space = true;
+      continue;
+    }
+    if (c == ';') {  /* none before '}', one for many */
+      p = cssskip(p, end);
+      if (p < end && *p != '}') blob_addchar(out, ';');
+      space = false;
+      prelude = blob_len(out);
+      continue;
+    }
+
+    /* in declarations, "color : red" is "color:red" */
+    if (space && blob_len(out) > 0 && !cssnobefore(c) &&
+        !(c == ':' && !(groups >> depth & 1) && !cssnested(p, end)) &&
+        !cssnoafter(blob_str(out)[blob_len(out)-1]))
+      blob_addchar(out, ' ');
+    space = false;
+
+    if (c == '{' && depth < 63) {
+      bool group = cssgroup(blob_str(out) + prelude, blob_len(out) - prelude);
+      depth++;
+      groups = (groups & ~((uint64_t) 1 << depth)) | ((uint64_t) group << depth);
+    }
+    else if (c == '}' && depth > 0) depth--;
+
+    if (c == '"' || c == '\'') {
+      q = strend(p, end);
+      blob_addbuf(out, p, q - p);
+      p = q;
+    }
+    else if (c == '(' && p - text >= 3 && !strnicmp(p-3, "url", 3)) {
+      for (q = p+1; q < end && ISWS(*q); q++);
+      if (q < end && *q != '"' && *q != '\'') {
+        const char *e = memchr(q, ')', end - q);
+        q = e ? e + 1 : end;
+        blob_addbuf(out, p, q - p);
+        p = q;
+      }
+      else blob_addchar(out, *p++);
+    }
+    else blob_addchar(out, *p++);
+    if (c == '{' || c == '}') prelude = blob_len(out);
+  }
+}
+
+
+/** true iff a slash after the last output starts a regexp */
+static bool
+regexpok(const Blob *out)
+{
+  static const char *const keywords[] = {
+    "return", "typeof", "instanceof", "in", "of", "new", "delete",
+    "void", "throw", "case", "do", "else", "yield", "await"
+  };
+  const char *s = blob_str(out);
+  size_t n = blob_len(out), k, i;
+
+  while (n > 0 && ISWS(s[n-1])) n--;
+  if (n == 0) return true;
+  if (s[n-1] == ')' || s[n-1] == ']' || s[n-1] == '}' ||
+      s[n-1] == '"' || s[n-1] == '\'' || s[n-1] == '`')
+    return false;
+  if (!ISIDENT(s[n-1])) return true;
+  for (k = n; k > 0 && ISIDENT(s[k-1]); k--);
+  for (i = 0; i < sizeof(keywords)/sizeof(keywords[0]); i++)
+    if (strlen(keywords[i]) == n - k && !memcmp(s+k, keywords[i], n - k))
+      return true;
+  return false;
+}
+
+
+/** end of regexp literal at p (p[0] is '/'), with its flags */
+static const char *
+regexpend(const char *p, const char *end)
+{
+  bool inclass = false;
+  for (p++; p < end && *p != '\n'; p++) {
+    if (*p == '\\' && p+1 < end) p++;
+    else if (*p == '[') inclass = true;
+    else if (*p == ']') inclass = false;
+    else if (*p == '/' && !inclass) break;
+  }
+  if (p < end && *p == '/') p++;
+  while (p < end && ISIDENT(*p)) p++;
+  return p;
+}
+
+
+void
+minify_js(Blob *out, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *q;
+  int pending = 0;      /* held back white space: ' ' or '\n' */
+
+  assert(out != NULL && (text != NULL || len == 0));
+
+  while (p < end) {
+    char c = *p;
+    if (ISWS(c)) {
+      if (!pending) pending = ' ';
+      if (c == '\n') pending = '\n';
+      p++;
+      continue;
+    }
+    if (c == '/' && p+1 < end && p[1] == '/') {
+      q = memchr(p, '\n', end - p);
+      p = q ? q : end;
+      continue;
+    }
+    if (c == '/' && p+1 < end && p[1] == '*') {
+      q = commentend(p, end);
+      if (!pending) pending = ' ';
+      if (memchr(p, '\n', q - p)) pending = '\n';
+      p = q;
+      continue;
+    }
+
+    if (pending && blob_len(out) > 0) {
+      char last = blob_str(out)[blob_len(out)-1];
+      if (pending == '\n') blob_addchar(out, '\n');
+      else if ((ISIDENT(last) && ISIDENT(c)) || (last == c &&
+               (c == '+' || c == '-')) || (last == '/' && c == '/'))
+        blob_addchar(out, ' ');
+    }
+    pending = 0;
+
+    if (c == '"' || c == '\'' || c == '`')
+      q = strend(p, end);
+    else if (c == '/' && regexpok(out))
+      q = regexpend(p, end);
+    else q = p + 1;
+    blob_addbuf(out, p, q - p);
+    p = q;
+  }
+  if (blob_len(out) > 0 && blob_str(out)[blob_len(out)-1] != '\n')
+    blob_addchar(out, '\n');
+}
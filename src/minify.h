@@ -0,0 +1,28 @@
+#ifndef MINIFY_H
+#define MINIFY_H
+
+#include <stddef.h>
+
+#include "blob.h"
+
+/* Minifiers for HTML, CSS, and JavaScript: white space,
+ * comments, and (HTML) attribute quotes */
+
+void minify_html(Blob *out, const char *text, size_t len);
+void minify_css(Blob *out, const char *text, size_t len);
+void minify_js(Blob *out, const char *text, size_t len);
+
+/* Usage: minify_html() appends a minified copy of the HTML text
+   to out: runs of white space become one space (or newline, if
+   there was one) and go away next to block-level tags, comments
+   (other than conditional comments) are dropped, as are quotes
+   around attribute values that do not need them, and white space
+   within tags; the contents of pre, textarea, script, and style
+   elements are copied verbatim; in one pass, no parse tree;
+   minify_css() and minify_js() do the same for style sheets and
+   scripts: comments are dropped and white space where it does
+   not separate tokens; JavaScript keeps its line breaks (so that
+   automatic semicolon insertion is unaffected); strings, regular
+   expressions, and template literals are left alone */
+
+#endif
@@ -24,9 +24,13 @@
 #include <string.h>
 
 #include "blob.h"
+#include "links.h"
 #include "log.h"
 #include "markdown.h"
+#include "memory.h"
+#include "phash.h"
 #include "pikchr.h"
+#include "trace.h"
 
 
 #define UNUSED(x) ((void)(x))
@@ -50,120 +54,29 @@ struct html {
   const char *wrapperclass;
   bool cmout;  /* output as in CommonMark tests */
   int pretty;  /* prettiness; 0=dense, 1=looser, ... */
+  Blob *links;  /* collect links and ids here, if not null */
+  Blob *text;   /* collect plain text here, if not null */
+  size_t start; /* length of out after the last html_blockopen() */
 };
 
 
-static bool _initialized = false;
-
-
-/* HTML5 entities -- a subset needed to pass the CommonMark tests and
-   common German (umlauts) and French (acute, grave, circonflex) stuff.
-   See https://html.spec.whatwg.org/entities.json for a complete list.
-   You may add entities. Before use, sort the list with entitysort(). */
-static struct entity {
+/* HTML5 entities: the table is generated from entities.txt */
+struct entity {
   const char *name;
   size_t len;
   unsigned int code1;
   unsigned int code2;
-} entities[] = {
-  { "quot",                      4,    0x22,    0 },
-  { "amp",                       3,    0x26,    0 },
-  { "apos",                      4,    0x27,    0 },
-  { "lt",                        2,    0x3C,    0 },
-  { "gt",                        2,    0x3E,    0 },
-  /* Umlauts and German sz ligature: */
-  { "Auml",                      4,    0xC4,    0 },
-  { "Euml",                      4,    0xCB,    0 },
-  { "Iuml",                      4,    0xEF,    0 },
-  { "Ouml",                      4,    0xD6,    0 },
-  { "Uuml",                      4,    0xDC,    0 },
-  { "szlig",                     5,    0xDF,    0 },
-  { "auml",                      4,    0xE4,    0 },
-  { "euml",                      4,    0xEB,    0 },
-  { "iuml",                      4,    0xEF,    0 },
-  { "ouml",                      4,    0xF6,    0 },
-  { "uuml",                      4,    0xFC,    0 },
-  /* Common latin ligatures: */
-  { "AElig",                     5,    0xC6,    0 },
-  { "aelig",                     5,    0xE6,    0 },
-  { "OElig",                     5,  0x0152,    0 },
-  { "oelig",                     5,  0x0153,    0 },
-  /* More accented latin characters: */
-  { "Ccedil",                    6,    0xC7,    0 },
-  { "ccedil",                    6,    0xE7,    0 },
-  { "Eacute",                    6,    0xC9,    0 },
-  { "eacute",                    6,    0xE9,    0 },
-  { "acirc",                     5,    0xE2,    0 },
-  { "Acirc",                     5,    0xC2,    0 },
-  { "ecirc",                     5,    0xEA,    0 },
-  { "Ecirc",                     5,    0xCA,    0 },
-  { "icirc",                     5,    0xEE,    0 },
-  { "Icirc",                     5,    0xCE,    0 },
-  { "ocirc",                     5,    0xF4,    0 },
-  { "Ocirc",                     5,    0xD4,    0 },
-  { "ucirc",                     5,    0xFB,    0 },
-  { "Ucirc",                     5,    0xDB,    0 },
-  { "agrave",                    6,    0xE0,    0 },
-  { "Agrave",                    6,    0xC0,    0 },
-  { "egrave",                    6,    0xE8,    0 },
-  { "Egrave",                    6,    0xC8,    0 },
-  { "igrave",                    6,    0xEC,    0 },
-  { "Igrave",                    6,    0xCC,    0 },
-  { "ograve",                    6,    0xF2,    0 },
-  { "Ograve",                    6,    0xD2,    0 },
-  { "ugrave",                    6,    0xF9,    0 },
-  { "Ugrave",                    6,    0xD9,    0 },
-  /* Spaces, dashes, bullets: */
-  { "ndash",                     5,    8211,    0 },
-  { "mdash",                     5,    8212,    0 },
-  { "nbsp",                      4,     160,    0 },
-  { "ensp",                      4,    8194,    0 },
-  { "emsp",                      4,    8195,    0 },
-  { "shy",                       3,     173,    0 },  /* soft hyphen */
-  { "bull",                      4,    8226,    0 },  /* bullet */
-  /* Some more to pass the CommonMark tests: */
-  { "copy",                      4,     169,    0 },
-  { "frac34",                    6,     190,    0 },
-  { "Dcaron",                    6,     270,    0 },
-  { "HilbertSpace",             12,    8459,    0 },
-  { "DifferentialD",            13,    8518,    0 },
-  { "ClockwiseContourIntegral", 24,    8754,    0 },
-  { "ngE",                       3,    8807,  824 },
-  { 0, 0, 0, 0 }
 };
 
-
-static int
-entitycmp(const void *a, const void *b)
-{
-  const struct entity *pa = a;
-  const struct entity *pb = b;
-  if (pa->len < pb->len) return -1;
-  if (pa->len > pb->len) return +1;
-  return strncmp(pa->name, pb->name, pa->len);
-}
+#include "entities.h"
 
 
-static void
-entitysort(void)
-{
-  size_t msize = sizeof(entities[0]);
-  size_t nmemb = sizeof(entities)/msize;
-  qsort(entities, nmemb, msize, entitycmp);
-}
-
-
-static struct entity *
+static const struct entity *
 entityfind(const char *name, size_t size)
 {
-  struct entity key;
-  size_t msize = sizeof(entities[0]);
-  size_t nmemb = sizeof(entities)/msize;
   size_t len = 0;
   while (len < size && ISALNUM(name[len])) len++;
-  key.name = name;
-  key.len = len;
-  return bsearch(&key, entities, nmemb, msize, entitycmp);
+  return entities_find(name, len);
 }
 
 
@@ -231,7 +144,7 @@ is_entity(const char *text, size_t size)
 {
   size_t len = scan_entity(text, size);
   if (!len) return 0;
-  struct entity *p = entityfind(text+1, len-1);
+  const struct entity *p = entityfind(text+1, len-1);
   if (!p) return 0;
   return len;
 }
@@ -340,6 +253,14 @@ special:
 }
 
 
+/** separate the plain text of blocks (and lines) */
+static void
+addspace(struct html *phtml)
+{
+  if (phtml && phtml->text) blob_addchar(phtml->text, ' ');
+}
+
+
 static void
 html_prolog(Blob *out, void *udata)
 {
@@ -361,26 +282,106 @@ html_epilog(Blob *out, void *udata)
 }
 
 
+/** start of a container (type as in enum mkdntype); empty iff
+    nothing precedes it in the enclosing container */
 static void
-html_heading(Blob *out, int level, Blob *text, void *udata)
+openblock(Blob *out, int type, char c, int n, bool empty, struct html *phtml)
+{
+  switch (type) {
+  case MKDN_HEADING:
+    if (phtml->pretty > 0 && !empty)
+      blob_addstr(out, "\n");
+    blob_addfmt(out, "<h%d>", n);
+    break;
+  case MKDN_PARAGRAPH:
+    BLOB_ADDLIT(out, "<p>");
+    break;
+  case MKDN_BLOCKQUOTE:
+    if (!empty) blob_endline(out);
+    BLOB_ADDLIT(out, "<blockquote>\n");
+    break;
+  case MKDN_LIST:
+    if (!empty) blob_endline(out);  /* make list start on a new line */
+    if (c == '.' || c == ')') {
+      if (n == 1 || n < 0) BLOB_ADDLIT(out, "<ol>\n");
+      else blob_addfmt(out, "<ol start=\"%d\">\n", n);
+    }
+    else  /* type is '-' or '*' or '+' (but don't check here) */
+      BLOB_ADDLIT(out, "<ul>\n");
+    break;
+  case MKDN_LISTITEM:  /* n: 1 if tight start, 2 if tight end */
+    BLOB_ADDLIT(out, "<li>");
+    if (!(n & 1)) blob_addchar(out, '\n');
+    break;
+  }
+}
+
+
+/** end of a container, after its content */
+static void
+closeblock(Blob *out, int type, char c, int n, struct html *phtml)
+{
+  switch (type) {
+  case MKDN_HEADING:
+    blob_addfmt(out, "</h%d>\n", n);
+    addspace(phtml);
+    break;
+  case MKDN_PARAGRAPH:
+    blob_trimend(out);
+    BLOB_ADDLIT(out, "</p>\n");
+    addspace(phtml);
+    break;
+  case MKDN_BLOCKQUOTE:
+    BLOB_ADDLIT(out, "</blockquote>\n");
+    break;
+  case MKDN_LIST:
+    if (c == '.' || c == ')') BLOB_ADDLIT(out, "</ol>\n");
+    else BLOB_ADDLIT(out, "</ul>\n");
+    break;
+  case MKDN_LISTITEM:
+    if (n & 2) blob_trimend(out);
+    BLOB_ADDLIT(out, "</li>\n");
+    addspace(phtml);
+    break;
+  }
+}
+
+
+/* Containers from a syntax tree are written straight to out:
+ * the enclosing one is empty if nothing was written since the
+ * last open (a sibling or descendant always writes something) */
+
+static void
+html_blockopen(Blob *out, int type, char c, int n, void *udata)
 {
   struct html *phtml = udata;
-  if (phtml->pretty > 0 && blob_len(out) > 0)
-    blob_addstr(out, "\n");
-  blob_addfmt(out, "<h%d>", level);
+  openblock(out, type, c, n, blob_len(out) == phtml->start, phtml);
+  phtml->start = blob_len(out);
+}
+
+
+static void
+html_blockclose(Blob *out, int type, char c, int n, void *udata)
+{
+  closeblock(out, type, c, n, udata);
+}
+
+
+static void
+html_heading(Blob *out, int level, Blob *text, void *udata)
+{
+  openblock(out, MKDN_HEADING, 0, level, blob_len(out) == 0, udata);
   blob_add(out, text);
-  blob_addfmt(out, "</h%d>\n", level);
+  closeblock(out, MKDN_HEADING, 0, level, udata);
 }
 
 
 static void
 html_paragraph(Blob *out, Blob *text, void *udata)
 {
-  UNUSED(udata);
-  BLOB_ADDLIT(out, "<p>");
+  openblock(out, MKDN_PARAGRAPH, 0, 0, blob_len(out) == 0, udata);
   blob_add(out, text);
-  blob_trimend(out);
-  BLOB_ADDLIT(out, "</p>\n");
+  closeblock(out, MKDN_PARAGRAPH, 0, 0, udata);
 }
 
 
@@ -398,11 +399,9 @@ html_hrule(Blob *out, void *udata)
 static void
 html_blockquote(Blob *out, Blob *text, void *udata)
 {
-  UNUSED(udata);
-  blob_endline(out);
-  BLOB_ADDLIT(out, "<blockquote>\n");
+  openblock(out, MKDN_BLOCKQUOTE, 0, 0, blob_len(out) == 0, udata);
   blob_add(out, text);
-  BLOB_ADDLIT(out, "</blockquote>\n");
+  closeblock(out, MKDN_BLOCKQUOTE, 0, 0, udata);
 }
 
 
@@ -450,7 +449,9 @@ render_pikchr(Blob *out, const char *info, Blob *text)
 
   UNUSED(info); // TODO get flags from info
 
+  trace_begin("pikchr", "render_pikchr", 0);
   svg = pikchr(blob_str(text), "pikchr", flags, &wd, &ht);
+  trace_end();
 
   if (svg && wd >= 0) {
     log_debug("pikchr: wd=%d ht=%d", wd, ht);
@@ -507,38 +508,27 @@ html_codeblock(Blob *out, const char *lang, Blob *text, void *udata)
 static void
 html_listitem(Blob *out, int tightstart, int tightend, Blob *text, void *udata)
 {
-  UNUSED(udata);
-  BLOB_ADDLIT(out, "<li>");
-  if (!tightstart) blob_addchar(out, '\n');
+  int n = (tightstart ? 1 : 0) | (tightend ? 2 : 0);
+  openblock(out, MKDN_LISTITEM, 0, n, blob_len(out) == 0, udata);
   blob_add(out, text);
-  if (tightend) blob_trimend(out);
-  BLOB_ADDLIT(out, "</li>\n");
+  closeblock(out, MKDN_LISTITEM, 0, n, udata);
 }
 
 
 static void
 html_list(Blob *out, char type, int start, Blob *text, void *udata)
 {
-  UNUSED(udata);
-  blob_endline(out);  /* make list start on a new line */
-  if (type == '.' || type == ')') {
-    if (start == 1 || start < 0) BLOB_ADDLIT(out, "<ol>\n");
-    else blob_addfmt(out, "<ol start=\"%d\">\n", start);
-    blob_add(out, text);
-    BLOB_ADDLIT(out, "</ol>\n");
-  }
-  else {  /* type is '-' or '*' or '+' (but don't check here) */
-    BLOB_ADDLIT(out, "<ul>\n");
-    blob_add(out, text);
-    BLOB_ADDLIT(out, "</ul>\n");
-  }
+  openblock(out, MKDN_LIST, type, start, blob_len(out) == 0, udata);
+  blob_add(out, text);
+  closeblock(out, MKDN_LIST, type, start, udata);
 }
 
 
 static void
 html_htmlblock(Blob *out, Blob *text, void *udata)
 {
-  UNUSED(udata);
+  struct html *phtml = udata;
+  links_scan(phtml->links, blob_str(text), blob_len(text));
   // TODO trim text?
   blob_add(out, text);
   blob_endline(out);
@@ -554,6 +544,7 @@ html_codespan(Blob *out, Blob *code, void *udata)
     BLOB_ADDLIT(out, "<code>");
     quote_code(out, blob_str(code), blob_len(code), quotequot);
     BLOB_ADDLIT(out, "</code>");
+    if (phtml->text) blob_add(phtml->text, code);
   }
   return true;
 }
@@ -588,8 +579,9 @@ html_emphasis(Blob *out, char c, int n, Blob *text, void *udata)
 static bool
 html_link(Blob *out, Blob *link, Blob *title, Blob *body, void *udata)
 {
-  UNUSED(udata);
+  struct html *phtml = udata;
   /* <a href="LINK" title="TITLE">BODY</a> */
+  links_addhref(phtml->links, blob_str(link), blob_len(link));
 
   BLOB_ADDLIT(out, "<a href=\"");
   quote_attr(out, blob_str(link), blob_len(link), URLENCODE);
@@ -611,6 +603,7 @@ html_image(Blob *out, Blob *src, Blob *title, Blob *alt, void *udata)
 {
   /* <img src="SRC" title="TITLE" alt="ALT" /> */
   struct html *phtml = udata;
+  links_addhref(phtml->links, blob_str(src), blob_len(src));
   BLOB_ADDLIT(out, "<img src=\"");
   quote_attr(out, blob_str(src), blob_len(src), URLENCODE);
   blob_addchar(out, '"');
@@ -644,6 +637,7 @@ html_autolink(Blob *out, char type, const char *text, size_t size, void *udata)
     size -= 7;
   }
 
+  if (!ismail) links_addhref(phtml->links, text, size);
   BLOB_ADDLIT(out, "<a href=\"");
   if (ismail) BLOB_ADDLIT(out, "mailto:");
   quote_attr(out, text, size, URLENCODE);
@@ -658,7 +652,8 @@ html_autolink(Blob *out, char type, const char *text, size_t size, void *udata)
 static bool
 html_htmltag(Blob *out, const char *text, size_t size, void *udata)
 {
-  UNUSED(udata);
+  struct html *phtml = udata;
+  links_scan(phtml->links, text, size);
   blob_addbuf(out, text, size);
   return true;
 }
@@ -669,6 +664,7 @@ html_linebreak(Blob *out, void *udata)
 {
   struct html *phtml = udata;
   blob_trimend(out);
+  addspace(phtml);
   if (phtml->cmout)
     BLOB_ADDLIT(out, "<br />\n");
   else
@@ -677,17 +673,16 @@ html_linebreak(Blob *out, void *udata)
 }
 
 
-static bool
-html_entity(Blob *out, const char *text, size_t size, void *udata)
+/** decode entity text[0..size-1] as UTF-8 into buf (16 bytes);
+    return the number of bytes, 0 if it is not a valid entity */
+static size_t
+decode_entity(const char *text, size_t size, char *buf)
 {
   static const long replacement = 0xFFFD;
-  struct entity *p;
-  struct html *phtml = udata;
-  int quotequot = phtml->cmout;
-  char buf[16], *ptr;
-  size_t n;
+  const struct entity *p;
+  char *ptr = buf;
 
-  if (size < 3 && text[0] != '&') return false;
+  if (size < 3 || text[0] != '&') return 0;
   if (text[1] == '#') {
     long cp;
     if (text[2] == 'x' || text[2] == 'X') {
@@ -696,29 +691,38 @@ html_entity(Blob *out, const char *text, size_t size, void *udata)
     else {
       cp = scandec(text+2, size-2);
     }
-    if (cp < 0 || cp > 1114111) return false; /* out of UTF-8 range */
+    if (cp < 0 || cp > 1114111) return 0; /* out of UTF-8 range */
     if (cp == 0) cp = replacement;  /* by CM 2.3 */
-    ptr = buf;
     UTF8_PUT(cp, ptr);
-    n = ptr-buf;
-    quote_text(out, buf, n, quotequot);
-    return true;
+    return ptr-buf;
   }
 
   /* Named character reference: */
   p = entityfind(text+1, size-1);
   if (p && p->code1) {
-    ptr = buf;
     UTF8_PUT(p->code1, ptr);
     if (p->code2) {
       UTF8_PUT(p->code2, ptr);
     }
-    n = ptr-buf;
-    quote_text(out, buf, n, quotequot);
-    return true;
+    return ptr-buf;
   }
 
-  return false;
+  return 0;
+}
+
+
+static bool
+html_entity(Blob *out, const char *text, size_t size, void *udata)
+{
+  struct html *phtml = udata;
+  int quotequot = phtml->cmout;
+  char buf[16];
+  size_t n = decode_entity(text, size, buf);
+
+  if (!n) return false;
+  quote_text(out, buf, n, quotequot);
+  if (phtml->text) blob_addbuf(phtml->text, buf, n);
+  return true;
 }
 
 
@@ -728,53 +732,127 @@ html_text(Blob *out, const char *text, size_t size, void *udata)
   struct html *phtml = udata;
   int quotequot = phtml->cmout;
   quote_text(out, text, size, quotequot);
+  if (phtml->text) blob_addbuf(phtml->text, text, size);
 }
 
 
 void
 mkdnhtml(Blob *out, const char *txt, size_t len, const char *wrap, int pretty)
 {
-  struct markdown rndr;
-  struct html opts;
+  mkdnhtml_collect(out, txt, len, wrap, pretty, 0, 0);
+}
 
-  if (!_initialized) {
-    entitysort();
-    _initialized = true;
-  }
 
-  memset(&opts, 0, sizeof(opts));
-  memset(&rndr, 0, sizeof(rndr));
+/** set up the HTML render callbacks and their options */
+static void
+setup(struct markdown *rndr, struct html *opts, const char *wrap,
+      int pretty, Blob *links, Blob *text)
+{
+  memset(opts, 0, sizeof(*opts));
+  memset(rndr, 0, sizeof(*rndr));
 
-  rndr.udata = &opts;
-  rndr.emphchars = 0;  /* use defaults */
+  rndr->udata = opts;
+  rndr->emphchars = 0;  /* use defaults */
 
   if (wrap) {
-    rndr.prolog = html_prolog;
-    rndr.epilog = html_epilog;
-    opts.wrapperclass = wrap;
+    rndr->prolog = html_prolog;
+    rndr->epilog = html_epilog;
+    opts->wrapperclass = wrap;
   }
-  opts.pretty = pretty & 255;
-  opts.cmout = !!(pretty & 256);
-
-  rndr.heading = html_heading;
-  rndr.paragraph = html_paragraph;
-  rndr.hrule = html_hrule;
-  rndr.blockquote = html_blockquote;
-  rndr.codeblock = html_codeblock;
-  rndr.listitem = html_listitem;
-  rndr.list = html_list;
-  rndr.htmlblock = html_htmlblock;
-
-  rndr.codespan = html_codespan;
-  rndr.emphasis = html_emphasis;
-  rndr.link = html_link;
-  rndr.image = html_image;
-  rndr.autolink = html_autolink;
-  rndr.htmltag = html_htmltag;
-  rndr.linebreak = html_linebreak;
-
-  rndr.entity = html_entity;
-  rndr.text = html_text;
+  opts->pretty = pretty & 255;
+  opts->cmout = !!(pretty & 256);
+  opts->links = links;
+  opts->text = text;
+
+  rndr->heading = html_heading;
+  rndr->paragraph = html_paragraph;
+  rndr->hrule = html_hrule;
+  rndr->blockquote = html_blockquote;
+  rndr->codeblock = html_codeblock;
+  rndr->listitem = html_listitem;
+  rndr->list = html_list;
+  rndr->htmlblock = html_htmlblock;
+
+  rndr->codespan = html_codespan;
+  rndr->emphasis = html_emphasis;
+  rndr->link = html_link;
+  rndr->image = html_image;
+  rndr->autolink = html_autolink;
+  rndr->htmltag = html_htmltag;
+  rndr->linebreak = html_linebreak;
+
+  rndr->entity = html_entity;
+  rndr->text = html_text;
+}
+
+
+void
+mkdnhtml_collect(Blob *out, const char *txt, size_t len, const char *wrap,
+                 int pretty, Blob *links, Blob *text)
+{
+  struct markdown rndr;
+  struct html opts;
+
+  setup(&rndr, &opts, wrap, pretty, links, text);
 
+  trace_begin("markdown", "mkdnhtml", 0);
   markdown(out, txt, len, &rndr);
+  trace_end();
+}
+
+
+void
+mkdnhtml_tree(Blob *out, const struct mkdnnode *doc, const char *wrap,
+              int pretty, Blob *links, Blob *text)
+{
+  struct markdown rndr;
+  struct html opts;
+
+  setup(&rndr, &opts, wrap, pretty, links, text);
+  rndr.blockopen = html_blockopen;
+  rndr.blockclose = html_blockclose;
+
+  trace_begin("markdown", "mkdnhtml_tree", 0);
+  markdown_render(out, doc, &rndr);
+  trace_end();
+}
+
+
+void
+mkdnhtml_unescape(Blob *out, const char *text, size_t size)
+{
+  const char *amp, *end = text + size;
+  char buf[16];
+  size_t len, n;
+
+  while ((amp = memchr(text, '&', end - text))) {
+    blob_addbuf(out, text, amp - text);
+    len = scan_entity(amp, end - amp);
+    if (len && (n = decode_entity(amp, len, buf)) > 0)
+      blob_addbuf(out, buf, n);
+    else
+      blob_addbuf(out, amp, len = 1);
+    text = amp + len;
+  }
+  blob_addbuf(out, text, end - text);
+}
+
+
+struct mkdnstream *
+mkdnhtml_begin(const char *wrap, int pretty)
+{
+  struct markdown rndr;
+  struct html *opts = mem_alloc(sizeof(*opts));
+  assert(opts != NULL);
+
+  setup(&rndr, opts, wrap, pretty, 0, 0);
+
+  return markdown_begin(&rndr);
+}
+
+
+void
+mkdnhtml_end(struct mkdnstream *sp, Blob *out)
+{
+  mem_free(markdown_end(sp, out));  /* the struct html */
 }
@@ -0,0 +1,194 @@
+/* Generate a perfect hash table (see phash.h) */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phash.h"
+
+#define MAXKEYS 8192
+#define MAXLINE 512
+#define MAXDISP 65535
+
+struct key {
+  char *name;
+  size_t len;
+  char *fields;              /* rest of the line: more initializers */
+  unsigned long bucket;
+};
+
+static struct key keys[MAXKEYS];
+static size_t nkeys;
+static bool fold;
+
+
+static void
+die(const char *msg, const char *arg)
+{
+  fprintf(stderr, "mkphash: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+  exit(1);
+}
+
+
+static char *
+copystr(const char *s, size_t n)
+{
+  char *t = malloc(n+1);
+  if (!t) die("out of memory", 0);
+  memcpy(t, s, n);
+  t[n] = 0;
+  return t;
+}
+
+
+/** read "key [fields]" lines; skip blank lines and # comments */
+static void
+readkeys(FILE *fp)
+{
+  char line[MAXLINE];
+  size_t i, j, n;
+
+  while (fgets(line, sizeof(line), fp)) {
+    n = strlen(line);
+    if (n == sizeof(line)-1 && line[n-1] != '\n' && !feof(fp))
+      die("line too long", 0);
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r' ||
+                     line[n-1] == ' ' || line[n-1] == '\t')) n--;
+    line[n] = 0;
+    for (i = 0; line[i] == ' ' || line[i] == '\t'; i++);
+    if (!line[i] || line[i] == '#') continue;
+    for (j = i; line[j] && line[j] != ' ' && line[j] != '\t'; j++);
+    if (nkeys >= MAXKEYS) die("too many keys", 0);
+    keys[nkeys].name = copystr(line+i, j-i);
+    keys[nkeys].len = j-i;
+    while (line[j] == ' ' || line[j] == '\t') j++;
+    keys[nkeys].fields = copystr(line+j, n-j);
+    nkeys++;
+  }
+}
+
+
+static int
+bucketcmp(const void *a, const void *b)
+{
+  const struct key *const *pa = a;
+  const struct key *const *pb = b;
+  if ((*pa)->bucket != (*pb)->bucket)
+    return (*pa)->bucket < (*pb)->bucket ? -1 : 1;
+  return 0;
+}
+
+
+/** find a displacement per bucket; fill slots[] (key index+1 or 0) */
+static void
+displace(unsigned long nbuckets, unsigned long nslots,
+         unsigned *disp, size_t *slots)
+{
+  struct key **order = malloc(nkeys * sizeof(*order));
+  size_t *size = calloc(nbuckets, sizeof(*size));
+  size_t *first = calloc(nbuckets, sizeof(*first));
+  unsigned long *tried = malloc(nkeys * sizeof(*tried));
+  unsigned long b, d, k, r, done;
+  size_t i;
+
+  if (!order || !size || !first || !tried) die("out of memory", 0);
+  for (i = 0; i < nkeys; i++) {
+    keys[i].bucket = phash(keys[i].name, keys[i].len, 0, fold) % nbuckets;
+    order[i] = &keys[i];
+    size[keys[i].bucket]++;
+  }
+  qsort(order, nkeys, sizeof(*order), bucketcmp);
+  for (i = nkeys; i > 0; i--) first[order[i-1]->bucket] = i-1;
+
+  /* largest buckets first, while there are many free slots */
+  for (done = 0; done < nbuckets; done++) {
+    unsigned long big = 0;
+    for (b = 1; b < nbuckets; b++)
+      if (size[b] > size[big]) big = b;
+    b = big;
+    if (!size[b]) break;
+    for (d = 1; d <= MAXDISP; d++) {
+      for (k = 0; k < size[b]; k++) {
+        struct key *p = order[first[b]+k];
+        tried[k] = phash(p->name, p->len, d, fold) % nslots;
+        if (slots[tried[k]]) break;
+        for (r = 0; r < k && tried[r] != tried[k]; r++);
+        if (r < k) break;
+      }
+      if (k == size[b]) break;
+    }
+    if (d > MAXDISP) die("no displacement found", order[first[b]]->name);
+    for (k = 0; k < size[b]; k++)
+      slots[tried[k]] = order[first[b]+k] - keys + 1;
+    disp[b] = d;
+    size[b] = 0;
+  }
+
+  free(order);
+  free(size);
+  free(first);
+  free(tried);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  const char *type, *name;
+  unsigned long nbuckets, nslots;
+  unsigned *disp;
+  size_t *slots, i, j;
+
+  if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+    fold = true;
+    argc--; argv++;
+  }
+  if (argc != 3) die("usage: mkphash [-i] STRUCT NAME < keys > NAME.h", 0);
+  type = argv[1];
+  name = argv[2];
+
+  readkeys(stdin);
+  if (!nkeys) die("no keys", 0);
+  for (i = 0; i < nkeys; i++)
+    for (j = 0; j < i; j++)
+      if (keys[i].len == keys[j].len &&
+          phash_equal(keys[i].name, keys[j].name, keys[i].len, fold))
+        die("duplicate key", keys[i].name);
+
+  /* about two keys per bucket, at most half of the slots used */
+  for (nbuckets = 1; nbuckets < (nkeys+1)/2; nbuckets *= 2);
+  for (nslots = 1; nslots < 2*nkeys; nslots *= 2);
+  disp = calloc(nbuckets, sizeof(*disp));
+  slots = calloc(nslots, sizeof(*slots));
+  if (!disp || !slots) die("out of memory", 0);
+  displace(nbuckets, nslots, disp, slots);
+
+  printf("/* generated by mkphash -- do not edit */\n\n");
+  printf("static const struct %s %s[%lu] = {\n", type, name, nslots);
+  for (i = 0; i < nslots; i++) {
+    struct key *p = slots[i] ? &keys[slots[i]-1] : 0;
+    if (!p) printf("  { 0 },\n");
+    else printf("  { \"%s\", %zu%s%s },\n", p->name, p->len,
+                *p->fields ? ", " : "", p->fields);
+  }
+  printf("};\n\n");
+
+  printf("static const unsigned short %s_disp[%lu] = {", name, nbuckets);
+  for (i = 0; i < nbuckets; i++)
+    printf("%s%u%s", i % 12 ? " " : "\n  ", disp[i], i+1 < nbuckets ? "," : "");
+  printf("\n};\n\n");
+
+  printf("static const struct %s *\n", type);
+  printf("%s_find(const char *key, size_t len)\n{\n", name);
+  printf("  unsigned long d = %s_disp[phash(key, len, 0, %d) %% %lu];\n",
+         name, fold, nbuckets);
+  printf("  const struct %s *p = &%s[phash(key, len, d, %d) %% %lu];\n",
+         type, name, fold, nslots);
+  printf("  if (p->name && p->len == len && phash_equal(p->name, key, len, %d))\n",
+         fold);
+  printf("    return p;\n");
+  printf("  return 0;\n}\n");
+
+  return 0;
+}
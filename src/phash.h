@@ -0,0 +1,51 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Perfect hashing for static tables: mkphash generates the table
+ * and a lookup function at build time (hash and displace: a first
+ * hash picks a bucket, whose displacement is the seed for a second
+ * hash that picks the slot; no two keys share a slot) */
+
+#define PHASH_FOLD(c) ('A' <= (c) && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+
+/** 32 bit FNV-1a with a final mix, ASCII case folded if fold */
+static unsigned long
+phash(const char *s, size_t n, unsigned long seed, bool fold)
+{
+  unsigned long h = (2166136261UL ^ seed) & 0xFFFFFFFFUL;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char c = (unsigned char) s[i];
+    h ^= fold ? PHASH_FOLD(c) : c;
+    h = (h * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  h ^= h >> 16;
+  h = (h * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+  h ^= h >> 13;
+  return h;
+}
+
+
+/** compare n chars of s and t (ASCII case folded if fold) */
+static bool
+phash_equal(const char *s, const char *t, size_t n, bool fold)
+{
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char a = (unsigned char) s[i], b = (unsigned char) t[i];
+    if (fold ? PHASH_FOLD(a) != PHASH_FOLD(b) : a != b) return false;
+  }
+  return true;
+}
+
+/* Usage: `mkphash [-i] STRUCT NAME < keys > NAME.h` writes NAME[]
+   (struct STRUCT with name and len first, then the fields from the
+   key's line) and NAME_find(key, len), which returns the entry or
+   null; -i for case-insensitive keys. Include phash.h and define
+   struct STRUCT before the generated file. */
+
+#endif
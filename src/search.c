@@ -0,0 +1,584 @@
+/* Search index */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "hash.h"
+#include "log.h"
+#include "search.h"
+#include "utils.h"
+
+
+/* The Markdown renderer hands its plain text to the build (see
+ * mkdnhtml.c), so indexing needs no second pass over the HTML. A
+ * term is a run of ASCII letters and digits (lowercased) and of
+ * non-ASCII bytes, so UTF-8 words stay whole; terms shorter than
+ * MINTERM or longer than MAXTERM are dropped. Each page's terms,
+ * with their counts, are kept as lines "term count\n", sorted, and
+ * carried over from the previous build (SEARCH_FILE in build.c)
+ * for pages that were not rendered.
+ *
+ * To write the index, all (term, page, count) triples go into one
+ * array, which is sorted by term and then page; that gives every
+ * term's posting list, and the shards (by first character) come
+ * out in order. Page numbers are delta-encoded, so a posting list
+ * is [delta, count, delta, count, ...] of small numbers, in JSON,
+ * which the client reads without a decoder of its own. */
+
+#define MAGIC "JOTSEARCH 1"
+#define MINTERM 2
+#define MAXTERM 40
+
+struct doc {
+  char *path;           /* output path */
+  char *title;
+  char *terms;          /* lines "term count\n", sorted */
+  size_t len;
+  uint32_t id;          /* page number, by path */
+  bool seen;            /* rendered or kept in this build */
+};
+
+struct term {
+  const char *term;     /* not terminated */
+  uint32_t len;
+  uint32_t doc;         /* page number */
+  uint32_t count;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  Blob docs;            /* array of struct doc */
+  size_t ndocs;
+  uint32_t *slots;      /* hash table by path: doc index + 1, or 0 */
+  size_t nslots;        /* a power of 2 */
+} search = { PTHREAD_MUTEX_INITIALIZER, BLOB_INIT, 0, 0, 0 };
+
+#define DOCS ((struct doc *) blob_buf(&search.docs))
+
+static const char client[] =
+  "/* jot search: jotSearch(query) returns a promise of results\n"
+  "   [{url, title, score}], best first; the last word is a prefix */\n"
+  "var jotSearch = (function () {\n"
+  "  var script = document.currentScript;\n"
+  "  var base = script ? script.src.replace(/[^\\/]*$/, \"\") : \"/search/\";\n"
+  "  var files = {};\n"
+  "  function get(name) {\n"
+  "    if (!files[name]) files[name] = fetch(base + name)\n"
+  "      .then(function (r) { return r.ok ? r.json() : {}; });\n"
+  "    return files[name];\n"
+  "  }\n"
+  "  function shard(term) {\n"
+  "    return /^[a-z0-9]/.test(term) ? term.charAt(0) : \"_\";\n"
+  "  }\n"
+  "  function terms(query) {\n"
+  "    return query.replace(/[A-Z]/g, function (c) { return c.toLowerCase(); })\n"
+  "      .split(/[^a-z0-9\\u0080-\\uffff]+/)\n"
+  "      .filter(function (t) { return t.length >= 2; });\n"
+  "  }\n"
+  "  return function (query) {\n"
+  "    var words = terms(query);\n"
+  "    if (!words.length) return Promise.resolve([]);\n"
+  "    return Promise.all([get(\"pages.json\")].concat(words.map(function (t) {\n"
+  "      return get(\"s-\" + shard(t) + \".json\");\n"
+  "    }))).then(function (r) {\n"
+  "      var pages = r[0], scores = null;\n"
+  "      words.forEach(function (word, i) {\n"
+  "        var index = r[i+1], hits = {}, last = i == words.length - 1;\n"
+  "        Object.keys(index).forEach(function (term) {\n"
+  "          if (term !== word && !(last && term.indexOf(word) === 0)) return;\n"
+  "          var list = index[term], id = 0;\n"
+  "          var idf = Math.log(1 + pages.length / (list.length / 2));\n"
+  "          for (var j = 0; j < list.length; j += 2) {\n"
+  "            id += list[j];\n"
+  "            hits[id] = (hits[id] || 0) + list[j+1] * idf;\n"
+  "          }\n"
+  "        });\n"
+  "        if (scores) for (var id in hits)\n"
+  "          if (id in scores) hits[id] += scores[id]; else delete hits[id];\n"
+  "        scores = hits;\n"
+  "      });\n"
+  "      return Object.keys(scores).map(function (id) {\n"
+  "        return { url: pages[id][0], title: pages[id][1], score: scores[id] };\n"
+  "      }).sort(function (a, b) { return b.score - a.score; });\n"
+  "    });\n"
+  "  };\n"
+  "})();\n";
+
+
+/* === pages === */
+
+
+static uint32_t *
+findslot(const char *path)
+{
+  size_t i = hash64(path, strlen(path), 0) & (search.nslots-1);
+  while (search.slots[i] && strcmp(DOCS[search.slots[i]-1].path, path))
+    i = (i + 1) & (search.nslots-1);
+  return &search.slots[i];
+}
+
+
+static bool
+rehash(size_t n)
+{
+  uint32_t *old = search.slots;
+  size_t i;
+  search.slots = calloc(n, sizeof(*search.slots));
+  if (!search.slots) {
+    search.slots = old;
+    return false;
+  }
+  free(old);
+  search.nslots = n;
+  for (i = 0; i < search.ndocs; i++)
+    *findslot(DOCS[i].path) = i + 1;
+  return true;
+}
+
+
+/** the doc for path, added if new; null if out of memory */
+static struct doc *
+getdoc(const char *path)
+{
+  struct doc *doc;
+  uint32_t *slot;
+
+  if (search.nslots > 0 && *(slot = findslot(path)))
+    return &DOCS[*slot-1];
+  if (2 * (search.ndocs+1) > search.nslots &&
+      !rehash(search.nslots ? 2 * search.nslots : 256))
+    return 0;
+  doc = blob_prepare(&search.docs, sizeof(*doc));
+  if (!doc) return 0;
+  memset(doc, 0, sizeof(*doc));
+  doc->path = strcopy(path);
+  if (!doc->path) return 0;
+  blob_addlen(&search.docs, sizeof(*doc));
+  search.ndocs++;
+  *findslot(path) = search.ndocs;
+  return doc;
+}
+
+
+/** set the page's title and terms (copied) */
+static void
+putdoc(const char *path, const char *title, const char *terms, size_t len)
+{
+  struct doc *doc;
+  char *tcopy = strcopy(title), *copy = malloc(len + 1);
+
+  pthread_mutex_lock(&search.lock);
+  doc = tcopy && copy ? getdoc(path) : 0;
+  if (!doc) {
+    log_warn("search: out of memory");
+    free(tcopy);
+    free(copy);
+  }
+  else {
+    memcpy(copy, terms, len);
+    copy[len] = '\0';
+    free(doc->title);
+    free(doc->terms);
+    doc->title = tcopy;
+    doc->terms = copy;
+    doc->len = len;
+    doc->seen = true;
+  }
+  pthread_mutex_unlock(&search.lock);
+}
+
+
+static inline bool
+istermchar(unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+
+static int
+termcmp(const void *a, const void *b)
+{
+  const struct term *s = a, *t = b;
+  int c = memcmp(s->term, t->term, s->len < t->len ? s->len : t->len);
+  if (c) return c;
+  if (s->len != t->len) return s->len < t->len ? -1 : 1;
+  return s->doc < t->doc ? -1 : s->doc > t->doc;
+}
+
+
+static inline bool
+sameterm(const struct term *s, const struct term *t)
+{
+  return s->len == t->len && !memcmp(s->term, t->term, s->len);
+}
+
+
+void
+search_page(const char *path, const char *title, const char *text, size_t len)
+{
+  Blob lower = BLOB_INIT, terms = BLOB_INIT, lines = BLOB_INIT;
+  struct term *tv;
+  const char *p, *end, *start;
+  char *s;
+  size_t i, j, n;
+
+  assert(path != NULL && (text != NULL || len == 0));
+
+  s = blob_prepare(&lower, len);
+  if (s) {
+    for (i = 0; i < len; i++)
+      s[i] = (char) toLower(text[i]);
+    blob_addlen(&lower, len);
+  }
+  for (p = blob_str(&lower), end = p + blob_len(&lower); p < end; ) {
+    while (p < end && !istermchar(*p)) p++;
+    for (start = p; p < end && istermchar(*p); p++);
+    if (p - start < MINTERM || p - start > MAXTERM) continue;
+    tv = blob_prepare(&terms, sizeof(*tv));
+    if (!tv) break;
+    tv->term = start;
+    tv->len = p - start;
+    tv->doc = tv->count = 0;
+    blob_addlen(&terms, sizeof(*tv));
+  }
+
+  /* sorted, equal terms are adjacent: count them */
+  tv = blob_buf(&terms);
+  n = blob_len(&terms) / sizeof(*tv);
+  qsort(tv, n, sizeof(*tv), termcmp);
+  for (i = 0; i < n; i = j) {
+    for (j = i+1; j < n && sameterm(&tv[i], &tv[j]); j++);
+    blob_addbuf(&lines, tv[i].term, tv[i].len);
+    blob_addfmt(&lines, " %zu\n", j - i);
+  }
+
+  /* titles go in a line of their own in SEARCH_FILE */
+  blob_clear(&lower);
+  for (s = (char *) (title ? title : ""); *s; s++)
+    blob_addchar(&lower, (unsigned char) *s < ' ' ? ' ' : *s);
+  putdoc(path, blob_str(&lower), blob_str(&lines), blob_len(&lines));
+
+  blob_free(&lower);
+  blob_free(&terms);
+  blob_free(&lines);
+}
+
+
+void
+search_keep(const char *path)
+{
+  uint32_t *slot;
+  pthread_mutex_lock(&search.lock);
+  if (search.nslots > 0 && *(slot = findslot(path)))
+    DOCS[*slot-1].seen = true;
+  pthread_mutex_unlock(&search.lock);
+}
+
+
+void
+search_begin(void)
+{
+  size_t i;
+  pthread_mutex_lock(&search.lock);
+  for (i = 0; i < search.ndocs; i++)
+    DOCS[i].seen = false;
+  pthread_mutex_unlock(&search.lock);
+}
+
+
+/** drop pages not seen in this build (gone), rebuild the index */
+static void
+compact(void)
+{
+  struct doc *docs = DOCS;
+  size_t i, n = 0;
+
+  for (i = 0; i < search.ndocs; i++) {
+    if (!docs[i].seen) {
+      free(docs[i].path);
+      free(docs[i].title);
+      free(docs[i].terms);
+      continue;
+    }
+    docs[n++] = docs[i];
+  }
+  search.ndocs = n;
+  blob_trunc(&search.docs, n * sizeof(*docs));
+  if (search.nslots > 0) {
+    memset(search.slots, 0, search.nslots * sizeof(*search.slots));
+    for (i = 0; i < n; i++)
+      *findslot(docs[i].path) = i + 1;
+  }
+}
+
+
+void
+search_free(void)
+{
+  size_t i;
+  for (i = 0; i < search.ndocs; i++) {
+    free(DOCS[i].path);
+    free(DOCS[i].title);
+    free(DOCS[i].terms);
+  }
+  blob_free(&search.docs);
+  search.ndocs = 0;
+  free(search.slots);
+  search.slots = 0;
+  search.nslots = 0;
+}
+
+
+/* === index files === */
+
+
+static void
+addjson(Blob *out, const char *s)
+{
+  blob_addchar(out, '"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') blob_addfmt(out, "\\%c", *s);
+    else if ((unsigned char) *s < ' ') blob_addfmt(out, "\\u%04x", *s);
+    else blob_addchar(out, *s);
+  }
+  blob_addchar(out, '"');
+}
+
+
+static int
+docpcmp(const void *a, const void *b)
+{
+  const struct doc *const *s = a, *const *t = b;
+  return strcmp((*s)->path, (*t)->path);
+}
+
+
+/** shard of a term: its first letter or digit, or '_' */
+static inline char
+shardof(const struct term *t)
+{
+  return (unsigned char) *t->term < 0x80 ? *t->term : '_';
+}
+
+
+int
+search_write(const char *dir,
+  int (*flush)(const char *name, const char *data, size_t len, void *ud),
+  void *ud)
+{
+  static const char shards[] = "0123456789abcdefghijklmnopqrstuvwxyz_";
+  Blob order = BLOB_INIT, terms = BLOB_INIT, out = BLOB_INIT;
+  Blob name = BLOB_INIT;
+  struct doc **dv;
+  struct term *tv;
+  const char *p, *end, *sp;
+  size_t i, j, k, n, ndocs;
+  int r = SUCCESS;
+
+  assert(dir != NULL && flush != NULL);
+  pthread_mutex_lock(&search.lock);
+  compact();
+  ndocs = search.ndocs;
+
+  /* number pages by path, so page numbers are stable */
+  dv = blob_prepare(&order, ndocs * sizeof(*dv) + 1);
+  if (!dv) goto nomem;
+  for (i = 0; i < ndocs; i++)
+    dv[i] = &DOCS[i];
+  qsort(dv, ndocs, sizeof(*dv), docpcmp);
+  for (i = 0; i < ndocs; i++)
+    dv[i]->id = i;
+
+  for (i = 0; i < ndocs; i++) {
+    for (p = dv[i]->terms, end = p + dv[i]->len; p < end; p = sp) {
+      sp = memchr(p, ' ', end - p);
+      if (!sp) break;
+      tv = blob_prepare(&terms, sizeof(*tv));
+      if (!tv) goto nomem;
+      tv->term = p;
+      tv->len = sp - p;
+      tv->doc = i;
+      tv->count = strtoul(sp+1, 0, 10);
+      blob_addlen(&terms, sizeof(*tv));
+      sp = memchr(sp, '\n', end - sp);
+      if (!sp) break;
+      sp++;
+    }
+  }
+  tv = blob_buf(&terms);
+  n = blob_len(&terms) / sizeof(*tv);
+  qsort(tv, n, sizeof(*tv), termcmp);
+
+  /* pages.json: [url, title] by page number */
+  blob_addchar(&out, '[');
+  for (i = 0; i < ndocs; i++) {
+    const char *path = dv[i]->path;
+    size_t len = strlen(path);
+    blob_addstr(&out, i ? ",\n[" : "[");
+    blob_clear(&name);
+    blob_addchar(&name, '/');
+    if (len >= 10 && !strcmp(path + len - 10, "index.html") &&
+        (len == 10 || path[len-11] == '/'))
+      len -= 10;
+    blob_addbuf(&name, path, len);
+    addjson(&out, blob_str(&name));
+    blob_addchar(&out, ',');
+    addjson(&out, dv[i]->title);
+    blob_addchar(&out, ']');
+  }
+  blob_addstr(&out, "]\n");
+  if (blob_failed(&out)) goto nomem;
+  blob_clear(&name);
+  blob_addfmt(&name, "%s/pages.json", dir);
+  if (flush(blob_str(&name), blob_str(&out), blob_len(&out), ud) != SUCCESS)
+    r = FAILSOFT;
+
+  /* shards, all of them, so none is left over from before: empty
+     ones are removed (the client takes a missing shard as empty) */
+  for (i = k = 0; shards[k]; k++) {
+    uint32_t last;
+    blob_clear(&out);
+    blob_addchar(&out, '{');
+    while (i < n && shardof(&tv[i]) == shards[k]) {
+      if (blob_len(&out) > 1) blob_addstr(&out, ",\n");
+      blob_addchar(&out, '"');
+      blob_addbuf(&out, tv[i].term, tv[i].len);
+      blob_addstr(&out, "\":[");
+      for (j = i, last = 0; j < n && sameterm(&tv[i], &tv[j]); j++) {
+        blob_addfmt(&out, "%s%lu,%lu", j > i ? "," : "",
+          (unsigned long) (tv[j].doc - last), (unsigned long) tv[j].count);
+        last = tv[j].doc;
+      }
+      blob_addchar(&out, ']');
+      i = j;
+    }
+    blob_addstr(&out, "}\n");
+    if (blob_failed(&out)) goto nomem;
+    blob_clear(&name);
+    blob_addfmt(&name, "%s/s-%c.json", dir, shards[k]);
+    p = blob_len(&out) > 3 ? blob_str(&out) : 0;  /* else just "{}\n" */
+    if (flush(blob_str(&name), p, p ? blob_len(&out) : 0, ud) != SUCCESS)
+      r = FAILSOFT;
+  }
+
+  blob_clear(&name);
+  blob_addfmt(&name, "%s/search.js", dir);
+  if (flush(blob_str(&name), client, sizeof(client) - 1, ud) != SUCCESS)
+    r = FAILSOFT;
+  goto done;
+
+nomem:
+  log_warn("search: out of memory");
+  r = FAILSOFT;
+done:
+  pthread_mutex_unlock(&search.lock);
+  blob_free(&order);
+  blob_free(&terms);
+  blob_free(&out);
+  blob_free(&name);
+  return r;
+}
+
+
+/* === persistence === */
+
+
+int
+search_save(const char *fn)
+{
+  Blob tmp = BLOB_INIT;
+  size_t i;
+  FILE *fp;
+
+  assert(fn != NULL);
+  blob_addfmt(&tmp, "%s.tmp", fn);
+  fp = fopen(blob_str(&tmp), "wb");
+  if (!fp) goto fail;
+
+  fprintf(fp, "%s\n", MAGIC);
+  pthread_mutex_lock(&search.lock);
+  for (i = 0; i < search.ndocs; i++) {
+    const struct doc *doc = &DOCS[i];
+    if (!doc->seen) continue;
+    fprintf(fp, "P %s\t%s\n", doc->path, doc->title);
+    fwrite(doc->terms, 1, doc->len, fp);
+  }
+  pthread_mutex_unlock(&search.lock);
+
+  if (ferror(fp)) {
+    fclose(fp);
+    goto fail;
+  }
+  if (fclose(fp) != 0 || rename(blob_str(&tmp), fn) < 0) goto fail;
+  blob_free(&tmp);
+  return SUCCESS;
+
+fail:
+  log_warn("search: cannot write %s: %s", fn, strerror(errno));
+  remove(blob_str(&tmp));
+  blob_free(&tmp);
+  return FAILSOFT;
+}
+
+
+int
+search_load(const char *fn)
+{
+  Blob line = BLOB_INIT, data = BLOB_INIT, head = BLOB_INIT;
+  FILE *fp;
+  char *tab;
+  int c;
+  bool ok = false;
+
+  assert(fn != NULL);
+  if (search.ndocs > 0) return SUCCESS;  /* have them in memory */
+  fp = fopen(fn, "rb");
+  if (!fp) {
+    if (errno != ENOENT) log_warn("search: cannot read %s: %s", fn, strerror(errno));
+    return FAILSOFT;
+  }
+
+  for (;;) {
+    blob_clear(&line);
+    while ((c = getc(fp)) != EOF && c != '\n')
+      blob_addchar(&line, (char) c);
+    if (c == EOF && blob_len(&line) == 0) break;
+    if (!ok) {  /* first line */
+      ok = !strcmp(blob_str(&line), MAGIC);
+      if (!ok) break;
+      continue;
+    }
+    if (blob_len(&line) > 2 && !strncmp(blob_str(&line), "P ", 2)) {
+      if ((tab = strchr(blob_str(&head), '\t'))) {
+        *tab = '\0';
+        putdoc(blob_str(&head), tab+1, blob_str(&data), blob_len(&data));
+      }
+      blob_clear(&head);
+      blob_addstr(&head, blob_str(&line) + 2);
+      blob_clear(&data);
+    }
+    else {
+      blob_add(&data, &line);
+      blob_addchar(&data, '\n');
+    }
+  }
+  if ((tab = strchr(blob_str(&head), '\t'))) {
+    *tab = '\0';
+    putdoc(blob_str(&head), tab+1, blob_str(&data), blob_len(&data));
+  }
+  fclose(fp);
+
+  search_begin();  /* nothing seen yet */
+  blob_free(&line);
+  blob_free(&data);
+  blob_free(&head);
+  return ok ? SUCCESS : FAILSOFT;
+}
@@ -0,0 +1,37 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/* Search index: the words of all pages, collected while they
+ * render, written as an inverted index in shards for a small
+ * client-side search script; process-wide, thread-safe */
+
+#define SEARCH_REGKEY "jot.search"  /* Lua registry: Blob for text */
+
+int search_load(const char *fn);
+void search_begin(void);
+void search_page(const char *path, const char *title,
+                 const char *text, size_t len);
+void search_keep(const char *path);
+int search_write(const char *dir,
+  int (*flush)(const char *name, const char *data, size_t len, void *ud),
+  void *ud);
+int search_save(const char *fn);
+void search_free(void);
+
+/* Usage: a build calls search_begin(), and for each page either
+   search_page() with its output path, title, and plain text (the
+   Markdown renderer collects it while a build renders the page:
+   SEARCH_REGKEY is then a light userdata, the Blob to append to),
+   which splits the text into terms and counts them, or search_keep()
+   if the page was up to date (its terms are kept from the previous
+   build, as restored by search_load()); search_write() then calls
+   flush for each file of the index in dir: pages.json (URL and
+   title by page number), s-X.json for the terms starting with X
+   (a-z, 0-9, _ for others: term => page number deltas and counts;
+   with data null if there are none, for flush to remove the file),
+   and search.js, the client; search_save() writes the pages' terms
+   for the next build */
+
+#endif
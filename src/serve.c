@@ -0,0 +1,528 @@
+/* Local development server */
+
+#define _POSIX_C_SOURCE 200809L  /* for MSG_NOSIGNAL */
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include "jot.h"
+#include "blob.h"
+#include "build.h"
+#include "log.h"
+#include "serve.h"
+
+
+/* Serve an in-memory build of the site on localhost, rebuilding
+ * on changes (watch mode). One thread, one poll loop over the
+ * listening socket, the inotify fd, and the client sockets.
+ * Requests are answered in full (one request per connection);
+ * rendered pages come from memory, verbatim files straight from
+ * the source file via sendfile(2). Client sockets are non-blocking:
+ * a response is queued with the client and sent as the socket
+ * takes it, so a slow reader holds up no one else. Served HTML
+ * pages get a small script that subscribes to EVENTS_PATH (Server-
+ * Sent Events) and reloads the page when a rebuild completes; a
+ * subscriber that lets more than MAXBACKLOG bytes pile up is dropped.
+ */
+
+#define EVENTS_PATH "/_jot/events"
+#define MAXREQUEST 16384
+#define MAXCLIENTS 256
+#define MAXBACKLOG 65536
+
+static const char reloadscript[] =
+  "<script>new EventSource(\"" EVENTS_PATH "\")"
+  ".onmessage = function() { location.reload(); };</script>\n";
+
+struct client {
+  int fd;
+  bool events;          /* subscribed to events (SSE) */
+  bool answered;        /* response queued, close when sent */
+  Blob request;         /* request received so far */
+  Blob output;          /* queued output, sent up to sent */
+  size_t sent;
+  int file;             /* then send this file, or -1 */
+  size_t filelen;       /* bytes left of it */
+};
+
+static const struct { const char *ext, *type; } mimetypes[] = {
+  { ".css",   "text/css; charset=utf-8" },
+  { ".gif",   "image/gif" },
+  { ".htm",   "text/html; charset=utf-8" },
+  { ".html",  "text/html; charset=utf-8" },
+  { ".ico",   "image/x-icon" },
+  { ".jpeg",  "image/jpeg" },
+  { ".jpg",   "image/jpeg" },
+  { ".js",    "text/javascript; charset=utf-8" },
+  { ".json",  "application/json" },
+  { ".pdf",   "application/pdf" },
+  { ".png",   "image/png" },
+  { ".svg",   "image/svg+xml" },
+  { ".txt",   "text/plain; charset=utf-8" },
+  { ".webp",  "image/webp" },
+  { ".woff",  "font/woff" },
+  { ".woff2", "font/woff2" },
+  { ".xml",   "application/xml" },
+};
+
+
+static const char *
+mimetype(const char *path)
+{
+  const char *ext = strrchr(path, '.');
+  size_t i;
+  if (ext && !strchr(ext, '/'))
+    for (i = 0; i < sizeof(mimetypes)/sizeof(mimetypes[0]); i++)
+      if (!strcasecmp(ext, mimetypes[i].ext)) return mimetypes[i].type;
+  return "application/octet-stream";
+}
+
+
+/** queue output for the client */
+static void
+sendall(struct client *client, const char *buf, size_t len)
+{
+  blob_addbuf(&client->output, buf, len);
+}
+
+
+/** send queued output as far as the socket takes it; -1 on error */
+static int
+flush(struct client *client)
+{
+  size_t len = blob_len(&client->output);
+  ssize_t n;
+
+  while (client->sent < len) {
+    n = send(client->fd, blob_str(&client->output) + client->sent,
+             len - client->sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    client->sent += n;
+  }
+  blob_clear(&client->output);
+  client->sent = 0;
+
+  while (client->file >= 0 && client->filelen > 0) {
+#if defined(__linux__)
+    n = sendfile(client->fd, client->file, 0, client->filelen);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+    client->filelen -= n;
+#else
+    char buf[32*1024];
+    n = read(client->file, buf, sizeof(buf));
+    if (n <= 0) return -1;
+    client->filelen -= n;
+    sendall(client, buf, n);
+    return flush(client);
+#endif
+  }
+  if (client->file >= 0) {
+    close(client->file);
+    client->file = -1;
+  }
+  return 0;
+}
+
+
+/** true iff the client has output not yet sent */
+static bool
+unsent(const struct client *client)
+{
+  return client->sent < blob_len(&client->output) || client->file >= 0;
+}
+
+
+static void
+respond(struct client *client, int status, const char *reason,
+        const char *type, size_t len, const char *extra)
+{
+  Blob buf = BLOB_INIT;
+  blob_addfmt(&buf, "HTTP/1.1 %d %s\r\n", status, reason);
+  if (type) blob_addfmt(&buf, "Content-Type: %s\r\n", type);
+  blob_addfmt(&buf, "Content-Length: %zu\r\n", len);
+  blob_addstr(&buf, "Cache-Control: no-store\r\nConnection: close\r\n");
+  if (extra) blob_addstr(&buf, extra);
+  blob_addstr(&buf, "\r\n");
+  sendall(client, blob_str(&buf), blob_len(&buf));
+  blob_free(&buf);
+}
+
+
+static void
+senderror(struct client *client, int status, const char *reason, bool head)
+{
+  Blob body = BLOB_INIT;
+  blob_addfmt(&body, "<!DOCTYPE html>\n<title>%d %s</title>\n"
+    "<h1>%d %s</h1>\n%s", status, reason, status, reason, reloadscript);
+  respond(client, status, reason, "text/html; charset=utf-8",
+    blob_len(&body), 0);
+  if (!head) sendall(client, blob_str(&body), blob_len(&body));
+  blob_free(&body);
+}
+
+
+/** send rendered HTML with the reload script before </body> */
+static void
+sendhtml(struct client *client, const char *data, size_t len, bool head)
+{
+  const char *p, *at = data + len;
+  size_t n = strlen(reloadscript);
+
+  for (p = data; (p = strchr(p, '<')) && p < data + len; p++)
+    if (!strncasecmp(p, "</body>", 7)) at = p;  /* the last one */
+
+  respond(client, 200, "OK", mimetype(".html"), len + n, 0);
+  if (head) return;
+  sendall(client, data, at - data);
+  sendall(client, reloadscript, n);
+  sendall(client, at, data + len - at);
+}
+
+
+static void
+sendverbatim(struct client *client, const char *file, const char *path,
+             bool head)
+{
+  struct stat statbuf;
+  int in = open(file, O_RDONLY);
+  if (in < 0 || fstat(in, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+    if (in >= 0) close(in);
+    senderror(client, 404, "Not Found", head);
+    return;
+  }
+  respond(client, 200, "OK", mimetype(path), statbuf.st_size, 0);
+  if (head || statbuf.st_size == 0) close(in);
+  else {
+    client->file = in;
+    client->filelen = statbuf.st_size;
+  }
+}
+
+
+static int
+hexval(int c)
+{
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('a' <= c && c <= 'f') return c - 'a' + 10;
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+/** decode the request target into a path relative to the site root;
+    return false if it is not acceptable (e.g. contains ..) */
+static bool
+decodepath(const char *s, size_t len, Blob *path)
+{
+  const char *end = s + len;
+  const char *p;
+
+  if (s == end || *s != '/') return false;
+  for (s++; s < end && *s != '?' && *s != '#'; s++) {
+    int c = (unsigned char) *s;
+    if (c == '%' && end - s > 2 && hexval(s[1]) >= 0 && hexval(s[2]) >= 0) {
+      c = hexval(s[1]) * 16 + hexval(s[2]);
+      s += 2;
+    }
+    if (c == 0) return false;
+    blob_addchar(path, c);
+  }
+
+  /* no . or .. segments (and no empty ones but the last) */
+  for (p = blob_str(path); *p; ) {
+    size_t n = strcspn(p, "/");
+    if ((n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+      return false;
+    if (n == 0 && p[n]) return false;
+    p += n;
+    if (*p) p++;
+  }
+  return true;
+}
+
+
+/** answer the request (complete in client->request) */
+static void
+handle(Builder *builder, struct client *client)
+{
+  const char *req = blob_str(&client->request);
+  const char *data, *file, *sp, *target;
+  Blob path = BLOB_INIT;
+  Blob location = BLOB_INIT;
+  size_t len, n;
+  bool head;
+
+  head = !strncmp(req, "HEAD ", 5);
+  if (!head && strncmp(req, "GET ", 4)) {
+    senderror(client, 405, "Method Not Allowed", false);
+    return;
+  }
+  target = strchr(req, ' ') + 1;
+  sp = strpbrk(target, " \r\n");
+  if (!sp || !decodepath(target, sp - target, &path)) {
+    senderror(client, 400, "Bad Request", head);
+    goto done;
+  }
+  log_debug("serve: %s /%s", head ? "HEAD" : "GET", blob_str(&path));
+
+  if (!strncmp(target, EVENTS_PATH, strlen(EVENTS_PATH)) &&
+      strchr(" ?", target[strlen(EVENTS_PATH)])) {
+    static const char headers[] =
+      "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+      "Cache-Control: no-store\r\n\r\nretry: 1000\n\n";
+    sendall(client, headers, sizeof(headers)-1);
+    client->events = true;
+    goto done;
+  }
+
+  n = blob_len(&path);
+  if (n == 0 || blob_str(&path)[n-1] == '/')
+    blob_addstr(&path, "index.html");
+
+  if (build_lookup(builder, blob_str(&path), &data, &len, &file)) {
+    if (!data) sendverbatim(client, file, blob_str(&path), head);
+    else if (!strcmp(mimetype(blob_str(&path)), mimetype(".html")))
+      sendhtml(client, data, len, head);
+    else {
+      respond(client, 200, "OK", mimetype(blob_str(&path)), len, 0);
+      if (!head) sendall(client, data, len);
+    }
+    goto done;
+  }
+
+  /* a directory without the trailing slash? */
+  blob_addstr(&path, "/index.html");
+  if (build_lookup(builder, blob_str(&path), &data, &len, &file)) {
+    blob_addstr(&location, "Location: ");
+    blob_addbuf(&location, target, strcspn(target, "? "));
+    blob_addstr(&location, "/\r\n");
+    respond(client, 301, "Moved Permanently", 0, 0, blob_str(&location));
+    goto done;
+  }
+
+  senderror(client, 404, "Not Found", head);
+
+done:
+  blob_free(&path);
+  blob_free(&location);
+}
+
+
+static void
+dropclient(Blob *clients, size_t *nclients, size_t i)
+{
+  struct client *cv = blob_buf(clients);
+  close(cv[i].fd);
+  if (cv[i].file >= 0) close(cv[i].file);
+  blob_free(&cv[i].request);
+  blob_free(&cv[i].output);
+  cv[i] = cv[--*nclients];
+  blob_trunc(clients, *nclients * sizeof(*cv));
+}
+
+
+/** ping all event subscribers: a rebuild completed */
+static void
+notify(Blob *clients, size_t *nclients, unsigned generation)
+{
+  struct client *cv = blob_buf(clients);
+  char msg[64];
+  size_t i;
+  int n;
+
+  n = snprintf(msg, sizeof(msg), "data: rebuilt %u\n\n", generation);
+  for (i = *nclients; i-- > 0; ) {
+    if (!cv[i].events) continue;
+    sendall(&cv[i], msg, n);
+    if (flush(&cv[i]) < 0 || blob_len(&cv[i].output) > MAXBACKLOG)
+      dropclient(clients, nclients, i);
+  }
+}
+
+
+static int
+listenon(int port)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  /* localhost only */
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 64) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int
+serve(Builder *builder, int port)
+{
+  Blob clients = BLOB_INIT;
+  Blob pollfds = BLOB_INIT;
+  struct pollfd *pv;
+  struct client *cv;
+  size_t i, nclients = 0;
+  int lfd, wfd, r, timeout;
+  unsigned generation = 0;
+  double lastevent = 0;
+  bool pending = false;
+
+  assert(builder != NULL);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  wfd = build_watch_start(builder);
+  if (wfd < 0) return 1;
+
+  lfd = listenon(port);
+  if (lfd < 0) {
+    log_error("cannot listen on port %d: %s", port, strerror(errno));
+    return 1;
+  }
+
+  build_run(builder);
+  log_info("serving at http://localhost:%d/, press Ctrl-C to stop", port);
+
+  for (;;) {
+    blob_clear(&pollfds);
+    pv = blob_prepare(&pollfds, (nclients + 2) * sizeof(*pv));
+    pv[0].fd = lfd;
+    pv[0].events = nclients < MAXCLIENTS ? POLLIN : 0;
+    pv[1].fd = wfd;
+    pv[1].events = POLLIN;
+    cv = blob_buf(&clients);
+    for (i = 0; i < nclients; i++) {
+      pv[i+2].fd = cv[i].fd;
+      pv[i+2].events = POLLIN | (unsent(&cv[i]) ? POLLOUT : 0);
+    }
+
+    timeout = -1;
+    if (pending) {  /* rebuild once events stop coming */
+      timeout = (lastevent - now()) * 1000 + BUILD_DEBOUNCE_MS;
+      if (timeout < 0) timeout = 0;
+    }
+
+    r = poll(pv, nclients + 2, timeout);
+    if (r < 0 && errno != EINTR) {
+      log_error("serve: poll: %s", strerror(errno));
+      break;
+    }
+
+    if (r == 0 && pending) {
+      pending = false;
+      build_watch_rebuild(builder);
+      notify(&clients, &nclients, ++generation);
+      continue;  /* clients may have changed */
+    }
+    if (r <= 0) continue;
+
+    if (pv[1].revents & POLLIN && build_watch_read(builder)) {
+      pending = true;
+      lastevent = now();
+    }
+
+    for (i = nclients; i-- > 0; ) {
+      char buf[4096];
+      ssize_t n;
+      short revents = pv[i+2].revents;
+      if (!revents) continue;
+      cv = blob_buf(&clients);
+      if (revents & POLLOUT && flush(&cv[i]) < 0) {
+        dropclient(&clients, &nclients, i);
+        continue;
+      }
+      if (revents & (POLLIN|POLLHUP|POLLERR)) {
+        n = read(cv[i].fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) {  /* closed */
+          dropclient(&clients, &nclients, i);
+          continue;
+        }
+        if (!cv[i].events && !cv[i].answered) {  /* else nothing expected */
+          blob_addbuf(&cv[i].request, buf, n);
+          if (strstr(blob_str(&cv[i].request), "\r\n\r\n")) {
+            handle(builder, &cv[i]);
+            cv[i].answered = !cv[i].events;
+          }
+          else if (blob_len(&cv[i].request) > MAXREQUEST) {
+            senderror(&cv[i], 431, "Request Header Fields Too Large", false);
+            cv[i].answered = true;
+          }
+          if (flush(&cv[i]) < 0) {
+            dropclient(&clients, &nclients, i);
+            continue;
+          }
+        }
+      }
+      if (cv[i].answered && !unsent(&cv[i]))
+        dropclient(&clients, &nclients, i);
+    }
+
+    if (pv[0].revents & POLLIN) {
+      struct client *client;
+      int fd = accept(lfd, 0, 0);
+      if (fd < 0) {
+        log_warn("serve: accept: %s", strerror(errno));
+        continue;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      client = blob_prepare(&clients, sizeof(*client));
+      client->fd = fd;
+      client->events = false;
+      client->answered = false;
+      client->request = (Blob) BLOB_INIT;
+      client->output = (Blob) BLOB_INIT;
+      client->sent = 0;
+      client->file = -1;
+      client->filelen = 0;
+      blob_addlen(&clients, sizeof(*client));
+      nclients++;
+    }
+  }
+
+  while (nclients > 0)
+    dropclient(&clients, &nclients, nclients-1);
+  blob_free(&clients);
+  blob_free(&pollfds);
+  close(lfd);
+  return 1;
+}
@@ -0,0 +1,12 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "build.h"
+
+/* Serve the site on localhost:port from an in-memory build
+ * (opts.inmemory), rebuilding on changes and telling browsers
+ * to reload; only returns on failure */
+
+int serve(Builder *builder, int port);
+
+#endif
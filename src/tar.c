@@ -0,0 +1,258 @@
+/* Tar archives */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "copy.h"
+#include "tar.h"
+
+
+/* An archive is a sequence of 512-byte blocks: for each file a
+ * header block, then its data, padded to a whole block; and two
+ * zero blocks at the end. The ustar header has 100 bytes for the
+ * name and a prefix of 155 (split at a slash); a name that does
+ * not fit goes into a pax extended header (typeflag 'x') before
+ * the file's own, as a record "len path=name\n", where len counts
+ * the whole record, its own digits included.
+ *
+ * Headers and data from memory collect in a buffer, written when
+ * it holds FLUSHSIZE bytes, and before data copied from a file,
+ * which goes from file to archive in the kernel (sendfile(2) and
+ * friends): the site's static files never pass through user space.
+ * Owner is root, numerically, so extraction as any user works.
+ */
+
+#define BLOCK 512
+#define FLUSHSIZE (64*1024)
+#define MAXSIZE 077777777777LL  /* 11 octal digits: 8 GB */
+
+struct header {         /* POSIX.1-1988 ustar */
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+
+static int
+flush(struct tar *tar)
+{
+  const char *p = blob_buf(&tar->buf);
+  size_t len = blob_len(&tar->buf);
+  ssize_t n;
+
+  if (blob_failed(&tar->buf)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  while (len > 0) {
+    n = write(tar->fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    p += n;
+    len -= n;
+  }
+  blob_clear(&tar->buf);
+  return 0;
+}
+
+
+static void
+addpadding(struct tar *tar, uint64_t len)
+{
+  static const char zeros[BLOCK];
+  size_t n = (BLOCK - len % BLOCK) % BLOCK;
+  blob_addbuf(&tar->buf, zeros, n);
+  tar->nbytes += n;
+}
+
+
+static void
+octal(char *field, size_t size, uint64_t value)
+{
+  snprintf(field, size, "%0*llo", (int) size - 1, (unsigned long long) value);
+}
+
+
+/** where name splits into prefix and name (0 for not at all);
+    false if it does not fit into a ustar header either way */
+static bool
+splitname(const char *name, size_t *psplit)
+{
+  size_t len = strlen(name), i;
+  *psplit = 0;
+  if (len <= 100) return true;
+  for (i = len - 1; i > 0; i--)
+    if (name[i] == '/' && i <= 155 && len - i - 1 <= 100) {
+      *psplit = i;
+      return true;
+    }
+  return false;
+}
+
+
+/** append a header block for a regular file (or pax header) */
+static void
+addheader(struct tar *tar, char type, const char *name, unsigned mode,
+          uint64_t size, int64_t mtime)
+{
+  struct header h;
+  const unsigned char *p;
+  size_t len = strlen(name), split, i, sum = 0;
+
+  assert(sizeof(h) == BLOCK);
+  memset(&h, 0, sizeof(h));
+  if (!splitname(name, &split))  /* a pax header has it */
+    memcpy(h.name, name, sizeof(h.name));
+  else if (split > 0) {
+    memcpy(h.prefix, name, split);
+    memcpy(h.name, name + split + 1, len - split - 1);
+  }
+  else memcpy(h.name, name, len);
+  octal(h.mode, sizeof(h.mode), mode);
+  octal(h.uid, sizeof(h.uid), 0);
+  octal(h.gid, sizeof(h.gid), 0);
+  octal(h.size, sizeof(h.size), size);
+  octal(h.mtime, sizeof(h.mtime), mtime > 0 ? (uint64_t) mtime : 0);
+  h.typeflag = type;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  memset(h.chksum, ' ', sizeof(h.chksum));
+  for (p = (const unsigned char *) &h, i = 0; i < sizeof(h); i++)
+    sum += p[i];
+  snprintf(h.chksum, sizeof(h.chksum), "%06o", (unsigned) sum);
+
+  blob_addbuf(&tar->buf, (const char *) &h, sizeof(h));
+  tar->nbytes += sizeof(h);
+}
+
+
+/** header(s) for a file of the given name and size */
+static int
+addentry(struct tar *tar, const char *name, unsigned mode, uint64_t size,
+         int64_t mtime)
+{
+  size_t split;
+
+  if (size > (uint64_t) MAXSIZE) {
+    errno = EFBIG;
+    return -1;
+  }
+  if (!splitname(name, &split)) {
+    Blob rec = BLOB_INIT;
+    size_t len = strlen(name) + 7;  /* " path=" and "\n" */
+    size_t n = len + 1;
+    while (n != len + (size_t) snprintf(0, 0, "%zu", n))
+      n = len + snprintf(0, 0, "%zu", n);
+    blob_addfmt(&rec, "%zu path=%s\n", n, name);
+    addheader(tar, 'x', "PaxHeader", 0644, blob_len(&rec), mtime);
+    blob_add(&tar->buf, &rec);
+    tar->nbytes += blob_len(&rec);
+    addpadding(tar, blob_len(&rec));
+    blob_free(&rec);
+  }
+  addheader(tar, '0', name, mode, size, mtime);
+  return 0;
+}
+
+
+void
+tar_begin(struct tar *tar, int fd, int64_t mtime)
+{
+  assert(tar != NULL && fd >= 0);
+  tar->fd = fd;
+  tar->buf = (Blob) BLOB_INIT;
+  tar->mtime = mtime;
+  tar->nbytes = 0;
+}
+
+
+int
+tar_add(struct tar *tar, const char *name, const void *data, size_t len)
+{
+  assert(tar != NULL && name != NULL && (data != NULL || len == 0));
+  if (addentry(tar, name, 0644, len, tar->mtime) < 0) return -1;
+  if (len >= FLUSHSIZE) {  /* no copy into the buffer */
+    ssize_t n;
+    const char *p = data;
+    size_t left = len;
+    if (flush(tar) < 0) return -1;
+    while (left > 0) {
+      n = write(tar->fd, p, left);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return -1;
+      p += n;
+      left -= n;
+    }
+  }
+  else blob_addbuf(&tar->buf, data, len);
+  tar->nbytes += len;
+  addpadding(tar, len);
+  return blob_len(&tar->buf) >= FLUSHSIZE ? flush(tar) : 0;
+}
+
+
+int
+tar_addfile(struct tar *tar, const char *name, const char *path)
+{
+  struct stat st;
+  int fd, r;
+
+  assert(tar != NULL && name != NULL && path != NULL);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      addentry(tar, name, (st.st_mode & 0111) ? 0755 : 0644,
+               st.st_size, st.st_mtime) < 0 ||
+      flush(tar) < 0)
+    goto fail;
+  r = copy_stream(fd, tar->fd, st.st_size);
+  if (r != 0) {
+    if (r > 0) errno = EIO;  /* file shrank while we copied it */
+    goto fail;
+  }
+  close(fd);
+  tar->nbytes += st.st_size;
+  addpadding(tar, st.st_size);
+  return 0;
+
+fail:
+  { int saved = errno; close(fd); errno = saved ? saved : EINVAL; }
+  return -1;
+}
+
+
+int
+tar_end(struct tar *tar)
+{
+  static const char zeros[2*BLOCK];
+  int r;
+  assert(tar != NULL);
+  blob_addbuf(&tar->buf, zeros, sizeof(zeros));
+  tar->nbytes += sizeof(zeros);
+  r = flush(tar);
+  blob_free(&tar->buf);
+  return r;
+}
@@ -0,0 +1,33 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blob.h"
+
+/* Writing POSIX tar archives (ustar, with pax headers for long
+ * names) to a file descriptor, which may be a pipe */
+
+struct tar {
+  int fd;
+  Blob buf;             /* headers and small data, not yet written */
+  int64_t mtime;        /* of entries from memory, seconds */
+  uint64_t nbytes;      /* archive size so far */
+};
+
+void tar_begin(struct tar *tar, int fd, int64_t mtime);
+int tar_add(struct tar *tar, const char *name, const void *data, size_t len);
+int tar_addfile(struct tar *tar, const char *name, const char *path);
+int tar_end(struct tar *tar);
+
+/* Usage: tar_begin() with an open file descriptor and the time
+   for entries from memory; tar_add() appends a file with the
+   given name and contents, tar_addfile() one with the contents,
+   mode, and mtime of the file at path (copied in the kernel, see
+   copy_stream()); tar_end() writes the end-of-archive marker and
+   flushes; all return 0 or -1 and set errno; directories are not
+   archived (tar creates them as needed) and the descriptor is
+   not closed */
+
+#endif
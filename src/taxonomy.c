@@ -0,0 +1,306 @@
+/* Taxonomies: pages of the site index grouped by term */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "hash.h"
+#include "index.h"
+#include "log.h"
+#include "memory.h"
+#include "taxonomy.h"
+
+
+/* All kinds of terms are found in one pass over the records,
+ * taken newest first: each term of a record is interned in a
+ * hash table (kind and name) and the pair (term, record) goes
+ * into a list. Then the terms of each kind are sorted by name,
+ * which gives each its slot range in the kind's page array, and
+ * the pairs are dealt into these slots in list order, so every
+ * term's pages come out newest first without sorting them again
+ * (a counting sort). Listing pages slice these arrays. */
+
+struct entry {          /* a term while grouping */
+  const char *name;
+  int kind;
+  uint32_t count;
+  uint32_t last;        /* record last added, for duplicate tags */
+  size_t fill;          /* next slot in pages */
+};
+
+struct pair {
+  uint32_t entry;
+  uint32_t rec;
+};
+
+struct dated {
+  const char *date;
+  const char *path;
+  uint32_t rec;
+};
+
+struct grouping {
+  MemPool *pool;
+  Blob entries;         /* array of struct entry */
+  Blob pairs;           /* array of struct pair */
+  uint32_t *slots;      /* hash table: entry index + 1, or 0 */
+  size_t nslots;        /* a power of 2 */
+  size_t nentries;
+};
+
+static struct {
+  MemPool pool;         /* term names */
+  Blob terms[TAXO_NKINDS];  /* arrays of struct term */
+  Blob pages[TAXO_NKINDS];  /* arrays of uint32_t */
+  unsigned serial;      /* of the index grouped */
+  bool valid;
+} taxo;
+
+static const char *const kindnames[TAXO_NKINDS] = {
+  "date", "section", "tag", "year", "month"
+};
+
+
+int
+taxonomy_kind(const char *name)
+{
+  int i;
+  for (i = 0; i < TAXO_NKINDS; i++)
+    if (!strcmp(name, kindnames[i])) return i;
+  return -1;
+}
+
+
+const struct term *
+taxonomy_terms(int kind, size_t *pn)
+{
+  assert(pn != NULL);
+  *pn = 0;
+  if (kind < 0 || kind >= TAXO_NKINDS) return 0;
+  if (!taxo.valid || taxo.serial != index_serial()) return 0;
+  *pn = blob_len(&taxo.terms[kind]) / sizeof(struct term);
+  return blob_buf(&taxo.terms[kind]);
+}
+
+
+const uint32_t *
+taxonomy_pages(int kind)
+{
+  if (kind < 0 || kind >= TAXO_NKINDS) return 0;
+  if (!taxo.valid || taxo.serial != index_serial()) return 0;
+  return blob_buf(&taxo.pages[kind]);
+}
+
+
+void
+taxonomy_free(void)
+{
+  int i;
+  for (i = 0; i < TAXO_NKINDS; i++) {
+    blob_free(&taxo.terms[i]);
+    blob_free(&taxo.pages[i]);
+  }
+  mem_pool_free(&taxo.pool);
+  taxo.valid = false;
+}
+
+
+/** double the hash table and rehash; false if out of memory */
+static bool
+grow(struct grouping *g)
+{
+  const struct entry *entries = blob_buf(&g->entries);
+  size_t i, j, n = g->nslots ? 2 * g->nslots : 256;
+  uint32_t *slots = calloc(n, sizeof(*slots));
+  if (!slots) return false;
+  for (i = 0; i < g->nentries; i++) {
+    const struct entry *e = &entries[i];
+    j = hash64(e->name, strlen(e->name), e->kind) & (n-1);
+    while (slots[j]) j = (j+1) & (n-1);
+    slots[j] = i + 1;
+  }
+  free(g->slots);
+  g->slots = slots;
+  g->nslots = n;
+  return true;
+}
+
+
+/** add the pair (term, rec), interning the term; false if out of memory */
+static bool
+addterm(struct grouping *g, int kind, const char *name, size_t len, uint32_t rec)
+{
+  struct entry *entries, *e;
+  struct pair *pair;
+  size_t j;
+
+  if (2 * (g->nentries + 1) > g->nslots && !grow(g)) return false;
+
+  entries = blob_buf(&g->entries);
+  j = hash64(name, len, kind) & (g->nslots-1);
+  for (; g->slots[j]; j = (j+1) & (g->nslots-1)) {
+    e = &entries[g->slots[j]-1];
+    if (e->kind == kind && !strncmp(e->name, name, len) && !e->name[len])
+      break;
+  }
+  if (g->slots[j]) {
+    e = &entries[g->slots[j]-1];
+    if (e->count > 0 && e->last == rec) return true;  /* tag given twice */
+  }
+  else {
+    e = blob_prepare(&g->entries, sizeof(*e));
+    if (!e) return false;
+    e->name = mem_pool_dup(g->pool, name, len);
+    if (!e->name) return false;
+    e->kind = kind;
+    e->count = 0;
+    blob_addlen(&g->entries, sizeof(*e));
+    g->slots[j] = ++g->nentries;
+  }
+  e->count++;
+  e->last = rec;
+
+  pair = blob_prepare(&g->pairs, sizeof(*pair));
+  if (!pair) return false;
+  pair->entry = e - (struct entry *) blob_buf(&g->entries);
+  pair->rec = rec;
+  blob_addlen(&g->pairs, sizeof(*pair));
+  return true;
+}
+
+
+/** add all terms of the given record; false if out of memory */
+static bool
+addrecord(struct grouping *g, const struct pageinfo *info, uint32_t rec)
+{
+  const char *p, *q, *e, *d = info->date;
+  bool ok = addterm(g, TAXO_DATE, "", 0, rec);
+
+  if (*info->section)
+    ok = ok && addterm(g, TAXO_SECTION, info->section, strlen(info->section), rec);
+
+  for (p = info->tags; ok && *p; p = *e ? e+1 : e) {
+    e = strchr(p, ',');
+    if (!e) e = p + strlen(p);
+    for (q = e; q > p && isspace((unsigned char) q[-1]); q--);
+    while (p < q && isspace((unsigned char) *p)) p++;
+    if (p < q) ok = addterm(g, TAXO_TAG, p, q - p, rec);
+  }
+
+  /* dates are YYYY-MM-DD, possibly followed by a time */
+  if (isdigit((unsigned char) d[0]) && isdigit((unsigned char) d[1]) &&
+      isdigit((unsigned char) d[2]) && isdigit((unsigned char) d[3])) {
+    ok = ok && addterm(g, TAXO_YEAR, d, 4, rec);
+    if (d[4] == '-' && isdigit((unsigned char) d[5]) && isdigit((unsigned char) d[6]))
+      ok = ok && addterm(g, TAXO_MONTH, d, 7, rec);
+  }
+  return ok;
+}
+
+
+/** newest first, then by path; no date is oldest */
+static int
+datedcmp(const void *a, const void *b)
+{
+  const struct dated *p = a;
+  const struct dated *q = b;
+  int c = strcmp(q->date, p->date);
+  return c ? c : strcmp(p->path, q->path);
+}
+
+
+static int
+entrycmp(const void *a, const void *b)
+{
+  const struct entry *const *p = a;
+  const struct entry *const *q = b;
+  return strcmp((*p)->name, (*q)->name);
+}
+
+
+/** group the current index; SUCCESS or FAILSOFT (out of memory) */
+int
+taxonomy_update(void)
+{
+  struct grouping g;
+  struct pageinfo info;
+  struct dated *dv = 0;
+  struct entry *entries, **ev = 0;
+  const struct pair *pairs;
+  size_t i, k, n = index_count(), npairs, nterms;
+  int kind, r = FAILSOFT;
+
+  taxonomy_free();
+  mem_pool_init(&taxo.pool, 0);
+  memset(&g, 0, sizeof(g));
+  g.pool = &taxo.pool;
+
+  /* records, newest first */
+  dv = malloc((n ? n : 1) * sizeof(*dv));
+  if (!dv) goto done;
+  for (i = 0; i < n && index_get(i, &info); i++) {
+    dv[i].date = info.date;
+    dv[i].path = info.path;
+    dv[i].rec = i;
+  }
+  qsort(dv, n, sizeof(*dv), datedcmp);
+
+  /* one pass: intern terms, list (term, record) pairs */
+  for (i = 0; i < n; i++) {
+    index_get(dv[i].rec, &info);
+    if (!addrecord(&g, &info, dv[i].rec)) goto done;
+  }
+
+  ev = malloc((g.nentries ? g.nentries : 1) * sizeof(*ev));
+  if (!ev) goto done;
+  entries = blob_buf(&g.entries);
+  pairs = blob_buf(&g.pairs);
+  npairs = blob_len(&g.pairs) / sizeof(*pairs);
+
+  /* per kind: terms by name, then deal pairs into their slots */
+  for (kind = 0; kind < TAXO_NKINDS; kind++) {
+    size_t first = 0;
+    for (i = nterms = 0; i < g.nentries; i++)
+      if (entries[i].kind == kind) ev[nterms++] = &entries[i];
+    qsort(ev, nterms, sizeof(*ev), entrycmp);
+    for (k = 0; k < nterms; k++) {
+      struct term *term = blob_prepare(&taxo.terms[kind], sizeof(*term));
+      if (!term) goto done;
+      term->name = ev[k]->name;
+      term->first = ev[k]->fill = first;
+      term->count = ev[k]->count;
+      blob_addlen(&taxo.terms[kind], sizeof(*term));
+      first += ev[k]->count;
+    }
+    if (!blob_prepare(&taxo.pages[kind], (first ? first : 1) * sizeof(uint32_t)))
+      goto done;
+    blob_addlen(&taxo.pages[kind], first * sizeof(uint32_t));
+    for (i = 0; i < npairs; i++) {
+      struct entry *e = &entries[pairs[i].entry];
+      if (e->kind == kind)
+        ((uint32_t *) blob_buf(&taxo.pages[kind]))[e->fill++] = pairs[i].rec;
+    }
+  }
+
+  taxo.serial = index_serial();
+  taxo.valid = true;
+  log_debug("taxonomy: %zu pages, %zu terms", n, g.nentries);
+  r = SUCCESS;
+
+done:
+  if (r != SUCCESS) {
+    log_error("taxonomy: out of memory");
+    taxonomy_free();
+  }
+  free(dv);
+  free(ev);
+  free(g.slots);
+  blob_free(&g.entries);
+  blob_free(&g.pairs);
+  return r;
+}
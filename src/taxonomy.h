@@ -0,0 +1,40 @@
+#ifndef TAXONOMY_H
+#define TAXONOMY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Taxonomies: the pages of the site index grouped by section,
+ * tag, year, and month (of their date), for list pages */
+
+#define TAXO_DATE     0   /* all pages, one term "" */
+#define TAXO_SECTION  1
+#define TAXO_TAG      2
+#define TAXO_YEAR     3
+#define TAXO_MONTH    4
+#define TAXO_NKINDS   5
+
+struct term {
+  const char *name;
+  size_t first;         /* of this term's pages in taxonomy_pages() */
+  size_t count;
+};
+
+int taxonomy_update(void);
+void taxonomy_free(void);
+int taxonomy_kind(const char *name);
+
+const struct term *taxonomy_terms(int kind, size_t *pn);
+const uint32_t *taxonomy_pages(int kind);
+
+/* Usage: after each index update (index_open(), index_update()),
+   call taxonomy_update() to group the index records, before any
+   reader; taxonomy_terms() then returns the terms of a kind (one
+   of the TAXO_* constants; taxonomy_kind() maps their names, e.g.
+   "tag", to them), sorted by name; the pages of a term are record
+   indices (see index_get()), newest first (by date, then path),
+   at taxonomy_pages(kind)[first..first+count); slices of this
+   array are pages of a listing, no copying needed; if the index
+   changed since the update, there are no terms */
+
+#endif
@@ -0,0 +1,211 @@
+/* Trace events for chrome://tracing and Perfetto */
+
+#define _POSIX_C_SOURCE 200809L  /* for clock_gettime(2) */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jot.h"
+#include "blob.h"
+#include "log.h"
+#include "trace.h"
+
+
+/* The trace file is a JSON array of event objects (the "JSON
+ * Array Format" of the trace-event spec); spans are a pair of
+ * "B" and "E" events on the same thread, which the viewers
+ * match up; thread names are "M" (metadata) events. Events
+ * are formatted into a buffer under the lock and written out
+ * when it gets large. Thread ids are small numbers assigned
+ * on first use and kept in thread-specific data. */
+
+#define FLUSHSIZE (256 * 1024)
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  bool active;          /* set and cleared only while single-threaded */
+  FILE *fp;
+  char *fn;
+  Blob buf;             /* events not yet written */
+  struct timespec t0;   /* timestamps are relative to this */
+  unsigned nthreads;    /* thread ids assigned so far */
+} trace = { PTHREAD_MUTEX_INITIALIZER, 0, false, 0, 0, BLOB_INIT, {0, 0}, 0 };
+
+
+static double
+elapsed(void)  /* microseconds since trace_open() */
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - trace.t0.tv_sec) * 1e6 +
+         (ts.tv_nsec - trace.t0.tv_nsec) / 1e3;
+}
+
+
+static unsigned
+threadid(void)  /* call with lock held */
+{
+  void *p = pthread_getspecific(trace.key);
+  if (!p) {
+    p = (void *) (uintptr_t) ++trace.nthreads;
+    pthread_setspecific(trace.key, p);
+  }
+  return (unsigned) (uintptr_t) p;
+}
+
+
+static void
+addstring(Blob *bp, const char *s)  /* as a JSON string */
+{
+  blob_addchar(bp, '"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      blob_addchar(bp, '\\');
+      blob_addchar(bp, c);
+    }
+    else if (c < 32) blob_addfmt(bp, "\\u%04x", c);
+    else blob_addchar(bp, c);
+  }
+  blob_addchar(bp, '"');
+}
+
+
+static void
+writeout(void)  /* call with lock held */
+{
+  size_t len = blob_len(&trace.buf);
+  if (len > 0 && fwrite(blob_str(&trace.buf), 1, len, trace.fp) != len)
+    log_warn("trace: cannot write %s: %s", trace.fn, strerror(errno));
+  blob_clear(&trace.buf);
+}
+
+
+static void
+emit(const char *ph, const char *cat, const char *name,
+     const char *argname, const char *argval)
+{
+  double ts = elapsed();
+  Blob *bp = &trace.buf;
+
+  pthread_mutex_lock(&trace.lock);
+  blob_addfmt(bp, ",\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+              ph, threadid(), ts);
+  if (cat) {
+    blob_addstr(bp, ",\"cat\":");
+    addstring(bp, cat);
+  }
+  if (name) {
+    blob_addstr(bp, ",\"name\":");
+    addstring(bp, name);
+  }
+  if (argname && argval) {
+    blob_addstr(bp, ",\"args\":{");
+    addstring(bp, argname);
+    blob_addchar(bp, ':');
+    addstring(bp, argval);
+    blob_addchar(bp, '}');
+  }
+  blob_addchar(bp, '}');
+  if (blob_len(bp) > FLUSHSIZE)
+    writeout();
+  pthread_mutex_unlock(&trace.lock);
+}
+
+
+int
+trace_open(const char *fn)
+{
+  if (trace.active) trace_close();
+
+  trace.fp = fopen(fn, "w");
+  if (!trace.fp) {
+    log_error("trace: cannot create %s: %s", fn, strerror(errno));
+    return FAILSOFT;
+  }
+  if (pthread_key_create(&trace.key, 0)) {
+    log_error("trace: cannot create thread key");
+    fclose(trace.fp);
+    trace.fp = 0;
+    return FAILSOFT;
+  }
+  trace.fn = strdup(fn);
+  trace.nthreads = 0;
+  clock_gettime(CLOCK_MONOTONIC, &trace.t0);
+  trace.active = true;
+
+  /* first element, so that all events can be written with a
+     leading comma; it names the process in the viewer */
+  blob_addstr(&trace.buf, "[{\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+    "\"name\":\"process_name\",\"args\":{\"name\":\"" PRODUCT "\"}}");
+  trace_thread("main");
+
+  log_debug("trace: writing events to %s", fn);
+  return SUCCESS;
+}
+
+
+void
+trace_flush(void)
+{
+  if (!trace.active) return;
+  pthread_mutex_lock(&trace.lock);
+  writeout();
+  fflush(trace.fp);
+  pthread_mutex_unlock(&trace.lock);
+}
+
+
+void
+trace_close(void)
+{
+  if (!trace.active) return;
+  blob_addstr(&trace.buf, "\n]\n");
+  writeout();
+  if (fclose(trace.fp))
+    log_warn("trace: cannot write %s: %s", trace.fn, strerror(errno));
+  pthread_key_delete(trace.key);
+  blob_free(&trace.buf);
+  free(trace.fn);
+  trace.fn = 0;
+  trace.fp = 0;
+  trace.active = false;
+}
+
+
+bool
+trace_active(void)
+{
+  return trace.active;
+}
+
+
+void
+trace_thread(const char *name)
+{
+  if (trace.active)
+    emit("M", 0, "thread_name", "name", name);
+}
+
+
+void
+trace_begin(const char *cat, const char *name, const char *detail)
+{
+  if (trace.active)
+    emit("B", cat, name, "detail", detail);
+}
+
+
+void
+trace_end(void)
+{
+  if (trace.active)
+    emit("E", 0, 0, 0, 0);
+}
@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+/* Trace events in the Chrome trace-event format (JSON), for
+ * viewing in chrome://tracing or Perfetto: spans (begin/end)
+ * per thread, with a category, a name, and optional detail;
+ * process-wide, thread-safe, and a no-op while not open */
+
+int trace_open(const char *fn);
+void trace_flush(void);
+void trace_close(void);
+bool trace_active(void);
+
+void trace_thread(const char *name);
+void trace_begin(const char *cat, const char *name, const char *detail);
+void trace_end(void);
+
+/* Usage: trace_open() once while single-threaded (jot does so
+   for option --trace), name threads with trace_thread(), wrap
+   things of interest in trace_begin() and trace_end(), which
+   must nest properly per thread; trace_flush() writes buffered
+   events (viewers accept the file without the closing bracket,
+   so a long-running process can flush now and then and need
+   never close); finally trace_close() */
+
+#endif